@@ -16,63 +16,186 @@
 #include "common.h"
 #include "bitmap.h"
 
-/** bictionary for speedup bitmap comparing */
-static unsigned char dict[256] = {
-/* 0x00 _0 _1 _2 _3 _4 _5 _6 _7 _8 _9 _A _B _C _D _E _F */
-/* ---------------------------------------------------- */
-/* 0_ */ 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-/* 1_ */ 1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-/* 2_ */ 1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-/* 3_ */ 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-/* 4_ */ 1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-/* 5_ */ 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-/* 6_ */ 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-/* 7_ */ 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-/* 8_ */ 1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-/* 9_ */ 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-/* A_ */ 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-/* B_ */ 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-/* C_ */ 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-/* D_ */ 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-/* E_ */ 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-/* F_ */ 4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8,
-};
+#define BITMAP_WORDS (SIMDB_BITMAP_SIZE / sizeof(uint64_t))
 
 int
 simdb_bitmap_compare(const unsigned char *a, const unsigned char *b) {
-  unsigned char diff = 0;
-  size_t i = 0;
+  return simdb_bitmap_compare_inline(a, b);
+}
+
+int
+simdb_bitmap_distance(const unsigned char *a, const unsigned char *b) {
+  assert(a != NULL);
+  assert(b != NULL);
+
+  return simdb_bitmap_compare(a, b);
+}
+
+int
+simdb_bitmap_popcount(const unsigned char *map) {
+  uint64_t w;
   size_t cnt = 0;
 
-  for (i = 0; i < SIMDB_BITMAP_SIZE; i++, a++, b++) {
-    diff = *a ^ *b;
-    cnt += dict[diff];
+  assert(map != NULL);
+
+  for (size_t i = 0; i < SIMDB_BITMAP_SIZE; i += sizeof(uint64_t)) {
+    memcpy(&w, map + i, sizeof(uint64_t));
+    cnt += __builtin_popcountll(w);
   }
 
   return cnt;
 }
 
+void
+simdb_bitmap_xor(const unsigned char *a, const unsigned char *b, unsigned char *out) {
+  uint64_t wa[BITMAP_WORDS], wb[BITMAP_WORDS];
+
+  assert(a   != NULL);
+  assert(b   != NULL);
+  assert(out != NULL);
+
+  memcpy(wa, a, SIMDB_BITMAP_SIZE);
+  memcpy(wb, b, SIMDB_BITMAP_SIZE);
+  for (size_t i = 0; i < BITMAP_WORDS; i++)
+    wa[i] ^= wb[i];
+  memcpy(out, wa, SIMDB_BITMAP_SIZE);
+}
+
+int
+simdb_bitmap_row_diff(const unsigned char *a, const unsigned char *b, int *rows) {
+  uint16_t ra, rb;
+  int cnt = 0;
+
+  assert(a    != NULL);
+  assert(b    != NULL);
+  assert(rows != NULL);
+
+  for (size_t i = 0; i < SIMDB_BITMAP_SIDE; i++, a += sizeof(uint16_t), b += sizeof(uint16_t)) {
+    memcpy(&ra, a, sizeof(uint16_t));
+    memcpy(&rb, b, sizeof(uint16_t));
+    rows[i] = __builtin_popcount(ra ^ rb);
+    cnt += rows[i];
+  }
+
+  return cnt;
+}
+
+int
+simdb_bitmap_compare_hr(const unsigned char *a, const unsigned char *b) {
+  uint64_t wa, wb;
+  size_t cnt = 0;
+
+  for (size_t i = 0; i < SIMDB_BITMAP_HR_SIZE; i += sizeof(uint64_t)) {
+    memcpy(&wa, a + i, sizeof(uint64_t));
+    memcpy(&wb, b + i, sizeof(uint64_t));
+    cnt += __builtin_popcountll(wa ^ wb);
+  }
+
+  return cnt;
+}
+
+/** get bit of square bitmap, rows stored one after another, lower bit first */
+static inline int
+simdb_bitmap_bit(const unsigned char *map, int side, int x, int y) {
+  int pos = y * side + x;
+  return (map[pos / 8] >> (pos % 8)) & 0x1;
+}
+
+void
+simdb_bitmap_transform(const unsigned char *src, unsigned char *dst, int side, int transform) {
+  const int last = side - 1;
+  int sx = 0, sy = 0, pos = 0;
+
+  assert(src != NULL);
+  assert(dst != NULL);
+  assert(src != dst);
+
+  memset(dst, 0x0, side * side / 8);
+
+  for (int y = 0; y < side; y++) {
+    for (int x = 0; x < side; x++, pos++) {
+      /* source pixel for each destination pixel */
+      switch (transform) {
+        case SIMDB_TRANSFORM_ROT90  : sx = y;        sy = last - x; break;
+        case SIMDB_TRANSFORM_ROT180 : sx = last - x; sy = last - y; break;
+        case SIMDB_TRANSFORM_ROT270 : sx = last - y; sy = x;        break;
+        case SIMDB_TRANSFORM_FLIP_H : sx = last - x; sy = y;        break;
+        case SIMDB_TRANSFORM_FLIP_V : sx = x;        sy = last - y; break;
+        case SIMDB_TRANSFORM_TRANSPOSE  : sx = y;        sy = x;        break;
+        case SIMDB_TRANSFORM_TRANSVERSE : sx = last - y; sy = last - x; break;
+        default /* NONE */          : sx = x;        sy = y;        break;
+      }
+      if (simdb_bitmap_bit(src, side, sx, sy))
+        dst[pos / 8] |= 1 << (pos % 8);
+    }
+  }
+}
+
+int
+simdb_bitmap_compare_multi(const unsigned char *map, const unsigned char *samples, int mask, int *best) {
+  uint64_t w[SIMDB_BITMAP_SIZE / sizeof(uint64_t)], s;
+  int cnt = 0, min = SIMDB_BITMAP_BITS + 1;
+
+  assert(map     != NULL);
+  assert(samples != NULL);
+  assert(best    != NULL);
+
+  /* tested bitmap loaded once, then compared against each sample word by word */
+  memcpy(w, map, SIMDB_BITMAP_SIZE);
+  for (int t = 0; t < SIMDB_TRANSFORMS; t++, samples += SIMDB_BITMAP_SIZE) {
+    if (!(mask & (1 << t)))
+      continue;
+    cnt = 0;
+    for (size_t i = 0; i < SIMDB_BITMAP_SIZE / sizeof(uint64_t); i++) {
+      memcpy(&s, samples + i * sizeof(uint64_t), sizeof(uint64_t));
+      cnt += __builtin_popcountll(w[i] ^ s);
+    }
+    if (cnt < min) {
+      min   = cnt;
+      *best = t;
+    }
+  }
+
+  return min;
+}
+
+void
+simdb_bitmap_unpack_into(const unsigned char *map, char *buf) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t bytes;
+
+  assert(map != NULL);
+  assert(buf != NULL);
+
+  /* each source byte spread to 8 bytes at once: byte N of broadcast value
+   * keeps only bit N, then any non-zero byte turned to 0x01 */
+  for (size_t i = 0; i < SIMDB_BITMAP_SIZE; i++, buf += 8) {
+    bytes  = map[i] * 0x0101010101010101ULL;
+    bytes &= 0x8040201008040201ULL;
+    bytes  = ((bytes + 0x7F7F7F7F7F7F7F7FULL) >> 7) & 0x0101010101010101ULL;
+    memcpy(buf, &bytes, sizeof(bytes)); /* little-endian: byte N - bit N */
+  }
+#else
+  assert(map != NULL);
+  assert(buf != NULL);
+
+  /* big-endian or unknown byte order: memory order of word bytes differs, bit by bit */
+  for (size_t i = 0; i < SIMDB_BITMAP_SIZE; i++, buf += 8) {
+    for (int bit = 0; bit < 8; bit++)
+      buf[bit] = (map[i] >> bit) & 0x1;
+  }
+#endif
+}
+
 size_t
 simdb_bitmap_unpack(const unsigned char *map, char **buf) {
-  size_t buf_size = SIMDB_BITMAP_BITS;
-  uint16_t *p, row, mask;
-  char *q = NULL;
-
   assert(map != NULL);
   assert(buf != NULL);
 
-  if ((*buf = calloc(buf_size, sizeof(char))) == NULL)
+  if ((*buf = calloc(SIMDB_BITMAP_BITS, sizeof(char))) == NULL)
     return 0;
 
-  p = (uint16_t *) map;
-  q = *buf;
-  for (size_t i = 0; i < SIMDB_BITMAP_SIDE; i++, p++) {
-    row = *p; mask = 0x1;
-    for (size_t j = 0; j < SIMDB_BITMAP_SIDE; j++, q++) {
-      *q = (row & mask) ? 0x1 : 0x0;
-      mask <<= 1;
-    }
-  }
+  simdb_bitmap_unpack_into(map, *buf);
 
-  return buf_size;
+  return SIMDB_BITMAP_BITS;
 }
@@ -9,31 +9,72 @@
 #ifndef HAS_BITMAP_H
 #define HAS_BITMAP_H 1
 
+#include "simdb.h"
+
 /**
  * @file
  * @brief Functions for work with image bitmaps
  */
 
-/** Bits per bitmap side (currently - 16) */
-#define SIMDB_BITMAP_SIDE 16
-/** Total bits in bitmap (currently - 256) */
-#define SIMDB_BITMAP_BITS (SIMDB_BITMAP_SIDE * SIMDB_BITMAP_SIDE)
-/** Bitmap size in bytes (currently - 32) */
-#define SIMDB_BITMAP_SIZE (SIMDB_BITMAP_BITS / 8)
-
 /**
- * @brief Compare two bitmaps
+ * @brief Compare two bitmaps, same as @ref simdb_bitmap_distance()
  * @param a First bitmap to compare
  * @param b Second bitmap to compare
  * @returns Integer showing difference between bitmaps in bits (0-256)
  */
 int simdb_bitmap_compare(const unsigned char *a, const unsigned char *b);
 
+/**
+ * @brief Inline version of @ref simdb_bitmap_compare() for search kernels,
+ *   so popcount instruction chosen by target ISA of caller
+ */
+static inline int
+simdb_bitmap_compare_inline(const unsigned char *a, const unsigned char *b) {
+  uint64_t wa, wb;
+  int cnt = 0;
+
+  for (size_t i = 0; i < SIMDB_BITMAP_SIZE; i += sizeof(uint64_t)) {
+    memcpy(&wa, a + i, sizeof(uint64_t));
+    memcpy(&wb, b + i, sizeof(uint64_t));
+    cnt += __builtin_popcountll(wa ^ wb);
+  }
+
+  return cnt;
+}
+
+/**
+ * @brief Compare two high-resolution bitmaps
+ * @param a First bitmap to compare
+ * @param b Second bitmap to compare
+ * @returns Integer showing difference between bitmaps in bits (0-1024)
+ */
+int simdb_bitmap_compare_hr(const unsigned char *a, const unsigned char *b);
+
+/**
+ * @brief Transform bitmap: rotate or flip, see @ref SIMDBTransforms
+ * @param src       Source bitmap
+ * @param dst       Storage for transformed bitmap, same size, must not overlap @a src
+ * @param side      Bits per bitmap side: @ref SIMDB_BITMAP_SIDE or @ref SIMDB_BITMAP_HR_SIDE
+ * @param transform Transform to apply
+ */
+void simdb_bitmap_transform(const unsigned char *src, unsigned char *dst, int side, int transform);
+
+/**
+ * @brief Compare bitmap against several samples at once
+ * @param map     Bitmap to compare
+ * @param samples Array of @ref SIMDB_TRANSFORMS bitmaps, usually transforms of single sample
+ * @param mask    Samples to compare against, bit N - sample N
+ * @param best    Pointer to store number of closest sample
+ * @returns Difference with closest sample in bits (0-256), or >256 if @a mask empty
+ */
+int simdb_bitmap_compare_multi(const unsigned char *map, const unsigned char *samples, int mask, int *best);
+
 /**
  * @brief Unpack BITmap to BYTEmap
  * @param map Source bitmap
- * @param buf Pointer to store generated bytemap
+ * @param buf Pointer to store generated bytemap (allocated)
  * @returns Size of generated bytemap (now is @a BITMAP_BITS)
+ * @see simdb_bitmap_unpack_into() for caller-provided buffer
  */
 size_t simdb_bitmap_unpack(const unsigned char *map, char **buf);
 #endif
@@ -0,0 +1,214 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/**
+ * @file
+ * @brief LRU cache of search results
+ */
+
+#include "common.h"
+#include "cache.h"
+
+/** hash table size, must be power of 2 */
+#define CACHE_BUCKETS 256
+
+typedef struct simdb_cache_entry_t simdb_cache_entry_t;
+
+struct simdb_cache_entry_t {
+  simdb_cache_key_t key;      /**< search parameters */
+  uint32_t hash;              /**< hash of key */
+  int found;                  /**< matches count */
+  simdb_match_t *matches;     /**< copy of search results */
+  simdb_cache_entry_t *next;  /**< next entry in same bucket */
+  simdb_cache_entry_t *newer; /**< lru list: more recently used entry */
+  simdb_cache_entry_t *older; /**< lru list: less recently used entry */
+};
+
+struct simdb_cache_t {
+  size_t budget;              /**< memory limit */
+  size_t size;                /**< memory used */
+  unsigned long gen;          /**< write generation of stored results */
+  simdb_cache_stats_t stats;  /**< usage counters */
+  simdb_cache_entry_t *newest;  /**< lru list: head */
+  simdb_cache_entry_t *oldest;  /**< lru list: tail */
+  simdb_cache_entry_t *buckets[CACHE_BUCKETS];
+};
+
+/** FNV-1a hash */
+static uint32_t
+simdb_cache_hash(const simdb_cache_key_t *key) {
+  const unsigned char *p = (const unsigned char *) key;
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < sizeof(simdb_cache_key_t); i++, p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static size_t
+simdb_cache_entry_size(int found) {
+  return sizeof(simdb_cache_entry_t) + found * sizeof(simdb_match_t);
+}
+
+static void
+simdb_cache_unlink(simdb_cache_t *cache, simdb_cache_entry_t *e) {
+  if (e->newer) e->newer->older = e->older; else cache->newest = e->older;
+  if (e->older) e->older->newer = e->newer; else cache->oldest = e->newer;
+  e->newer = e->older = NULL;
+}
+
+static void
+simdb_cache_push(simdb_cache_t *cache, simdb_cache_entry_t *e) {
+  e->newer = NULL;
+  e->older = cache->newest;
+  if (cache->newest)
+    cache->newest->newer = e;
+  cache->newest = e;
+  if (cache->oldest == NULL)
+    cache->oldest = e;
+}
+
+static void
+simdb_cache_remove(simdb_cache_t *cache, simdb_cache_entry_t *e) {
+  simdb_cache_entry_t **pp;
+
+  pp = &cache->buckets[e->hash & (CACHE_BUCKETS - 1)];
+  while (*pp != e)
+    pp = &(*pp)->next;
+  *pp = e->next;
+
+  simdb_cache_unlink(cache, e);
+  cache->size -= simdb_cache_entry_size(e->found);
+  cache->stats.entries--;
+
+  free(e->matches);
+  free(e);
+}
+
+static void
+simdb_cache_flush(simdb_cache_t *cache) {
+  while (cache->oldest)
+    simdb_cache_remove(cache, cache->oldest);
+}
+
+simdb_cache_t *
+simdb_cache_new(size_t budget) {
+  simdb_cache_t *cache = NULL;
+
+  if ((cache = calloc(1, sizeof(simdb_cache_t))) == NULL)
+    return NULL;
+
+  cache->budget = budget;
+
+  return cache;
+}
+
+void
+simdb_cache_free(simdb_cache_t *cache) {
+  assert(cache != NULL);
+
+  simdb_cache_flush(cache);
+  FREE(cache);
+}
+
+int
+simdb_cache_get(simdb_cache_t *cache, const simdb_cache_key_t *key,
+                unsigned long gen, simdb_search_t *search) {
+  simdb_cache_entry_t *e = NULL;
+  simdb_match_t *matches = NULL;
+  uint32_t hash = 0;
+
+  assert(cache  != NULL);
+  assert(key    != NULL);
+  assert(search != NULL);
+
+  if (cache->gen != gen) {
+    /* database changed, all stored results are stale */
+    simdb_cache_flush(cache);
+    cache->gen = gen;
+  }
+
+  hash = simdb_cache_hash(key);
+  for (e = cache->buckets[hash & (CACHE_BUCKETS - 1)]; e != NULL; e = e->next) {
+    if (e->hash == hash && memcmp(&e->key, key, sizeof(simdb_cache_key_t)) == 0)
+      break;
+  }
+
+  if (e == NULL) {
+    cache->stats.misses++;
+    return -1;
+  }
+
+  if (e->found > 0) {
+    if ((matches = calloc(e->found, sizeof(simdb_match_t))) == NULL)
+      return -1;
+    memcpy(matches, e->matches, e->found * sizeof(simdb_match_t));
+    search->matches = matches;
+    search->found   = e->found;
+  }
+
+  simdb_cache_unlink(cache, e);
+  simdb_cache_push(cache, e);
+  cache->stats.hits++;
+
+  return e->found;
+}
+
+void
+simdb_cache_put(simdb_cache_t *cache, const simdb_cache_key_t *key,
+                unsigned long gen, const simdb_match_t *matches, int found) {
+  simdb_cache_entry_t *e = NULL;
+  size_t size = simdb_cache_entry_size(found);
+
+  assert(cache != NULL);
+  assert(key   != NULL);
+
+  if (cache->gen != gen || size > cache->budget)
+    return; /* results are stale already or too large to store */
+
+  while (cache->size + size > cache->budget && cache->oldest) {
+    simdb_cache_remove(cache, cache->oldest);
+    cache->stats.evictions++;
+  }
+
+  if ((e = calloc(1, sizeof(simdb_cache_entry_t))) == NULL)
+    return;
+
+  if (found > 0) {
+    if ((e->matches = calloc(found, sizeof(simdb_match_t))) == NULL) {
+      FREE(e);
+      return;
+    }
+    memcpy(e->matches, matches, found * sizeof(simdb_match_t));
+  }
+
+  memcpy(&e->key, key, sizeof(simdb_cache_key_t));
+  e->hash  = simdb_cache_hash(key);
+  e->found = found;
+  e->next  = cache->buckets[e->hash & (CACHE_BUCKETS - 1)];
+  cache->buckets[e->hash & (CACHE_BUCKETS - 1)] = e;
+  simdb_cache_push(cache, e);
+
+  cache->size += size;
+  cache->stats.entries++;
+}
+
+void
+simdb_cache_get_stats(simdb_cache_t *cache, simdb_cache_stats_t *stats) {
+  assert(cache != NULL);
+  assert(stats != NULL);
+
+  memcpy(stats, &cache->stats, sizeof(simdb_cache_stats_t));
+  stats->size   = cache->size;
+  stats->budget = cache->budget;
+}
@@ -0,0 +1,84 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef HAS_CACHE_H
+#define HAS_CACHE_H 1
+
+#include "record.h"
+#include "simdb.h"
+
+/**
+ * @file
+ * @brief LRU cache of search results, see @ref simdb_cache_setup()
+ */
+
+/** search cache key, must be zeroed before filling, as compared with memcmp() */
+typedef struct simdb_cache_key_t {
+  simdb_urec_t sample; /**< search sample, bitmap, ratio and color levels used */
+  simdb_hrec_t hires;  /**< search sample, 32x32 bitmap, zeroed if not used */
+  float d_bitmap;      /**< search parameter: max difference of luma bitmaps */
+  float d_ratio;       /**< search parameter: max difference of ratios */
+  float d_color;       /**< search parameter: max difference of color levels */
+  float d_phash;       /**< search parameter: max difference of perceptual hashes */
+  int limit;           /**< search parameter: max results */
+  int mode;            /**< search parameter: search mode */
+  int lsh_tables;      /**< search parameter: LSH tables, zeroed in exact mode */
+  int lsh_probes;      /**< search parameter: LSH probes, zeroed in exact mode */
+  int transforms;      /**< search parameter: sample transforms */
+  simdb_num_t skip;    /**< skipped record (source sample) */
+  simdb_num_t first;   /**< search parameter: first record of range */
+  simdb_num_t last;    /**< search parameter: last record of range */
+} simdb_cache_key_t;
+
+/** opaque cache handle */
+typedef struct simdb_cache_t simdb_cache_t;
+
+/**
+ * @brief Creates new cache
+ * @param budget Memory limit for cached results, in bytes
+ * @returns Pointer to cache handle or NULL on error
+ */
+simdb_cache_t * simdb_cache_new(size_t budget);
+
+/**
+ * @brief Destroys cache and all stored results
+ * @param cache Cache handle
+ */
+void simdb_cache_free(simdb_cache_t *cache);
+
+/**
+ * @brief Lookup search results in cache
+ * @param cache  Cache handle
+ * @param key    Search key
+ * @param gen    Current write generation of database, all older entries are dropped
+ * @param search Search struct to store copy of results
+ * @retval <0 on cache miss (or if can't copy results)
+ * @retval >=0 on cache hit, as matches count
+ */
+int simdb_cache_get(simdb_cache_t *cache, const simdb_cache_key_t *key,
+                    unsigned long gen, simdb_search_t *search);
+
+/**
+ * @brief Store search results in cache
+ * @param cache   Cache handle
+ * @param key     Search key
+ * @param gen     Current write generation of database
+ * @param matches Search results (copied)
+ * @param found   Search results count
+ */
+void simdb_cache_put(simdb_cache_t *cache, const simdb_cache_key_t *key,
+                     unsigned long gen, const simdb_match_t *matches, int found);
+
+/**
+ * @brief Get cache usage counters
+ * @param cache Cache handle
+ * @param stats Pointer to storage for counters
+ */
+void simdb_cache_get_stats(simdb_cache_t *cache, simdb_cache_stats_t *stats);
+
+#endif /* HAS_CACHE_H */
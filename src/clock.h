@@ -0,0 +1,55 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef HAS_CLOCK_H
+#define HAS_CLOCK_H 1
+
+/**
+ * @file
+ * @brief Helpers for measuring wall and cpu time of code sections
+ */
+
+/** section start time */
+typedef struct simdb_clock_t {
+  struct timespec wall; /**< wall time */
+  struct timespec cpu;  /**< cpu time of calling thread */
+} simdb_clock_t;
+
+/** difference between two timespecs, in seconds */
+static inline double
+simdb_clock_diff(const struct timespec *a, const struct timespec *b) {
+  return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Mark start of measured section
+ * @param c Clock storage
+ */
+static inline void
+simdb_clock_start(simdb_clock_t *c) {
+  clock_gettime(CLOCK_MONOTONIC, &c->wall);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c->cpu);
+}
+
+/**
+ * @brief Mark end of measured section, add elapsed time to counters
+ * @param c Clock storage, filled with @ref simdb_clock_start()
+ * @param wall Wall time counter, in seconds
+ * @param cpu  Cpu time counter, in seconds
+ */
+static inline void
+simdb_clock_stop(const simdb_clock_t *c, double *wall, double *cpu) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  *wall += simdb_clock_diff(&c->wall, &now);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  *cpu  += simdb_clock_diff(&c->cpu, &now);
+}
+
+#endif /* HAS_CLOCK_H */
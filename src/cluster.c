@@ -0,0 +1,511 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/**
+ * @file
+ * @brief Table of near-duplicate groups
+ *
+ * Table file: header, then one entry per record at offset
+ * header + num * sizeof(entry), see @ref simdb_cluster_entry_t.
+ */
+
+#include "common.h"
+#include "cluster.h"
+
+#include <pthread.h>
+
+#define CLUSTER_BLOCK 4096   /**< entries read from or written to table file at once */
+
+/** header of table file */
+typedef struct simdb_cluster_hdr_t {
+  char magic[8];      /**< "SDBCLU1" */
+  float d_bitmap;     /**< link parameters, see @ref simdb_search_t */
+  float d_ratio;
+  float d_color;
+  float d_phash;
+  int32_t transforms;
+  int32_t mode;       /**< search mode, see @ref SIMDBSearchModes */
+  int64_t  size;      /**< database size on last sync */
+  int64_t  mtime;     /**< database mtime on last sync, seconds */
+  int64_t  mtime_ns;  /**< database mtime on last sync, nanoseconds */
+} simdb_cluster_hdr_t;
+
+/** table entry of single record, all zeros if record not in any group */
+typedef struct simdb_cluster_entry_t {
+  int64_t next;   /**< next member of group, members form a cycle */
+  int64_t label;  /**< group label: number of one of members */
+  int64_t size;   /**< members count, valid only in entry of label */
+} simdb_cluster_entry_t;
+
+struct simdb_cluster_t {
+  int fd;               /**< table file */
+  bool write;           /**< table file updated on changes */
+  bool deferred;        /**< table rebuilt, file updated only on sync */
+  bool broken;          /**< update failed, table unusable until rebuilt */
+  simdb_cluster_hdr_t hdr;  /**< header with link parameters */
+  simdb_cluster_entry_t *entries; /**< entry per record, indexed by record number */
+  simdb_num_t capacity; /**< entries allocated */
+  pthread_rwlock_t lock;  /**< shared for lookups, exclusive for updates */
+};
+
+static const char cluster_magic[8] = "SDBCLU1";
+
+/** make room for entry of record @a num */
+static int
+simdb_cluster_reserve(simdb_cluster_t *cl, simdb_num_t num) {
+  simdb_cluster_entry_t *tmp = NULL;
+  simdb_num_t capacity = cl->capacity ? cl->capacity : CLUSTER_BLOCK;
+
+  if (num < cl->capacity)
+    return SIMDB_SUCCESS;
+
+  while (capacity <= num)
+    capacity *= 2;
+
+  if ((tmp = realloc(cl->entries, (size_t) capacity * sizeof(simdb_cluster_entry_t))) == NULL)
+    return SIMDB_ERR_OOM;
+
+  memset(&tmp[cl->capacity], 0x0, (size_t) (capacity - cl->capacity) * sizeof(simdb_cluster_entry_t));
+  cl->entries  = tmp;
+  cl->capacity = capacity;
+
+  return SIMDB_SUCCESS;
+}
+
+/** write entry of record @a num to table file, unless deferred */
+static int
+simdb_cluster_put(simdb_cluster_t *cl, simdb_num_t num) {
+  const size_t entry = sizeof(simdb_cluster_entry_t);
+
+  if (!cl->write || cl->deferred)
+    return SIMDB_SUCCESS;
+
+  if (pwrite(cl->fd, &cl->entries[num], entry, sizeof(simdb_cluster_hdr_t) + entry * num) != (ssize_t) entry) {
+    cl->broken = true;
+    return SIMDB_ERR_SYSTEM;
+  }
+
+  return SIMDB_SUCCESS;
+}
+
+/** read header of table file, @returns true if header valid */
+static bool
+simdb_cluster_header(int fd, simdb_cluster_hdr_t *hdr) {
+  return pread(fd, hdr, sizeof(simdb_cluster_hdr_t), 0) == sizeof(simdb_cluster_hdr_t) &&
+         memcmp(hdr->magic, cluster_magic, sizeof(cluster_magic)) == 0;
+}
+
+bool
+simdb_cluster_stored(const char *path, simdb_search_t *link) {
+  simdb_cluster_hdr_t hdr;
+  bool valid = false;
+  int fd = -1;
+
+  assert(path != NULL);
+  assert(link != NULL);
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return false;
+  if ((valid = simdb_cluster_header(fd, &hdr))) {
+    simdb_search_init(link);
+    link->d_bitmap   = hdr.d_bitmap;
+    link->d_ratio    = hdr.d_ratio;
+    link->d_color    = hdr.d_color;
+    link->d_phash    = hdr.d_phash;
+    link->transforms = hdr.transforms;
+    link->mode       = hdr.mode;
+  }
+  close(fd);
+
+  return valid;
+}
+
+/** set label of all members of group, starting from @a num */
+static int
+simdb_cluster_relabel(simdb_cluster_t *cl, simdb_num_t num, simdb_num_t label) {
+  simdb_num_t cur = num;
+  int ret = SIMDB_SUCCESS;
+
+  do {
+    cl->entries[cur].label = label;
+    if ((ret = simdb_cluster_put(cl, cur)) < 0)
+      break;
+    cur = cl->entries[cur].next;
+  } while (cur != num);
+
+  return ret;
+}
+
+/** remove record from its group, caller must hold exclusive lock */
+static int
+simdb_cluster_detach(simdb_cluster_t *cl, simdb_num_t num) {
+  simdb_cluster_entry_t *e = &cl->entries[num];
+  simdb_num_t prev = num, next = e->next, label = e->label;
+  int64_t size = cl->entries[label].size - 1;
+  int ret = SIMDB_SUCCESS;
+
+  if (next != num) {
+    while (cl->entries[prev].next != num)
+      prev = cl->entries[prev].next;
+    cl->entries[prev].next = next;
+    if ((ret = simdb_cluster_put(cl, prev)) < 0)
+      return ret;
+    if (label == num) {
+      /* label leaves group, pass it to other member */
+      label = next;
+      if ((ret = simdb_cluster_relabel(cl, next, label)) < 0)
+        return ret;
+    }
+    cl->entries[label].size = size;
+    if ((ret = simdb_cluster_put(cl, label)) < 0)
+      return ret;
+  }
+
+  memset(e, 0x0, sizeof(simdb_cluster_entry_t));
+
+  return simdb_cluster_put(cl, num);
+}
+
+simdb_cluster_t *
+simdb_cluster_open(const char *path, const simdb_search_t *link, bool write, int *error) {
+  simdb_cluster_hdr_t hdr;
+  simdb_cluster_t *cl = NULL;
+  bool valid = false;
+
+  assert(path  != NULL);
+  assert(link  != NULL);
+  assert(error != NULL);
+
+  if ((cl = calloc(1, sizeof(simdb_cluster_t))) == NULL) {
+    *error = SIMDB_ERR_OOM;
+    return NULL;
+  }
+
+  memcpy(cl->hdr.magic, cluster_magic, sizeof(cluster_magic));
+  cl->hdr.d_bitmap   = link->d_bitmap;
+  cl->hdr.d_ratio    = link->d_ratio;
+  cl->hdr.d_color    = link->d_color;
+  cl->hdr.d_phash    = link->d_phash;
+  cl->hdr.transforms = link->transforms;
+  cl->hdr.mode       = link->mode;
+  cl->write = write;
+
+  if (pthread_rwlock_init(&cl->lock, NULL) != 0) {
+    FREE(cl);
+    *error = SIMDB_ERR_SYSTEM;
+    return NULL;
+  }
+
+  cl->fd = open(path, write ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  if (cl->fd < 0) {
+    *error = (errno == ENOENT) ? SIMDB_ERR_NOINDEX : SIMDB_ERR_SYSTEM;
+    simdb_cluster_free(cl);
+    return NULL;
+  }
+
+  if ((valid = simdb_cluster_header(cl->fd, &hdr)) &&
+      (hdr.d_bitmap != cl->hdr.d_bitmap || hdr.d_ratio != cl->hdr.d_ratio ||
+       hdr.d_color  != cl->hdr.d_color  || hdr.d_phash != cl->hdr.d_phash ||
+       hdr.transforms != cl->hdr.transforms || hdr.mode != cl->hdr.mode)) {
+    /* table of other writer, not ours to replace */
+    simdb_cluster_free(cl);
+    *error = SIMDB_ERR_NOINDEX;
+    return NULL;
+  }
+
+  if (!valid && !write) {
+    simdb_cluster_free(cl);
+    *error = SIMDB_ERR_NOINDEX;
+    return NULL;
+  }
+
+  /* new or damaged file */
+  if (!valid && (ftruncate(cl->fd, 0) < 0 || pwrite(cl->fd, &cl->hdr, sizeof(cl->hdr), 0) != sizeof(cl->hdr))) {
+    simdb_cluster_free(cl);
+    *error = SIMDB_ERR_SYSTEM;
+    return NULL;
+  }
+
+  return cl;
+}
+
+void
+simdb_cluster_free(simdb_cluster_t *cl) {
+  assert(cl != NULL);
+
+  if (cl->fd >= 0)
+    close(cl->fd);
+
+  pthread_rwlock_destroy(&cl->lock);
+  FREE(cl->entries);
+  FREE(cl);
+}
+
+bool
+simdb_cluster_synced(simdb_cluster_t *cl, const struct stat *st) {
+  simdb_cluster_hdr_t hdr;
+
+  assert(cl != NULL);
+  assert(st != NULL);
+
+  if (cl->broken || pread(cl->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+    return false;
+
+  return hdr.size == st->st_size &&
+         hdr.mtime == st->st_mtim.tv_sec && hdr.mtime_ns == st->st_mtim.tv_nsec;
+}
+
+int
+simdb_cluster_sync(simdb_cluster_t *cl, const struct stat *st) {
+  const size_t entry = sizeof(simdb_cluster_entry_t);
+  simdb_num_t count = 0;
+  int ret = SIMDB_SUCCESS;
+
+  assert(cl != NULL);
+  assert(st != NULL);
+
+  if (!cl->write)
+    return SIMDB_SUCCESS;
+
+  pthread_rwlock_wrlock(&cl->lock);
+  if (cl->broken) {
+    pthread_rwlock_unlock(&cl->lock);
+    return SIMDB_ERR_NOINDEX;
+  }
+  if (cl->deferred) {
+    if (ftruncate(cl->fd, sizeof(simdb_cluster_hdr_t)) < 0)
+      ret = SIMDB_ERR_SYSTEM;
+    for (simdb_num_t num = 1; num < cl->capacity && ret == SIMDB_SUCCESS; num += count) {
+      count = (cl->capacity - num > CLUSTER_BLOCK) ? CLUSTER_BLOCK : cl->capacity - num;
+      if (pwrite(cl->fd, &cl->entries[num], entry * count, sizeof(simdb_cluster_hdr_t) + entry * num) != (ssize_t) (entry * count))
+        ret = SIMDB_ERR_SYSTEM;
+    }
+    if (ret == SIMDB_SUCCESS)
+      cl->deferred = false;
+  }
+
+  cl->hdr.size     = st->st_size;
+  cl->hdr.mtime    = st->st_mtim.tv_sec;
+  cl->hdr.mtime_ns = st->st_mtim.tv_nsec;
+
+  if (ret == SIMDB_SUCCESS && pwrite(cl->fd, &cl->hdr, sizeof(cl->hdr), 0) != sizeof(cl->hdr))
+    ret = SIMDB_ERR_SYSTEM;
+  pthread_rwlock_unlock(&cl->lock);
+
+  return ret;
+}
+
+int
+simdb_cluster_load(simdb_cluster_t *cl, simdb_num_t records) {
+  const size_t entry = sizeof(simdb_cluster_entry_t);
+  ssize_t bytes = 0;
+  simdb_num_t count = 0;
+  int ret = SIMDB_SUCCESS;
+
+  assert(cl != NULL);
+
+  pthread_rwlock_wrlock(&cl->lock);
+  if (records > 0)
+    ret = simdb_cluster_reserve(cl, records);
+  for (simdb_num_t num = 1; num <= records && ret == SIMDB_SUCCESS; num += count) {
+    count = (records - num + 1 > CLUSTER_BLOCK) ? CLUSTER_BLOCK : records - num + 1;
+    bytes = pread(cl->fd, &cl->entries[num], entry * count, sizeof(simdb_cluster_hdr_t) + entry * num);
+    if (bytes < 0) {
+      ret = SIMDB_ERR_SYSTEM;
+    } else if ((size_t) bytes < entry * count) {
+      /* records at end never joined any group */
+      memset((char *) &cl->entries[num] + bytes, 0x0, entry * count - bytes);
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&cl->lock);
+
+  return ret;
+}
+
+void
+simdb_cluster_reset(simdb_cluster_t *cl) {
+  assert(cl != NULL);
+
+  pthread_rwlock_wrlock(&cl->lock);
+  FREE(cl->entries);
+  cl->capacity = 0;
+  cl->deferred = true;
+  cl->broken   = false;
+  pthread_rwlock_unlock(&cl->lock);
+}
+
+void
+simdb_cluster_invalidate(simdb_cluster_t *cl) {
+  assert(cl != NULL);
+
+  pthread_rwlock_wrlock(&cl->lock);
+  cl->broken = true;
+  pthread_rwlock_unlock(&cl->lock);
+}
+
+int
+simdb_cluster_remap(simdb_cluster_t *cl, const simdb_remap_run_t *runs, size_t count, simdb_num_t records) {
+  simdb_cluster_entry_t e;
+  simdb_num_t src = 0, dst = 0;
+  int ret = SIMDB_SUCCESS;
+
+  assert(cl != NULL);
+
+  pthread_rwlock_wrlock(&cl->lock);
+  if ((ret = simdb_cluster_reserve(cl, records)) < 0) {
+    cl->broken = true;
+    pthread_rwlock_unlock(&cl->lock);
+    return ret;
+  }
+
+  /* runs ascending and never move records up, so entries moved in place:
+   * each entry read before anything written over it */
+  for (size_t r = 0; r < count; r++) {
+    for (uint64_t i = 0; i < runs[r].count; i++) {
+      src = runs[r].old + i;
+      dst = runs[r].num + i;
+      memset(&e, 0x0, sizeof(e));
+      if (src < cl->capacity)
+        e = cl->entries[src];
+      if (e.next != 0) {
+        e.next  = simdb_remap_runs(runs, count, e.next);
+        e.label = simdb_remap_runs(runs, count, e.label);
+        if (e.next == 0 || e.label == 0)
+          cl->broken = true; /* member was unused: table out of date */
+      }
+      cl->entries[dst] = e;
+    }
+  }
+  if (records + 1 < cl->capacity)
+    memset(&cl->entries[records + 1], 0x0, (size_t) (cl->capacity - records - 1) * sizeof(simdb_cluster_entry_t));
+  cl->deferred = true;
+  ret = cl->broken ? SIMDB_ERR_NOINDEX : SIMDB_SUCCESS;
+  pthread_rwlock_unlock(&cl->lock);
+
+  return ret;
+}
+
+int
+simdb_cluster_insert(simdb_cluster_t *cl, simdb_num_t num) {
+  int ret = SIMDB_SUCCESS;
+
+  assert(cl != NULL);
+
+  if (num < 1)
+    return SIMDB_ERR_USAGE;
+
+  pthread_rwlock_wrlock(&cl->lock);
+  if ((ret = simdb_cluster_reserve(cl, num)) == SIMDB_SUCCESS &&
+      (cl->entries[num].next == 0 || (ret = simdb_cluster_detach(cl, num)) == SIMDB_SUCCESS)) {
+    cl->entries[num].next  = num;
+    cl->entries[num].label = num;
+    cl->entries[num].size  = 1;
+    ret = simdb_cluster_put(cl, num);
+  }
+  pthread_rwlock_unlock(&cl->lock);
+
+  return ret;
+}
+
+int
+simdb_cluster_remove(simdb_cluster_t *cl, simdb_num_t num) {
+  int ret = SIMDB_SUCCESS;
+
+  assert(cl != NULL);
+
+  pthread_rwlock_wrlock(&cl->lock);
+  if (num > 0 && num < cl->capacity && cl->entries[num].next != 0)
+    ret = simdb_cluster_detach(cl, num);
+  pthread_rwlock_unlock(&cl->lock);
+
+  return ret;
+}
+
+int
+simdb_cluster_merge(simdb_cluster_t *cl, simdb_num_t a, simdb_num_t b) {
+  simdb_num_t la = 0, lb = 0, tmp = 0;
+  int ret = 0;
+
+  assert(cl != NULL);
+
+  pthread_rwlock_wrlock(&cl->lock);
+  if (a < 1 || a >= cl->capacity || b < 1 || b >= cl->capacity ||
+      cl->entries[a].next == 0 || cl->entries[b].next == 0 ||
+      (la = cl->entries[a].label) == (lb = cl->entries[b].label)) {
+    pthread_rwlock_unlock(&cl->lock);
+    return 0;
+  }
+
+  if (cl->entries[la].size < cl->entries[lb].size) {
+    /* relabel smaller group */
+    tmp = a;  a  = b;  b  = tmp;
+    tmp = la; la = lb; lb = tmp;
+  }
+
+  cl->entries[la].size += cl->entries[lb].size;
+  if ((ret = simdb_cluster_relabel(cl, b, la)) == SIMDB_SUCCESS) {
+    cl->entries[lb].size = 0;
+    /* splice cycles */
+    tmp = cl->entries[a].next;
+    cl->entries[a].next = cl->entries[b].next;
+    cl->entries[b].next = tmp;
+    if ((ret = simdb_cluster_put(cl, a))  == SIMDB_SUCCESS &&
+        (ret = simdb_cluster_put(cl, b))  == SIMDB_SUCCESS &&
+        (ret = simdb_cluster_put(cl, lb)) == SIMDB_SUCCESS &&
+        (ret = simdb_cluster_put(cl, la)) == SIMDB_SUCCESS)
+      ret = 1;
+  }
+  pthread_rwlock_unlock(&cl->lock);
+
+  return ret;
+}
+
+static int
+simdb_cluster_cmp(const void *a, const void *b) {
+  simdb_num_t ia = *(const simdb_num_t *) a, ib = *(const simdb_num_t *) b;
+  return (ia > ib) - (ia < ib);
+}
+
+simdb_num_t
+simdb_cluster_members(simdb_cluster_t *cl, simdb_num_t num, simdb_num_t **nums) {
+  simdb_num_t *found = NULL, cur = num, count = 0, size = 0;
+
+  assert(cl   != NULL);
+  assert(nums != NULL);
+
+  pthread_rwlock_rdlock(&cl->lock);
+  if (cl->broken) {
+    pthread_rwlock_unlock(&cl->lock);
+    return SIMDB_ERR_NOINDEX;
+  }
+  if (num < 1 || num >= cl->capacity || cl->entries[num].next == 0) {
+    pthread_rwlock_unlock(&cl->lock);
+    return 0;
+  }
+
+  size = cl->entries[cl->entries[num].label].size;
+  if (size < 1 || (found = calloc(size, sizeof(simdb_num_t))) == NULL) {
+    pthread_rwlock_unlock(&cl->lock);
+    return SIMDB_ERR_OOM;
+  }
+
+  count = 0;
+  do {
+    found[count++] = cur;
+    cur = cl->entries[cur].next;
+  } while (cur != num && count < size);
+  pthread_rwlock_unlock(&cl->lock);
+
+  qsort(found, count, sizeof(simdb_num_t), simdb_cluster_cmp);
+  *nums = found;
+
+  return count;
+}
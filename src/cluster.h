@@ -0,0 +1,149 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef HAS_CLUSTER_H
+#define HAS_CLUSTER_H 1
+
+#include "simdb.h"
+#include "record.h"
+#include "io.h"
+
+/**
+ * @file
+ * @brief Table of near-duplicate groups, see @ref simdb_cluster_setup()
+ *
+ * Union-find over record numbers: each record stores label of its group
+ * (number of one of members) and next member, members of group form
+ * a cycle. Merge relabels smaller group and splices cycles, group members
+ * listed by walking the cycle. Table persisted entry per record, so
+ * it loaded without searches, if file is in sync with database.
+ */
+
+/** opaque handle of cluster table */
+typedef struct simdb_cluster_t simdb_cluster_t;
+
+/**
+ * @brief Open or create cluster table file
+ * @param path  Path to table file
+ * @param link  Search parameters used to link records, file used only if same
+ * @param write Table file may be created and updated
+ * @param error Pointer to error code storage
+ * @returns Pointer to table handle or NULL on error
+ * @note Table file built with other parameters never replaced, fails with
+ *   @ref SIMDB_ERR_NOINDEX, as missing file without @a write
+ */
+simdb_cluster_t * simdb_cluster_open(const char *path, const simdb_search_t *link, bool write, int *error);
+
+/**
+ * @brief Get parameters of table stored in file
+ * @param path Path to table file
+ * @param link Storage for parameters, other fields set to defaults
+ * @returns true if file exists and has valid header
+ */
+bool simdb_cluster_stored(const char *path, simdb_search_t *link);
+
+/**
+ * @brief Close table file and free table
+ * @param cl Table handle
+ */
+void simdb_cluster_free(simdb_cluster_t *cl);
+
+/**
+ * @brief Check table file was last synced with database of given state
+ * @param cl Table handle
+ * @param st Database file state
+ */
+bool simdb_cluster_synced(simdb_cluster_t *cl, const struct stat *st);
+
+/**
+ * @brief Remember database state in table file, see @ref simdb_cluster_synced()
+ * @param cl Table handle
+ * @param st Database file state
+ * @retval  0 on success, also for memory-only table
+ * @retval <0 on error
+ * @note After @ref simdb_cluster_reset() whole table written here
+ */
+int simdb_cluster_sync(simdb_cluster_t *cl, const struct stat *st);
+
+/**
+ * @brief Read table from file
+ * @param cl      Table handle
+ * @param records Database records count
+ * @retval  0 on success
+ * @retval <0 on error
+ */
+int simdb_cluster_load(simdb_cluster_t *cl, simdb_num_t records);
+
+/**
+ * @brief Drop all groups, before full rebuild
+ * @param cl Table handle
+ * @note Changes not written to file until @ref simdb_cluster_sync()
+ */
+void simdb_cluster_reset(simdb_cluster_t *cl);
+
+/**
+ * @brief Mark table out of date after failed update
+ * @param cl Table handle
+ * @note Lookups and syncs fail with @ref SIMDB_ERR_NOINDEX until @ref simdb_cluster_reset()
+ */
+void simdb_cluster_invalidate(simdb_cluster_t *cl);
+
+/**
+ * @brief Renumber entries after vacuum
+ * @param cl      Table handle
+ * @param runs    Runs of records kept by vacuum, ascending
+ * @param count   Runs count
+ * @param records Records count after vacuum
+ * @retval  0 on success
+ * @retval <0 on error, table invalidated
+ * @note Takes time proportional to records count, no searches.
+ *   Whole table written on next @ref simdb_cluster_sync()
+ */
+int simdb_cluster_remap(simdb_cluster_t *cl, const simdb_remap_run_t *runs, size_t count, simdb_num_t records);
+
+/**
+ * @brief Put record to new group of its own, leaving old group if any
+ * @param cl  Table handle
+ * @param num Record number
+ * @retval  0 on success
+ * @retval <0 on error
+ */
+int simdb_cluster_insert(simdb_cluster_t *cl, simdb_num_t num);
+
+/**
+ * @brief Remove record from its group
+ * @param cl  Table handle
+ * @param num Record number
+ * @retval  0 on success, also if record not in any group
+ * @retval <0 on error
+ * @note Group not split, even if record was only link between its parts
+ */
+int simdb_cluster_remove(simdb_cluster_t *cl, simdb_num_t num);
+
+/**
+ * @brief Merge groups of two records
+ * @param cl Table handle
+ * @param a  First record number
+ * @param b  Second record number
+ * @retval  1 if groups merged
+ * @retval  0 if already in same group, or any of records not in table
+ * @retval <0 on error
+ */
+int simdb_cluster_merge(simdb_cluster_t *cl, simdb_num_t a, simdb_num_t b);
+
+/**
+ * @brief Get members of record's group
+ * @param cl   Table handle
+ * @param num  Record number
+ * @param nums Pointer to storage for members (allocated), sorted ascending, including @a num
+ * @returns Members count, 0 if record not in table, or <0 on error,
+ *   @ref SIMDB_ERR_NOINDEX if table invalidated
+ */
+simdb_num_t simdb_cluster_members(simdb_cluster_t *cl, simdb_num_t num, simdb_num_t **nums);
+
+#endif /* HAS_CLUSTER_H */
@@ -13,362 +13,2584 @@
  * Common routines to work with database
  */
 
+#define _GNU_SOURCE 1 /* O_DIRECT */
+
 #include "common.h"
 #include "bitmap.h"
+#include "cache.h"
+#include "clock.h"
+#include "cluster.h"
+#include "lock.h"
+#include "lsh.h"
+#include "metrics.h"
+#include "phash.h"
 #include "record.h"
+#include "resident.h"
 #include "io.h"
 #include "simdb.h"
 
+#include <libgen.h>
+#include <math.h>
+#include <pthread.h>
+
 struct _simdb_t {
   int fd;               /**< database file descriptor */
+  int hfd;              /**< sidecar file descriptor, only with SIMDB_CAP_BITMAP32 */
   int flags;            /**< database flags and capabilities, see SIMDB_FLAGS_* and SIMDB_CAP_* defines */
-  int records;          /**< database records count */
+  simdb_num_t records;  /**< database records count, published only after data written */
+  simdb_num_t reserved; /**< last record number reserved for append */
+  simdb_num_t written;  /**< last record number written, published when no appends pending below it */
+  simdb_num_t *pending; /**< first numbers of reserved ranges not yet written */
+  size_t pending_count; /**< ranges count in @a pending */
+  size_t pending_size;  /**< allocated size of @a pending */
+  int *lock_fds;        /**< idle descriptors for range locks, only with SIMDB_FLAG_THREADS and SIMDB_FLAG_LOCKRANGE */
+  size_t lock_fds_count; /**< descriptors count in @a lock_fds */
+  size_t lock_fds_size; /**< allocated size of @a lock_fds */
+  unsigned long gen;    /**< write generation, incremented on each write */
+  off_t st_size;        /**< file size, as seen on last refresh */
+  struct timespec st_mtim; /**< file modification time, as seen on last refresh */
+  pthread_mutex_t mutex;  /**< guards cache and metrics, only with SIMDB_FLAG_THREADS */
+  pthread_mutex_t append; /**< serializes appends under header lock, only with SIMDB_FLAG_THREADS */
+  simdb_cache_t *cache; /**< search results cache, optional */
+  simdb_metrics_t *metrics; /**< operation metrics, only with SIMDB_FLAG_METRICS */
+  simdb_resident_t *resident; /**< in-memory records, only with SIMDB_FLAG_RESIDENT */
+  simdb_lsh_t *lsh;     /**< LSH index for approximate search, optional */
+  simdb_cluster_t *cluster; /**< near-duplicate groups, optional */
+  simdb_search_t cluster_link; /**< search parameters linking records to groups */
+  simdb_remap_run_t *remap; /**< runs kept by last vacuum, only with SIMDB_VACUUM_REMAP */
+  size_t remap_runs;    /**< runs count in @a remap */
+  simdb_num_t remap_records; /**< records count before last vacuum, only with SIMDB_VACUUM_REMAP */
   char path[PATH_MAX];  /**< path to database file */
 };
 
 /** database header format line */
 static const char *simdb_hdr_fmt = "IMDB v%02u, CAPS: %s;";
 
-bool
-simdb_create(const char *path) {
-  ssize_t bytes = 0;
-  unsigned char buf[SIMDB_REC_LEN];
-  const char *caps = "M-R";
-  bool result = false;
-  int fd = -1;
+/** sidecar file header format line, see @ref SIMDB_CAP_BITMAP32 */
+static const char *simdb_hr_hdr_fmt = "IMDB-HR v%02u, BITMAP: %ux%u;";
 
-  memset(buf, 0x0, sizeof(char) * SIMDB_REC_LEN);
+/** sidecar file suffix */
+static const char *simdb_hr_suffix = ".hr";
 
-  if ((fd = creat(path, 0644)) < 0)
-    return result;
+/** LSH index file suffix, see @ref simdb_lsh_setup() */
+static const char *simdb_lsh_suffix = ".lsh";
 
-  snprintf((char *) buf, SIMDB_REC_LEN, simdb_hdr_fmt, SIMDB_VERSION, caps);
+/** cluster table file suffix, see @ref simdb_cluster_setup() */
+static const char *simdb_cluster_suffix = ".clu";
 
-  bytes = pwrite(fd, buf, SIMDB_REC_LEN, 0);
-  if (bytes == SIMDB_REC_LEN)
-    result = true; /* success */
+/** suffix of files written by @ref simdb_vacuum(), before rename */
+static const char *simdb_vacuum_suffix = ".vacuum";
 
-  close(fd);
+/** offset of vacuum generation (uint64_t) in last bytes of database and sidecar headers */
+#define SIMDB_GEN_OFF    (SIMDB_REC_LEN  - sizeof(uint64_t))
+#define SIMDB_HR_GEN_OFF (SIMDB_HREC_LEN - sizeof(uint64_t))
 
-  return result;
+/** mapping file magic, see @ref SIMDBVacuum */
+static const char simdb_remap_magic[4] = { 'S', 'D', 'B', 'M' };
+
+/** lock shared state of handle, no-op without @ref SIMDB_FLAG_THREADS */
+static inline void
+simdb_lock(simdb_t *db) {
+  if (db->flags & SIMDB_FLAG_THREADS)
+    pthread_mutex_lock(&db->mutex);
 }
 
-simdb_t *
-simdb_open(const char *path, int mode, int *error) {
-  simdb_t *db = NULL;
-  ssize_t bytes = 0;
-  struct stat st;
-  char buf[SIMDB_REC_LEN] = "\0";
-  int flags = 0, fd = -1;
-  char *p;
+/** unlock shared state of handle, see @ref simdb_lock() */
+static inline void
+simdb_unlock(simdb_t *db) {
+  if (db->flags & SIMDB_FLAG_THREADS)
+    pthread_mutex_unlock(&db->mutex);
+}
 
-  assert(path  != NULL);
-  assert(error != NULL);
+/**
+ * @brief Get descriptor to take range lock through, see @ref simdb_lock_records()
+ * @param db Database handle
+ * @returns Descriptor or <0 on error
+ * @note OFD locks belong to open file description, so threads locking through
+ *   shared @a db->fd would be one lock owner: read lock of one thread downgrades
+ *   write lock of other, and its unlock drops that lock entirely. With
+ *   @ref SIMDB_FLAG_THREADS each lock taken through own description, idle
+ *   ones kept in handle for reuse.
+ */
+static int
+simdb_lock_fd_get(simdb_t *db) {
+  struct stat st, own;
+  int fd = -1;
 
-  if (stat(path, &st) < 0) {
-    *error = SIMDB_ERR_SYSTEM;
-    return NULL;
+  if (!(db->flags & SIMDB_FLAG_THREADS))
+    return db->fd;
+
+  simdb_lock(db);
+  if (db->lock_fds_count > 0)
+    fd = db->lock_fds[--db->lock_fds_count];
+  simdb_unlock(db);
+
+  if (fd >= 0)
+    return fd;
+
+  if ((fd = open(db->path, (db->flags & SIMDB_FLAG_WRITE) ? O_RDWR : O_RDONLY)) < 0)
+    return SIMDB_ERR_SYSTEM;
+
+  if (fstat(fd, &st) < 0 || fstat(db->fd, &own) < 0) {
+    close(fd);
+    return SIMDB_ERR_SYSTEM;
   }
 
-  if ((fd = open(path, (mode & SIMDB_FLAG_WRITE) ? O_RDWR : O_RDONLY)) < 0) {
-    *error = SIMDB_ERR_SYSTEM;
-    return NULL;
+  /* locks on new file would guard nothing read from old one */
+  if (st.st_dev != own.st_dev || st.st_ino != own.st_ino) {
+    close(fd);
+    return SIMDB_ERR_STALE;
   }
 
-  if ((mode & SIMDB_FLAG_WRITE) && (mode & (SIMDB_FLAG_LOCK|SIMDB_FLAG_LOCKNB))) {
-    int locktype = (mode & SIMDB_FLAG_LOCKNB) ? F_TLOCK : F_LOCK;
-    if (lockf(fd, locktype, 0) < 0) {
-      *error = SIMDB_ERR_LOCK;
-      return NULL;
+  return fd;
+}
+
+/** return descriptor taken by @ref simdb_lock_fd_get() */
+static void
+simdb_lock_fd_put(simdb_t *db, int fd) {
+  size_t size = 0;
+  int *tmp = NULL;
+
+  if (fd == db->fd)
+    return;
+
+  simdb_lock(db);
+  if (db->lock_fds_count == db->lock_fds_size) {
+    size = db->lock_fds_size ? db->lock_fds_size * 2 : 8;
+    if ((tmp = realloc(db->lock_fds, size * sizeof(int))) != NULL) {
+      db->lock_fds = tmp;
+      db->lock_fds_size = size;
     }
   }
-
-  errno = 0;
-  bytes = pread(fd, buf, SIMDB_REC_LEN, 0);
-  if (bytes < SIMDB_REC_LEN) {
-    *error = errno ? SIMDB_ERR_SYSTEM : SIMDB_ERR_CORRUPTDB;
-    return NULL;
+  if (db->lock_fds_count < db->lock_fds_size) {
+    db->lock_fds[db->lock_fds_count++] = fd;
+    fd = -1;
   }
+  simdb_unlock(db);
 
-  p = buf + 0;
-  if (memcmp("IMDB", p, 4) != 0) {
-    *error = SIMDB_ERR_CORRUPTDB;
-    return NULL;
+  if (fd >= 0)
+    close(fd); /* no memory to keep it, holds no locks */
+}
+
+/** close idle descriptors of @ref simdb_lock_fd_get(), no locks held through them */
+static void
+simdb_lock_fds_close(simdb_t *db) {
+  for (size_t i = 0; i < db->lock_fds_count; i++)
+    close(db->lock_fds[i]);
+  db->lock_fds_count = 0;
+}
+
+/**
+ * @brief Lock range of records, no-op without @ref SIMDB_FLAG_LOCKRANGE
+ * @param db    Database handle
+ * @param fd    Pointer to storage for descriptor holding lock, -1 if none,
+ *   pass it to @ref simdb_unlock_records()
+ * @param type  Lock type: F_RDLCK or F_WRLCK
+ * @param start First record number, zero for header
+ * @param records Records count
+ */
+static int
+simdb_lock_records(simdb_t *db, int *fd, int type, simdb_num_t start, int records) {
+  bool wait = !(db->flags & SIMDB_FLAG_LOCKNB);
+  int ret = 0;
+
+  *fd = -1;
+  if (!(db->flags & SIMDB_FLAG_LOCKRANGE))
+    return SIMDB_SUCCESS;
+
+  if ((ret = simdb_lock_fd_get(db)) < 0)
+    return ret;
+
+  *fd = ret;
+  if ((ret = simdb_lock_range(*fd, type, (off_t) SIMDB_REC_LEN * start, (off_t) SIMDB_REC_LEN * records, wait)) < 0) {
+    simdb_lock_fd_put(db, *fd);
+    *fd = -1;
   }
 
-  p = buf + 6;
-  if (atoi(p) != SIMDB_VERSION) {
-    *error = SIMDB_ERR_WRONGVERS;
-    return NULL;
+  return ret;
+}
+
+/** unlock range locked by @ref simdb_lock_records() */
+static void
+simdb_unlock_records(simdb_t *db, int fd, simdb_num_t start, int records) {
+  if (fd < 0)
+    return;
+
+  simdb_lock_range(fd, F_UNLCK, (off_t) SIMDB_REC_LEN * start, (off_t) SIMDB_REC_LEN * records, true);
+  simdb_lock_fd_put(db, fd);
+}
+
+/**
+ * @brief Read records from file to memory
+ * @param db    Database handle
+ * @param start First record number to read
+ * @retval  0 on success
+ * @retval <0 on error
+ */
+static int
+simdb_resident_load(simdb_t *db, simdb_num_t start) {
+  const int blksize = 65536;
+  simdb_urec_t *data = NULL;
+  int ret = 0;
+
+  for (simdb_num_t num = start; ; num += blksize) {
+    if ((ret = simdb_read(db, num, blksize, &data)) <= 0)
+      break;
+    ret = simdb_resident_store(db->resident, num, ret, data);
+    FREE(data);
+    if (ret < 0)
+      break;
   }
 
-  p = buf + 10;
-  if (memcmp("CAPS", p, 4) != 0) {
-    *error = -3; /* Can't read database capabilities */
-    return NULL;
+  return ret;
+}
+
+/**
+ * @brief Update in-memory records from file, see @ref simdb_refresh()
+ * @param db Database handle
+ * @retval  0 on success
+ * @retval <0 on error
+ * @note Whole file read, but only changed or new records stored,
+ *   also to LSH index if any
+ */
+static int
+simdb_resident_reload(simdb_t *db) {
+  const int blksize = 65536;
+  simdb_urec_t *data = NULL, *mem = NULL;
+  bool *changed = NULL;
+  int ret = 0, records = 0, avail = 0, first = 0;
+
+  if ((changed = calloc(blksize, sizeof(bool))) == NULL)
+    return SIMDB_ERR_OOM;
+
+  for (simdb_num_t num = 1; ret >= 0; num += blksize) {
+    if ((records = simdb_read(db, num, blksize, &data)) <= 0) {
+      ret = records;
+      break;
+    }
+
+    simdb_resident_rdlock(db->resident);
+    avail = simdb_resident_fetch(db->resident, num, records, &mem);
+    for (int i = 0; i < records; i++)
+      changed[i] = (i >= avail || memcmp(&mem[i], &data[i], SIMDB_REC_LEN) != 0);
+    simdb_resident_unlock(db->resident);
+
+    for (int i = 0; i < records && ret >= 0; ) {
+      if (!changed[i]) {
+        i++;
+        continue;
+      }
+      for (first = i; i < records && changed[i]; i++);
+      ret = simdb_resident_store(db->resident, num + first, i - first, &data[first]);
+      if (ret >= 0 && db->lsh)
+        ret = simdb_lsh_store(db->lsh, num + first, i - first, &data[first]);
+    }
+    FREE(data);
   }
+  FREE(changed);
 
-  flags = mode & SIMDB_FLAGS_MASK;
+  return ret;
+}
 
-  /* all seems to be ok */
+/**
+ * @brief Add records to LSH index
+ * @param db    Database handle
+ * @param start First record number to read
+ * @retval  0 on success
+ * @retval <0 on error
+ */
+static int
+simdb_lsh_index(simdb_t *db, simdb_num_t start) {
+  const int blksize = 65536;
+  simdb_urec_t *data = NULL;
+  int ret = 0;
 
-  if ((db = calloc(1, sizeof(simdb_t))) == NULL) {
-    *error = SIMDB_ERR_OOM;
-    return NULL;
+  for (simdb_num_t num = start; ; num += blksize) {
+    if ((ret = simdb_read(db, num, blksize, &data)) <= 0)
+      break;
+    ret = simdb_lsh_store(db->lsh, num, ret, data);
+    FREE(data);
+    if (ret < 0)
+      break;
   }
 
-  p = buf + 16;
-  for (size_t i = 0; i < 8 && *p != '\0'; p++) {
-    switch (*p) {
-      case 'M' : flags |= SIMDB_CAP_BITMAP; break;
-      case 'C' : flags |= SIMDB_CAP_COLORS; break;
-      case 'R' : flags |= SIMDB_CAP_RATIO;  break;
-      case ';' : i = 9; /* end of flags */ break;
-      default: /* ignore */ break;
+  return ret;
+}
+
+/**
+ * @brief Add written records to LSH index
+ * @param st State of database file after write, or NULL if it was changed
+ *   by others before write: index file then left out of sync, foreign
+ *   changes picked up by @ref simdb_refresh() or rebuild on next setup
+ */
+static int
+simdb_lsh_update(simdb_t *db, simdb_num_t start, int records, const simdb_urec_t *data, const struct stat *st) {
+  int ret = 0;
+
+  if ((ret = simdb_lsh_store(db->lsh, start, records, data)) < 0)
+    return ret;
+
+  return st ? simdb_lsh_sync(db->lsh, st) : SIMDB_SUCCESS;
+}
+
+/**
+ * @brief Get block of records for scanning
+ * @param db      Database handle
+ * @param start   First record number
+ * @param records Records count wanted
+ * @param data    Pointer to storage for records
+ * @returns Same as simdb_read()
+ * @note With in-memory records caller must hold shared lock on them.
+ *   Release block with @ref simdb_release()
+ */
+static inline int
+simdb_fetch(simdb_t *db, simdb_num_t start, int records, simdb_urec_t **data) {
+  if (db->resident)
+    return simdb_resident_fetch(db->resident, start, records, data);
+  return simdb_read(db, start, records, data);
+}
+
+/** release block of records taken with @ref simdb_fetch() */
+static inline void
+simdb_release(simdb_t *db, simdb_urec_t **data) {
+  if (!db->resident)
+    free(*data);
+  *data = NULL;
+}
+
+/** add observation to metrics histogram */
+static void
+simdb_observe(simdb_t *db, simdb_histogram_t *hist, const struct timespec *start) {
+  simdb_lock(db);
+  simdb_histogram_observe(hist, start);
+  simdb_unlock(db);
+}
+
+/**
+ * @brief Merge group of record with groups of its near-duplicates
+ * @param db   Database handle
+ * @param num  Record number, already in cluster table
+ * @param last Last record to look at, 0 - up to end
+ * @retval  0 on success
+ * @retval <0 on error
+ */
+static int
+simdb_cluster_link(simdb_t *db, simdb_num_t num, simdb_num_t last) {
+  simdb_search_t search = db->cluster_link;
+  int ret = 0;
+
+  search.last = last;
+  if ((ret = simdb_search_byid(db, &search, num)) < 0)
+    return ret;
+
+  for (int i = 0; i < search.found && ret >= 0; i++)
+    ret = simdb_cluster_merge(db->cluster, num, search.matches[i].num);
+  simdb_search_free(&search);
+
+  return (ret < 0) ? ret : SIMDB_SUCCESS;
+}
+
+/**
+ * @brief Add records to cluster table, linking each with records before it
+ * @param db    Database handle
+ * @param start First record number to read
+ * @retval  0 on success
+ * @retval <0 on error
+ */
+static int
+simdb_cluster_index(simdb_t *db, simdb_num_t start) {
+  const int blksize = 65536;
+  simdb_urec_t *data = NULL;
+  int ret = 0, count = 0;
+
+  for (simdb_num_t num = start; ret >= 0; num += blksize) {
+    if ((count = simdb_read(db, num, blksize, &data)) <= 0) {
+      ret = count;
+      break;
+    }
+    for (int i = 0; i < count && ret >= 0; i++) {
+      if (!data[i].used)
+        continue;
+      if ((ret = simdb_cluster_insert(db->cluster, num + i)) >= 0 && num + i > 1)
+        ret = simdb_cluster_link(db, num + i, num + i - 1);
     }
+    FREE(data);
   }
 
-  db->fd    = fd;
-  db->flags = flags;
-  db->records = (st.st_size / SIMDB_REC_LEN) - 1;
+  return ret;
+}
 
-  strncpy(db->path, path, sizeof(db->path));
+/**
+ * @brief Check database file state is same as seen on last refresh or own write
+ * @param db Database handle
+ * @param st File state
+ */
+static bool
+simdb_stat_same(simdb_t *db, const struct stat *st) {
+  bool same = false;
 
-  return db;
+  simdb_lock(db);
+  same = (st->st_size == db->st_size &&
+          st->st_mtim.tv_sec  == db->st_mtim.tv_sec &&
+          st->st_mtim.tv_nsec == db->st_mtim.tv_nsec);
+  simdb_unlock(db);
+
+  return same;
 }
 
-void
-simdb_close(simdb_t *db) {
-  assert(db != NULL);
+/**
+ * @brief Remember database file state, so own writes not taken as foreign by @ref simdb_refresh()
+ * @param db Database handle
+ * @param st File state
+ */
+static void
+simdb_stat_store(simdb_t *db, const struct stat *st) {
+  simdb_lock(db);
+  db->st_size = st->st_size;
+  db->st_mtim = st->st_mtim;
+  simdb_unlock(db);
+}
 
-  if (db->fd >= 0)
-    close(db->fd);
+/**
+ * @brief Update cluster table after record added or deleted
+ * @note Table file marked as current only if database has no changes
+ *   of others since last own write or refresh, see @ref simdb_write().
+ *   On error table invalidated: record already written, so caller
+ *   reports success of write anyway.
+ */
+static int
+simdb_cluster_update(simdb_t *db, simdb_num_t num, bool used) {
+  struct stat st;
+  int ret = 0;
 
-  FREE(db);
+  if (used) {
+    if ((ret = simdb_cluster_insert(db->cluster, num)) >= 0)
+      ret = simdb_cluster_link(db, num, 0);
+  } else {
+    ret = simdb_cluster_remove(db->cluster, num);
+  }
+
+  if (ret >= 0 && fstat(db->fd, &st) == 0 && simdb_stat_same(db, &st))
+    ret = simdb_cluster_sync(db->cluster, &st);
+
+  if (ret < 0)
+    simdb_cluster_invalidate(db->cluster);
+
+  return ret;
 }
 
-const char *
-simdb_error(int error) {
-  if (error == SIMDB_SUCCESS) {
-    return "success";
-  } else if (error == SIMDB_ERR_SYSTEM) {
-    return strerror(errno);
-  } else if (error == SIMDB_ERR_OOM) {
-    return "can't allocate memory";
-  } else if (error == SIMDB_ERR_CORRUPTDB) {
-    return "database corrupted";
-  } else if (error == SIMDB_ERR_WRONGVERS) {
-    return "database version differs from library version";
-  } else if (error == SIMDB_ERR_READONLY) {
-    return "database opened in read-only mode";
-  } else if (error == SIMDB_ERR_NXRECORD) {
-    return "no such record in database";
-  } else if (error == SIMDB_ERR_USAGE) {
-    return "wrong parameters passed to finction";
-  } else if (error == SIMDB_ERR_SAMPLER) {
-    return "given file not an image, damaged or has unsupported format";
-  } else if (error == SIMDB_ERR_LOCK) {
-    return "can't add lock on database file";
-  }
-  return "unknown error";
+/** check file at database path is other than opened one, i.e. replaced by vacuum */
+static bool
+simdb_replaced(int fd, const char *path) {
+  struct stat st, cur;
+
+  if (fstat(fd, &st) < 0 || stat(path, &cur) < 0)
+    return true;
+
+  return st.st_ino != cur.st_ino || st.st_dev != cur.st_dev;
 }
 
-int
-simdb_read(simdb_t *db, int start, int records, simdb_urec_t **data) {
-  simdb_urec_t *tmp;
-  off_t offset = 0;
-  ssize_t bytes = 0;
+/** fsync directory of given file, so renames in it are durable */
+static int
+simdb_sync_dir(const char *path) {
+  char dir[PATH_MAX];
+  int fd = -1, ret = SIMDB_SUCCESS;
 
-  assert(db != NULL);
-  assert(data != NULL);
+  strncpy(dir, path, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = '\0';
+  if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) < 0)
+    return SIMDB_ERR_SYSTEM;
+  if (fsync(fd) < 0)
+    ret = SIMDB_ERR_SYSTEM;
+  close(fd);
+
+  return ret;
+}
+
+/** read vacuum generation from header of file at given path */
+static bool
+simdb_gen_read(const char *path, off_t offset, uint64_t *gen) {
+  bool ok = false;
+  int fd = -1;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return false;
+  ok = (pread(fd, gen, sizeof(uint64_t), offset) == sizeof(uint64_t));
+  close(fd);
+
+  return ok;
+}
+
+/**
+ * @brief Finish vacuum interrupted after sidecar rename, see @ref simdb_vacuum()
+ * @param path Database path
+ * @retval  0 on success, also if there was nothing to finish
+ * @retval <0 on error
+ * @note New database file already synced then, only its rename left.
+ *   Caller holds exclusive lock on database file.
+ */
+static int
+simdb_vacuum_recover(const char *path) {
+  char tmp[PATH_MAX], hr_path[PATH_MAX];
+  uint64_t gen = 0, hr_gen = 0, tmp_gen = 0;
+
+  if (snprintf(tmp, sizeof(tmp), "%s%s", path, simdb_vacuum_suffix) >= (int) sizeof(tmp) ||
+      snprintf(hr_path, sizeof(hr_path), "%s%s", path, simdb_hr_suffix) >= (int) sizeof(hr_path))
+    return SIMDB_ERR_USAGE;
+
+  if (!simdb_gen_read(path, SIMDB_GEN_OFF, &gen) || !simdb_gen_read(hr_path, SIMDB_HR_GEN_OFF, &hr_gen) ||
+      gen == hr_gen || !simdb_gen_read(tmp, SIMDB_GEN_OFF, &tmp_gen) || tmp_gen != hr_gen)
+    return SIMDB_SUCCESS; /* nothing to finish, mismatch if any reported by open */
+
+  if (rename(tmp, path) < 0)
+    return SIMDB_ERR_SYSTEM;
+
+  return simdb_sync_dir(path);
+}
+
+/**
+ * @brief Publish new records count, if greater than current
+ * @param records Last record number written
+ * @note Count stops below first pending append, so readers never see
+ *   reserved slots before their data is written, see @ref simdb_unreserve()
+ */
+static void
+simdb_publish(simdb_t *db, simdb_num_t records) {
+  simdb_num_t limit = 0;
+
+  simdb_lock(db);
+  if (records > db->written)
+    db->written = records;
+  limit = db->written;
+  for (size_t i = 0; i < db->pending_count; i++) {
+    if (db->pending[i] <= limit)
+      limit = db->pending[i] - 1;
+  }
+  if (limit > __atomic_load_n(&db->records, __ATOMIC_ACQUIRE))
+    __atomic_store_n(&db->records, limit, __ATOMIC_RELEASE);
+  simdb_unlock(db);
+}
+
+/**
+ * @brief Reserve next record numbers for append
+ * @param count Records count to reserve
+ * @returns First reserved record number, range is unique across all threads using this handle,
+ *   or <0 on error
+ * @note Range stays pending until @ref simdb_unreserve()
+ */
+static simdb_num_t
+simdb_reserve(simdb_t *db, int count) {
+  simdb_num_t next = 0, records = 0;
+
+  simdb_lock(db);
+  if (db->pending_count == db->pending_size) {
+    size_t size = db->pending_size ? db->pending_size * 2 : 8;
+    simdb_num_t *pending = realloc(db->pending, size * sizeof(simdb_num_t));
+    if (pending == NULL) {
+      simdb_unlock(db);
+      return SIMDB_ERR_OOM;
+    }
+    db->pending = pending;
+    db->pending_size = size;
+  }
+  records = __atomic_load_n(&db->records, __ATOMIC_ACQUIRE);
+  next = ((db->reserved > records) ? db->reserved : records) + 1;
+  db->reserved = next + count - 1;
+  db->pending[db->pending_count++] = next;
+  simdb_unlock(db);
+
+  return next;
+}
+
+/**
+ * @brief Finish append started with @ref simdb_reserve(), written or not
+ * @param num First reserved record number
+ */
+static void
+simdb_unreserve(simdb_t *db, simdb_num_t num) {
+  simdb_lock(db);
+  for (size_t i = 0; i < db->pending_count; i++) {
+    if (db->pending[i] == num) {
+      db->pending[i] = db->pending[--db->pending_count];
+      break;
+    }
+  }
+  simdb_unlock(db);
+
+  simdb_publish(db, 0);
+}
+
+/** create empty sidecar file for high-resolution records */
+static bool
+simdb_create_hires(const char *path) {
+  unsigned char buf[SIMDB_HREC_LEN];
+  char hr_path[PATH_MAX];
+  bool result = false;
+  int fd = -1;
+
+  if (snprintf(hr_path, sizeof(hr_path), "%s%s", path, simdb_hr_suffix) >= (int) sizeof(hr_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+
+  if ((fd = creat(hr_path, 0644)) < 0)
+    return false;
+
+  memset(buf, 0x0, sizeof(buf));
+  snprintf((char *) buf, sizeof(buf), simdb_hr_hdr_fmt, SIMDB_VERSION, SIMDB_BITMAP_HR_SIDE, SIMDB_BITMAP_HR_SIDE);
+
+  if (pwrite(fd, buf, SIMDB_HREC_LEN, 0) == SIMDB_HREC_LEN)
+    result = true;
+
+  close(fd);
+
+  return result;
+}
+
+bool
+simdb_create_ex(const char *path, int caps) {
+  ssize_t bytes = 0;
+  unsigned char buf[SIMDB_REC_LEN];
+  char caps_str[8] = "";
+  char *c = caps_str;
+  bool result = false;
+  int fd = -1;
+
+  memset(buf, 0x0, sizeof(char) * SIMDB_REC_LEN);
+
+  *c++ = (caps & SIMDB_CAP_BITMAP)   ? 'M' : '-';
+  *c++ = (caps & SIMDB_CAP_COLORS)   ? 'C' : '-';
+  *c++ = (caps & SIMDB_CAP_RATIO)    ? 'R' : '-';
+  if (caps & SIMDB_CAP_BITMAP32)
+    *c++ = 'H';
+  if (caps & SIMDB_CAP_PHASH)
+    *c++ = 'P';
+  *c = '\0';
+
+  if (caps & SIMDB_CAP_BITMAP32 && !simdb_create_hires(path))
+    return result;
+
+  if ((fd = creat(path, 0644)) < 0)
+    return result;
+
+  snprintf((char *) buf, SIMDB_REC_LEN, simdb_hdr_fmt, SIMDB_VERSION, caps_str);
+
+  bytes = pwrite(fd, buf, SIMDB_REC_LEN, 0);
+  if (bytes == SIMDB_REC_LEN)
+    result = true; /* success */
+
+  close(fd);
+
+  return result;
+}
+
+bool
+simdb_create(const char *path) {
+  return simdb_create_ex(path, SIMDB_CAP_BITMAP | SIMDB_CAP_COLORS | SIMDB_CAP_RATIO);
+}
+
+simdb_t *
+simdb_open(const char *path, int mode, int *error) {
+  simdb_t *db = NULL;
+  ssize_t bytes = 0;
+  struct stat st;
+  char buf[SIMDB_REC_LEN] = "\0";
+  int flags = 0, fd = -1;
+  char *p;
+
+  assert(path  != NULL);
+  assert(error != NULL);
+
+  do {
+    if (fd >= 0)
+      close(fd); /* replaced by vacuum while waiting for lock, open new file */
+
+    if ((fd = open(path, (mode & SIMDB_FLAG_WRITE) ? O_RDWR : O_RDONLY)) < 0) {
+      *error = SIMDB_ERR_SYSTEM;
+      return NULL;
+    }
+
+    if ((mode & SIMDB_FLAG_WRITE) && (mode & (SIMDB_FLAG_LOCK|SIMDB_FLAG_LOCKNB)) && !(mode & SIMDB_FLAG_LOCKRANGE)) {
+      int locktype = (mode & SIMDB_FLAG_LOCKNB) ? F_TLOCK : F_LOCK;
+      if (lockf(fd, locktype, 0) < 0) {
+        close(fd);
+        *error = SIMDB_ERR_LOCK;
+        return NULL;
+      }
+    }
+  } while (simdb_replaced(fd, path));
+
+  /* threads take range locks through own file descriptions, see simdb_lock_fd_get(),
+   * classic locks are per process and dropped by closing any of them */
+  if ((mode & SIMDB_FLAG_THREADS) && (mode & SIMDB_FLAG_LOCKRANGE) && !simdb_lock_ofd(fd)) {
+    close(fd);
+    *error = SIMDB_ERR_USAGE;
+    return NULL;
+  }
+
+  if ((mode & SIMDB_FLAG_WRITE) && (mode & (SIMDB_FLAG_LOCK|SIMDB_FLAG_LOCKNB))) {
+    /* with file locked no vacuum runs, so leftovers of interrupted one may be finished */
+    bool wait = !(mode & SIMDB_FLAG_LOCKNB);
+    if (mode & SIMDB_FLAG_LOCKRANGE && (*error = simdb_lock_range(fd, F_WRLCK, 0, 0, wait)) < 0) {
+      close(fd);
+      return NULL;
+    }
+    *error = simdb_vacuum_recover(path);
+    if (mode & SIMDB_FLAG_LOCKRANGE)
+      simdb_lock_range(fd, F_UNLCK, 0, 0, true);
+    if (*error < 0) {
+      close(fd);
+      return NULL;
+    }
+    if (simdb_replaced(fd, path)) {
+      /* finished vacuum: reopen new file, lockf() lock taken again there */
+      close(fd);
+      return simdb_open(path, mode, error);
+    }
+  }
+
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    *error = SIMDB_ERR_SYSTEM;
+    return NULL;
+  }
+
+  errno = 0;
+  bytes = pread(fd, buf, SIMDB_REC_LEN, 0);
+  if (bytes < SIMDB_REC_LEN) {
+    *error = errno ? SIMDB_ERR_SYSTEM : SIMDB_ERR_CORRUPTDB;
+    return NULL;
+  }
+
+  p = buf + 0;
+  if (memcmp("IMDB", p, 4) != 0) {
+    *error = SIMDB_ERR_CORRUPTDB;
+    return NULL;
+  }
+
+  p = buf + 6;
+  if (atoi(p) != SIMDB_VERSION) {
+    *error = SIMDB_ERR_WRONGVERS;
+    return NULL;
+  }
+
+  p = buf + 10;
+  if (memcmp("CAPS", p, 4) != 0) {
+    *error = -3; /* Can't read database capabilities */
+    return NULL;
+  }
+
+  flags = mode & SIMDB_FLAGS_MASK;
+
+  /* all seems to be ok */
+
+  if ((db = calloc(1, sizeof(simdb_t))) == NULL) {
+    *error = SIMDB_ERR_OOM;
+    return NULL;
+  }
+
+  p = buf + 16;
+  for (size_t i = 0; i < 8 && *p != '\0'; p++) {
+    switch (*p) {
+      case 'M' : flags |= SIMDB_CAP_BITMAP; break;
+      case 'C' : flags |= SIMDB_CAP_COLORS; break;
+      case 'R' : flags |= SIMDB_CAP_RATIO;  break;
+      case 'H' : flags |= SIMDB_CAP_BITMAP32; break;
+      case 'P' : flags |= SIMDB_CAP_PHASH;  break;
+      case ';' : i = 9; /* end of flags */ break;
+      default: /* ignore */ break;
+    }
+  }
+
+  if (flags & SIMDB_FLAG_METRICS && (db->metrics = calloc(1, sizeof(simdb_metrics_t))) == NULL) {
+    FREE(db);
+    *error = SIMDB_ERR_OOM;
+    return NULL;
+  }
+
+  if (flags & SIMDB_FLAG_THREADS && pthread_mutex_init(&db->mutex, NULL) != 0) {
+    FREE(db->metrics);
+    FREE(db);
+    *error = SIMDB_ERR_SYSTEM;
+    return NULL;
+  }
+
+  if (flags & SIMDB_FLAG_THREADS && pthread_mutex_init(&db->append, NULL) != 0) {
+    pthread_mutex_destroy(&db->mutex);
+    FREE(db->metrics);
+    FREE(db);
+    *error = SIMDB_ERR_SYSTEM;
+    return NULL;
+  }
+
+  db->fd    = fd;
+  db->hfd   = -1;
+  db->flags = flags;
+  db->records  = (st.st_size / SIMDB_REC_LEN) - 1;
+  db->reserved = db->records;
+  db->written  = db->records;
+  db->st_size  = st.st_size;
+  db->st_mtim  = st.st_mtim;
+
+  strncpy(db->path, path, sizeof(db->path));
+
+  if (flags & SIMDB_CAP_BITMAP32) {
+    char hr_path[PATH_MAX];
+    uint64_t hr_gen = 0;
+    snprintf(hr_path, sizeof(hr_path), "%s%s", path, simdb_hr_suffix);
+    db->hfd = open(hr_path, (mode & SIMDB_FLAG_WRITE) ? O_RDWR : O_RDONLY);
+    /* lost sidecar: records without 32x32 bitmaps are valid, so start empty one */
+    if (db->hfd < 0 && errno == ENOENT && mode & SIMDB_FLAG_WRITE && simdb_create_hires(path) &&
+        (db->hfd = open(hr_path, O_RDWR)) >= 0 &&
+        pwrite(db->hfd, buf + SIMDB_GEN_OFF, sizeof(uint64_t), SIMDB_HR_GEN_OFF) != sizeof(uint64_t)) {
+      close(db->hfd);
+      db->hfd = -1;
+    }
+    if (db->hfd < 0) {
+      *error = (errno == ENOENT) ? SIMDB_ERR_CORRUPTDB : SIMDB_ERR_SYSTEM;
+      simdb_close(db);
+      return NULL;
+    }
+    /* sidecar of other vacuum generation: interrupted vacuum, not finished above */
+    if (pread(db->hfd, &hr_gen, sizeof(hr_gen), SIMDB_HR_GEN_OFF) != sizeof(hr_gen) ||
+        memcmp(&hr_gen, buf + SIMDB_GEN_OFF, sizeof(hr_gen)) != 0) {
+      *error = SIMDB_ERR_CORRUPTDB;
+      simdb_close(db);
+      return NULL;
+    }
+  }
+
+  if (flags & SIMDB_FLAG_RESIDENT) {
+    if ((db->resident = simdb_resident_new()) == NULL) {
+      simdb_close(db);
+      *error = SIMDB_ERR_OOM;
+      return NULL;
+    }
+    if ((*error = simdb_resident_load(db, 1)) < 0) {
+      simdb_close(db);
+      return NULL;
+    }
+  }
+
+  return db;
+}
+
+void
+simdb_close(simdb_t *db) {
+  assert(db != NULL);
+
+  if (db->fd >= 0)
+    close(db->fd);
+
+  if (db->hfd >= 0)
+    close(db->hfd);
+
+  if (db->cache)
+    simdb_cache_free(db->cache);
+
+  FREE(db->metrics);
+
+  if (db->resident)
+    simdb_resident_free(db->resident);
+
+  if (db->lsh)
+    simdb_lsh_free(db->lsh);
+
+  if (db->cluster)
+    simdb_cluster_free(db->cluster);
+
+  FREE(db->remap);
+  FREE(db->pending);
+
+  simdb_lock_fds_close(db);
+  FREE(db->lock_fds);
+
+  if (db->flags & SIMDB_FLAG_THREADS) {
+    pthread_mutex_destroy(&db->mutex);
+    pthread_mutex_destroy(&db->append);
+  }
+
+  FREE(db);
+}
+
+const char *
+simdb_error(int error) {
+  if (error == SIMDB_SUCCESS) {
+    return "success";
+  } else if (error == SIMDB_ERR_SYSTEM) {
+    return strerror(errno);
+  } else if (error == SIMDB_ERR_OOM) {
+    return "can't allocate memory";
+  } else if (error == SIMDB_ERR_CORRUPTDB) {
+    return "database corrupted";
+  } else if (error == SIMDB_ERR_WRONGVERS) {
+    return "database version differs from library version";
+  } else if (error == SIMDB_ERR_READONLY) {
+    return "database opened in read-only mode";
+  } else if (error == SIMDB_ERR_NXRECORD) {
+    return "no such record in database";
+  } else if (error == SIMDB_ERR_USAGE) {
+    return "wrong parameters passed to finction";
+  } else if (error == SIMDB_ERR_SAMPLER) {
+    return "given file not an image, damaged or has unsupported format";
+  } else if (error == SIMDB_ERR_LOCK) {
+    return "can't add lock on database file";
+  } else if (error == SIMDB_ERR_STALE) {
+    return "database file replaced by vacuum, reopen database";
+  } else if (error == SIMDB_ERR_NOINDEX) {
+    return "index file missing, out of date or built with other parameters";
+  }
+  return "unknown error";
+}
+
+/**
+ * @brief Read records, see @ref simdb_read()
+ * @param lock Take range lock, false if caller already holds lock on whole file:
+ *   lock of same owner would turn part of it to shared one, and unlock drop it
+ */
+static int
+simdb_read_real(simdb_t *db, simdb_num_t start, int records, simdb_urec_t **data, bool lock) {
+  simdb_urec_t *tmp;
+  off_t offset = 0;
+  ssize_t bytes = 0;
+  int ret = 0, lock_fd = -1;
+
+  assert(db != NULL);
+  assert(data != NULL);
+
+  if (start < 1 || records < 1)
+    return SIMDB_ERR_USAGE;
+
+  offset = (off_t) SIMDB_REC_LEN * start;
+  bytes  = (ssize_t) SIMDB_REC_LEN * records;
+
+  if ((tmp = calloc(1, bytes)) == NULL)
+    return SIMDB_ERR_OOM;
+
+  if (lock && (ret = simdb_lock_records(db, &lock_fd, F_RDLCK, start, records)) < 0) {
+    free(tmp);
+    return ret;
+  }
+
+  bytes = pread(db->fd, tmp, bytes, offset);
+  simdb_unlock_records(db, lock_fd, start, records);
+
+  if (bytes < 0) {
+    free(tmp);
+    return SIMDB_ERR_SYSTEM;
+  }
+
+  if (db->metrics) {
+    simdb_lock(db);
+    db->metrics->read_calls++;
+    db->metrics->read_bytes += bytes;
+    simdb_unlock(db);
+  }
+
+  records = bytes / SIMDB_REC_LEN;
+  if (records <= 0) {
+    free(tmp);
+    return 0;
+  }
+
+  *data = tmp;
+  return records;
+}
+
+int
+simdb_read(simdb_t *db, simdb_num_t start, int records, simdb_urec_t **data) {
+  return simdb_read_real(db, start, records, data, true);
+}
+
+int
+simdb_write(simdb_t *db, simdb_num_t start, int records, simdb_urec_t *data) {
+  struct stat st;
+  off_t offset = 0;
+  ssize_t bytes = 0;
+  bool clean = false;
+  int ret = 0, lock_fd = -1;
+
+  assert(db != NULL);
+  assert(data != NULL);
+
+  if (start < 1 || records < 1)
+    return SIMDB_ERR_USAGE;
+
+  if (!(db->flags & SIMDB_FLAG_WRITE))
+    return SIMDB_ERR_READONLY;
+
+  offset = (off_t) SIMDB_REC_LEN * start;
+  bytes  = (ssize_t) SIMDB_REC_LEN * records;
+
+  if ((ret = simdb_lock_records(db, &lock_fd, F_WRLCK, start, records)) < 0)
+    return ret;
+
+  /* vacuum by other process waits for range locks, then renames new file over this one */
+  if (db->flags & SIMDB_FLAG_LOCKRANGE && simdb_replaced(db->fd, db->path)) {
+    simdb_unlock_records(db, lock_fd, start, records);
+    return SIMDB_ERR_STALE;
+  }
+
+  /* file state taken after own write only if nobody else changed it before,
+   * otherwise foreign changes would be missed by simdb_refresh(). With range
+   * locks other process may change disjoint records between both fstat() calls,
+   * so own writes are seen as foreign ones by next refresh. */
+  clean = !(db->flags & SIMDB_FLAG_LOCKRANGE) && fstat(db->fd, &st) == 0 && simdb_stat_same(db, &st);
+  bytes = pwrite(db->fd, data, bytes, offset);
+  if (clean && bytes > 0 && fstat(db->fd, &st) == 0)
+    simdb_stat_store(db, &st);
+  simdb_unlock_records(db, lock_fd, start, records);
+
+  if (bytes < 0)
+    return SIMDB_ERR_SYSTEM;
+
+  if (db->metrics) {
+    simdb_lock(db);
+    db->metrics->write_calls++;
+    db->metrics->write_bytes += bytes;
+    simdb_unlock(db);
+  }
+
+  records = bytes / SIMDB_REC_LEN;
+  if (records <= 0)
+    return 0;
+
+  simdb_publish(db, start + records - 1);
+
+  if (db->resident)
+    ret = simdb_resident_store(db->resident, start, records, data);
+
+  /* records already written: failed index marks itself broken, write still succeeded */
+  if (ret >= 0 && db->lsh)
+    simdb_lsh_update(db, start, records, data, clean ? &st : NULL);
+
+  /* bumped last: search which read older generation scanned old records,
+   * so its cached result never outlives this write */
+  __atomic_add_fetch(&db->gen, 1, __ATOMIC_RELEASE);
+
+  return (ret < 0) ? ret : records;
+}
+
+int
+simdb_read_hires(simdb_t *db, simdb_num_t num, simdb_hrec_t *hires) {
+  ssize_t bytes = 0;
+
+  assert(db != NULL);
+  assert(hires != NULL);
+
+  if (db->hfd < 0 || num < 1)
+    return 0;
+
+  if ((bytes = pread(db->hfd, hires, SIMDB_HREC_LEN, (off_t) SIMDB_HREC_LEN * num)) < 0)
+    return SIMDB_ERR_SYSTEM;
+
+  if (bytes < SIMDB_HREC_LEN || !hires->used)
+    return 0; /* beyond end of file or not set */
+
+  return 1;
+}
+
+/** write whole buffer, short write is error (ENOSPC or EIO in errno) */
+static bool
+simdb_pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+  ssize_t bytes = pwrite(fd, buf, len, offset);
+
+  if (bytes >= 0 && (size_t) bytes != len)
+    errno = ENOSPC;
+
+  return bytes >= 0 && (size_t) bytes == len;
+}
+
+int
+simdb_write_hires(simdb_t *db, simdb_num_t start, int records, const simdb_hrec_t *hires) {
+  static const simdb_hrec_t empty[64];
+  off_t offset = 0;
+  int count = 0;
+
+  assert(db != NULL);
+
+  if (start < 1 || records < 1)
+    return SIMDB_ERR_USAGE;
+
+  if (db->hfd < 0)
+    return records;
+
+  if (!(db->flags & SIMDB_FLAG_WRITE))
+    return SIMDB_ERR_READONLY;
+
+  offset = (off_t) SIMDB_HREC_LEN * start;
+
+  if (hires != NULL)
+    return simdb_pwrite_full(db->hfd, hires, (size_t) SIMDB_HREC_LEN * records, offset) ? records : SIMDB_ERR_SYSTEM;
+
+  /* no data: invalidate stale records in range */
+  for (int i = 0; i < records; i += count, offset += (off_t) SIMDB_HREC_LEN * count) {
+    count = (records - i > 64) ? 64 : records - i;
+    if (!simdb_pwrite_full(db->hfd, empty, (size_t) SIMDB_HREC_LEN * count, offset))
+      return SIMDB_ERR_SYSTEM;
+  }
+
+  return records;
+}
+
+int
+simdb_refresh(simdb_t *db) {
+  struct stat st;
+  simdb_num_t records = 0, indexed = 0;
+  int ret = 0;
+
+  assert(db != NULL);
+
+  if (simdb_replaced(db->fd, db->path))
+    return SIMDB_ERR_STALE;
+
+  if (fstat(db->fd, &st) < 0)
+    return SIMDB_ERR_SYSTEM;
+
+  if (simdb_stat_same(db, &st))
+    return 0;
+
+  records = (st.st_size / SIMDB_REC_LEN) - 1;
+  indexed = simdb_records_count(db);
+  if (records < indexed) {
+    simdb_lock(db);
+    db->written = records;
+    __atomic_store_n(&db->records, records, __ATOMIC_RELEASE); /* truncated */
+    simdb_unlock(db);
+  } else {
+    simdb_publish(db, records);
+  }
+
+  if (db->resident) {
+    /* changes may be foreign: appended records may come together
+     * with changes in place, so whole file compared */
+    if (records < simdb_resident_count(db->resident))
+      simdb_resident_truncate(db->resident, records);
+    ret = simdb_resident_reload(db);
+  }
+
+  if (ret >= 0 && db->lsh) {
+    /* records with unchanged keys stay in their buckets */
+    if (!db->resident)
+      ret = simdb_lsh_index(db, 1);
+    /* also without truncation now: it may be retry after failure below it */
+    if (ret >= 0)
+      ret = simdb_lsh_truncate(db->lsh, records);
+    if (ret >= 0)
+      ret = simdb_lsh_sync(db->lsh, &st);
+  }
+
+  /* groups of foreign records unknown without searches, set up again to rebuild */
+  if (db->cluster)
+    simdb_cluster_invalidate(db->cluster);
+
+  /* bumped after records reloaded, see simdb_write() */
+  __atomic_add_fetch(&db->gen, 1, __ATOMIC_RELEASE);
+
+  if (ret < 0)
+    return ret;
+
+  /* stored last: after failure above next refresh retries */
+  simdb_stat_store(db, &st);
+
+  return 1;
+}
+
+/**
+ * @brief Copy used records densely to new files, see @ref simdb_vacuum()
+ * @param db    Database handle
+ * @param fd    New database file
+ * @param hfd   New sidecar file, or -1 without @ref SIMDB_CAP_BITMAP32
+ * @param runs  Pointer to storage for kept runs (allocated, also on error)
+ * @param count Pointer to storage for runs count
+ * @returns Records count in new file or <0 on error
+ */
+static simdb_num_t
+simdb_vacuum_copy(simdb_t *db, int fd, int hfd, simdb_remap_run_t **runs, size_t *count) {
+  const int blksize = 65536;
+  unsigned char hdr[SIMDB_HREC_LEN];
+  simdb_urec_t *data = NULL;
+  simdb_hrec_t *hires = NULL;
+  simdb_remap_run_t *run = NULL, *tmp = NULL;
+  size_t allocated = 0;
+  simdb_num_t next = 1;
+  uint64_t gen = 0;
+  int ret = 0, records = 0, kept = 0;
+
+  /* new files get next generation, so sidecar and database of different vacuums never mixed */
+  if (pread(db->fd, hdr, SIMDB_REC_LEN, 0) != SIMDB_REC_LEN)
+    return SIMDB_ERR_SYSTEM;
+  memcpy(&gen, hdr + SIMDB_GEN_OFF, sizeof(gen));
+  gen++;
+  memcpy(hdr + SIMDB_GEN_OFF, &gen, sizeof(gen));
+  if (pwrite(fd, hdr, SIMDB_REC_LEN, 0) != SIMDB_REC_LEN)
+    return SIMDB_ERR_SYSTEM;
+
+  if (hfd >= 0) {
+    if (pread(db->hfd, hdr, SIMDB_HREC_LEN, 0) != SIMDB_HREC_LEN)
+      return SIMDB_ERR_SYSTEM;
+    memcpy(hdr + SIMDB_HR_GEN_OFF, &gen, sizeof(gen));
+    if (pwrite(hfd, hdr, SIMDB_HREC_LEN, 0) != SIMDB_HREC_LEN)
+      return SIMDB_ERR_SYSTEM;
+    if ((hires = calloc(blksize, sizeof(simdb_hrec_t))) == NULL)
+      return SIMDB_ERR_OOM;
+  }
+
+  for (simdb_num_t num = 1; ret >= 0; num += blksize) {
+    /* whole file locked by caller */
+    if ((records = simdb_read_real(db, num, blksize, &data, false)) <= 0) {
+      ret = records;
+      break;
+    }
+
+    if (hires) {
+      /* sidecar may be shorter than database, missing records stay empty */
+      memset(hires, 0x0, sizeof(simdb_hrec_t) * records);
+      if (pread(db->hfd, hires, (size_t) SIMDB_HREC_LEN * records, (off_t) SIMDB_HREC_LEN * num) < 0)
+        ret = SIMDB_ERR_SYSTEM;
+    }
+
+    kept = 0;
+    for (int i = 0; i < records && ret >= 0; i++) {
+      if (!data[i].used)
+        continue;
+      if (run && run->old + run->count == (uint64_t) (num + i)) {
+        run->count++;
+      } else {
+        if (*count == allocated) {
+          allocated = allocated ? allocated * 2 : 64;
+          if ((tmp = realloc(*runs, allocated * sizeof(simdb_remap_run_t))) == NULL) {
+            ret = SIMDB_ERR_OOM;
+            break;
+          }
+          *runs = tmp;
+        }
+        run = &(*runs)[(*count)++];
+        run->old   = num + i;
+        run->num   = next + kept;
+        run->count = 1;
+      }
+      data[kept] = data[i];
+      if (hires)
+        hires[kept] = hires[i];
+      kept++;
+    }
+
+    if (ret >= 0 && kept > 0) {
+      if (pwrite(fd, data, (size_t) SIMDB_REC_LEN * kept, (off_t) SIMDB_REC_LEN * next) != (ssize_t) SIMDB_REC_LEN * kept)
+        ret = SIMDB_ERR_SYSTEM;
+      if (hires && pwrite(hfd, hires, (size_t) SIMDB_HREC_LEN * kept, (off_t) SIMDB_HREC_LEN * next) != (ssize_t) SIMDB_HREC_LEN * kept)
+        ret = SIMDB_ERR_SYSTEM;
+    }
+
+    FREE(data);
+    next += kept;
+  }
+
+  FREE(hires);
+
+  return (ret < 0) ? ret : next - 1;
+}
+
+/** write mapping file, see @ref SIMDBVacuum */
+static int
+simdb_vacuum_map(const char *path, simdb_num_t records, const simdb_remap_run_t *runs, size_t count) {
+  unsigned char hdr[8] = { 0 };
+  uint64_t total = records;
+  size_t bytes = count * sizeof(simdb_remap_run_t);
+  int fd = -1, ret = SIMDB_SUCCESS;
+
+  memcpy(hdr, simdb_remap_magic, sizeof(simdb_remap_magic));
+  hdr[4] = 1; /* version */
+
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return SIMDB_ERR_SYSTEM;
+
+  if (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      pwrite(fd, &total, sizeof(total), sizeof(hdr)) != sizeof(total) ||
+      (bytes > 0 && pwrite(fd, runs, bytes, sizeof(hdr) + sizeof(total)) != (ssize_t) bytes) ||
+      fsync(fd) < 0)
+    ret = SIMDB_ERR_SYSTEM;
+
+  close(fd);
+
+  return ret;
+}
+
+simdb_num_t
+simdb_vacuum(simdb_t *db, const char *map, int flags) {
+  char tmp[PATH_MAX], hr_path[PATH_MAX], hr_tmp[PATH_MAX];
+  simdb_remap_run_t *runs = NULL;
+  size_t count = 0;
+  simdb_num_t records = 0, before = 0;
+  struct stat st;
+  bool range = false, wait = false;
+  int fd = -1, hfd = -1, ret = 0;
+
+  assert(db != NULL);
+
+  if (!(db->flags & SIMDB_FLAG_WRITE))
+    return SIMDB_ERR_READONLY;
+
+  if (flags & ~(SIMDB_VACUUM_REMAP))
+    return SIMDB_ERR_USAGE;
+
+  if (snprintf(tmp, sizeof(tmp), "%s%s", db->path, simdb_vacuum_suffix) >= (int) sizeof(tmp) ||
+      snprintf(hr_path, sizeof(hr_path), "%s%s", db->path, simdb_hr_suffix) >= (int) sizeof(hr_path) ||
+      snprintf(hr_tmp, sizeof(hr_tmp), "%s%s", hr_path, simdb_vacuum_suffix) >= (int) sizeof(hr_tmp))
+    return SIMDB_ERR_USAGE;
+
+  /* no writes of other processes during copy and swap: handle without range locks
+   * already holds lock on whole file since open, with range locks take it now */
+  range = db->flags & SIMDB_FLAG_LOCKRANGE;
+  wait  = !(db->flags & SIMDB_FLAG_LOCKNB);
+  if (range && (ret = simdb_lock_range(db->fd, F_WRLCK, 0, 0, wait)) < 0)
+    return ret;
+  if (range && simdb_replaced(db->fd, db->path)) {
+    simdb_lock_range(db->fd, F_UNLCK, 0, 0, true);
+    return SIMDB_ERR_STALE; /* other vacuum finished first */
+  }
+
+  if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+    if (range)
+      simdb_lock_range(db->fd, F_UNLCK, 0, 0, true);
+    return SIMDB_ERR_SYSTEM;
+  }
+
+  if (db->hfd >= 0 && (hfd = open(hr_tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    ret = SIMDB_ERR_SYSTEM;
+
+  before = simdb_records_count(db);
+  if (ret >= 0 && (records = simdb_vacuum_copy(db, fd, hfd, &runs, &count)) < 0)
+    ret = (int) records;
+
+  if (ret >= 0 && (fsync(fd) < 0 || (hfd >= 0 && fsync(hfd) < 0) || fstat(fd, &st) < 0))
+    ret = SIMDB_ERR_SYSTEM;
+
+  /* mapping written before swap, so it exists once new file visible */
+  if (ret >= 0 && map)
+    ret = simdb_vacuum_map(map, before, runs, count);
+
+  /* new file locked before it becomes visible, so others wait for it too */
+  if (ret >= 0 && (db->flags & (SIMDB_FLAG_LOCK|SIMDB_FLAG_LOCKNB)) && !range) {
+    if (lockf(fd, F_TLOCK, 0) < 0)
+      ret = SIMDB_ERR_LOCK;
+  }
+  if (ret >= 0 && range)
+    ret = simdb_lock_range(fd, F_WRLCK, 0, 0, false);
+
+  if (ret >= 0 && hfd >= 0 && rename(hr_tmp, hr_path) < 0)
+    ret = SIMDB_ERR_SYSTEM;
+
+  if (ret < 0) {
+    if (range)
+      simdb_lock_range(db->fd, F_UNLCK, 0, 0, true);
+    close(fd);
+    unlink(tmp);
+    if (hfd >= 0) {
+      close(hfd);
+      unlink(hr_tmp);
+    }
+    FREE(runs);
+    return ret;
+  }
+
+  /* database renamed last: if this fails or process dies before, new sidecar
+   * has newer generation than database, and next open for writing finishes
+   * rename, see simdb_vacuum_recover(). Own handle keeps using old files. */
+  if (rename(tmp, db->path) < 0 || simdb_sync_dir(db->path) < 0) {
+    if (range)
+      simdb_lock_range(db->fd, F_UNLCK, 0, 0, true);
+    close(fd);
+    if (hfd >= 0)
+      close(hfd);
+    FREE(runs);
+    return SIMDB_ERR_SYSTEM;
+  }
+
+  close(db->fd); /* drops locks on old file, waiting processes see it replaced */
+  if (range)
+    simdb_lock_range(fd, F_UNLCK, 0, 0, true);
+  simdb_lock_fds_close(db); /* opened on old file, no calls run concurrently */
+  db->fd = fd;
+  if (hfd >= 0) {
+    close(db->hfd);
+    db->hfd = hfd;
+  }
+
+  simdb_lock(db);
+  db->st_size = st.st_size;
+  db->st_mtim = st.st_mtim;
+  db->written  = records;
+  db->reserved = records;
+  __atomic_store_n(&db->records, records, __ATOMIC_RELEASE);
+  simdb_unlock(db);
+
+  if (db->resident && (ret = simdb_resident_load(db, 1)) >= 0)
+    simdb_resident_truncate(db->resident, records);
+
+  if (ret >= 0 && db->lsh) {
+    simdb_lsh_reset(db->lsh);
+    if ((ret = simdb_lsh_index(db, 1)) >= 0 && (ret = simdb_lsh_truncate(db->lsh, records)) >= 0)
+      ret = simdb_lsh_sync(db->lsh, &st);
+  }
+
+  /* bumped after records reloaded, see simdb_write() */
+  __atomic_add_fetch(&db->gen, 1, __ATOMIC_RELEASE);
+
+  /* groups kept, only renumbered */
+  if (ret >= 0 && db->cluster && (ret = simdb_cluster_remap(db->cluster, runs, count, records)) >= 0)
+    ret = simdb_cluster_sync(db->cluster, &st);
+
+  FREE(db->remap);
+  db->remap_runs    = 0;
+  db->remap_records = 0;
+  if (flags & SIMDB_VACUUM_REMAP) {
+    db->remap = runs;
+    db->remap_runs    = count;
+    db->remap_records = before;
+    runs = NULL;
+  }
+  FREE(runs);
+
+  return (ret < 0) ? ret : records;
+}
+
+simdb_num_t
+simdb_remap_runs(const simdb_remap_run_t *runs, size_t count, simdb_num_t num) {
+  const simdb_remap_run_t *run = NULL;
+  size_t lo = 0, hi = 0, mid = 0;
+
+  /* find last run starting at or before num */
+  hi = count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (runs[mid].old <= (uint64_t) num) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo == 0)
+    return 0;
+
+  run = &runs[lo - 1];
+  if ((uint64_t) num >= run->old + run->count)
+    return 0; /* unused before vacuum */
+
+  return run->num + (num - run->old);
+}
+
+simdb_num_t
+simdb_remap(simdb_t *db, simdb_num_t num) {
+  assert(db != NULL);
+
+  if (db->remap_records == 0)
+    return SIMDB_ERR_USAGE;
+
+  if (num < 1 || num > db->remap_records)
+    return SIMDB_ERR_NXRECORD;
+
+  return simdb_remap_runs(db->remap, db->remap_runs, num);
+}
+
+bool
+simdb_record_used(simdb_t *db, simdb_num_t num) {
+  simdb_urec_t *rec = NULL;
+  bool ret = false;
+
+  assert(db != NULL);
+
+  if (num <= 0 || num > simdb_records_count(db))
+    return false;
+
+  if (simdb_read(db, num, 1, &rec) < 1)
+    return false;
+
+  ret = rec->used ? true : false;
+
+  FREE(rec);
+  return ret;
+}
+
+/**
+ * @brief Calls sampler and accounts time spent in it
+ * @param hires Storage for high-resolution record, filled only with @ref SIMDB_CAP_BITMAP32
+ */
+static simdb_urec_t *
+simdb_sample(simdb_t *db, const char *path, simdb_hrec_t *hires) {
+  simdb_urec_t *rec = NULL;
+  struct timespec start;
+
+  memset(hires, 0x0, sizeof(simdb_hrec_t));
+  if (!(db->flags & SIMDB_CAP_BITMAP32))
+    hires = NULL;
+
+  if (!db->metrics)
+    return simdb_record_create(path, hires);
+
+  simdb_metrics_start(&start);
+  rec = simdb_record_create(path, hires);
+  simdb_observe(db, &db->metrics->sampler, &start);
+
+  return rec;
+}
+
+/** reserve numbers for records and write them, high-resolution records first */
+static simdb_num_t
+simdb_append_write(simdb_t *db, int records, simdb_urec_t *data, const simdb_hrec_t *hires) {
+  simdb_num_t num = simdb_reserve(db, records);
+  int ret = 0;
+
+  if (num < 0)
+    return num;
+
+  if ((ret = simdb_write_hires(db, num, records, hires)) > 0)
+    ret = simdb_write(db, num, records, data);
+  simdb_unreserve(db, num);
+
+  return (ret > 0) ? num : ret;
+}
+
+simdb_num_t
+simdb_append(simdb_t *db, int records, simdb_urec_t *data, const simdb_hrec_t *hires) {
+  struct stat st;
+  simdb_num_t num = 0, ret = 0;
+  int lock_fd = -1;
+
+  assert(db != NULL);
+  assert(data != NULL);
+
+  if (records < 1)
+    return SIMDB_ERR_USAGE;
+
+  if (!(db->flags & SIMDB_FLAG_LOCKRANGE))
+    return simdb_append_write(db, records, data, hires);
+
+  /* database shared by many processes: header range is locked exclusively
+   * while actual records count taken from file size and new records written.
+   * Threads of same process are serialized with mutex, so they wait for
+   * each other also with SIMDB_FLAG_LOCKNB. */
+  if (db->flags & SIMDB_FLAG_THREADS)
+    pthread_mutex_lock(&db->append);
+
+  do {
+    if ((ret = simdb_lock_records(db, &lock_fd, F_WRLCK, 0, 1)) < 0)
+      break;
+    if (fstat(db->fd, &st) < 0) {
+      ret = SIMDB_ERR_SYSTEM;
+    } else {
+      simdb_publish(db, st.st_size / SIMDB_REC_LEN - 1);
+      ret = num = simdb_append_write(db, records, data, hires);
+    }
+    simdb_unlock_records(db, lock_fd, 0, 1);
+  } while (0);
+
+  if (db->flags & SIMDB_FLAG_THREADS)
+    pthread_mutex_unlock(&db->append);
+
+  return (ret > 0) ? num : ret;
+}
+
+static simdb_num_t
+simdb_record_add_real(simdb_t *db, simdb_num_t num, const char *path, int flags) {
+  simdb_hrec_t hires;
+  simdb_urec_t *rec = NULL;
+  int ret = 0;
+
+  assert(db != NULL);
+
+  if (num < 0 || path == NULL)
+    return SIMDB_ERR_USAGE;
+
+  if (flags & SIMDB_ADD_NOEXTEND && num > simdb_records_count(db))
+    return 0;
+
+  if (access(path, R_OK) < 0)
+    return SIMDB_ERR_SYSTEM;
+
+  if (num > 0 && flags & SIMDB_ADD_NOREPLACE && simdb_record_used(db, num))
+    return 0;
+
+  if ((rec = simdb_sample(db, path, &hires)) == NULL)
+    return SIMDB_ERR_SAMPLER;
+
+  if (num == 0) {
+    num = simdb_append(db, 1, rec, &hires);
+  } else if ((ret = simdb_write_hires(db, num, 1, &hires)) <= 0 ||
+             (ret = simdb_write(db, num, 1, rec)) <= 0) {
+    num = ret;
+  }
+
+  FREE(rec);
+
+  /* failed update invalidates table, record is added anyway */
+  if (num > 0 && db->cluster)
+    simdb_cluster_update(db, num, true);
+
+  return num;
+}
+
+simdb_num_t
+simdb_record_add(simdb_t *db, simdb_num_t num, const char *path, int flags) {
+  struct timespec start;
+  simdb_num_t ret = 0;
+
+  assert(db != NULL);
+
+  if (!db->metrics)
+    return simdb_record_add_real(db, num, path, flags);
+
+  simdb_metrics_start(&start);
+  ret = simdb_record_add_real(db, num, path, flags);
+  simdb_observe(db, &db->metrics->add, &start);
+
+  return ret;
+}
+
+static simdb_num_t
+simdb_record_del_real(simdb_t *db, simdb_num_t num) {
+  simdb_urec_t *rec;
+  int ret = 0;
+
+  assert(db != NULL);
+
+  if (num < 1)
+    return SIMDB_ERR_USAGE;
+
+  if (!(db->flags & SIMDB_FLAG_WRITE))
+    return SIMDB_ERR_READONLY;
+
+  if ((ret = simdb_read(db, num, 1, &rec)) < 1)
+    return ret;
+
+  rec->used = 0x0;
+
+  if ((ret = simdb_write(db, num, 1, rec)) < 1)
+    num = ret;
+
+  FREE(rec);
+
+  /* failed update invalidates table, record is deleted anyway */
+  if (num > 0 && db->cluster)
+    simdb_cluster_update(db, num, false);
+
+  return num;
+}
+
+simdb_num_t
+simdb_record_del(simdb_t *db, simdb_num_t num) {
+  struct timespec start;
+  simdb_num_t ret = 0;
+
+  assert(db != NULL);
+
+  if (!db->metrics)
+    return simdb_record_del_real(db, num);
+
+  simdb_metrics_start(&start);
+  ret = simdb_record_del_real(db, num);
+  simdb_observe(db, &db->metrics->del, &start);
+
+  return ret;
+}
+
+int
+simdb_record_bitmap(simdb_t *db, simdb_num_t num, char **map, size_t *side) {
+  simdb_urec_t *rec;
+  int ret = 0;
+
+  assert(db != NULL);
+
+  if (num < 0 || map == NULL || side == NULL)
+    return SIMDB_ERR_USAGE;
+
+  if ((ret = simdb_read(db, num, 1, &rec)) <= 0)
+    return ret;
+
+  ret = simdb_bitmap_unpack(rec->bitmap, map);
+  *side = SIMDB_BITMAP_SIDE;
+
+  FREE(rec);
+  return ret;
+}
+
+int
+simdb_record_bitmap_raw(simdb_t *db, simdb_num_t num, unsigned char *map) {
+  simdb_urec_t *rec;
+  int ret = 0;
+
+  assert(db != NULL);
+
+  if (num < 1 || map == NULL)
+    return SIMDB_ERR_USAGE;
+
+  if ((ret = simdb_read(db, num, 1, &rec)) <= 0)
+    return ret;
+
+  if (rec->used) {
+    memcpy(map, rec->bitmap, SIMDB_BITMAP_SIZE);
+  } else {
+    ret = 0;
+  }
+
+  FREE(rec);
+  return ret;
+}
+
+simdb_num_t
+simdb_records_count(simdb_t * const db) {
+  assert(db != NULL);
+  return __atomic_load_n(&db->records, __ATOMIC_ACQUIRE);
+}
+
+inline static float
+simdb_record_ratio(const simdb_urec_t *r) {
+  assert(r != NULL);
+
+  if (r->image_w > 0 && r->image_h > 0)
+    return (float) r->image_w / r->image_h;
+
+  return 0.0;
+}
+
+/**
+ * @brief Check record has overall color levels
+ * @note Records sampled before @ref SIMDB_CAP_COLORS (e.g. imported from older
+ *   databases) have all levels zero, so they are not compared as black ones,
+ *   same as missing perceptual hash. Truly black image loses only this filter.
+ */
+inline static bool
+simdb_record_color_set(const simdb_urec_t *r) {
+  return r->clevel_r || r->clevel_g || r->clevel_b;
+}
+
+/**
+ * @brief Difference of overall color levels of two records
+ * @returns Max difference of single channel (0-255)
+ */
+inline static int
+simdb_record_color_diff(const simdb_urec_t *a, const simdb_urec_t *b) {
+  int diff = 0, max = 0;
+
+  assert(a != NULL);
+  assert(b != NULL);
+
+  diff = abs(a->clevel_r - b->clevel_r);
+  max = (diff > max) ? diff : max;
+  diff = abs(a->clevel_g - b->clevel_g);
+  max = (diff > max) ? diff : max;
+  diff = abs(a->clevel_b - b->clevel_b);
+  max = (diff > max) ? diff : max;
+
+  return max;
+}
+
+int
+simdb_cache_setup(simdb_t *db, size_t budget) {
+  assert(db != NULL);
+
+  if (db->cache) {
+    simdb_cache_free(db->cache);
+    db->cache = NULL;
+  }
+
+  if (budget == 0)
+    return SIMDB_SUCCESS;
+
+  if ((db->cache = simdb_cache_new(budget)) == NULL)
+    return SIMDB_ERR_OOM;
+
+  return SIMDB_SUCCESS;
+}
+
+int
+simdb_memory_setup(simdb_t *db, int options) {
+  assert(db != NULL);
+
+  if (!db->resident || options & ~(SIMDB_MEMORY_HUGEPAGES | SIMDB_MEMORY_INTERLEAVE))
+    return SIMDB_ERR_USAGE;
+
+  return simdb_resident_setup(db->resident, options);
+}
+
+int
+simdb_lsh_setup(simdb_t *db, int tables, int bits) {
+  char path[PATH_MAX];
+  struct stat st;
+  simdb_num_t records = 0;
+  int ret = 0;
+
+  assert(db != NULL);
+
+  if (db->lsh) {
+    simdb_lsh_free(db->lsh);
+    db->lsh = NULL;
+  }
+
+  if (tables == 0)
+    return SIMDB_SUCCESS;
+
+  ret = snprintf(path, sizeof(path), "%s%s", db->path, simdb_lsh_suffix);
+  if (ret < 0 || (size_t) ret >= sizeof(path))
+    return SIMDB_ERR_USAGE;
+
+  if ((db->lsh = simdb_lsh_open(path, tables, bits, db->flags & SIMDB_FLAG_WRITE, &ret)) == NULL)
+    return ret;
+
+  if (fstat(db->fd, &st) < 0) {
+    ret = SIMDB_ERR_SYSTEM;
+  } else {
+    records = (st.st_size / SIMDB_REC_LEN) - 1;
+    /* reuse stored keys, if database not changed since last sync */
+    if (simdb_lsh_synced(db->lsh, &st) && (ret = simdb_lsh_load(db->lsh, records)) == SIMDB_SUCCESS)
+      return SIMDB_SUCCESS;
+    if (db->flags & SIMDB_FLAG_WRITE) {
+      /* rebuilt once and persisted for others */
+      simdb_lsh_reset(db->lsh);
+      if ((ret = simdb_lsh_index(db, 1)) >= 0 && (ret = simdb_lsh_truncate(db->lsh, records)) >= 0)
+        ret = simdb_lsh_sync(db->lsh, &st);
+    } else if (ret >= 0) {
+      ret = SIMDB_ERR_NOINDEX; /* read-only handle never rebuilds */
+    }
+  }
+
+  if (ret < 0) {
+    simdb_lsh_free(db->lsh);
+    db->lsh = NULL;
+    return ret;
+  }
+
+  return SIMDB_SUCCESS;
+}
+
+int
+simdb_cluster_setup(simdb_t *db, const simdb_search_t *link) {
+  char path[PATH_MAX];
+  struct stat st;
+  simdb_num_t records = 0;
+  int ret = 0;
+
+  assert(db != NULL);
+
+  if (db->cluster) {
+    simdb_cluster_free(db->cluster);
+    db->cluster = NULL;
+  }
+
+  if (link == NULL)
+    return SIMDB_SUCCESS;
+
+  if (link->mode == SIMDB_SEARCH_LSH && !db->lsh)
+    return SIMDB_ERR_USAGE;
+
+  ret = snprintf(path, sizeof(path), "%s%s", db->path, simdb_cluster_suffix);
+  if (ret < 0 || (size_t) ret >= sizeof(path))
+    return SIMDB_ERR_USAGE;
+
+  /* only parameters of link, all matches wanted */
+  simdb_search_init(&db->cluster_link);
+  db->cluster_link.d_bitmap   = link->d_bitmap;
+  db->cluster_link.d_ratio    = link->d_ratio;
+  db->cluster_link.d_color    = link->d_color;
+  db->cluster_link.d_phash    = link->d_phash;
+  db->cluster_link.mode       = link->mode;
+  db->cluster_link.lsh_tables = link->lsh_tables;
+  db->cluster_link.lsh_probes = link->lsh_probes;
+  db->cluster_link.transforms = link->transforms;
+
+  if ((db->cluster = simdb_cluster_open(path, &db->cluster_link, db->flags & SIMDB_FLAG_WRITE, &ret)) == NULL)
+    return ret;
+
+  if (fstat(db->fd, &st) < 0) {
+    ret = SIMDB_ERR_SYSTEM;
+  } else {
+    records = (st.st_size / SIMDB_REC_LEN) - 1;
+    /* reuse stored groups, if database not changed since last sync */
+    if (simdb_cluster_synced(db->cluster, &st) && (ret = simdb_cluster_load(db->cluster, records)) == SIMDB_SUCCESS)
+      return SIMDB_SUCCESS;
+    if (db->flags & SIMDB_FLAG_WRITE) {
+      /* rebuilt once and persisted for others */
+      simdb_cluster_reset(db->cluster);
+      if ((ret = simdb_cluster_index(db, 1)) >= 0)
+        ret = simdb_cluster_sync(db->cluster, &st);
+    } else if (ret >= 0) {
+      ret = SIMDB_ERR_NOINDEX; /* read-only handle never rebuilds */
+    }
+  }
+
+  if (ret < 0) {
+    simdb_cluster_free(db->cluster);
+    db->cluster = NULL;
+    return ret;
+  }
+
+  return SIMDB_SUCCESS;
+}
+
+int
+simdb_indexes_setup(simdb_t *db) {
+  char path[PATH_MAX];
+  simdb_search_t link;
+  int tables = 0, bits = 0, ret = 0;
+
+  assert(db != NULL);
+
+  ret = snprintf(path, sizeof(path), "%s%s", db->path, simdb_lsh_suffix);
+  if (ret < 0 || (size_t) ret >= sizeof(path))
+    return SIMDB_ERR_USAGE;
+
+  if (!db->lsh && simdb_lsh_stored(path, &tables, &bits) && (ret = simdb_lsh_setup(db, tables, bits)) < 0)
+    return ret;
+
+  ret = snprintf(path, sizeof(path), "%s%s", db->path, simdb_cluster_suffix);
+  if (ret < 0 || (size_t) ret >= sizeof(path))
+    return SIMDB_ERR_USAGE;
+
+  /* after LSH index, table may link records in LSH mode */
+  if (!db->cluster && simdb_cluster_stored(path, &link) && (ret = simdb_cluster_setup(db, &link)) < 0)
+    return ret;
+
+  return SIMDB_SUCCESS;
+}
+
+simdb_num_t
+simdb_cluster_get(simdb_t *db, simdb_num_t num, simdb_num_t **nums) {
+  assert(db   != NULL);
+  assert(nums != NULL);
+
+  if (!db->cluster || num < 1)
+    return SIMDB_ERR_USAGE;
+
+  return simdb_cluster_members(db->cluster, num, nums);
+}
+
+bool
+simdb_cache_stats(simdb_t *db, simdb_cache_stats_t *stats) {
+  assert(db    != NULL);
+  assert(stats != NULL);
+
+  if (!db->cache)
+    return false;
+
+  simdb_lock(db);
+  simdb_cache_get_stats(db->cache, stats);
+  simdb_unlock(db);
+  return true;
+}
+
+bool
+simdb_metrics_get(simdb_t *db, simdb_metrics_t *metrics) {
+  assert(db      != NULL);
+  assert(metrics != NULL);
+
+  if (!db->metrics)
+    return false;
+
+  simdb_lock(db);
+  memcpy(metrics, db->metrics, sizeof(simdb_metrics_t));
+  simdb_unlock(db);
+  return true;
+}
+
+void
+simdb_metrics_reset(simdb_t *db) {
+  assert(db != NULL);
+
+  if (db->metrics) {
+    simdb_lock(db);
+    memset(db->metrics, 0x0, sizeof(simdb_metrics_t));
+    simdb_unlock(db);
+  }
+}
+
+void
+simdb_search_init(simdb_search_t *search) {
+  assert(search != NULL);
+
+  memset(search, 0x0, sizeof(simdb_search_t));
+
+  search->d_ratio  = 0.07; /* 7% */
+  search->d_bitmap = 0.07; /* 7% */
+  search->d_color  = 0.10; /* 10% */
+  search->d_phash  = 0.25; /* 25% */
+
+  return;
+}
+
+void
+simdb_search_free(simdb_search_t *search) {
+  assert(search != NULL);
+
+  if (search->found == 0)
+    return;
+  FREE(search->matches);
+  search->found = 0;
+}
+
+#define COLD_ALIGN 4096   /**< alignment of offsets and buffer for O_DIRECT reads */
+#define COLD_BLOCK 16384  /**< records read at once in cold scan, 768 KiB */
+
+/** reader of cold scan, see simdb_search_t.cold */
+typedef struct simdb_cold_t {
+  int fd;               /**< own descriptor of database file, -1 - use db->fd */
+  bool direct;          /**< @a fd opened with O_DIRECT */
+  unsigned char *buf;   /**< aligned buffer of @ref COLD_BLOCK records and alignment slack */
+} simdb_cold_t;
 
-  if (start < 1 || records < 1)
-    return SIMDB_ERR_USAGE;
+static int
+simdb_cold_open(simdb_t *db, simdb_cold_t *cold) {
+  size_t size = (size_t) COLD_BLOCK * SIMDB_REC_LEN + 2 * COLD_ALIGN;
 
-  offset = SIMDB_REC_LEN * start;
-  bytes  = SIMDB_REC_LEN * records;
+  memset(cold, 0x0, sizeof(simdb_cold_t));
 
-  if ((tmp = calloc(1, bytes)) == NULL)
+  if (posix_memalign((void **) &cold->buf, COLD_ALIGN, size) != 0)
     return SIMDB_ERR_OOM;
 
-  if ((bytes = pread(db->fd, tmp, bytes, offset)) < 0) {
-    free(tmp);
-    return SIMDB_ERR_SYSTEM;
+#ifdef O_DIRECT
+  if ((cold->fd = open(db->path, O_RDONLY | O_DIRECT)) >= 0) {
+    cold->direct = true;
+    return SIMDB_SUCCESS;
   }
+#endif
+  /* filesystem without direct i/o (tmpfs, some fuse): drop pages after reading */
+  if ((cold->fd = open(db->path, O_RDONLY)) >= 0)
+    posix_fadvise(cold->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-  records = bytes / SIMDB_REC_LEN;
-  if (records <= 0) {
-    free(tmp);
-    return 0;
-  }
+  return SIMDB_SUCCESS;
+}
 
-  *data = tmp;
-  return records;
+static void
+simdb_cold_close(simdb_cold_t *cold) {
+  if (cold->fd >= 0)
+    close(cold->fd);
+  FREE(cold->buf);
 }
 
-int
-simdb_write(simdb_t *db, int start, int records, simdb_urec_t *data) {
-  off_t offset = 0;
+/**
+ * @brief Read block of records bypassing page cache, same as simdb_read()
+ * @note Returned records valid until next call, don't free them
+ */
+static int
+simdb_cold_read(simdb_t *db, simdb_cold_t *cold, simdb_num_t start, int records, simdb_urec_t **data) {
+  int fd = (cold->fd >= 0) ? cold->fd : db->fd;
+  off_t offset = (off_t) SIMDB_REC_LEN * start;
+  off_t aligned = offset & ~((off_t) COLD_ALIGN - 1);
+  size_t length = (offset - aligned) + (size_t) SIMDB_REC_LEN * records;
   ssize_t bytes = 0;
+  int ret = 0, lock_fd = -1;
 
-  assert(db != NULL);
-  assert(data != NULL);
-
-  if (start < 1 || records < 1)
-    return SIMDB_ERR_USAGE;
+  length = (length + COLD_ALIGN - 1) & ~((size_t) COLD_ALIGN - 1);
 
-  if (!(db->flags & SIMDB_FLAG_WRITE))
-    return SIMDB_ERR_READONLY;
+  if ((ret = simdb_lock_records(db, &lock_fd, F_RDLCK, start, records)) < 0)
+    return ret;
 
-  offset = SIMDB_REC_LEN * start;
-  bytes  = SIMDB_REC_LEN * records;
+  bytes = pread(fd, cold->buf, length, aligned);
+  simdb_unlock_records(db, lock_fd, start, records);
 
-  if ((bytes = pwrite(db->fd, data, bytes, offset)) < 0)
+  if (bytes < 0)
     return SIMDB_ERR_SYSTEM;
 
-  records = bytes / SIMDB_REC_LEN;
-  if (records <= 0)
+  if (!cold->direct) {
+    /* pages of this block not needed anymore, next block wanted soon */
+    posix_fadvise(fd, aligned, length, POSIX_FADV_DONTNEED);
+    posix_fadvise(fd, aligned + length, length, POSIX_FADV_WILLNEED);
+  }
+
+  if (db->metrics) {
+    simdb_lock(db);
+    db->metrics->read_calls++;
+    db->metrics->read_bytes += bytes;
+    simdb_unlock(db);
+  }
+
+  bytes -= offset - aligned;
+  if (bytes < SIMDB_REC_LEN)
     return 0;
 
-  if ((start + records - 1) > db->records)
-    db->records = (start + records - 1);
+  if (records > bytes / SIMDB_REC_LEN)
+    records = bytes / SIMDB_REC_LEN;
 
+  *data = (simdb_urec_t *) (cold->buf + (offset - aligned));
   return records;
 }
 
-bool
-simdb_record_used(simdb_t *db, int num) {
-  simdb_urec_t *rec = NULL;
-  bool ret = false;
-
-  assert(db != NULL);
+/** transforms swapping width and height of sample, see @ref SIMDBTransforms */
+#define SIMDB_TRANSFORMS_SWAP ((1 << SIMDB_TRANSFORM_ROT90) | (1 << SIMDB_TRANSFORM_ROT270) | \
+  (1 << SIMDB_TRANSFORM_TRANSPOSE) | (1 << SIMDB_TRANSFORM_TRANSVERSE))
 
-  if (num <= 0 || num > db->records)
-    return false;
+struct simdb_scan_t;
 
-  if (simdb_read(db, num, 1, &rec) < 1)
-    return false;
+/**
+ * @brief Test block of records against search sample
+ * @param db    Database handle
+ * @param scan  Search state
+ * @param first Number of first record in block
+ * @param data  Records
+ * @param count Records count
+ * @retval <0 error
+ * @retval  0 block done, or results limit reached
+ */
+typedef int (*simdb_kernel_t)(simdb_t *db, struct simdb_scan_t *scan, simdb_num_t first,
+                              simdb_urec_t *data, int count);
+
+/** state of single search, shared by exact and LSH search */
+typedef struct simdb_scan_t {
+  simdb_search_t *search;
+  simdb_urec_t *sample;       /**< source sample */
+  const simdb_hrec_t *hires;  /**< source sample, 32x32 bitmap, NULL if not available */
+  simdb_num_t skip;           /**< source record number, skipped */
+  simdb_num_t first;          /**< first record of range */
+  simdb_num_t last;           /**< last record of range, also last eligible one */
+  float ratio_s;              /**< source ratio, 0.0 - don't compare */
+  float ratio_swap;           /**< source ratio after rotation by 90 degrees */
+  int transforms;             /**< sample transforms to compare, mask, 0x1 - sample as is only */
+  unsigned char bitmaps[SIMDB_TRANSFORMS][SIMDB_BITMAP_SIZE];       /**< transformed sample bitmaps */
+  unsigned char hires_maps[SIMDB_TRANSFORMS][SIMDB_BITMAP_HR_SIZE]; /**< transformed sample 32x32 bitmaps */
+  int bitmap_max;             /**< max bitmaps difference, in bits */
+  int hires_max;              /**< max 32x32 bitmaps difference, in bits */
+  int color_max;              /**< max color levels difference, <0 - don't compare */
+  int phash_max;              /**< max perceptual hashes difference, <0 - don't compare */
+  simdb_kernel_t kernel;      /**< block test routine, chosen once per search */
+  simdb_search_stats_t stats;
+  simdb_match_t *matches;
+  int found;
+  int capacity;
+} simdb_scan_t;
+
+/** check record is eligible, see simdb_search_t.allow */
+static inline bool
+simdb_search_allowed(const simdb_search_t *search, simdb_num_t num) {
+  return num < search->allow_bits && (search->allow[num / 8] >> (num % 8)) & 0x1;
+}
 
-  ret = rec->used ? true : false;
+/**
+ * @brief Find next eligible record, see simdb_search_t.allow
+ * @param search Search parameters
+ * @param num    Record to start from
+ * @param last   Last record of range, not beyond @a allow_bits
+ * @returns Number of eligible record, or @a last + 1 if none
+ */
+static simdb_num_t
+simdb_search_next(const simdb_search_t *search, simdb_num_t num, simdb_num_t last) {
+  uint64_t word = 0;
+
+  while (num <= last) {
+    /* whole words and bytes of ineligible records skipped at once */
+    if (num % 64 == 0 && num + 63 <= last) {
+      memcpy(&word, search->allow + num / 8, sizeof(word));
+      if (word == 0) {
+        num += 64;
+        continue;
+      }
+    }
+    if (num % 8 == 0 && search->allow[num / 8] == 0) {
+      num += 8;
+      continue;
+    }
+    if (simdb_search_allowed(search, num))
+      return num;
+    num++;
+  }
 
-  FREE(rec);
-  return ret;
+  return last + 1;
 }
 
-int
-simdb_record_add(simdb_t *db, int num, const char *path, int flags) {
-  simdb_urec_t *rec = NULL;
-  int ret = 0;
+/**
+ * @brief Convert max difference to bits
+ * @returns Max bits count @a n, for which (n / bits) <= d in float arithmetic,
+ *   so integer compare gives same result as float one
+ */
+static int
+simdb_search_threshold(float d, int bits) {
+  int max = d * bits;
 
-  assert(db != NULL);
+  while (max >= 0 && max / (float) bits > d)
+    max--;
+  while (max < bits && (max + 1) / (float) bits <= d)
+    max++;
 
-  if (num < 0 || path == NULL)
-    return SIMDB_ERR_USAGE;
+  return max;
+}
 
-  if (flags & SIMDB_ADD_NOEXTEND && num > db->records)
-    return 0;
+/**
+ * @brief Add record passed all cheap tests to matches
+ * @param db      Database handle
+ * @param scan    Search state
+ * @param num     Record number
+ * @param rec     Record data
+ * @param dist    Bitmaps difference, in bits
+ * @param best    Matched transform of sample
+ * @param ratio_t Record ratio, 0.0 - not compared
+ * @retval <0 error
+ * @retval  0 record rejected by 32x32 bitmap
+ * @retval  1 record added to matches
+ */
+static int
+simdb_search_accept(simdb_t *db, simdb_scan_t *scan, simdb_num_t num, const simdb_urec_t *rec,
+                    int dist, int best, float ratio_t) {
+  simdb_match_t match;
+  simdb_hrec_t target;
+  float ratio_s = 0.0; /* source, in orientation of matched transform */
+  int hr = 0;
 
-  if (access(path, R_OK) < 0)
-    return SIMDB_ERR_SYSTEM;
+  memset(&match, 0x0, sizeof(simdb_match_t));
 
-  if (num > 0 && flags & SIMDB_ADD_NOREPLACE && simdb_record_used(db, num))
-    return 0;
+  match.num       = num;
+  match.transform = best;
+  match.d_bitmap  = dist / (float) SIMDB_BITMAP_BITS;
+  if (ratio_t > 0.0) {
+    ratio_s = ((1 << best) & SIMDB_TRANSFORMS_SWAP) ? scan->ratio_swap : scan->ratio_s;
+    match.d_ratio = fabsf(ratio_s - ratio_t);
+  }
+  if (scan->color_max >= 0 && simdb_record_color_set(rec))
+    match.d_color = simdb_record_color_diff(rec, scan->sample) / (float) 255;
+  /* - refine survivors with 32x32 bitmap - most expensive, needs extra read */
+  if (scan->hires && (hr = simdb_read_hires(db, num, &target)) > 0) {
+    scan->stats.refines++;
+    dist = simdb_bitmap_compare_hr(target.bitmap, scan->hires_maps[best]);
+    if (dist > scan->hires_max) {
+      scan->stats.r_refine++;
+      return 0;
+    }
+    match.d_bitmap = dist / (float) SIMDB_BITMAP_HR_BITS;
+  } else if (hr < 0) {
+    return hr;
+  }
+  /* whoa! a match found */
+  /* allocate more memory for results array if needed */
+  if (scan->found == scan->capacity) {
+    simdb_match_t *tmp = NULL;
+    if ((tmp = realloc(scan->matches, scan->capacity * 2 * sizeof(simdb_match_t))) == NULL)
+      return SIMDB_ERR_OOM; /* fuck! */
+    scan->matches = tmp; /* successfully relocated */
+    scan->capacity *= 2;
+  }
+  /* copy match to results array */
+  memcpy(&scan->matches[scan->found], &match, sizeof(simdb_match_t));
+  scan->found++;
 
-  if ((rec = simdb_record_create(path)) == NULL)
-    return SIMDB_ERR_SAMPLER;
+  return 1;
+}
 
-  if (num == 0)
-    num = db->records + 1;
+/**
+ * @brief Test single record against all compared transforms of sample
+ * @param db   Database handle
+ * @param scan Search state
+ * @param num  Record number
+ * @param rec  Record data
+ * @retval <0 error
+ * @retval  0 record rejected
+ * @retval  1 record added to matches
+ */
+static int
+simdb_search_test(simdb_t *db, simdb_scan_t *scan, simdb_num_t num, simdb_urec_t *rec) {
+  simdb_search_t *search = scan->search;
+  simdb_urec_t *sample = scan->sample;
+  float ratio_t = 0.0; /* tested */
+  int allowed = scan->transforms; /* transforms passed ratio test */
+  int best = SIMDB_TRANSFORM_NONE;
+  int dist = 0;
 
-  if ((ret = simdb_write(db, num, 1, rec)) <= 0)
-    num = ret;
+  if (search->allow && !simdb_search_allowed(search, num)) {
+    scan->stats.filtered++;
+    return 0; /* not eligible */
+  }
+  if (!rec->used) {
+    scan->stats.unused++;
+    return 0; /* record missing */
+  }
+  if (num == scan->skip)
+    return 0; /* source sample */
 
-  FREE(rec);
-  return num;
+  /* - compare perceptual hashes - single popcount, cheapest */
+  if (scan->phash_max >= 0 && rec->phash && simdb_phash_compare(rec->phash, sample->phash) > scan->phash_max) {
+    scan->stats.r_phash++;
+    return 0;
+  }
+  /* - compare ratio - cheap */
+  /* TODO: check caps */
+  if (scan->ratio_s > 0.0 && (ratio_t = simdb_record_ratio(rec)) > 0.0) {
+    if (fabsf(scan->ratio_s - ratio_t) > search->d_ratio)
+      allowed &= SIMDB_TRANSFORMS_SWAP;
+    if (fabsf(scan->ratio_swap - ratio_t) > search->d_ratio)
+      allowed &= ~SIMDB_TRANSFORMS_SWAP; /* rotated sample also too wide or too tall */
+    if (!allowed) {
+      scan->stats.r_ratio++;
+      return 0;
+    }
+  } else {
+    /* either source or target ratio not set, can't compare, skip test */
+  }
+  /* - compare color levels - also cheap */
+  if (scan->color_max >= 0 && simdb_record_color_set(rec) && simdb_record_color_diff(rec, sample) > scan->color_max) {
+    scan->stats.r_color++;
+    return 0;
+  }
+  /* - compare bitmap - more expensive, all transforms of sample in one pass over record */
+  scan->stats.compares++;
+  dist = simdb_bitmap_compare_multi(rec->bitmap, scan->bitmaps[0], allowed, &best);
+  if (dist > scan->bitmap_max)
+    return 0;
+
+  return simdb_search_accept(db, scan, num, rec, dist, best, ratio_t);
 }
 
-int
-simdb_record_del(simdb_t *db, int num) {
-  simdb_urec_t *rec;
+/** block test routine for any search, see @ref simdb_kernel_t */
+static int
+simdb_scan_generic(simdb_t *db, simdb_scan_t *scan, simdb_num_t first, simdb_urec_t *data, int count) {
   int ret = 0;
 
-  assert(db != NULL);
-
-  if (num < 1)
-    return SIMDB_ERR_USAGE;
-
-  if (!(db->flags & SIMDB_FLAG_WRITE))
-    return SIMDB_ERR_READONLY;
-
-  if ((ret = simdb_read(db, num, 1, &rec)) < 1)
-    return ret;
+  for (int i = 0; i < count && scan->found < scan->search->limit; i++) {
+    if ((ret = simdb_search_test(db, scan, first + i, &data[i])) < 0)
+      return ret;
+  }
 
-  rec->used = 0x0;
+  return 0;
+}
 
-  if ((ret = simdb_write(db, num, 1, rec)) < 1)
-    num = ret;
+/**
+ * @brief Body of specialized block test routines, for sample without transforms
+ * @param filter  Skip records not eligible by simdb_search_t.allow
+ * @param ratio   Compare ratios
+ * @param skip    Skip source record
+ * @param limited Stop on results limit
+ * @note Always inlined with constant flags, so each kernel has no branches
+ *   for disabled tests in its loop, and bitmaps compared against integer threshold
+ */
+static inline __attribute__((always_inline)) int
+simdb_scan_block(simdb_t *db, simdb_scan_t *scan, simdb_num_t first, simdb_urec_t *data, int count,
+                 const bool filter, const bool ratio, const bool skip, const bool limited) {
+  const simdb_search_t *search = scan->search;
+  const simdb_urec_t *sample = scan->sample;
+  const float ratio_s = scan->ratio_s, d_ratio = scan->search->d_ratio;
+  const int bitmap_max = scan->bitmap_max, color_max = scan->color_max, phash_max = scan->phash_max;
+  const int limit = scan->search->limit;
+  unsigned long filtered = 0, unused = 0, r_phash = 0, r_ratio = 0, r_color = 0, compares = 0;
+  float ratio_t = 0.0;
+  int dist = 0, ret = 0;
+
+  for (int i = 0; i < count; i++) {
+    const simdb_urec_t *rec = &data[i];
+    if (filter && !simdb_search_allowed(search, first + i)) {
+      filtered++;
+      continue;
+    }
+    if (!rec->used) {
+      unused++;
+      continue;
+    }
+    if (skip && first + i == scan->skip)
+      continue;
+    if (phash_max >= 0 && rec->phash && simdb_phash_compare(rec->phash, sample->phash) > phash_max) {
+      r_phash++;
+      continue;
+    }
+    if (ratio && (ratio_t = simdb_record_ratio(rec)) > 0.0 && fabsf(ratio_s - ratio_t) > d_ratio) {
+      r_ratio++;
+      continue;
+    }
+    if (color_max >= 0 && simdb_record_color_set(rec) && simdb_record_color_diff(rec, sample) > color_max) {
+      r_color++;
+      continue;
+    }
+    compares++;
+    if ((dist = simdb_bitmap_compare_inline(rec->bitmap, sample->bitmap)) > bitmap_max)
+      continue;
+    if ((ret = simdb_search_accept(db, scan, first + i, rec, dist, SIMDB_TRANSFORM_NONE, ratio ? ratio_t : 0.0)) < 0)
+      break;
+    if (limited && scan->found >= limit)
+      break;
+  }
 
-  FREE(rec);
+  scan->stats.filtered += filtered;
+  scan->stats.unused   += unused;
+  scan->stats.r_phash  += r_phash;
+  scan->stats.r_ratio  += r_ratio;
+  scan->stats.r_color  += r_color;
+  scan->stats.compares += compares;
 
-  return num;
+  return (ret < 0) ? ret : 0;
 }
 
-int
-simdb_record_bitmap(simdb_t *db, int num, char **map, size_t *side) {
-  simdb_urec_t *rec;
-  int ret = 0;
-
-  assert(db != NULL);
+/* kernels also built for several ISAs (popcnt, AVX2), if compiler supports it,
+ * best one chosen by dynamic loader */
+#ifdef SIMDB_TARGET_CLONES
+#define SIMDB_KERNEL_ISA __attribute__((target_clones("arch=haswell", "popcnt", "default")))
+#else
+#define SIMDB_KERNEL_ISA
+#endif
+
+/** specialized block test routine, @a n is mask: 8 - filter, 4 - ratio, 2 - skip, 1 - limited */
+#define SIMDB_SCAN_KERNEL(n) \
+  static SIMDB_KERNEL_ISA int \
+  simdb_scan_kernel_##n(simdb_t *db, simdb_scan_t *scan, simdb_num_t first, simdb_urec_t *data, int count) { \
+    return simdb_scan_block(db, scan, first, data, count, (n) & 8, (n) & 4, (n) & 2, (n) & 1); \
+  }
 
-  if (num < 0 || map == NULL || side == NULL)
-    return SIMDB_ERR_USAGE;
+SIMDB_SCAN_KERNEL(0)
+SIMDB_SCAN_KERNEL(1)
+SIMDB_SCAN_KERNEL(2)
+SIMDB_SCAN_KERNEL(3)
+SIMDB_SCAN_KERNEL(4)
+SIMDB_SCAN_KERNEL(5)
+SIMDB_SCAN_KERNEL(6)
+SIMDB_SCAN_KERNEL(7)
+SIMDB_SCAN_KERNEL(8)
+SIMDB_SCAN_KERNEL(9)
+SIMDB_SCAN_KERNEL(10)
+SIMDB_SCAN_KERNEL(11)
+SIMDB_SCAN_KERNEL(12)
+SIMDB_SCAN_KERNEL(13)
+SIMDB_SCAN_KERNEL(14)
+SIMDB_SCAN_KERNEL(15)
+
+static const simdb_kernel_t simdb_scan_kernels[16] = {
+  simdb_scan_kernel_0,  simdb_scan_kernel_1,  simdb_scan_kernel_2,  simdb_scan_kernel_3,
+  simdb_scan_kernel_4,  simdb_scan_kernel_5,  simdb_scan_kernel_6,  simdb_scan_kernel_7,
+  simdb_scan_kernel_8,  simdb_scan_kernel_9,  simdb_scan_kernel_10, simdb_scan_kernel_11,
+  simdb_scan_kernel_12, simdb_scan_kernel_13, simdb_scan_kernel_14, simdb_scan_kernel_15,
+};
 
-  if ((ret = simdb_read(db, num, 1, &rec)) <= 0)
-    return ret;
+/** choose block test routine for search */
+static simdb_kernel_t
+simdb_scan_kernel(const simdb_scan_t *scan) {
+  int n = 0;
 
-  ret = simdb_bitmap_unpack(rec->bitmap, map);
-  *side = SIMDB_BITMAP_SIDE;
+  if (scan->transforms != (1 << SIMDB_TRANSFORM_NONE))
+    return simdb_scan_generic;
 
-  FREE(rec);
-  return ret;
-}
+  if (scan->search->allow)
+    n |= 8;
+  if (scan->ratio_s > 0.0)
+    n |= 4;
+  if (scan->skip > 0)
+    n |= 2;
+  if (scan->search->limit < INT_MAX)
+    n |= 1;
 
-int
-simdb_records_count(simdb_t * const db) {
-  assert(db != NULL);
-  return db->records;
+  return simdb_scan_kernels[n];
 }
 
-inline static float
-simdb_record_ratio(simdb_urec_t *r) {
-  assert(r != NULL);
-
-  if (r->image_w > 0 && r->image_h > 0)
-    return (float) r->image_w / r->image_h;
-
-  return 0.0;
-}
+/** check all records of database, see @ref SIMDB_SEARCH_EXACT */
+static int
+simdb_search_exact(simdb_t *db, simdb_scan_t *scan) {
+  simdb_clock_t clk;
+  simdb_cold_t cold;
+  simdb_urec_t *data = NULL;
+  bool timed = scan->search->stats != NULL;
+  bool is_cold = scan->search->cold && !db->resident;
+  int blksize = is_cold ? COLD_BLOCK : 4096;
+  int want = 0, ret = 0, test = 0;
 
-void
-simdb_search_init(simdb_search_t *search) {
-  assert(search != NULL);
+  if (is_cold && (ret = simdb_cold_open(db, &cold)) < 0)
+    return ret;
 
-  memset(search, 0x0, sizeof(simdb_search_t));
+  for (simdb_num_t num = scan->first; num <= scan->last; num += ret) {
+    /* blocks without eligible records not read at all */
+    if (scan->search->allow && (num = simdb_search_next(scan->search, num, scan->last)) > scan->last)
+      break;
+    want = (scan->last - num + 1 < blksize) ? scan->last - num + 1 : blksize;
+    if (timed)
+      simdb_clock_start(&clk);
+    if (is_cold) {
+      ret = simdb_cold_read(db, &cold, num, want, &data);
+    } else {
+      ret = simdb_fetch(db, num, want, &data);
+    }
+    if (timed)
+      simdb_clock_stop(&clk, &scan->stats.io_wall, &scan->stats.io_cpu);
+    if (ret <= 0)
+      break; /* end of records or error */
+    scan->stats.blocks  += 1;
+    scan->stats.bytes   += ret * SIMDB_REC_LEN;
+    scan->stats.scanned += ret;
+    if (timed)
+      simdb_clock_start(&clk);
+    test = scan->kernel(db, scan, num, data, ret);
+    if (timed)
+      simdb_clock_stop(&clk, &scan->stats.cmp_wall, &scan->stats.cmp_cpu);
+    if (!is_cold)
+      simdb_release(db, &data);
+    if (test < 0) {
+      ret = test;
+      break;
+    }
+    if (scan->found >= scan->search->limit)
+      break;
+  }
 
-  search->d_ratio  = 0.07; /* 7% */
-  search->d_bitmap = 0.07; /* 7% */
+  if (is_cold)
+    simdb_cold_close(&cold);
 
-  return;
+  return (ret < 0) ? ret : 0;
 }
 
-void
-simdb_search_free(simdb_search_t *search) {
-  assert(search != NULL);
+/** check only candidates from LSH index, see @ref SIMDB_SEARCH_LSH */
+static int
+simdb_search_lsh(simdb_t *db, simdb_scan_t *scan) {
+  simdb_search_t *search = scan->search;
+  simdb_clock_t clk;
+  simdb_urec_t *data = NULL;
+  unsigned char bitmaps[SIMDB_TRANSFORMS][SIMDB_BITMAP_SIZE];
+  const int blksize = 4096;
+  bool timed = search->stats != NULL;
+  simdb_num_t *nums = NULL;
+  int variants = 0, count = 0, kept = 0, run = 0, ret = 0, test = 0, radius = 0;
+
+  /* candidates of each compared transform of sample */
+  for (int t = 0; t < SIMDB_TRANSFORMS; t++) {
+    if (scan->transforms & (1 << t))
+      memcpy(bitmaps[variants++], scan->bitmaps[t], SIMDB_BITMAP_SIZE);
+  }
+  if (search->lsh_probes > 0)
+    radius = search->lsh_probes;
+  else if (search->lsh_probes == 0)
+    radius = simdb_lsh_radius(db->lsh, search->lsh_tables, search->d_bitmap);
+  if ((count = simdb_lsh_candidates(db->lsh, bitmaps[0], variants,
+                                    search->lsh_tables, radius, &nums)) <= 0)
+    return count;
+  scan->stats.candidates = count;
+
+  /* drop candidates out of range or not eligible before reading */
+  for (int i = 0; i < count; i++) {
+    if (nums[i] < scan->first || nums[i] > scan->last || (search->allow && !simdb_search_allowed(search, nums[i])))
+      continue;
+    nums[kept++] = nums[i];
+  }
+  scan->stats.filtered = count - kept;
+  count = kept;
+
+  /* candidates sorted, read runs of adjacent records at once */
+  for (int i = 0; i < count && scan->found < search->limit; i += run) {
+    for (run = 1; i + run < count && run < blksize && nums[i + run] == nums[i] + run; run++)
+      ;
+    if (timed)
+      simdb_clock_start(&clk);
+    ret = simdb_fetch(db, nums[i], run, &data);
+    if (timed)
+      simdb_clock_stop(&clk, &scan->stats.io_wall, &scan->stats.io_cpu);
+    if (ret <= 0)
+      break; /* rest of candidates beyond end of database, or error */
+    scan->stats.blocks  += 1;
+    scan->stats.bytes   += ret * SIMDB_REC_LEN;
+    scan->stats.scanned += ret;
+    if (timed)
+      simdb_clock_start(&clk);
+    test = scan->kernel(db, scan, nums[i], data, ret);
+    if (timed)
+      simdb_clock_stop(&clk, &scan->stats.cmp_wall, &scan->stats.cmp_cpu);
+    simdb_release(db, &data);
+    if (test < 0) {
+      ret = test;
+      break;
+    }
+  }
 
-  if (search->found == 0)
-    return;
-  FREE(search->matches);
-  search->found = 0;
+  free(nums);
+
+  return (ret < 0) ? ret : 0;
 }
 
 /**
@@ -376,111 +2598,181 @@ simdb_search_free(simdb_search_t *search) {
  * @param db  Database handle
  * @param search Search struct, initialized with @ref simdb_search_init
  * @param sample Source sample
+ * @param hires  Source sample, high-resolution bitmap, NULL if not available
  * @param skip   Skep this record number from search (if ge take source from same database)
  * @retval <0 error
  * @retval  0 nothing found
  * @retval >0 matches count
  */
 static int
-simdb_search(simdb_t *db, simdb_search_t *search, simdb_urec_t *sample, int skip) {
-  simdb_match_t *matches;
-  simdb_match_t match;
-  simdb_urec_t *rec, *data = NULL;
-  const int blksize = 4096;
-  float ratio_s = 0.0; /* source */
-  float ratio_t = 0.0; /* tested */
-  int ret = 0, found = 0, capacity = 16;
+simdb_search_scan(simdb_t *db, simdb_search_t *search, simdb_urec_t *sample,
+                  const simdb_hrec_t *hires, simdb_num_t skip) {
+  simdb_scan_t scan;
+  simdb_cache_key_t key;
+  unsigned long gen = 0;
+  int ret = 0;
 
   assert(db      != NULL);
   assert(search  != NULL);
 
-  if (search->d_ratio  < 0.0 && search->d_ratio  > 1.0)
+  if (search->d_ratio  < 0.0 || search->d_ratio  > 1.0)
+    return SIMDB_ERR_USAGE;
+  if (search->d_color  < 0.0 || search->d_color  > 1.0)
+    return SIMDB_ERR_USAGE;
+  if (search->d_bitmap < 0.0 || search->d_bitmap > 1.0)
+    return SIMDB_ERR_USAGE;
+  if (search->d_phash  < 0.0 || search->d_phash  > 1.0)
     return SIMDB_ERR_USAGE;
-  if (search->d_bitmap < 0.0 && search->d_bitmap > 1.0)
+  if (search->mode != SIMDB_SEARCH_EXACT && search->mode != SIMDB_SEARCH_LSH)
+    return SIMDB_ERR_USAGE;
+  if (search->mode == SIMDB_SEARCH_LSH && !db->lsh)
+    return SIMDB_ERR_USAGE; /* no index, see simdb_lsh_setup() */
+  if (search->transforms & ~SIMDB_TRANSFORMS_ALL)
+    return SIMDB_ERR_USAGE;
+  if (search->first < 0 || search->last < 0 || (search->last && search->first > search->last))
+    return SIMDB_ERR_USAGE;
+  if (search->allow_bits < 0 || (search->allow_bits && !search->allow))
     return SIMDB_ERR_USAGE;
 
-  memset(&match, 0x0, sizeof(simdb_match_t));
+  memset(&scan, 0x0, sizeof(simdb_scan_t));
+  scan.search    = search;
+  scan.sample    = sample;
+  scan.skip      = skip;
+  scan.first     = search->first ? search->first : 1;
+  scan.last      = search->last  ? search->last  : SIMDB_NUM_MAX;
+  if (search->allow && scan.last > search->allow_bits - 1)
+    scan.last = search->allow_bits - 1;
+  scan.color_max = -1;
+  scan.phash_max = -1;
+  scan.capacity  = 16;
+  scan.transforms = search->transforms ? search->transforms : (1 << SIMDB_TRANSFORM_NONE);
 
   if (search->limit == 0)
     search->limit = INT_MAX;
 
-  if (search->d_ratio > 0.0)
-    ratio_s = simdb_record_ratio(sample);
+  if (search->d_ratio > 0.0 && (scan.ratio_s = simdb_record_ratio(sample)) > 0.0)
+    scan.ratio_swap = 1.0 / scan.ratio_s;
+
+  if (search->d_color > 0.0 && db->flags & SIMDB_CAP_COLORS && simdb_record_color_set(sample))
+    scan.color_max = search->d_color * 255;
+
+  /* hash of transformed image can't be derived from hash of sample */
+  if (search->d_phash > 0.0 && db->flags & SIMDB_CAP_PHASH && sample->phash &&
+      scan.transforms == (1 << SIMDB_TRANSFORM_NONE))
+    scan.phash_max = search->d_phash * SIMDB_PHASH_BITS;
 
   if (search->found)
     simdb_search_free(search);
 
-  if ((matches = calloc(capacity, sizeof(simdb_match_t))) == NULL)
-    return SIMDB_ERR_OOM;
+  if (hires != NULL && hires->used)
+    scan.hires = hires;
 
-  for (int num = 1; ; num += blksize) {
-    ret = simdb_read(db, num, blksize, &data);
-    if (ret == 0)
-      break; /* end of records */
-    if (ret < 0) {
-      FREE(matches);
-      return ret; /* error */
-    }
-    rec = data;
-    for (int i = 0; i < ret; i++, rec++) {
-      if (!rec->used)
-        continue; /* record missing */
-      if (num + i == skip)
-        continue; /* source sample */
-
-      memset(&match, 0x0, sizeof(simdb_match_t));
-
-      /* - compare ratio - cheap */
-      /* TODO: check caps */
-      if (ratio_s > 0.0 && (ratio_t = simdb_record_ratio(rec)) > 0.0) {
-        match.d_ratio  =  ratio_s - ratio_t;
-        match.d_ratio *= (ratio_s > ratio_t) ? 1.0 : -1.0;
-        if (match.d_ratio > search->d_ratio)
-          continue;
-      } else {
-        /* either source or target ratio not set, can't compare, skip test */
-      }
-      /* - compare bitmap - more expensive */
-      match.d_bitmap = simdb_bitmap_compare(rec->bitmap, sample->bitmap) / (float) SIMDB_BITMAP_BITS;
-      if (match.d_bitmap > search->d_bitmap)
-        continue;
-      /* whoa! a match found */
-      /* allocate more memory for results array if needed */
-      if (found == capacity) {
-        simdb_match_t *tmp = NULL;
-        capacity *= 2;
-        if ((tmp = realloc(matches, capacity * sizeof(simdb_match_t))) == NULL) {
-          /* fuck! */
-          FREE(matches);
-          FREE(data);
-          return SIMDB_ERR_OOM;
-        }
-        matches = tmp; /* successfully relocated */
+  scan.bitmap_max = simdb_search_threshold(search->d_bitmap, SIMDB_BITMAP_BITS);
+  scan.hires_max  = simdb_search_threshold(search->d_bitmap, SIMDB_BITMAP_HR_BITS);
+  scan.kernel     = simdb_scan_kernel(&scan);
+
+  for (int t = 0; t < SIMDB_TRANSFORMS; t++) {
+    if (!(scan.transforms & (1 << t)))
+      continue;
+    simdb_bitmap_transform(sample->bitmap, scan.bitmaps[t], SIMDB_BITMAP_SIDE, t);
+    if (scan.hires)
+      simdb_bitmap_transform(scan.hires->bitmap, scan.hires_maps[t], SIMDB_BITMAP_HR_SIDE, t);
+  }
+
+  if (db->cache && !search->allow) {
+    memset(&key, 0x0, sizeof(simdb_cache_key_t));
+    memcpy(&key.sample, sample, sizeof(simdb_urec_t));
+    if (scan.hires)
+      memcpy(&key.hires, scan.hires, sizeof(simdb_hrec_t));
+    key.d_bitmap = search->d_bitmap;
+    key.d_ratio  = search->d_ratio;
+    key.d_color  = search->d_color;
+    key.d_phash  = search->d_phash;
+    key.limit    = search->limit;
+    key.mode     = search->mode;
+    if (search->mode == SIMDB_SEARCH_LSH) {
+      key.lsh_tables = search->lsh_tables;
+      key.lsh_probes = search->lsh_probes;
+    }
+    key.transforms = scan.transforms;
+    key.skip     = skip;
+    key.first    = search->first;
+    key.last     = search->last;
+    gen = __atomic_load_n(&db->gen, __ATOMIC_ACQUIRE);
+    simdb_lock(db);
+    ret = simdb_cache_get(db->cache, &key, gen, search);
+    simdb_unlock(db);
+    if (ret >= 0) {
+      if (search->stats) {
+        scan.stats.cached = true;
+        memcpy(search->stats, &scan.stats, sizeof(simdb_search_stats_t));
       }
-      /* copy match to results array */
-      match.num = num + i;
-      memcpy(&matches[found], &match, sizeof(simdb_match_t));
-      found++;
-      if (found >= search->limit)
-        break;
+      return ret;
     }
-    FREE(data);
-    if (found >= search->limit)
-      break;
   }
 
-  if (found) {
-    search->found   = found;
-    search->matches = matches;
+  if ((scan.matches = calloc(scan.capacity, sizeof(simdb_match_t))) == NULL)
+    return SIMDB_ERR_OOM;
+
+  if (db->resident)
+    simdb_resident_rdlock(db->resident);
+
+  if (search->mode == SIMDB_SEARCH_LSH) {
+    ret = simdb_search_lsh(db, &scan);
+  } else {
+    ret = simdb_search_exact(db, &scan);
+  }
+
+  if (db->resident)
+    simdb_resident_unlock(db->resident);
+
+  if (ret < 0) {
+    FREE(scan.matches);
+    return ret; /* error */
+  }
+
+  if (search->stats)
+    memcpy(search->stats, &scan.stats, sizeof(simdb_search_stats_t));
+
+  if (db->cache && !search->allow) {
+    simdb_lock(db);
+    simdb_cache_put(db->cache, &key, gen, scan.matches, scan.found);
+    simdb_unlock(db);
+  }
+
+  if (scan.found) {
+    search->found   = scan.found;
+    search->matches = scan.matches;
   } else {
-    FREE(matches);
+    FREE(scan.matches);
   }
 
-  return found;
+  return scan.found;
+}
+
+/** wrapper for @ref simdb_search_scan(), accounts search latency */
+static int
+simdb_search(simdb_t *db, simdb_search_t *search, simdb_urec_t *sample,
+             const simdb_hrec_t *hires, simdb_num_t skip) {
+  struct timespec start;
+  int ret = 0;
+
+  if (db->flags & SIMDB_FLAG_REFRESH && (ret = simdb_refresh(db)) < 0)
+    return ret;
+
+  if (!db->metrics)
+    return simdb_search_scan(db, search, sample, hires, skip);
+
+  simdb_metrics_start(&start);
+  ret = simdb_search_scan(db, search, sample, hires, skip);
+  simdb_observe(db, &db->metrics->search, &start);
+
+  return ret;
 }
 
 int
-simdb_search_byid(simdb_t *db, simdb_search_t *search, int num) {
+simdb_search_byid(simdb_t *db, simdb_search_t *search, simdb_num_t num) {
+  simdb_hrec_t hires;
   simdb_urec_t *sample;
   int ret = 0;
 
@@ -490,13 +2782,24 @@ simdb_search_byid(simdb_t *db, simdb_search_t *search, int num) {
   if (num <= 0)
     return SIMDB_ERR_USAGE;
 
+  /* sample taken from current file too, simdb_search() refreshes again for free */
+  if (db->flags & SIMDB_FLAG_REFRESH && (ret = simdb_refresh(db)) < 0)
+    return ret;
+
   if ((ret = simdb_read(db, num, 1, &sample)) < 1)
     return ret;
 
-  if (!sample->used)
+  if (!sample->used) {
+    FREE(sample);
     return SIMDB_ERR_NXRECORD;
+  }
+
+  if ((ret = simdb_read_hires(db, num, &hires)) < 0) {
+    FREE(sample);
+    return ret;
+  }
 
-  ret = simdb_search(db, search, sample, num);
+  ret = simdb_search(db, search, sample, ret ? &hires : NULL, num);
   FREE(sample);
 
   return ret;
@@ -504,6 +2807,7 @@ simdb_search_byid(simdb_t *db, simdb_search_t *search, int num) {
 
 int
 simdb_search_file(simdb_t *db, simdb_search_t *search, const char *path) {
+  simdb_hrec_t hires;
   simdb_urec_t *sample = NULL;
   int ret = 0;
 
@@ -513,51 +2817,60 @@ simdb_search_file(simdb_t *db, simdb_search_t *search, const char *path) {
   if (path == NULL)
     return SIMDB_ERR_USAGE;
 
-  if ((sample = simdb_record_create(path)) == NULL)
+  if ((sample = simdb_sample(db, path, &hires)) == NULL)
     return SIMDB_ERR_SAMPLER;
 
-  ret = simdb_search(db, search, sample, 0);
+  ret = simdb_search(db, search, sample, &hires, 0);
   FREE(sample);
 
   return ret;
 }
 
-int
+simdb_num_t
 simdb_usage_map(simdb_t * const db, char ** const map) {
   const int blksize = 4096;
   simdb_urec_t *data = NULL;
   simdb_urec_t *r;  /* mnemonics : record pointer */
   char *m = NULL;   /* mnemonics : map pointer */
-  int ret = 0, records = 0;
+  simdb_num_t records = 0;
+  int ret = 0;
 
   assert(db  != NULL);
   assert(map != NULL);
 
   records = simdb_records_count(db);
-  if ((m = calloc(records + 1, sizeof(char))) == NULL)
+  if ((m = calloc((size_t) records + 1, sizeof(char))) == NULL)
     return SIMDB_ERR_OOM;
   *map = m;
 
-  for (int num = 1; ; num += blksize) {
-    ret = simdb_read(db, num, blksize, &data);
-    if (ret < 0) {
-      FREE(*map);
-      return ret;
-    }
-    if (ret == 0)
+  /* records count may grow while reading, but map size is fixed */
+  if (db->resident)
+    simdb_resident_rdlock(db->resident);
+
+  for (simdb_num_t num = 1; num <= records; num += blksize) {
+    ret = simdb_fetch(db, num, (records - num + 1 < blksize) ? records - num + 1 : blksize, &data);
+    if (ret <= 0)
       break;
     r = data;
     for (int i = 0; i < ret; i++, m++, r++) {
       *m = (r->used == 0xFF) ? 0x1 : 0x0;
     }
-    FREE(data);
+    simdb_release(db, &data);
+  }
+
+  if (db->resident)
+    simdb_resident_unlock(db->resident);
+
+  if (ret < 0) {
+    FREE(*map);
+    return ret;
   }
 
   return records;
 }
 
 int
-simdb_usage_slice(simdb_t * const db, char ** const map, int offset, int limit) {
+simdb_usage_slice(simdb_t * const db, char ** const map, simdb_num_t offset, int limit) {
   simdb_urec_t *data = NULL;
   simdb_urec_t *r;  /* mnemonics : record pointer */
   char *m = NULL;   /* mnemonics : map pointer */
@@ -578,7 +2891,7 @@ simdb_usage_slice(simdb_t * const db, char ** const map, int offset, int limit)
   *map = m;
 
   r = data;
-  for (int i = 0; i < limit; i++, m++, r++) {
+  for (int i = 0; i < ret; i++, m++, r++) {
     *m = (r->used == 0xFF) ? 0x1 : 0x0;
   }
   FREE(data);
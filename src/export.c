@@ -0,0 +1,345 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/**
+ * @file
+ * @brief Bulk export and import of raw records, see @ref SIMDBExportFormats
+ */
+
+#include "common.h"
+#include "record.h"
+#include "io.h"
+#include "simdb.h"
+
+#define EXPORT_BLOCK   65536      /**< records read or written at once */
+#define EXPORT_BUFSIZE (1 << 20)  /**< size of stream buffer, in bytes */
+#define EXPORT_HDRLEN  8          /**< length of binary stream header */
+#define EXPORT_NUMLEN  8          /**< length of record number in binary stream */
+
+static const char export_magic[4] = { 'S', 'D', 'B', 'X' };
+static const char hexdigits[16] = "0123456789abcdef";
+
+/** records batch of import, written to database in one call */
+typedef struct simdb_import_t {
+  simdb_t *db;
+  int flags;              /**< see @ref SIMDBAddModifiers */
+  simdb_num_t start;      /**< number of first record in batch */
+  int count;              /**< records in batch */
+  simdb_num_t imported;   /**< records written so far */
+  simdb_urec_t *data;     /**< batch records, @ref EXPORT_BLOCK max */
+} simdb_import_t;
+
+/** open stdio stream with large buffer on copy of descriptor */
+static FILE *
+simdb_export_stream(int fd, const char *mode) {
+  FILE *stream = NULL;
+  int copy = -1;
+
+  if ((copy = dup(fd)) < 0)
+    return NULL;
+
+  if ((stream = fdopen(copy, mode)) == NULL) {
+    close(copy);
+    return NULL;
+  }
+
+  setvbuf(stream, NULL, _IOFBF, EXPORT_BUFSIZE);
+
+  return stream;
+}
+
+static void
+simdb_export_hex(FILE *out, uint64_t num, const simdb_urec_t *rec) {
+  const unsigned char *p = (const unsigned char *) rec;
+  char line[SIMDB_REC_LEN * 2 + 2];
+  char *l = line;
+
+  for (int i = 0; i < SIMDB_REC_LEN; i++, p++) {
+    *l++ = hexdigits[*p >> 4];
+    *l++ = hexdigits[*p & 0xF];
+  }
+  *l++ = '\n';
+  *l   = '\0';
+
+  fprintf(out, "%" PRIu64 ",", num);
+  fputs(line, out);
+}
+
+simdb_num_t
+simdb_export(simdb_t *db, int fd, int format, simdb_num_t start, simdb_num_t limit) {
+  unsigned char hdr[EXPORT_HDRLEN] = { 0 };
+  simdb_urec_t *data = NULL;
+  FILE *out = NULL;
+  uint64_t num = 0;
+  simdb_num_t end = 0, count = 0;
+  int ret = 0;
+
+  assert(db != NULL);
+
+  if (start < 1 || limit < 0)
+    return SIMDB_ERR_USAGE;
+  if (format != SIMDB_EXPORT_BINARY && format != SIMDB_EXPORT_HEX)
+    return SIMDB_ERR_USAGE;
+
+  end = simdb_records_count(db);
+  if (limit > 0 && end - start + 1 > limit)
+    end = start + limit - 1;
+
+  if ((out = simdb_export_stream(fd, "w")) == NULL)
+    return SIMDB_ERR_SYSTEM;
+
+  if (format == SIMDB_EXPORT_BINARY) {
+    memcpy(hdr, export_magic, sizeof(export_magic));
+    hdr[4] = SIMDB_VERSION;
+    hdr[5] = SIMDB_REC_LEN;
+    hdr[6] = EXPORT_NUMLEN;
+    fwrite(hdr, sizeof(hdr), 1, out);
+  } else {
+    fprintf(out, "# simdb export, format v%02u\n", SIMDB_VERSION);
+  }
+
+  for (simdb_num_t n = start; n <= end; n += EXPORT_BLOCK) {
+    int want = (end - n + 1 > EXPORT_BLOCK) ? EXPORT_BLOCK : end - n + 1;
+    if ((ret = simdb_read(db, n, want, &data)) <= 0)
+      break;
+    for (int i = 0; i < ret; i++) {
+      if (!data[i].used)
+        continue;
+      num = n + i;
+      if (format == SIMDB_EXPORT_BINARY) {
+        fwrite(&num, sizeof(num), 1, out);
+        fwrite(&data[i], SIMDB_REC_LEN, 1, out);
+      } else {
+        simdb_export_hex(out, num, &data[i]);
+      }
+      count++;
+    }
+    FREE(data);
+    if (ferror(out))
+      break;
+  }
+
+  if (ferror(out))
+    ret = SIMDB_ERR_SYSTEM;
+  if (fclose(out) != 0 && ret >= 0)
+    ret = SIMDB_ERR_SYSTEM;
+
+  return (ret < 0) ? ret : count;
+}
+
+/** write part of batch to database */
+static int
+simdb_import_write(simdb_import_t *batch, int from, int count) {
+  int ret = 0;
+
+  if (count <= 0)
+    return 0;
+
+  /* stream has no high-resolution records, drop stale ones */
+  if ((ret = simdb_write_hires(batch->db, batch->start + from, count, NULL)) > 0)
+    ret = simdb_write(batch->db, batch->start + from, count, batch->data + from);
+  if (ret > 0)
+    batch->imported += ret;
+
+  return ret;
+}
+
+/** write collected batch to database, according to flags */
+static int
+simdb_import_flush(simdb_import_t *batch) {
+  simdb_urec_t *old = NULL;
+  simdb_num_t records = 0, first = 0;
+  int exists = 0, from = 0, ret = 0;
+
+  if (batch->count == 0)
+    return 0;
+
+  if (batch->flags & SIMDB_ADD_APPEND) {
+    if ((first = simdb_append(batch->db, batch->count, batch->data, NULL)) > 0)
+      batch->imported += batch->count;
+    batch->count = 0;
+    return (first < 0) ? (int) first : 0;
+  }
+
+  if (batch->flags & SIMDB_ADD_NOEXTEND) {
+    records = simdb_records_count(batch->db);
+    if (batch->start + batch->count - 1 > records)
+      batch->count = (records >= batch->start) ? records - batch->start + 1 : 0;
+  }
+
+  if (!(batch->flags & SIMDB_ADD_NOREPLACE)) {
+    ret = simdb_import_write(batch, 0, batch->count);
+    batch->count = 0;
+    return ret;
+  }
+
+  /* write only runs of records, which are unused in database */
+  if (batch->count > 0 && (exists = simdb_read(batch->db, batch->start, batch->count, &old)) < 0) {
+    batch->count = 0;
+    return exists;
+  }
+
+  for (int i = 0; i < batch->count && ret >= 0; i++) {
+    if (i < exists && old[i].used) {
+      ret  = simdb_import_write(batch, from, i - from);
+      from = i + 1;
+    }
+  }
+  if (ret >= 0)
+    ret = simdb_import_write(batch, from, batch->count - from);
+
+  free(old);
+  batch->count = 0;
+
+  return ret;
+}
+
+/** add record to batch, flush batch if needed */
+static int
+simdb_import_push(simdb_import_t *batch, simdb_num_t num, const simdb_urec_t *rec) {
+  int ret = 0;
+
+  if (!(batch->flags & SIMDB_ADD_APPEND) && num < 1)
+    return SIMDB_ERR_USAGE;
+
+  if (batch->count == EXPORT_BLOCK ||
+      (batch->count > 0 && !(batch->flags & SIMDB_ADD_APPEND) && num != batch->start + batch->count)) {
+    if ((ret = simdb_import_flush(batch)) < 0)
+      return ret;
+  }
+
+  if (batch->count == 0)
+    batch->start = num;
+  memcpy(&batch->data[batch->count++], rec, SIMDB_REC_LEN);
+
+  return 0;
+}
+
+static int
+simdb_import_binary(simdb_import_t *batch, FILE *in, simdb_num_t shift) {
+  unsigned char hdr[EXPORT_HDRLEN];
+  simdb_urec_t rec;
+  uint64_t num = 0;
+  uint32_t num32 = 0;
+  bool wide = false;
+  int ret = 0;
+
+  if (fread(hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr, export_magic, sizeof(export_magic)) != 0)
+    return SIMDB_ERR_CORRUPTDB;
+  if (hdr[4] != SIMDB_VERSION)
+    return SIMDB_ERR_WRONGVERS;
+  if (hdr[5] != SIMDB_REC_LEN)
+    return SIMDB_ERR_CORRUPTDB;
+  if (hdr[6] != 0 && hdr[6] != sizeof(uint32_t) && hdr[6] != sizeof(uint64_t))
+    return SIMDB_ERR_CORRUPTDB;
+  wide = hdr[6] == sizeof(uint64_t); /* zero - stream of older version */
+
+  while (wide ? fread(&num, sizeof(num), 1, in) == 1 : fread(&num32, sizeof(num32), 1, in) == 1) {
+    if (!wide)
+      num = num32;
+    if (fread(&rec, SIMDB_REC_LEN, 1, in) != 1)
+      return SIMDB_ERR_CORRUPTDB; /* truncated stream */
+    if (num > SIMDB_NUM_MAX - (uint64_t) (shift > 0 ? shift : 0))
+      return SIMDB_ERR_USAGE;
+    if ((ret = simdb_import_push(batch, (simdb_num_t) num + shift, &rec)) < 0)
+      return ret;
+  }
+
+  return ferror(in) ? SIMDB_ERR_SYSTEM : 0;
+}
+
+static int
+simdb_hexdigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static int
+simdb_import_hex(simdb_import_t *batch, FILE *in, simdb_num_t shift) {
+  unsigned char *r = NULL;
+  simdb_urec_t rec;
+  char *line = NULL, *p = NULL;
+  size_t size = 0;
+  unsigned long long num = 0;
+  int hi, lo, ret = 0;
+
+  while (ret >= 0 && getline(&line, &size, in) >= 0) {
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\r' || line[0] == '\0')
+      continue;
+    errno = 0;
+    num = strtoull(line, &p, 10);
+    if (p == line || *p++ != ',' || errno == ERANGE) {
+      ret = SIMDB_ERR_CORRUPTDB;
+      break;
+    }
+    r = (unsigned char *) &rec;
+    for (int i = 0; i < SIMDB_REC_LEN; i++, p += 2) {
+      if ((hi = simdb_hexdigit(p[0])) < 0 || (lo = simdb_hexdigit(p[1])) < 0)
+        break;
+      *r++ = (hi << 4) | lo;
+    }
+    if (r - (unsigned char *) &rec != SIMDB_REC_LEN || (*p != '\n' && *p != '\r' && *p != '\0')) {
+      ret = SIMDB_ERR_CORRUPTDB;
+      break;
+    }
+    if (num > (unsigned long long) SIMDB_NUM_MAX - (shift > 0 ? shift : 0)) {
+      ret = SIMDB_ERR_USAGE;
+      break;
+    }
+    ret = simdb_import_push(batch, (simdb_num_t) num + shift, &rec);
+  }
+
+  free(line);
+
+  if (ret >= 0 && ferror(in))
+    ret = SIMDB_ERR_SYSTEM;
+
+  return ret;
+}
+
+simdb_num_t
+simdb_import(simdb_t *db, int fd, int format, simdb_num_t shift, int flags) {
+  simdb_import_t batch;
+  FILE *in = NULL;
+  int ret = 0;
+
+  assert(db != NULL);
+
+  if (format != SIMDB_EXPORT_BINARY && format != SIMDB_EXPORT_HEX)
+    return SIMDB_ERR_USAGE;
+
+  memset(&batch, 0x0, sizeof(batch));
+  batch.db    = db;
+  batch.flags = flags;
+  if ((batch.data = calloc(EXPORT_BLOCK, sizeof(simdb_urec_t))) == NULL)
+    return SIMDB_ERR_OOM;
+
+  if ((in = simdb_export_stream(fd, "r")) == NULL) {
+    FREE(batch.data);
+    return SIMDB_ERR_SYSTEM;
+  }
+
+  if (format == SIMDB_EXPORT_BINARY) {
+    ret = simdb_import_binary(&batch, in, shift);
+  } else {
+    ret = simdb_import_hex(&batch, in, shift);
+  }
+
+  if (ret >= 0) {
+    ret = simdb_import_flush(&batch);
+  }
+
+  fclose(in);
+  FREE(batch.data);
+
+  return (ret < 0) ? ret : batch.imported;
+}
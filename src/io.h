@@ -15,6 +15,22 @@
  * @brief This file contains definitions of internal i/o functions, used by database
  */
 
+/** run of records kept by @ref simdb_vacuum(), same layout as in mapping file */
+typedef struct simdb_remap_run_t {
+  uint64_t old;   /**< number of first record before vacuum */
+  uint64_t num;   /**< number of first record after vacuum */
+  uint64_t count; /**< records in run */
+} simdb_remap_run_t;
+
+/**
+ * @brief Get number of record after vacuum by its number before
+ * @param runs  Kept runs, ascending
+ * @param count Runs count
+ * @param num   Record number before vacuum
+ * @returns Record number after vacuum, 0 if record was not kept
+ */
+simdb_num_t simdb_remap_runs(const simdb_remap_run_t *runs, size_t count, simdb_num_t num);
+
 /**
  * @brief Read records from database
  * @param db  Database handle
@@ -27,7 +43,7 @@
  * @note If at least one record read, contents of @a data pointer
  *   must be freed by user
  */
-int simdb_read(simdb_t *db, int start, int records, simdb_urec_t **data);
+int simdb_read(simdb_t *db, simdb_num_t start, int records, simdb_urec_t **data);
 
 /**
  * @brief Write records to database
@@ -39,6 +55,43 @@ int simdb_read(simdb_t *db, int start, int records, simdb_urec_t **data);
  * @retval  0 on no records written
  * @retval >0 as records count actually written
  */
-int simdb_write(simdb_t *db, int start, int records, simdb_urec_t *data);
+int simdb_write(simdb_t *db, simdb_num_t start, int records, simdb_urec_t *data);
+
+/**
+ * @brief Read high-resolution record from sidecar file
+ * @param db  Database handle
+ * @param num Record number
+ * @param hires Storage for record
+ * @retval <0 on error
+ * @retval  0 if database has no sidecar file, or no high-resolution record for @a num
+ * @retval  1 on success
+ */
+int simdb_read_hires(simdb_t *db, simdb_num_t num, simdb_hrec_t *hires);
+
+/**
+ * @brief Write high-resolution records to sidecar file
+ * @param db  Database handle
+ * @param start First record number
+ * @param records Records count to write
+ * @param hires Pointer to records data
+ * @retval <0 on error, short write is @ref SIMDB_ERR_SYSTEM
+ * @retval >0 as records count written, also if database has no sidecar file
+ * @note Should be written before main records, so readers never see
+ *   new main record together with stale high-resolution one
+ */
+int simdb_write_hires(simdb_t *db, simdb_num_t start, int records, const simdb_hrec_t *hires);
+
+/**
+ * @brief Append records to end of database
+ * @param db  Database handle
+ * @param records Records count to append
+ * @param data Pointer to records data
+ * @param hires Pointer to high-resolution records, written to sidecar file, may be NULL
+ * @retval <0 on error
+ * @retval >0 as number of first appended record
+ * @note Safe for concurrent use by threads (@ref SIMDB_FLAG_THREADS)
+ *   and processes (@ref SIMDB_FLAG_LOCKRANGE) sharing database
+ */
+simdb_num_t simdb_append(simdb_t *db, int records, simdb_urec_t *data, const simdb_hrec_t *hires);
 
 #endif
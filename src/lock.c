@@ -0,0 +1,68 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/**
+ * @file
+ * @brief Byte-range locks on database file
+ */
+
+#define _GNU_SOURCE 1 /* F_OFD_* */
+
+#include "common.h"
+#include "simdb.h"
+#include "lock.h"
+
+int
+simdb_lock_range(int fd, int type, off_t start, off_t len, bool wait) {
+  struct flock fl;
+  int ret = 0;
+
+  memset(&fl, 0x0, sizeof(struct flock));
+  fl.l_type   = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start  = start;
+  fl.l_len    = len;
+  fl.l_pid    = 0; /* required for OFD locks */
+
+#ifdef F_OFD_SETLK
+  do {
+    ret = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+  } while (ret < 0 && errno == EINTR);
+  if (ret == 0)
+    return SIMDB_SUCCESS;
+  if (errno != EINVAL)
+    return (errno == EAGAIN || errno == EACCES) ? SIMDB_ERR_LOCK : SIMDB_ERR_SYSTEM;
+  /* kernel without OFD locks, fall through */
+#endif
+
+  do {
+    ret = fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl);
+  } while (ret < 0 && errno == EINTR);
+  if (ret == 0)
+    return SIMDB_SUCCESS;
+
+  return (errno == EAGAIN || errno == EACCES) ? SIMDB_ERR_LOCK : SIMDB_ERR_SYSTEM;
+}
+
+bool
+simdb_lock_ofd(int fd) {
+#ifdef F_OFD_GETLK
+  struct flock fl;
+
+  memset(&fl, 0x0, sizeof(struct flock));
+  fl.l_type   = F_RDLCK;
+  fl.l_whence = SEEK_SET;
+
+  return fcntl(fd, F_OFD_GETLK, &fl) == 0;
+#else
+  (void) fd;
+  return false;
+#endif
+}
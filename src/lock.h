@@ -0,0 +1,39 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef HAS_LOCK_H
+#define HAS_LOCK_H 1
+
+/**
+ * @file
+ * @brief Byte-range locks on database file, see @ref SIMDB_FLAG_LOCKRANGE
+ */
+
+/**
+ * @brief Lock or unlock range of file
+ * @param fd    File descriptor
+ * @param type  One of F_RDLCK (shared), F_WRLCK (exclusive) or F_UNLCK
+ * @param start Start of range, in bytes
+ * @param len   Length of range, in bytes
+ * @param wait  Wait until lock can be taken
+ * @retval  0 on success
+ * @retval <0 on error, @ref SIMDB_ERR_LOCK if range is locked by someone else
+ * @note Uses open file description locks where available, so locks
+ *   are associated with file descriptor rather than process. Otherwise falls back
+ *   to classic process-associated fcntl() locks.
+ */
+int simdb_lock_range(int fd, int type, off_t start, off_t len, bool wait);
+
+/**
+ * @brief Check open file description locks supported for file
+ * @param fd File descriptor
+ * @returns true if kernel and filesystem support them
+ */
+bool simdb_lock_ofd(int fd);
+
+#endif /* HAS_LOCK_H */
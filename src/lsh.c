@@ -0,0 +1,535 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/**
+ * @file
+ * @brief Bit-sampling locality-sensitive hashing index
+ *
+ * Index file: header, then one entry per record at offset
+ * header + num * tables * 2: key of record in each table, uint16_t each.
+ * Same keys kept in memory, so record removed from its old buckets
+ * when replaced or deleted.
+ */
+
+#include "common.h"
+#include "lsh.h"
+
+#include <math.h>
+#include <pthread.h>
+
+#define LSH_NOKEY 0xFFFF
+#define LSH_BLOCK 4096   /**< entries read from index file at once */
+
+/** header of index file */
+typedef struct simdb_lsh_hdr_t {
+  char magic[8];      /**< "SDBLSH1" */
+  uint32_t tables;
+  uint32_t bits;
+  int64_t  size;      /**< database size on last sync */
+  int64_t  mtime;     /**< database mtime on last sync, seconds */
+  int64_t  mtime_ns;  /**< database mtime on last sync, nanoseconds */
+} simdb_lsh_hdr_t;
+
+typedef struct simdb_lsh_bucket_t {
+  simdb_num_t *nums;
+  int count;
+  int capacity;
+} simdb_lsh_bucket_t;
+
+struct simdb_lsh_t {
+  int fd;               /**< index file */
+  bool write;           /**< index file updated on store */
+  bool broken;          /**< store failed, index incomplete until rebuilt */
+  int tables;
+  int bits;
+  uint8_t positions[SIMDB_LSH_MAX_TABLES][SIMDB_LSH_MAX_BITS]; /**< sampled bits of each table */
+  simdb_lsh_bucket_t *buckets;  /**< tables * 2^bits buckets */
+  uint16_t *keys;       /**< current keys of each record, tables per record, indexed by number */
+  simdb_num_t keys_size; /**< records allocated in @a keys */
+  pthread_rwlock_t lock;  /**< shared for lookups, exclusive for updates */
+};
+
+static const char lsh_magic[8] = "SDBLSH1";
+
+/** same bits sampled for same parameters, so index file may be reused */
+static void
+simdb_lsh_positions(simdb_lsh_t *lsh) {
+  uint32_t state = 2463534242u; /* xorshift32 */
+  bool taken[SIMDB_BITMAP_BITS];
+
+  for (int t = 0; t < lsh->tables; t++) {
+    memset(taken, 0x0, sizeof(taken));
+    for (int b = 0; b < lsh->bits; b++) {
+      int pos = 0;
+      do {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        pos = state % SIMDB_BITMAP_BITS;
+      } while (taken[pos]);
+      taken[pos] = true;
+      lsh->positions[t][b] = pos;
+    }
+  }
+}
+
+static inline uint16_t
+simdb_lsh_key(const simdb_lsh_t *lsh, int table, const unsigned char *bitmap) {
+  uint16_t key = 0;
+
+  for (int b = 0; b < lsh->bits; b++) {
+    int pos = lsh->positions[table][b];
+    key |= ((bitmap[pos / 8] >> (pos % 8)) & 0x1) << b;
+  }
+
+  return key;
+}
+
+static int
+simdb_lsh_bucket_add(simdb_lsh_t *lsh, int table, uint16_t key, simdb_num_t num) {
+  simdb_lsh_bucket_t *bucket = &lsh->buckets[((size_t) table << lsh->bits) + key];
+  simdb_num_t *tmp = NULL;
+
+  if (bucket->count == bucket->capacity) {
+    int capacity = bucket->capacity ? bucket->capacity * 2 : 8;
+    if ((tmp = realloc(bucket->nums, capacity * sizeof(simdb_num_t))) == NULL)
+      return SIMDB_ERR_OOM;
+    bucket->nums = tmp;
+    bucket->capacity = capacity;
+  }
+  bucket->nums[bucket->count++] = num;
+
+  return SIMDB_SUCCESS;
+}
+
+static void
+simdb_lsh_bucket_del(simdb_lsh_t *lsh, int table, uint16_t key, simdb_num_t num) {
+  simdb_lsh_bucket_t *bucket = &lsh->buckets[((size_t) table << lsh->bits) + key];
+
+  for (int i = 0; i < bucket->count; i++) {
+    if (bucket->nums[i] == num) {
+      bucket->nums[i] = bucket->nums[--bucket->count]; /* order doesn't matter, candidates sorted */
+      return;
+    }
+  }
+}
+
+/** make room for keys of records up to @a num, new entries are "no record" */
+static int
+simdb_lsh_keys_grow(simdb_lsh_t *lsh, simdb_num_t num) {
+  simdb_num_t size = lsh->keys_size ? lsh->keys_size : 1024;
+  uint16_t *tmp = NULL;
+
+  if (num < lsh->keys_size)
+    return SIMDB_SUCCESS;
+
+  while (size <= num)
+    size *= 2;
+  if ((tmp = realloc(lsh->keys, (size_t) size * lsh->tables * sizeof(uint16_t))) == NULL)
+    return SIMDB_ERR_OOM;
+  memset(tmp + (size_t) lsh->keys_size * lsh->tables, 0xFF, (size_t) (size - lsh->keys_size) * lsh->tables * sizeof(uint16_t));
+  lsh->keys = tmp;
+  lsh->keys_size = size;
+
+  return SIMDB_SUCCESS;
+}
+
+/**
+ * @brief Move record to buckets of its new keys
+ * @note Caller holds exclusive lock
+ */
+static int
+simdb_lsh_place(simdb_lsh_t *lsh, simdb_num_t num, const uint16_t *keys) {
+  uint16_t *old = NULL;
+  int ret = SIMDB_SUCCESS;
+
+  if ((ret = simdb_lsh_keys_grow(lsh, num)) < 0)
+    return ret;
+
+  old = lsh->keys + (size_t) num * lsh->tables;
+  for (int t = 0; t < lsh->tables && ret == SIMDB_SUCCESS; t++) {
+    if (old[t] == keys[t])
+      continue;
+    if (old[t] != LSH_NOKEY)
+      simdb_lsh_bucket_del(lsh, t, old[t], num);
+    old[t] = LSH_NOKEY;
+    if (keys[t] != LSH_NOKEY && (ret = simdb_lsh_bucket_add(lsh, t, keys[t], num)) == SIMDB_SUCCESS)
+      old[t] = keys[t];
+  }
+
+  return ret;
+}
+
+/** read header of index file, @returns true if header valid */
+static bool
+simdb_lsh_header(int fd, simdb_lsh_hdr_t *hdr) {
+  return pread(fd, hdr, sizeof(simdb_lsh_hdr_t), 0) == sizeof(simdb_lsh_hdr_t) &&
+         memcmp(hdr->magic, lsh_magic, sizeof(lsh_magic)) == 0;
+}
+
+bool
+simdb_lsh_stored(const char *path, int *tables, int *bits) {
+  simdb_lsh_hdr_t hdr;
+  bool valid = false;
+  int fd = -1;
+
+  assert(path != NULL);
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return false;
+  if ((valid = simdb_lsh_header(fd, &hdr))) {
+    *tables = hdr.tables;
+    *bits   = hdr.bits;
+  }
+  close(fd);
+
+  return valid;
+}
+
+simdb_lsh_t *
+simdb_lsh_open(const char *path, int tables, int bits, bool write, int *error) {
+  simdb_lsh_hdr_t hdr;
+  simdb_lsh_t *lsh = NULL;
+  bool valid = false;
+
+  assert(path  != NULL);
+  assert(error != NULL);
+
+  if (tables < 1 || tables > SIMDB_LSH_MAX_TABLES || bits < 1 || bits > SIMDB_LSH_MAX_BITS) {
+    *error = SIMDB_ERR_USAGE;
+    return NULL;
+  }
+
+  if ((lsh = calloc(1, sizeof(simdb_lsh_t))) == NULL ||
+      (lsh->buckets = calloc((size_t) tables << bits, sizeof(simdb_lsh_bucket_t))) == NULL) {
+    free(lsh);
+    *error = SIMDB_ERR_OOM;
+    return NULL;
+  }
+
+  lsh->tables = tables;
+  lsh->bits   = bits;
+  lsh->write  = write;
+  simdb_lsh_positions(lsh);
+
+  if (pthread_rwlock_init(&lsh->lock, NULL) != 0) {
+    FREE(lsh->buckets);
+    FREE(lsh);
+    *error = SIMDB_ERR_SYSTEM;
+    return NULL;
+  }
+
+  if ((lsh->fd = open(path, write ? O_RDWR | O_CREAT : O_RDONLY, 0644)) < 0) {
+    *error = (errno == ENOENT) ? SIMDB_ERR_NOINDEX : SIMDB_ERR_SYSTEM;
+    simdb_lsh_free(lsh);
+    return NULL;
+  }
+
+  if ((valid = simdb_lsh_header(lsh->fd, &hdr)) &&
+      (hdr.tables != (uint32_t) tables || hdr.bits != (uint32_t) bits)) {
+    /* index of other writer, not ours to replace */
+    simdb_lsh_free(lsh);
+    *error = SIMDB_ERR_NOINDEX;
+    return NULL;
+  }
+
+  if (!valid && !write) {
+    simdb_lsh_free(lsh);
+    *error = SIMDB_ERR_NOINDEX;
+    return NULL;
+  }
+
+  if (!valid) {
+    memset(&hdr, 0x0, sizeof(hdr));
+    memcpy(hdr.magic, lsh_magic, sizeof(lsh_magic));
+    hdr.tables = tables;
+    hdr.bits   = bits;
+    if (ftruncate(lsh->fd, 0) < 0 || pwrite(lsh->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+      simdb_lsh_free(lsh);
+      *error = SIMDB_ERR_SYSTEM;
+      return NULL;
+    }
+  }
+
+  return lsh;
+}
+
+void
+simdb_lsh_free(simdb_lsh_t *lsh) {
+  assert(lsh != NULL);
+
+  if (lsh->fd >= 0)
+    close(lsh->fd);
+
+  simdb_lsh_reset(lsh);
+  pthread_rwlock_destroy(&lsh->lock);
+  FREE(lsh->keys);
+  FREE(lsh->buckets);
+  FREE(lsh);
+}
+
+bool
+simdb_lsh_synced(simdb_lsh_t *lsh, const struct stat *st) {
+  simdb_lsh_hdr_t hdr;
+
+  assert(lsh != NULL);
+  assert(st  != NULL);
+
+  if (!simdb_lsh_header(lsh->fd, &hdr))
+    return false;
+
+  return hdr.size == st->st_size &&
+         hdr.mtime == st->st_mtim.tv_sec && hdr.mtime_ns == st->st_mtim.tv_nsec;
+}
+
+int
+simdb_lsh_sync(simdb_lsh_t *lsh, const struct stat *st) {
+  simdb_lsh_hdr_t hdr;
+
+  assert(lsh != NULL);
+  assert(st  != NULL);
+
+  if (__atomic_load_n(&lsh->broken, __ATOMIC_ACQUIRE))
+    return SIMDB_ERR_NOINDEX; /* file must stay out of sync */
+
+  if (!lsh->write)
+    return SIMDB_SUCCESS;
+
+  memset(&hdr, 0x0, sizeof(hdr));
+  memcpy(hdr.magic, lsh_magic, sizeof(lsh_magic));
+  hdr.tables   = lsh->tables;
+  hdr.bits     = lsh->bits;
+  hdr.size     = st->st_size;
+  hdr.mtime    = st->st_mtim.tv_sec;
+  hdr.mtime_ns = st->st_mtim.tv_nsec;
+
+  if (pwrite(lsh->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+    return SIMDB_ERR_SYSTEM;
+
+  return SIMDB_SUCCESS;
+}
+
+int
+simdb_lsh_load(simdb_lsh_t *lsh, simdb_num_t records) {
+  size_t entry = lsh->tables * sizeof(uint16_t);
+  uint16_t *keys = NULL;
+  ssize_t bytes = 0;
+  int ret = SIMDB_SUCCESS, count = 0;
+
+  assert(lsh != NULL);
+
+  if ((keys = malloc(entry * LSH_BLOCK)) == NULL)
+    return SIMDB_ERR_OOM;
+
+  pthread_rwlock_wrlock(&lsh->lock);
+  for (simdb_num_t num = 1; num <= records && ret == SIMDB_SUCCESS; num += LSH_BLOCK) {
+    count = (records - num + 1 > LSH_BLOCK) ? LSH_BLOCK : records - num + 1;
+    bytes = pread(lsh->fd, keys, entry * count, sizeof(simdb_lsh_hdr_t) + entry * num);
+    if (bytes < (ssize_t) (entry * count)) {
+      ret = SIMDB_ERR_CORRUPTDB; /* not in sync after all */
+      break;
+    }
+    for (int i = 0; i < count && ret == SIMDB_SUCCESS; i++)
+      ret = simdb_lsh_place(lsh, num + i, keys + (size_t) i * lsh->tables);
+  }
+  pthread_rwlock_unlock(&lsh->lock);
+
+  free(keys);
+
+  return ret;
+}
+
+void
+simdb_lsh_reset(simdb_lsh_t *lsh) {
+  size_t buckets = (size_t) lsh->tables << lsh->bits;
+
+  assert(lsh != NULL);
+
+  pthread_rwlock_wrlock(&lsh->lock);
+  for (size_t i = 0; i < buckets; i++) {
+    FREE(lsh->buckets[i].nums);
+    lsh->buckets[i].count    = 0;
+    lsh->buckets[i].capacity = 0;
+  }
+  FREE(lsh->keys);
+  lsh->keys_size = 0;
+  lsh->broken    = false;
+  pthread_rwlock_unlock(&lsh->lock);
+}
+
+int
+simdb_lsh_truncate(simdb_lsh_t *lsh, simdb_num_t records) {
+  size_t entry = lsh->tables * sizeof(uint16_t);
+  uint16_t none[SIMDB_LSH_MAX_TABLES];
+
+  assert(lsh != NULL);
+
+  memset(none, 0xFF, sizeof(none));
+  pthread_rwlock_wrlock(&lsh->lock);
+  for (simdb_num_t num = records + 1; num < lsh->keys_size; num++)
+    simdb_lsh_place(lsh, num, none); /* only removes, never fails */
+  pthread_rwlock_unlock(&lsh->lock);
+
+  if (lsh->write && ftruncate(lsh->fd, sizeof(simdb_lsh_hdr_t) + entry * (records + 1)) < 0)
+    return SIMDB_ERR_SYSTEM;
+
+  return SIMDB_SUCCESS;
+}
+
+int
+simdb_lsh_store(simdb_lsh_t *lsh, simdb_num_t start, int records, const simdb_urec_t *data) {
+  size_t entry = lsh->tables * sizeof(uint16_t);
+  uint16_t *keys = NULL, *k = NULL;
+  int ret = SIMDB_SUCCESS;
+
+  assert(lsh  != NULL);
+  assert(data != NULL);
+
+  if (start < 1 || records < 1)
+    return SIMDB_ERR_USAGE;
+
+  if ((keys = malloc(entry * records)) == NULL)
+    return SIMDB_ERR_OOM;
+
+  k = keys;
+  for (int i = 0; i < records; i++) {
+    for (int t = 0; t < lsh->tables; t++, k++)
+      *k = data[i].used ? simdb_lsh_key(lsh, t, data[i].bitmap) : LSH_NOKEY;
+  }
+
+  pthread_rwlock_wrlock(&lsh->lock);
+  for (int i = 0; i < records && ret == SIMDB_SUCCESS; i++)
+    ret = simdb_lsh_place(lsh, start + i, keys + (size_t) i * lsh->tables);
+  pthread_rwlock_unlock(&lsh->lock);
+
+  if (ret == SIMDB_SUCCESS && lsh->write &&
+      pwrite(lsh->fd, keys, entry * records, sizeof(simdb_lsh_hdr_t) + entry * start) != (ssize_t) (entry * records))
+    ret = SIMDB_ERR_SYSTEM;
+
+  /* buckets or file don't match records anymore */
+  if (ret != SIMDB_SUCCESS)
+    __atomic_store_n(&lsh->broken, true, __ATOMIC_RELEASE);
+
+  free(keys);
+
+  return ret;
+}
+
+static int
+simdb_lsh_cmp(const void *a, const void *b) {
+  simdb_num_t ia = *(const simdb_num_t *) a, ib = *(const simdb_num_t *) b;
+  return (ia > ib) - (ia < ib);
+}
+
+int
+simdb_lsh_radius(const simdb_lsh_t *lsh, int tables, float d_bitmap) {
+  double p = d_bitmap, hit = 0.0, term = 0.0;
+
+  assert(lsh != NULL);
+
+  if (tables <= 0 || tables > lsh->tables)
+    tables = lsh->tables;
+  if (p <= 0.0)
+    return 0;
+  if (p >= 1.0)
+    return lsh->bits;
+
+  /* record with fraction p of bits differing has all but r key bits same in one table
+   * with binomial probability, and is missed only if missed in every table */
+  for (int r = 0; r <= lsh->bits; r++) {
+    term = exp(lgamma(lsh->bits + 1) - lgamma(r + 1) - lgamma(lsh->bits - r + 1) +
+               r * log(p) + (lsh->bits - r) * log(1.0 - p));
+    hit += term;
+    if (1.0 - pow(1.0 - hit, tables) >= SIMDB_LSH_RECALL)
+      return r;
+  }
+
+  return lsh->bits;
+}
+
+/** append bucket contents to candidates, growing storage */
+static int
+simdb_lsh_collect(simdb_lsh_bucket_t *bucket, simdb_num_t **found, int *total, int *capacity) {
+  simdb_num_t *tmp = NULL;
+
+  if (*total + bucket->count > *capacity) {
+    while (*total + bucket->count > *capacity)
+      *capacity *= 2;
+    if ((tmp = realloc(*found, *capacity * sizeof(simdb_num_t))) == NULL)
+      return SIMDB_ERR_OOM;
+    *found = tmp;
+  }
+  memcpy(*found + *total, bucket->nums, bucket->count * sizeof(simdb_num_t));
+  *total += bucket->count;
+
+  return SIMDB_SUCCESS;
+}
+
+int
+simdb_lsh_candidates(simdb_lsh_t *lsh, const unsigned char *bitmaps, int count,
+                     int tables, int radius, simdb_num_t **nums) {
+  simdb_num_t *found = NULL;
+  int total = 0, capacity = 64, unique = 0, ret = SIMDB_SUCCESS;
+  uint32_t mask = 0, low = 0, limit = 0;
+  uint16_t key = 0;
+
+  assert(lsh    != NULL);
+  assert(bitmaps != NULL);
+  assert(nums    != NULL);
+
+  if (__atomic_load_n(&lsh->broken, __ATOMIC_ACQUIRE))
+    return SIMDB_ERR_NOINDEX;
+
+  if (tables <= 0 || tables > lsh->tables)
+    tables = lsh->tables;
+  if (radius < 0)
+    radius = 0;
+  if (radius > lsh->bits)
+    radius = lsh->bits;
+
+  if ((found = malloc(capacity * sizeof(simdb_num_t))) == NULL)
+    return SIMDB_ERR_OOM;
+
+  limit = 1u << lsh->bits;
+  pthread_rwlock_rdlock(&lsh->lock);
+  for (int b = 0; b < count && ret == SIMDB_SUCCESS; b++, bitmaps += SIMDB_BITMAP_SIZE) {
+    for (int t = 0; t < tables && ret == SIMDB_SUCCESS; t++) {
+      key = simdb_lsh_key(lsh, t, bitmaps);
+      /* buckets with keys differing in exactly w bits: all w-bit masks in increasing order */
+      for (int w = 0; w <= radius && ret == SIMDB_SUCCESS; w++) {
+        for (mask = (1u << w) - 1; mask < limit && ret == SIMDB_SUCCESS; ) {
+          ret = simdb_lsh_collect(&lsh->buckets[((size_t) t << lsh->bits) + (key ^ mask)], &found, &total, &capacity);
+          if (mask == 0)
+            break;
+          low  = mask & -mask;          /* next mask with same bit count */
+          mask = mask + low;
+          mask = mask | ((((mask ^ (mask - low)) >> 2) / low));
+        }
+      }
+    }
+  }
+  pthread_rwlock_unlock(&lsh->lock);
+
+  if (ret != SIMDB_SUCCESS || total == 0) {
+    FREE(found);
+    *nums = NULL;
+    return ret;
+  }
+
+  qsort(found, total, sizeof(simdb_num_t), simdb_lsh_cmp);
+  for (int i = 0; i < total; i++) {
+    if (unique == 0 || found[unique - 1] != found[i])
+      found[unique++] = found[i];
+  }
+
+  *nums = found;
+
+  return unique;
+}
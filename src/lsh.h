@@ -0,0 +1,140 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef HAS_LSH_H
+#define HAS_LSH_H 1
+
+#include "record.h"
+
+/**
+ * @file
+ * @brief Bit-sampling locality-sensitive hashing index, see @ref simdb_lsh_setup()
+ *
+ * Each of L tables samples k fixed bits of 16x16 bitmap, sampled bits
+ * form bucket key. Records with close bitmaps likely share bucket
+ * in at least one table. Keys of each record persisted in index file,
+ * so index loaded without reading records, if file is in sync with database.
+ * Current keys also kept in memory, replaced and deleted records leave
+ * their old buckets. Search probes buckets with keys differing from sample's
+ * in up to r bits, r chosen for given threshold, see @ref simdb_lsh_radius().
+ */
+
+/** max tables in index */
+#define SIMDB_LSH_MAX_TABLES 64
+/** max sampled bits per table, key 0xFFFF reserved for "no record" */
+#define SIMDB_LSH_MAX_BITS   15
+/** recall targeted by @ref simdb_lsh_radius() */
+#define SIMDB_LSH_RECALL     0.95
+
+/** opaque handle of index */
+typedef struct simdb_lsh_t simdb_lsh_t;
+
+/**
+ * @brief Open or create index file
+ * @param path   Path to index file
+ * @param tables Tables count
+ * @param bits   Sampled bits per table
+ * @param write  Index file may be created and updated
+ * @param error  Pointer to error code storage
+ * @returns Pointer to index handle or NULL on error
+ * @note Fails with @ref SIMDB_ERR_NOINDEX if file has other parameters,
+ *   or without @a write if file is missing
+ */
+simdb_lsh_t * simdb_lsh_open(const char *path, int tables, int bits, bool write, int *error);
+
+/**
+ * @brief Read parameters of existing index file
+ * @param path   Path to index file
+ * @param tables Pointer to storage for tables count
+ * @param bits   Pointer to storage for sampled bits per table
+ * @returns true if file exists and valid
+ */
+bool simdb_lsh_stored(const char *path, int *tables, int *bits);
+
+/**
+ * @brief Close index file and free index
+ * @param lsh Index handle
+ */
+void simdb_lsh_free(simdb_lsh_t *lsh);
+
+/**
+ * @brief Check index file was last synced with database of given state
+ * @param lsh Index handle
+ * @param st  Database file state
+ */
+bool simdb_lsh_synced(simdb_lsh_t *lsh, const struct stat *st);
+
+/**
+ * @brief Remember database state in index file, see @ref simdb_lsh_synced()
+ * @param lsh Index handle
+ * @param st  Database file state
+ * @retval  0 on success, also for read-only index
+ * @retval <0 on error, @ref SIMDB_ERR_NOINDEX if index broken by failed store
+ */
+int simdb_lsh_sync(simdb_lsh_t *lsh, const struct stat *st);
+
+/**
+ * @brief Fill buckets from keys stored in index file
+ * @param lsh     Index handle
+ * @param records Database records count
+ * @retval  0 on success
+ * @retval <0 on error
+ */
+int simdb_lsh_load(simdb_lsh_t *lsh, simdb_num_t records);
+
+/**
+ * @brief Drop all buckets, before full rebuild
+ * @param lsh Index handle
+ */
+void simdb_lsh_reset(simdb_lsh_t *lsh);
+
+/**
+ * @brief Drop records after given number
+ * @param lsh     Index handle
+ * @param records New records count
+ * @retval  0 on success
+ * @retval <0 on error
+ */
+int simdb_lsh_truncate(simdb_lsh_t *lsh, simdb_num_t records);
+
+/**
+ * @brief Put records to buckets of their keys and store keys in index file
+ * @param lsh     Index handle
+ * @param start   First record number
+ * @param records Records count
+ * @param data    Records data, unused ones stored as "no record"
+ * @retval  0 on success
+ * @retval <0 on error, index marked broken: searches and sync fail until @ref simdb_lsh_reset()
+ * @note Records already indexed moved from old buckets, if keys changed
+ */
+int simdb_lsh_store(simdb_lsh_t *lsh, simdb_num_t start, int records, const simdb_urec_t *data);
+
+/**
+ * @brief Choose probe radius for given threshold
+ * @param lsh      Index handle
+ * @param tables   Tables to look in, 0 - all
+ * @param d_bitmap Max difference of bitmaps
+ * @returns Smallest radius, which finds record with @a d_bitmap of bits differing
+ *   with probability @ref SIMDB_LSH_RECALL, assuming differing bits are random
+ */
+int simdb_lsh_radius(const simdb_lsh_t *lsh, int tables, float d_bitmap);
+
+/**
+ * @brief Collect candidates for given bitmaps
+ * @param lsh     Index handle
+ * @param bitmaps Sample bitmaps, one after another
+ * @param count   Sample bitmaps count
+ * @param tables Tables to look in, 0 - all
+ * @param radius Also probe buckets with keys differing in up to this many bits, 0 - exact bucket only
+ * @param nums   Pointer to storage for candidates (allocated), sorted ascending, unique
+ * @returns Candidates count or <0 on error
+ */
+int simdb_lsh_candidates(simdb_lsh_t *lsh, const unsigned char *bitmaps, int count,
+                         int tables, int radius, simdb_num_t **nums);
+
+#endif /* HAS_LSH_H */
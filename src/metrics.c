@@ -0,0 +1,96 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/**
+ * @file
+ * @brief Latency histograms for operation metrics
+ *
+ * Buckets are log-linear: values below 4ns have own bucket each,
+ * every next power of two is split in 4 equal sub-buckets.
+ */
+
+#include "common.h"
+#include "metrics.h"
+
+int
+simdb_histogram_bucket(uint64_t ns) {
+  int exp = 0, bucket = 0;
+
+  if (ns < 4)
+    return ns;
+
+  exp = 63 - __builtin_clzll(ns); /* >= 2 */
+  bucket = 4 + (exp - 2) * 4 + ((ns >> (exp - 2)) & 0x3);
+
+  return (bucket < SIMDB_HIST_BUCKETS) ? bucket : SIMDB_HIST_BUCKETS - 1;
+}
+
+uint64_t
+simdb_histogram_bound(int bucket) {
+  int exp = 0, sub = 0;
+
+  assert(bucket >= 0 && bucket < SIMDB_HIST_BUCKETS);
+
+  if (bucket < 4)
+    return bucket;
+
+  exp = (bucket - 4) / 4 + 2;
+  sub = (bucket - 4) % 4;
+
+  return ((uint64_t) (5 + sub) << (exp - 2)) - 1;
+}
+
+void
+simdb_histogram_observe(simdb_histogram_t *hist, const struct timespec *start) {
+  struct timespec now;
+  uint64_t ns = 0;
+  double value = 0.0;
+
+  assert(hist  != NULL);
+  assert(start != NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ns = (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+  value = ns / 1e9;
+
+  hist->count++;
+  hist->sum += value;
+  if (value > hist->max)
+    hist->max = value;
+  hist->buckets[simdb_histogram_bucket(ns)]++;
+}
+
+double
+simdb_histogram_percentile(const simdb_histogram_t *hist, double q) {
+  unsigned long rank = 0, seen = 0;
+  double bound = 0.0;
+
+  assert(hist != NULL);
+
+  if (hist->count == 0)
+    return 0.0;
+
+  if (q < 0.0) q = 0.0;
+  if (q > 1.0) q = 1.0;
+
+  rank = q * hist->count;
+  if (rank < q * hist->count || rank < 1)
+    rank++; /* ceil() */
+
+  for (int i = 0; i < SIMDB_HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen < rank)
+      continue;
+    bound = simdb_histogram_bound(i) / 1e9;
+    return (bound < hist->max) ? bound : hist->max;
+  }
+
+  return hist->max;
+}
@@ -0,0 +1,46 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef HAS_METRICS_H
+#define HAS_METRICS_H 1
+
+#include "simdb.h"
+
+/**
+ * @file
+ * @brief Internal routines for collecting operation metrics
+ */
+
+/**
+ * @brief Get bucket number for given value
+ * @param ns Observed value, in nanoseconds
+ * @returns Bucket number, from 0 to @ref SIMDB_HIST_BUCKETS - 1
+ */
+int simdb_histogram_bucket(uint64_t ns);
+
+/**
+ * @brief Get upper bound of bucket
+ * @param bucket Bucket number
+ * @returns Max value that falls into this bucket, in nanoseconds
+ */
+uint64_t simdb_histogram_bound(int bucket);
+
+/**
+ * @brief Add observation to histogram
+ * @param hist  Histogram
+ * @param start Start time of observed operation (CLOCK_MONOTONIC)
+ */
+void simdb_histogram_observe(simdb_histogram_t *hist, const struct timespec *start);
+
+/** mark start of observed operation */
+static inline void
+simdb_metrics_start(struct timespec *start) {
+  clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+#endif /* HAS_METRICS_H */
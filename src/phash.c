@@ -0,0 +1,75 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/**
+ * @file
+ * @brief DCT-based perceptual hash
+ */
+
+#include "common.h"
+#include "phash.h"
+
+#include <math.h>
+
+/** low-frequency coefficients per side, kept in hash */
+#define PHASH_KEEP 8
+
+static int
+simdb_phash_cmp(const void *a, const void *b) {
+  float fa = *(const float *) a, fb = *(const float *) b;
+  return (fa > fb) - (fa < fb);
+}
+
+uint64_t
+simdb_phash(const unsigned char *luma) {
+  float cosines[PHASH_KEEP][SIMDB_PHASH_SIDE];
+  float rows[SIMDB_PHASH_SIDE][PHASH_KEEP];
+  float coefs[PHASH_KEEP * PHASH_KEEP];
+  float sorted[PHASH_KEEP * PHASH_KEEP];
+  float median = 0.0, sum = 0.0;
+  uint64_t hash = 0;
+
+  assert(luma != NULL);
+
+  for (int u = 0; u < PHASH_KEEP; u++) {
+    for (int x = 0; x < SIMDB_PHASH_SIDE; x++)
+      cosines[u][x] = cos((2 * x + 1) * u * M_PI / (2 * SIMDB_PHASH_SIDE));
+  }
+
+  /* separable 2D DCT-II, only first 8 frequencies in each direction */
+  for (int y = 0; y < SIMDB_PHASH_SIDE; y++) {
+    for (int u = 0; u < PHASH_KEEP; u++) {
+      sum = 0.0;
+      for (int x = 0; x < SIMDB_PHASH_SIDE; x++)
+        sum += luma[y * SIMDB_PHASH_SIDE + x] * cosines[u][x];
+      rows[y][u] = sum;
+    }
+  }
+  for (int v = 0; v < PHASH_KEEP; v++) {
+    for (int u = 0; u < PHASH_KEEP; u++) {
+      sum = 0.0;
+      for (int y = 0; y < SIMDB_PHASH_SIDE; y++)
+        sum += rows[y][u] * cosines[v][y];
+      coefs[v * PHASH_KEEP + u] = sum;
+    }
+  }
+
+  /* median of AC coefficients, DC one is average brightness */
+  memcpy(sorted, coefs + 1, sizeof(float) * (PHASH_KEEP * PHASH_KEEP - 1));
+  qsort(sorted, PHASH_KEEP * PHASH_KEEP - 1, sizeof(float), simdb_phash_cmp);
+  median = sorted[(PHASH_KEEP * PHASH_KEEP - 1) / 2];
+
+  for (int i = 0; i < PHASH_KEEP * PHASH_KEEP; i++) {
+    if (coefs[i] > median)
+      hash |= 1ULL << i;
+  }
+
+  return hash ? hash : 1; /* zero reserved for "not set" */
+}
@@ -0,0 +1,40 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef HAS_PHASH_H
+#define HAS_PHASH_H 1
+
+/**
+ * @file
+ * @brief DCT-based perceptual hash, see @ref SIMDB_CAP_PHASH
+ */
+
+/** Side of luma image, used as hash source */
+#define SIMDB_PHASH_SIDE 32
+/** Bits in hash */
+#define SIMDB_PHASH_BITS 64
+
+/**
+ * @brief Calculate perceptual hash of image
+ * @param luma Grayscale image, @ref SIMDB_PHASH_SIDE x @ref SIMDB_PHASH_SIDE pixels, row by row
+ * @returns Hash, each bit is set if matching low-frequency DCT coefficient
+ *   (8x8 block in top-left corner) is above median of them
+ * @note Never returns zero, as zero hash means "not set"
+ */
+uint64_t simdb_phash(const unsigned char *luma);
+
+/**
+ * @brief Compare two hashes
+ * @returns Count of different bits (0-64)
+ */
+static inline int
+simdb_phash_compare(uint64_t a, uint64_t b) {
+  return __builtin_popcountll(a ^ b);
+}
+
+#endif /* HAS_PHASH_H */
@@ -0,0 +1,106 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef HAS_PROTO_H
+#define HAS_PROTO_H 1
+
+/**
+ * @file
+ * @brief Binary protocol of simdb-server
+ *
+ * Client sends request header, followed by @a len bytes of payload
+ * (path to image for @ref SIMDB_OP_ADD and @ref SIMDB_OP_SEARCH_FILE).
+ * Server replies with response header, followed by @a len bytes of payload:
+ * - search: array of simdb_match_t, @a status is matches count
+ * - usage : usage map, one byte per record, @a status is records count
+ * - add, del: no payload, @a status is record number
+ * On error @a status is one of @ref SIMDBErrors codes.
+ * Connection may be used for many requests. All fields are in host byte
+ * order, as unix sockets are local anyway.
+ */
+
+#define SIMDB_PROTO_MAGIC 0x32424453 /**< "SDB2", 64-bit record numbers */
+
+/** max payload length of request */
+#define SIMDB_PROTO_MAXLEN PATH_MAX
+
+/**
+ * @defgroup SIMDBProtoOps Request types
+ * @{ */
+#define SIMDB_OP_SEARCH_ID   1  /**< simdb_search_byid(), uses @a num and search parameters */
+#define SIMDB_OP_SEARCH_FILE 2  /**< simdb_search_file(), uses payload and search parameters */
+#define SIMDB_OP_ADD         3  /**< simdb_record_add(), uses @a num and payload */
+#define SIMDB_OP_DEL         4  /**< simdb_record_del(), uses @a num */
+#define SIMDB_OP_USAGE       5  /**< simdb_usage_map() */
+/** @} */
+
+/** request header */
+typedef struct simdb_proto_req_t {
+  uint32_t magic;    /**< @ref SIMDB_PROTO_MAGIC */
+  uint8_t  op;       /**< request type, see @ref SIMDBProtoOps */
+  uint8_t  db;       /**< database number on server, in order of -b options */
+  uint16_t _pad;     /**< reserved, must be zero */
+  int64_t  num;      /**< record number */
+  int32_t  limit;    /**< search: max results */
+  float d_bitmap;    /**< search: max difference of luma bitmaps */
+  float d_ratio;     /**< search: max difference of ratios */
+  float d_color;     /**< search: max difference of color levels */
+  uint32_t len;      /**< payload length */
+} simdb_proto_req_t;
+
+/** response header */
+typedef struct simdb_proto_resp_t {
+  uint32_t magic;    /**< @ref SIMDB_PROTO_MAGIC */
+  uint32_t _pad;     /**< reserved, must be zero */
+  int64_t  status;   /**< operation result */
+  uint64_t len;      /**< payload length */
+} simdb_proto_resp_t;
+
+/**
+ * @brief Read exactly @a len bytes from socket
+ * @returns true on success, false on error or end of stream
+ */
+static inline bool
+simdb_proto_read(int fd, void *buf, size_t len) {
+  char *p = buf;
+  ssize_t bytes = 0;
+
+  while (len > 0) {
+    if ((bytes = read(fd, p, len)) < 0 && errno == EINTR)
+      continue;
+    if (bytes <= 0)
+      return false;
+    p   += bytes;
+    len -= bytes;
+  }
+
+  return true;
+}
+
+/**
+ * @brief Write exactly @a len bytes to socket
+ * @returns true on success, false on error
+ */
+static inline bool
+simdb_proto_write(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  ssize_t bytes = 0;
+
+  while (len > 0) {
+    if ((bytes = write(fd, p, len)) < 0 && errno == EINTR)
+      continue;
+    if (bytes <= 0)
+      return false;
+    p   += bytes;
+    len -= bytes;
+  }
+
+  return true;
+}
+
+#endif /* HAS_PROTO_H */
@@ -25,18 +25,32 @@ typedef struct simdb_urec_t {
   uint8_t clevel_b;  /**< color level: blue  */
   uint16_t image_w;  /**< image width  */
   uint16_t image_h;  /**< image height */
-  unsigned char _unused[8]; /**< padding */
+  uint64_t phash;    /**< perceptual hash, zero if not set, see @ref SIMDB_CAP_PHASH */
   unsigned char bitmap[SIMDB_BITMAP_SIZE]; /**< image luma bitmap */
 } __attribute__((__packed__)) simdb_urec_t;
 
 /** compile-time check for packed struct length */
 typedef char size_mismatch_for__simdb_urec_t[(sizeof(simdb_urec_t) == SIMDB_REC_LEN) * 2 - 1];
 
+/** length of high-resolution record in sidecar file, see @ref SIMDB_CAP_BITMAP32 */
+#define SIMDB_HREC_LEN 144
+
+/** high-resolution record, stored in sidecar file at same number as main record */
+typedef struct simdb_hrec_t {
+  uint8_t used;      /**< record has high-resolution bitmap */
+  unsigned char _unused[15]; /**< padding */
+  unsigned char bitmap[SIMDB_BITMAP_HR_SIZE]; /**< image luma bitmap, 32x32 */
+} __attribute__((__packed__)) simdb_hrec_t;
+
+/** compile-time check for packed struct length */
+typedef char size_mismatch_for__simdb_hrec_t[(sizeof(simdb_hrec_t) == SIMDB_HREC_LEN) * 2 - 1];
+
 /**
  * @brief Creates metadata record from given image
  * @param path Path to source image
+ * @param hires Pointer to storage for high-resolution record, may be NULL if not needed
  * @returns Pointer to allocated record or NULL on error
  */
-simdb_urec_t * simdb_record_create(const char * const path);
+simdb_urec_t * simdb_record_create(const char * const path, simdb_hrec_t *hires);
 
 #endif /* RECORD_H */
@@ -0,0 +1,294 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/**
+ * @file
+ * @brief In-memory copy of database records
+ */
+
+#define _GNU_SOURCE 1 /* MAP_ANONYMOUS, MAP_HUGETLB, MADV_HUGEPAGE */
+
+#include "common.h"
+#include "resident.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define HUGEPAGE_SIZE    (2UL << 20)  /**< allocations rounded to this size with SIMDB_MEMORY_HUGEPAGES */
+#if defined(MAP_HUGE_SHIFT) && !defined(MAP_HUGE_2MB)
+#define MAP_HUGE_2MB     (21 << MAP_HUGE_SHIFT) /**< from linux/mman.h, log2 of page size */
+#endif
+#define MPOL_INTERLEAVE  3            /**< from linux/mempolicy.h, numaif.h needs libnuma */
+#define NODES_MAX        1024         /**< max NUMA nodes in mask */
+
+struct simdb_resident_t {
+  simdb_urec_t *recs;   /**< records, starting from #1 */
+  simdb_num_t count;    /**< records stored */
+  simdb_num_t capacity; /**< records allocated */
+  int wanted;           /**< memory options requested, see @ref SIMDBMemory */
+  int options;          /**< memory options in effect */
+  size_t mapped;        /**< size of mapping, 0 if @a recs allocated with malloc() */
+  pthread_rwlock_t lock;  /**< shared for scans, exclusive for updates */
+};
+
+/** get mask of online NUMA nodes, returns nodes count, 0 if unknown */
+static int
+simdb_numa_nodes(unsigned long *mask, size_t words) {
+  FILE *f = NULL;
+  char buf[256], *p = NULL;
+  long first = 0, last = 0;
+  int count = 0;
+
+  memset(mask, 0x0, words * sizeof(unsigned long));
+
+  if ((f = fopen("/sys/devices/system/node/online", "r")) == NULL)
+    return 0;
+  p = fgets(buf, sizeof(buf), f);
+  fclose(f);
+  if (p == NULL)
+    return 0;
+
+  /* list of ranges: "0-3,8,10-11" */
+  while (*p >= '0' && *p <= '9') {
+    first = last = strtol(p, &p, 10);
+    if (*p == '-')
+      last = strtol(p + 1, &p, 10);
+    for (long n = first; n <= last && n < (long) (words * 8 * sizeof(unsigned long)); n++, count++)
+      mask[n / (8 * sizeof(unsigned long))] |= 1UL << (n % (8 * sizeof(unsigned long)));
+    if (*p == ',')
+      p++;
+  }
+
+  return count;
+}
+
+/**
+ * @brief Allocate zeroed memory for records according to options
+ * @param size    Bytes wanted, rounded up to page size
+ * @param options Wanted options, see @ref SIMDBMemory
+ * @param applied Storage for options actually applied
+ * @param mapped  Storage for size of mapping, 0 if allocated with calloc()
+ * @returns Pointer to memory or NULL on error
+ */
+static void *
+simdb_resident_alloc(size_t size, int options, int *applied, size_t *mapped) {
+  unsigned long nodes[NODES_MAX / (8 * sizeof(unsigned long))];
+  void *mem = MAP_FAILED;
+
+  *applied = 0;
+  *mapped  = 0;
+
+  if (options == 0)
+    return calloc(1, size);
+
+  size = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_2MB)
+  /* reserved huge pages of size we rounded to, default size may be other (1 GiB),
+   * fails if none configured (vm.nr_hugepages or per-size pool) */
+  if (options & SIMDB_MEMORY_HUGEPAGES) {
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (mem != MAP_FAILED)
+      *applied |= SIMDB_MEMORY_HUGEPAGES;
+  }
+#endif
+  if (mem == MAP_FAILED) {
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+      return NULL;
+#ifdef MADV_HUGEPAGE
+    /* transparent huge pages, if enabled in "madvise" or "always" mode */
+    if (options & SIMDB_MEMORY_HUGEPAGES && madvise(mem, size, MADV_HUGEPAGE) == 0)
+      *applied |= SIMDB_MEMORY_HUGEPAGES;
+#endif
+  }
+
+#ifdef SYS_mbind
+  /* spread pages over all nodes, before first touch */
+  if (options & SIMDB_MEMORY_INTERLEAVE && simdb_numa_nodes(nodes, sizeof(nodes) / sizeof(nodes[0])) > 1 &&
+      syscall(SYS_mbind, mem, size, MPOL_INTERLEAVE, nodes, NODES_MAX, 0) == 0)
+    *applied |= SIMDB_MEMORY_INTERLEAVE;
+#else
+  (void)(nodes);
+#endif
+
+  *mapped = size;
+
+  return mem;
+}
+
+static void
+simdb_resident_release(void *mem, size_t mapped) {
+  if (mapped) {
+    munmap(mem, mapped);
+  } else {
+    free(mem);
+  }
+}
+
+simdb_resident_t *
+simdb_resident_new(void) {
+  simdb_resident_t *res = NULL;
+
+  if ((res = calloc(1, sizeof(simdb_resident_t))) == NULL)
+    return NULL;
+
+  if (pthread_rwlock_init(&res->lock, NULL) != 0) {
+    FREE(res);
+    return NULL;
+  }
+
+  return res;
+}
+
+void
+simdb_resident_free(simdb_resident_t *res) {
+  assert(res != NULL);
+
+  pthread_rwlock_destroy(&res->lock);
+  simdb_resident_release(res->recs, res->mapped);
+  FREE(res);
+}
+
+/**
+ * @brief Move records to new memory of given capacity
+ * @note Caller holds exclusive lock
+ */
+static int
+simdb_resident_move(simdb_resident_t *res, simdb_num_t capacity, int options) {
+  simdb_urec_t *tmp = NULL;
+  size_t mapped = 0;
+  int applied = 0;
+
+  if (options == 0 && res->mapped == 0) {
+    /* plain heap memory, realloc() may extend in place */
+    if ((tmp = realloc(res->recs, (size_t) capacity * sizeof(simdb_urec_t))) == NULL)
+      return SIMDB_ERR_OOM;
+    memset(tmp + res->capacity, 0x0, (size_t) (capacity - res->capacity) * sizeof(simdb_urec_t));
+  } else {
+    if ((tmp = simdb_resident_alloc((size_t) capacity * sizeof(simdb_urec_t), options, &applied, &mapped)) == NULL)
+      return SIMDB_ERR_OOM;
+    if (mapped)
+      capacity = mapped / sizeof(simdb_urec_t); /* use rest of last page too */
+    if (res->recs)
+      memcpy(tmp, res->recs, (size_t) res->count * sizeof(simdb_urec_t));
+    simdb_resident_release(res->recs, res->mapped);
+  }
+
+  res->recs     = tmp;
+  res->capacity = capacity;
+  res->options  = applied;
+  res->mapped   = mapped;
+
+  return SIMDB_SUCCESS;
+}
+
+/** extend storage to hold at least @a records, caller holds exclusive lock */
+static int
+simdb_resident_grow(simdb_resident_t *res, simdb_num_t records) {
+  simdb_num_t capacity = res->capacity ? res->capacity : 4096;
+
+  while (capacity < records)
+    capacity *= 2;
+
+  return simdb_resident_move(res, capacity, res->wanted);
+}
+
+int
+simdb_resident_setup(simdb_resident_t *res, int options) {
+  int ret = 0;
+
+  assert(res != NULL);
+
+  pthread_rwlock_wrlock(&res->lock);
+  res->wanted = options;
+  if ((ret = simdb_resident_move(res, res->capacity ? res->capacity : 4096, options)) == SIMDB_SUCCESS)
+    ret = res->options;
+  pthread_rwlock_unlock(&res->lock);
+
+  return ret;
+}
+
+int
+simdb_resident_store(simdb_resident_t *res, simdb_num_t start, int records, const simdb_urec_t *data) {
+  simdb_num_t last = start + records - 1;
+  int ret = SIMDB_SUCCESS;
+
+  assert(res  != NULL);
+  assert(data != NULL);
+
+  if (start < 1 || records < 1)
+    return SIMDB_ERR_USAGE;
+
+  pthread_rwlock_wrlock(&res->lock);
+  if (last > res->capacity)
+    ret = simdb_resident_grow(res, last);
+  if (ret == SIMDB_SUCCESS) {
+    memcpy(&res->recs[start - 1], data, (size_t) records * sizeof(simdb_urec_t));
+    if (last > res->count)
+      res->count = last; /* gap, if any, is zeroed = unused records */
+  }
+  pthread_rwlock_unlock(&res->lock);
+
+  return ret;
+}
+
+void
+simdb_resident_truncate(simdb_resident_t *res, simdb_num_t records) {
+  assert(res != NULL);
+
+  pthread_rwlock_wrlock(&res->lock);
+  if (records >= 0 && records < res->count) {
+    memset(&res->recs[records], 0x0, (size_t) (res->count - records) * sizeof(simdb_urec_t));
+    res->count = records;
+  }
+  pthread_rwlock_unlock(&res->lock);
+}
+
+int
+simdb_resident_fetch(simdb_resident_t *res, simdb_num_t start, int records, simdb_urec_t **data) {
+  assert(res  != NULL);
+  assert(data != NULL);
+
+  if (start < 1 || start > res->count)
+    return 0;
+
+  if (records > res->count - start + 1)
+    records = res->count - start + 1;
+
+  *data = &res->recs[start - 1];
+  return records;
+}
+
+simdb_num_t
+simdb_resident_count(simdb_resident_t *res) {
+  simdb_num_t count = 0;
+
+  assert(res != NULL);
+
+  pthread_rwlock_rdlock(&res->lock);
+  count = res->count;
+  pthread_rwlock_unlock(&res->lock);
+
+  return count;
+}
+
+void
+simdb_resident_rdlock(simdb_resident_t *res) {
+  assert(res != NULL);
+  pthread_rwlock_rdlock(&res->lock);
+}
+
+void
+simdb_resident_unlock(simdb_resident_t *res) {
+  assert(res != NULL);
+  pthread_rwlock_unlock(&res->lock);
+}
@@ -0,0 +1,91 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef HAS_RESIDENT_H
+#define HAS_RESIDENT_H 1
+
+#include "record.h"
+
+/**
+ * @file
+ * @brief In-memory copy of database records, see @ref SIMDB_FLAG_RESIDENT
+ */
+
+/** opaque handle of in-memory records */
+typedef struct simdb_resident_t simdb_resident_t;
+
+/**
+ * @brief Creates empty in-memory records storage
+ * @returns Pointer to storage handle or NULL on error
+ */
+simdb_resident_t * simdb_resident_new(void);
+
+/**
+ * @brief Move records to memory allocated with given options
+ * @param res     Storage handle
+ * @param options Memory options, see @ref SIMDBMemory, 0 - plain heap memory
+ * @returns Options actually applied or <0 on error
+ * @note Options also used for all later extensions of storage
+ */
+int simdb_resident_setup(simdb_resident_t *res, int options);
+
+/**
+ * @brief Frees storage and all records
+ * @param res Storage handle
+ */
+void simdb_resident_free(simdb_resident_t *res);
+
+/**
+ * @brief Store copy of records, extending storage if needed
+ * @param res     Storage handle
+ * @param start   First record number
+ * @param records Records count
+ * @param data    Records data
+ * @retval  0 on success
+ * @retval <0 on error
+ * @note Takes exclusive lock while copying
+ */
+int simdb_resident_store(simdb_resident_t *res, simdb_num_t start, int records, const simdb_urec_t *data);
+
+/**
+ * @brief Drop records after given number
+ * @param res     Storage handle
+ * @param records New records count
+ */
+void simdb_resident_truncate(simdb_resident_t *res, simdb_num_t records);
+
+/**
+ * @brief Get pointer to block of stored records
+ * @param res     Storage handle
+ * @param start   First record number
+ * @param records Records count wanted
+ * @param data    Pointer to storage for pointer to first record
+ * @returns Records count available, 0 if @a start beyond stored records
+ * @note Caller must hold shared lock, see @ref simdb_resident_rdlock()
+ */
+int simdb_resident_fetch(simdb_resident_t *res, simdb_num_t start, int records, simdb_urec_t **data);
+
+/**
+ * @brief Get stored records count
+ * @param res Storage handle
+ */
+simdb_num_t simdb_resident_count(simdb_resident_t *res);
+
+/**
+ * @brief Take shared lock on storage, records will not be moved or changed until unlock
+ * @param res Storage handle
+ */
+void simdb_resident_rdlock(simdb_resident_t *res);
+
+/**
+ * @brief Release lock taken with @ref simdb_resident_rdlock()
+ * @param res Storage handle
+ */
+void simdb_resident_unlock(simdb_resident_t *res);
+
+#endif /* HAS_RESIDENT_H */
@@ -12,10 +12,11 @@
 #include "../simdb.h"
 
 simdb_urec_t *
-simdb_record_create(const char * const path) {
+simdb_record_create(const char * const path, simdb_hrec_t *hires) {
   assert(path != NULL);
 
   (void)(path);
+  (void)(hires);
 
   return NULL;
 }
@@ -9,31 +9,89 @@
 
 #include "../common.h"
 #include "../bitmap.h"
+#include "../phash.h"
 #include "../record.h"
 #include "../simdb.h"
 
+#include <pthread.h>
 #include <wand/magick_wand.h>
 
+/**
+ * size hint for JPEG decoder: image scaled down in DCT domain (1/2, 1/4 or 1/8)
+ * while still not smaller than this side, so 160x160 sample taken from
+ * at least twice denser pixels. Zero disables hint.
+ */
+#ifndef MAGICK_HINT_SIDE
+#define MAGICK_HINT_SIDE 320
+#endif
+
+/** library initialized once per process, as sampler may be called from many threads */
+static pthread_once_t magick_once = PTHREAD_ONCE_INIT;
+
+static void
+magick_init(void) {
+  InitializeMagick("/");
+}
+
+#if MAGICK_HINT_SIDE > 0
+/** check file starts with JPEG SOI marker, only JPEG decoder supports size hint */
+static bool
+magick_is_jpeg(const char *path) {
+  unsigned char magic[3] = { 0, 0, 0 };
+  int fd = -1;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return false;
+
+  if (read(fd, magic, sizeof(magic)) != sizeof(magic))
+    magic[0] = 0x0;
+  close(fd);
+
+  return magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF;
+}
+#endif
+
 simdb_urec_t *
-simdb_record_create(const char * const path) {
-  MagickWand *wand = NULL;
+simdb_record_create(const char * const path, simdb_hrec_t *hires) {
+  MagickWand *wand = NULL, *color = NULL, *hr = NULL, *ph = NULL;
   MagickPassFail status = MagickPass;
   uint16_t w = 0, h = 0;
   size_t buf_size = 64 * sizeof(char);
-  unsigned char *buf = NULL;
+  size_t hr_size = 0;
+  unsigned char *buf = NULL, *hr_buf = NULL;
+  unsigned char rgb[3] = { 0, 0, 0 };
+  unsigned char luma[SIMDB_PHASH_SIDE * SIMDB_PHASH_SIDE];
   simdb_urec_t *rec = NULL;
 
   assert(path != NULL);
 
-  InitializeMagick("/");
+  pthread_once(&magick_once, magick_init);
   wand = NewMagickWand();
+
+#if MAGICK_HINT_SIDE > 0
+  /* reduced decode: real size from header only, then hint for decoder */
+  if (magick_is_jpeg(path)) {
+    status = MagickPingImage(wand, path);
+    if (status == MagickPass) {
+      w = MagickGetImageWidth(wand);
+      h = MagickGetImageHeight(wand);
+    }
+    /* failed ping not fatal: fresh wand without exception, full read without hint */
+    DestroyMagickWand(wand);
+    wand = NewMagickWand();
+    status = MagickPass;
+    if (w >= 2 * MAGICK_HINT_SIDE && h >= 2 * MAGICK_HINT_SIDE)
+      status = MagickSetSize(wand, MAGICK_HINT_SIDE, MAGICK_HINT_SIDE);
+  }
+#endif
+
   if (status == MagickPass)
     status = MagickReadImage(wand, path);
 
-  if (status == MagickPass)
+  if (status == MagickPass && w == 0)
     w = MagickGetImageWidth(wand);
 
-  if (status == MagickPass)
+  if (status == MagickPass && h == 0)
     h = MagickGetImageHeight(wand);
 
   /* 2 -> 160 : width, "cols" */
@@ -41,7 +99,18 @@ simdb_record_create(const char * const path) {
   if (status == MagickPass)
     status = MagickSampleImage(wand, 160, 160);
 
-  /** TODO: color maps */
+  /* overall color levels: scale copy of sample to single pixel, its value is average color */
+  if (status == MagickPass)
+    status = ((color = CloneMagickWand(wand)) != NULL) ? MagickPass : MagickFail;
+
+  if (status == MagickPass)
+    status = MagickScaleImage(color, 1, 1);
+
+  if (status == MagickPass)
+    status = MagickGetImagePixels(color, 0, 0, 1, 1, "RGB", CharPixel, rgb);
+
+  if (color != NULL)
+    DestroyMagickWand(color);
 
   /* 2 -> 256 : number of colors */
   /* 4 ->   0 : treedepth     -> auto */
@@ -50,6 +119,19 @@ simdb_record_create(const char * const path) {
   if (status == MagickPass)
     status = MagickQuantizeImage(wand, 256, GRAYColorspace, 0, 0, 0);
 
+  /* perceptual hash: copy of grayscale sample, without blur and thresholding */
+  if (status == MagickPass)
+    status = ((ph = CloneMagickWand(wand)) != NULL) ? MagickPass : MagickFail;
+
+  if (status == MagickPass)
+    status = MagickScaleImage(ph, SIMDB_PHASH_SIDE, SIMDB_PHASH_SIDE);
+
+  if (status == MagickPass)
+    status = MagickGetImagePixels(ph, 0, 0, SIMDB_PHASH_SIDE, SIMDB_PHASH_SIDE, "I", CharPixel, luma);
+
+  if (ph != NULL)
+    DestroyMagickWand(ph);
+
   /* 2 -> 3 : radius, in pixels */
   /* 3 -> 2 : "for reasonable results, radius should be larger than sigma" */
   if (status == MagickPass)
@@ -61,6 +143,23 @@ simdb_record_create(const char * const path) {
   if (status == MagickPass)
     status = MagickEqualizeImage(wand);
 
+  /* high-resolution bitmap: same steps as below on copy of prepared sample */
+  if (status == MagickPass && hires != NULL) {
+    status = ((hr = CloneMagickWand(wand)) != NULL) ? MagickPass : MagickFail;
+    if (status == MagickPass)
+      status = MagickSampleImage(hr, SIMDB_BITMAP_HR_SIDE, SIMDB_BITMAP_HR_SIDE);
+    if (status == MagickPass)
+      status = MagickThresholdImage(hr, 50.0 * (MaxRGB / 100));
+    if (status == MagickPass)
+      status = MagickSetImageType(hr, BilevelType);
+    if (status == MagickPass)
+      status = MagickSetImageFormat(hr, "MONO");
+    if (status == MagickPass)
+      status = ((hr_buf = MagickWriteImageBlob(hr, &hr_size)) != NULL) ? MagickPass : MagickFail;
+    if (hr != NULL)
+      DestroyMagickWand(hr);
+  }
+
   /* 2 -> 16 : width, "cols" */
   /* 3 -> 16 : width, "rows" */
   if (status == MagickPass)
@@ -95,8 +194,18 @@ simdb_record_create(const char * const path) {
       rec->used = 0xFF;
       rec->image_w = w;
       rec->image_h = h;
+      rec->clevel_r = rgb[0];
+      rec->clevel_g = rgb[1];
+      rec->clevel_b = rgb[2];
+      rec->phash = simdb_phash(luma);
       memcpy(rec->bitmap, buf, SIMDB_BITMAP_SIZE);
     }
+    if (hires != NULL) {
+      assert(hr_size == SIMDB_BITMAP_HR_SIZE);
+      memset(hires, 0x0, sizeof(simdb_hrec_t));
+      hires->used = 0xFF;
+      memcpy(hires->bitmap, hr_buf, SIMDB_BITMAP_HR_SIZE);
+    }
 #ifdef DEBUG
   } else {
     ExceptionType severity = 0;
@@ -105,8 +214,11 @@ simdb_record_create(const char * const path) {
 #endif
   }
 
+  if (buf != NULL)
+    MagickRelinquishMemory(buf);
+  if (hr_buf != NULL)
+    MagickRelinquishMemory(hr_buf);
   DestroyMagickWand(wand);
-  DestroyMagick();
 
   return rec;
 }
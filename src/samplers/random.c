@@ -8,11 +8,12 @@
  */
 
 #include "../common.h"
+#include "../phash.h"
 #include "../record.h"
 #include "../simdb.h"
 
 simdb_urec_t *
-simdb_record_create(const char * const path) {
+simdb_record_create(const char * const path, simdb_hrec_t *hires) {
   simdb_urec_t *tmp;
   uint8_t pattern;
   uint16_t size;
@@ -31,6 +32,10 @@ simdb_record_create(const char * const path) {
   tmp->image_w = size;
   tmp->image_h = size * ratio;
 
+  tmp->clevel_r = rand() % 256;
+  tmp->clevel_g = rand() % 256;
+  tmp->clevel_b = rand() % 256;
+
   pattern = rand() % 256;
   for (size_t i =  0; i < 16; i += 2)
     tmp->bitmap[i + 0] =  pattern,
@@ -41,5 +46,29 @@ simdb_record_create(const char * const path) {
     tmp->bitmap[i + 0] =  pattern,
     tmp->bitmap[i + 1] = ~pattern;
 
+  /* hash of upscaled bitmap, so similar bitmaps have similar hashes */
+  unsigned char luma[SIMDB_PHASH_SIDE * SIMDB_PHASH_SIDE];
+  uint16_t bits[SIMDB_BITMAP_SIDE];
+  memcpy(bits, tmp->bitmap, sizeof(bits)); /* record is packed, bitmap may be unaligned */
+  for (size_t y = 0; y < SIMDB_PHASH_SIDE; y++) {
+    for (size_t x = 0; x < SIMDB_PHASH_SIDE; x++)
+      luma[y * SIMDB_PHASH_SIDE + x] = (bits[y / 2] & (1 << (x / 2))) ? 0xFF : 0x00;
+  }
+  tmp->phash = simdb_phash(luma);
+
+  if (hires) {
+    /* upscaled low-resolution bitmap: each bit becomes 2x2 square */
+    uint32_t wide = 0;
+    memset(hires, 0x0, sizeof(simdb_hrec_t));
+    hires->used = 0xFF;
+    for (size_t y = 0; y < SIMDB_BITMAP_SIDE; y++) {
+      wide = 0;
+      for (size_t x = 0; x < SIMDB_BITMAP_SIDE; x++)
+        wide |= (bits[y] & (1 << x)) ? (0x3u << (x * 2)) : 0;
+      memcpy(&hires->bitmap[(y * 2 + 0) * 4], &wide, 4);
+      memcpy(&hires->bitmap[(y * 2 + 1) * 4], &wide, 4);
+    }
+  }
+
   return tmp;
 }
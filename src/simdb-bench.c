@@ -0,0 +1,387 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/**
+ * @file
+ * @brief Benchmark suite for library, works on synthetic databases
+ *
+ * Results are printed to stdout, one json object per line
+ */
+
+#include "common.h"
+#include "bitmap.h"
+#include "record.h"
+#include "io.h"
+#include "simdb.h"
+
+#include <getopt.h>
+
+/** records per single write while generating database */
+#define BENCH_BATCH 4096
+
+typedef enum { gen_random = 0, gen_cluster, gen_sampler } bench_gen_t;
+
+/** benchmark settings */
+typedef struct bench_t {
+  const char *path;   /**< database path */
+  const char *image;  /**< sample image for sampler mode */
+  bench_gen_t gen;    /**< records generator */
+  int records;        /**< database size */
+  int clusters;       /**< clusters count for 'cluster' generator */
+  int flips;          /**< max flipped bits in cluster members */
+  int queries;        /**< searches count */
+  int compares;       /**< bitmap compares count */
+  float maxdiff;      /**< search threshold */
+  bool warm;          /**< run warm cache pass */
+  bool cold;          /**< run cold cache pass */
+  bool keep;          /**< don't remove database after benchmark */
+} bench_t;
+
+void usage(int exitcode) {
+  fprintf(stderr,
+"Usage: simdb-bench <opts>\n"
+"  -b <path>   Path to database (default: simdb-bench.db)\n"
+"  -n <int>    Records in generated database (default: 100000)\n"
+"  -g <type>   Records generator: random, cluster or sampler (default: cluster)\n"
+"  -i <path>   Sample image for 'sampler' generator\n"
+"  -c <int>    Clusters count for 'cluster' generator (default: records / 10)\n"
+"  -f <int>    Max flipped bits in cluster members (default: 8)\n"
+"  -q <int>    Searches to run in each pass (default: 100)\n"
+"  -x <int>    Bitmap compares to run (default: 10000000)\n"
+"  -t <int>    Maximum difference pct (0 - 50, default: 10%%)\n"
+"  -m <mode>   Page cache mode: warm, cold or both (default: both)\n"
+"  -k          Keep generated database\n"
+);
+  exit(exitcode);
+}
+
+static double
+now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static void
+random_bitmap(unsigned char *bitmap) {
+  for (size_t i = 0; i < SIMDB_BITMAP_SIZE; i++)
+    bitmap[i] = rand() % 256;
+}
+
+static void
+random_record(simdb_urec_t *rec) {
+  memset(rec, 0x0, sizeof(simdb_urec_t));
+  rec->used = 0xFF;
+  rec->image_w  = 200 + rand() % 2000;
+  rec->image_h  = 200 + rand() % 2000;
+  rec->clevel_r = rand() % 256;
+  rec->clevel_g = rand() % 256;
+  rec->clevel_b = rand() % 256;
+  random_bitmap(rec->bitmap);
+}
+
+/** fill record with random data, or make it a copy of cluster center with some noise */
+static void
+bench_record(const bench_t *b, simdb_urec_t *rec, const simdb_urec_t *centers, int num) {
+  int flips = 0, bit = 0;
+
+  if (b->gen != gen_cluster) {
+    random_record(rec);
+    return;
+  }
+
+  memcpy(rec, &centers[(num - 1) % b->clusters], sizeof(simdb_urec_t));
+  flips = (b->flips > 0) ? rand() % (b->flips + 1) : 0;
+  for (int i = 0; i < flips; i++) {
+    bit = rand() % SIMDB_BITMAP_BITS;
+    rec->bitmap[bit / 8] ^= 1 << (bit % 8);
+  }
+}
+
+static void
+report(const char *bench, const char *mode, const char *fmt, ...) {
+  va_list ap;
+
+  printf("{\"bench\": \"%s\", \"cache\": \"%s\", ", bench, mode);
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf("}\n");
+  fflush(stdout);
+}
+
+/** read whole database file to page cache */
+static void
+fill_cache(const char *path) {
+  char buf[1024 * 1024];
+  int fd = -1;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return;
+  while (read(fd, buf, sizeof(buf)) > 0);
+  close(fd);
+}
+
+/** drop database file pages from page cache */
+static void
+drop_cache(const char *path) {
+  int fd = -1;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static int
+bench_compare(const bench_t *b) {
+  const int maps = 1024;
+  unsigned char *bitmaps = NULL;
+  volatile unsigned long sum = 0;
+  double start, elapsed;
+
+  if ((bitmaps = calloc(maps, SIMDB_BITMAP_SIZE)) == NULL)
+    return 1;
+  for (int i = 0; i < maps; i++)
+    random_bitmap(bitmaps + i * SIMDB_BITMAP_SIZE);
+
+  start = now();
+  for (int i = 0; i < b->compares; i++) {
+    sum += simdb_bitmap_compare(bitmaps + (i % maps) * SIMDB_BITMAP_SIZE,
+                                bitmaps + ((i / maps + i) % maps) * SIMDB_BITMAP_SIZE);
+  }
+  elapsed = now() - start;
+
+  report("compare", "none", "\"ops\": %d, \"ns_per_op\": %.3f",
+    b->compares, elapsed * 1e9 / b->compares);
+
+  free(bitmaps);
+  return 0;
+}
+
+static int
+bench_ingest(const bench_t *b) {
+  simdb_urec_t *batch = NULL, *centers = NULL;
+  simdb_t *db = NULL;
+  double start, elapsed;
+  int ret = 0, count = 0;
+
+  unlink(b->path);
+  if (!simdb_create(b->path)) {
+    fprintf(stderr, "database init: %s\n", strerror(errno));
+    return 1;
+  }
+
+  if ((db = simdb_open(b->path, SIMDB_FLAG_WRITE|SIMDB_FLAG_LOCKNB, &ret)) == NULL) {
+    fprintf(stderr, "database open: %s\n", simdb_error(ret));
+    return 1;
+  }
+
+  if ((batch = calloc(BENCH_BATCH, sizeof(simdb_urec_t))) == NULL)
+    return 1;
+
+  if (b->gen == gen_cluster) {
+    if ((centers = calloc(b->clusters, sizeof(simdb_urec_t))) == NULL)
+      return 1;
+    for (int i = 0; i < b->clusters; i++)
+      random_record(&centers[i]);
+  }
+
+  start = now();
+  for (int num = 1; num <= b->records; num += count) {
+    count = (b->records - num + 1 > BENCH_BATCH) ? BENCH_BATCH : b->records - num + 1;
+    if (b->gen == gen_sampler) {
+      for (int i = 0; i < count; i++) {
+        if ((ret = simdb_record_add(db, num + i, b->image, 0)) < 0)
+          break;
+      }
+    } else {
+      for (int i = 0; i < count; i++)
+        bench_record(b, &batch[i], centers, num + i);
+      ret = simdb_write(db, num, count, batch);
+    }
+    if (ret < 0) {
+      fprintf(stderr, "database write: %s\n", simdb_error(ret));
+      break;
+    }
+  }
+  elapsed = now() - start;
+
+  if (ret >= 0) {
+    report("ingest", "none", "\"records\": %d, \"generator\": \"%s\", \"records_per_s\": %.1f",
+      b->records, b->gen == gen_sampler ? "sampler" : b->gen == gen_cluster ? "cluster" : "random",
+      b->records / elapsed);
+  }
+
+  free(centers);
+  free(batch);
+  simdb_close(db);
+
+  return (ret < 0) ? 1 : 0;
+}
+
+static int
+bench_scan(const bench_t *b, const char *mode) {
+  simdb_search_stats_t stats;
+  simdb_search_t search;
+  simdb_t *db = NULL;
+  double *lat = NULL, start, total = 0.0;
+  unsigned long scanned = 0, found = 0, expected = 0, hits = 0;
+  bool cold = (strcmp(mode, "cold") == 0);
+  int ret = 0, num = 0;
+
+  if ((db = simdb_open(b->path, 0, &ret)) == NULL) {
+    fprintf(stderr, "database open: %s\n", simdb_error(ret));
+    return 1;
+  }
+
+  if ((lat = calloc(b->queries, sizeof(double))) == NULL)
+    return 1;
+
+  /* usage map */
+  char *map = NULL;
+  if (cold)
+    drop_cache(b->path);
+  else
+    fill_cache(b->path);
+  start = now();
+  ret = simdb_usage_map(db, &map);
+  report("usage_map", mode, "\"records\": %d, \"ms\": %.3f", ret, (now() - start) * 1e3);
+  free(map);
+
+  /* search */
+  simdb_search_init(&search);
+  search.d_bitmap = b->maxdiff;
+  search.stats = &stats;
+  for (int i = 0; i < b->queries; i++) {
+    num = 1 + rand() % b->records;
+    if (cold)
+      drop_cache(b->path);
+    start = now();
+    ret = simdb_search_byid(db, &search, num);
+    lat[i] = now() - start;
+    if (ret < 0) {
+      fprintf(stderr, "search: %s\n", simdb_error(ret));
+      break;
+    }
+    total   += lat[i];
+    scanned += stats.scanned;
+    found   += ret;
+    if (b->gen == gen_cluster) {
+      /* all other members of cluster are known near-duplicates */
+      int members = b->records / b->clusters + ((num - 1) % b->clusters < b->records % b->clusters);
+      expected += members - 1;
+      for (int j = 0; j < search.found; j++)
+        hits += ((search.matches[j].num - 1) % b->clusters == (num - 1) % b->clusters);
+    }
+  }
+  simdb_search_free(&search);
+
+  if (ret >= 0) {
+    qsort(lat, b->queries, sizeof(double), cmp_double);
+    report("scan", mode, "\"records_per_s\": %.1f", scanned / total);
+    report("search", mode,
+      "\"queries\": %d, \"found_avg\": %.2f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f",
+      b->queries, (double) found / b->queries,
+      lat[b->queries * 50 / 100] * 1e3,
+      lat[b->queries * 90 / 100] * 1e3,
+      lat[b->queries * 99 / 100] * 1e3,
+      lat[b->queries - 1] * 1e3);
+    if (b->gen == gen_cluster && expected > 0)
+      report("recall", mode, "\"expected\": %lu, \"found\": %lu, \"recall\": %.4f",
+        expected, hits, (double) hits / expected);
+  }
+
+  free(lat);
+  simdb_close(db);
+
+  return (ret < 0) ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+  bench_t b;
+  char opt = '\0';
+  int ret = 0;
+
+  memset(&b, 0x0, sizeof(bench_t));
+  b.path     = "simdb-bench.db";
+  b.gen      = gen_cluster;
+  b.records  = 100000;
+  b.flips    = 8;
+  b.queries  = 100;
+  b.compares = 10000000;
+  b.maxdiff  = 0.10;
+  b.warm = b.cold = true;
+
+  while ((opt = getopt(argc, argv, "b:n:g:i:c:f:q:x:t:m:kh")) != -1) {
+    switch (opt) {
+      case 'b' : b.path     = optarg;       break;
+      case 'n' : b.records  = atoi(optarg); break;
+      case 'i' : b.image    = optarg;       break;
+      case 'c' : b.clusters = atoi(optarg); break;
+      case 'f' : b.flips    = atoi(optarg); break;
+      case 'q' : b.queries  = atoi(optarg); break;
+      case 'x' : b.compares = atoi(optarg); break;
+      case 'k' : b.keep     = true;         break;
+      case 'g' :
+        if      (strcmp(optarg, "random")  == 0) b.gen = gen_random;
+        else if (strcmp(optarg, "cluster") == 0) b.gen = gen_cluster;
+        else if (strcmp(optarg, "sampler") == 0) b.gen = gen_sampler;
+        else usage(EXIT_FAILURE);
+        break;
+      case 't' :
+        b.maxdiff = atoi(optarg);
+        if (b.maxdiff > 50 || b.maxdiff < 0)
+          usage(EXIT_FAILURE);
+        b.maxdiff /= 100;
+        break;
+      case 'm' :
+        b.warm = (strcmp(optarg, "warm") == 0 || strcmp(optarg, "both") == 0);
+        b.cold = (strcmp(optarg, "cold") == 0 || strcmp(optarg, "both") == 0);
+        if (!b.warm && !b.cold)
+          usage(EXIT_FAILURE);
+        break;
+      case 'h' :
+        usage(EXIT_SUCCESS);
+        break;
+      default :
+        usage(EXIT_FAILURE);
+        break;
+    }
+  }
+
+  if (b.records < 1 || b.queries < 1 || b.compares < 1)
+    usage(EXIT_FAILURE);
+  if (b.gen == gen_sampler && b.image == NULL)
+    usage(EXIT_FAILURE);
+  if (b.clusters <= 0)
+    b.clusters = (b.records >= 10) ? b.records / 10 : 1;
+
+  srand(1); /* reproducible databases and queries */
+
+  ret |= bench_compare(&b);
+  ret |= bench_ingest(&b);
+  if (ret == 0 && b.warm)
+    ret |= bench_scan(&b, "warm");
+  if (ret == 0 && b.cold)
+    ret |= bench_scan(&b, "cold");
+
+  if (!b.keep)
+    unlink(b.path);
+
+  return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,439 @@
+/* Copyright 2014-2017 Alex 'AdUser' Z (ad_user@runbox.com)
+ *
+ * This file is part of libsimdb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/**
+ * @file
+ * @brief Resident query daemon, serves requests over unix socket
+ *
+ * Main thread accepts connections and waits for requests on idle ones.
+ * Connection with pending request is passed to worker pool, worker serves
+ * single request and returns connection back to main thread.
+ * Database replaced by vacuum of other process is reopened by worker
+ * which sees it first, others wait for it.
+ * See proto.h for protocol description.
+ */
+
+#include "common.h"
+#include "simdb.h"
+#include "proto.h"
+
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define MAX_DATABASES 256
+#define MAX_CLIENTS   1024
+
+/** queue of connections with pending requests */
+typedef struct queue_t {
+  int fds[MAX_CLIENTS];
+  int head, count;
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+} queue_t;
+
+static const char *paths[MAX_DATABASES];
+static simdb_t *databases[MAX_DATABASES];
+static pthread_rwlock_t databases_locks[MAX_DATABASES]; /**< exclusive only while reopening */
+static int databases_count = 0;
+static int mode = 0, cache = 0, memory = 0;
+static bool writable = false;
+static int clients = 0; /**< open connections: idle, queued and in service, at most MAX_CLIENTS */
+static queue_t queue;
+static int wakeup[2] = { -1, -1 }; /**< workers return served connections here */
+static volatile sig_atomic_t stop = 0;
+
+void usage(int exitcode) {
+  fprintf(stderr,
+"Usage: simdb-server <opts>\n"
+"  -s <path>   Path to listening socket\n"
+"  -b <path>   Path to database, may be repeated (numbered from 0)\n"
+"  -w <int>    Worker threads (default: 4)\n"
+"  -c <int>    Search cache size per database, in megabytes (default: 0 - disabled)\n"
+"  -W          Open databases for writing (allows add and del requests)\n"
+"  -m <opts>   Placement of in-memory records, comma-separated:\n"
+"              'huge' - huge pages, 'interleave' - spread over NUMA nodes\n"
+);
+  exit(exitcode);
+}
+
+static void
+on_signal(int sig) {
+  (void)(sig);
+  stop = 1;
+}
+
+/** close client connection, see @ref clients */
+static void
+client_close(int fd) {
+  close(fd);
+  __atomic_sub_fetch(&clients, 1, __ATOMIC_RELEASE);
+}
+
+static void
+queue_push(int fd) {
+  pthread_mutex_lock(&queue.mutex);
+  assert(queue.count < MAX_CLIENTS); /* queued connections counted in clients */
+  queue.fds[(queue.head + queue.count) % MAX_CLIENTS] = fd;
+  queue.count++;
+  pthread_cond_signal(&queue.cond);
+  pthread_mutex_unlock(&queue.mutex);
+}
+
+/** @returns connection with pending request, or -1 on shutdown */
+static int
+queue_pop(void) {
+  int fd = -1;
+
+  pthread_mutex_lock(&queue.mutex);
+  while (queue.count == 0 && !stop)
+    pthread_cond_wait(&queue.cond, &queue.mutex);
+  if (queue.count > 0) {
+    fd = queue.fds[queue.head];
+    queue.head = (queue.head + 1) % MAX_CLIENTS;
+    queue.count--;
+  }
+  pthread_mutex_unlock(&queue.mutex);
+
+  return fd;
+}
+
+/**
+ * @brief Open database and set it up
+ * @param i Database index
+ * @returns Database handle or NULL on error, reported to stderr
+ */
+static simdb_t *
+database_open(int i) {
+  simdb_t *db = NULL;
+  int ret = 0;
+
+  if ((db = simdb_open(paths[i], mode, &ret)) == NULL) {
+    fprintf(stderr, "database open: %s: %s\n", paths[i], simdb_error(ret));
+    return NULL;
+  }
+  /* keep existing index files current */
+  if (writable && (ret = simdb_indexes_setup(db)) < 0) {
+    fprintf(stderr, "indexes: %s: %s\n", paths[i], simdb_error(ret));
+    simdb_close(db);
+    return NULL;
+  }
+  if (cache > 0 && (ret = simdb_cache_setup(db, (size_t) cache * 1024 * 1024)) < 0) {
+    fprintf(stderr, "search cache: %s: %s\n", paths[i], simdb_error(ret));
+    simdb_close(db);
+    return NULL;
+  }
+  if (memory && (ret = simdb_memory_setup(db, memory)) < 0) {
+    fprintf(stderr, "memory setup: %s: %s\n", paths[i], simdb_error(ret));
+    simdb_close(db);
+    return NULL;
+  }
+  if (memory && ret != memory)
+    fprintf(stderr, "memory setup: %s: some options not supported by system, ignored\n", paths[i]);
+
+  return db;
+}
+
+/**
+ * @brief Replace handle of database replaced by vacuum of other process
+ * @param i   Database index
+ * @param old Handle which returned @ref SIMDB_ERR_STALE
+ * @returns true if database may be used again
+ */
+static bool
+database_reopen(int i, simdb_t *old) {
+  simdb_t *db = NULL;
+  bool ok = true;
+
+  pthread_rwlock_wrlock(&databases_locks[i]);
+  if (databases[i] == old) { /* not reopened by other worker yet */
+    if ((ok = (db = database_open(i)) != NULL)) {
+      simdb_close(old);
+      databases[i] = db;
+    }
+  }
+  pthread_rwlock_unlock(&databases_locks[i]);
+
+  return ok;
+}
+
+/** run request on database, nothing written on error */
+static simdb_num_t
+execute(simdb_t *db, const simdb_proto_req_t *req, simdb_search_t *search, const char *path, char **map) {
+  switch (req->op) {
+    case SIMDB_OP_SEARCH_ID :
+      return simdb_search_byid(db, search, req->num);
+    case SIMDB_OP_SEARCH_FILE :
+      return (req->len > 0) ? simdb_search_file(db, search, path) : SIMDB_ERR_USAGE;
+    case SIMDB_OP_ADD :
+      return (req->len > 0) ? simdb_record_add(db, req->num, path, 0) : SIMDB_ERR_USAGE;
+    case SIMDB_OP_DEL :
+      return simdb_record_del(db, req->num);
+    case SIMDB_OP_USAGE :
+      return simdb_usage_map(db, map);
+    default :
+      break;
+  }
+
+  return SIMDB_ERR_USAGE;
+}
+
+/**
+ * @brief Serve single request
+ * @returns true if connection may be used for next request
+ */
+static bool
+serve(int fd) {
+  simdb_proto_req_t  req;
+  simdb_proto_resp_t resp;
+  simdb_search_t search;
+  char path[SIMDB_PROTO_MAXLEN + 1];
+  char *map = NULL;
+  const void *payload = NULL;
+  simdb_t *db = NULL;
+  bool ok = false;
+
+  if (!simdb_proto_read(fd, &req, sizeof(req)))
+    return false;
+  if (req.magic != SIMDB_PROTO_MAGIC || req.len > SIMDB_PROTO_MAXLEN)
+    return false; /* garbage, drop connection */
+  if (!simdb_proto_read(fd, path, req.len))
+    return false;
+  path[req.len] = '\0';
+
+  memset(&resp, 0x0, sizeof(resp));
+  resp.magic = SIMDB_PROTO_MAGIC;
+
+  simdb_search_init(&search);
+  search.limit    = req.limit;
+  search.d_bitmap = req.d_bitmap;
+  search.d_ratio  = req.d_ratio;
+  search.d_color  = req.d_color;
+
+  if (req.db >= databases_count) {
+    resp.status = SIMDB_ERR_USAGE;
+  } else {
+    /* retried once on new file, see simdb_vacuum() */
+    for (int tries = 0; tries < 2; tries++) {
+      pthread_rwlock_rdlock(&databases_locks[req.db]);
+      db = databases[req.db];
+      resp.status = execute(db, &req, &search, path, &map);
+      pthread_rwlock_unlock(&databases_locks[req.db]);
+      if (resp.status != SIMDB_ERR_STALE || !database_reopen(req.db, db))
+        break;
+    }
+    if (req.op == SIMDB_OP_USAGE && resp.status > 0) {
+      payload  = map;
+      resp.len = resp.status;
+    }
+  }
+
+  if ((req.op == SIMDB_OP_SEARCH_ID || req.op == SIMDB_OP_SEARCH_FILE) && search.found > 0) {
+    payload  = search.matches;
+    resp.len = search.found * sizeof(simdb_match_t);
+  }
+
+  ok = simdb_proto_write(fd, &resp, sizeof(resp));
+  if (ok && resp.len > 0)
+    ok = simdb_proto_write(fd, payload, resp.len);
+
+  simdb_search_free(&search);
+  free(map);
+
+  return ok;
+}
+
+static void *
+worker(void *arg) {
+  int fd = -1;
+
+  (void)(arg);
+
+  while ((fd = queue_pop()) >= 0) {
+    if (!serve(fd)) {
+      client_close(fd);
+      continue;
+    }
+    if (write(wakeup[1], &fd, sizeof(fd)) != sizeof(fd))
+      client_close(fd);
+  }
+
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_un addr;
+  struct pollfd fds[MAX_CLIENTS + 2];
+  struct sigaction sa;
+  struct timeval timeout = { 10, 0 };
+  pthread_t *workers = NULL;
+  const char *sock_path = NULL;
+  int nfds = 2, workers_count = 4;
+  int ret = 0, lsock = -1, fd = -1;
+  char opt = '\0';
+
+  mode = SIMDB_FLAG_THREADS | SIMDB_FLAG_RESIDENT | SIMDB_FLAG_REFRESH;
+
+  while ((opt = getopt(argc, argv, "s:b:w:c:m:W")) != -1) {
+    switch (opt) {
+      case 's' :
+        sock_path = optarg;
+        break;
+      case 'b' :
+        if (databases_count >= MAX_DATABASES) {
+          fprintf(stderr, "too many databases\n");
+          exit(EXIT_FAILURE);
+        }
+        paths[databases_count++] = optarg;
+        break;
+      case 'w' :
+        if ((workers_count = atoi(optarg)) < 1)
+          usage(EXIT_FAILURE);
+        break;
+      case 'c' :
+        cache = atoi(optarg);
+        break;
+      case 'W' :
+        writable = true;
+        break;
+      case 'm' :
+        for (char *o = strtok(optarg, ","); o != NULL; o = strtok(NULL, ",")) {
+          if (strcmp(o, "huge") == 0) {
+            memory |= SIMDB_MEMORY_HUGEPAGES;
+          } else if (strcmp(o, "interleave") == 0) {
+            memory |= SIMDB_MEMORY_INTERLEAVE;
+          } else {
+            usage(EXIT_FAILURE);
+          }
+        }
+        break;
+      default :
+        usage(EXIT_FAILURE);
+        break;
+    }
+  }
+
+  if (sock_path == NULL || databases_count == 0)
+    usage(EXIT_FAILURE);
+
+  if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (writable)
+    mode |= SIMDB_FLAG_WRITE | SIMDB_FLAG_LOCKRANGE;
+
+  for (int i = 0; i < databases_count; i++) {
+    if ((databases[i] = database_open(i)) == NULL)
+      exit(EXIT_FAILURE);
+    pthread_rwlock_init(&databases_locks[i], NULL);
+  }
+
+  memset(&sa, 0x0, sizeof(sa));
+  sa.sa_handler = on_signal; /* no SA_RESTART: interrupt poll() */
+  sigaction(SIGINT,  &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(&addr, 0x0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+  unlink(sock_path);
+
+  if ((lsock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      bind(lsock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(lsock, 64) < 0) {
+    fprintf(stderr, "socket: %s: %s\n", sock_path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (pipe(wakeup) < 0) {
+    fprintf(stderr, "pipe: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&queue, 0x0, sizeof(queue));
+  pthread_mutex_init(&queue.mutex, NULL);
+  pthread_cond_init(&queue.cond, NULL);
+
+  if ((workers = calloc(workers_count, sizeof(pthread_t))) == NULL)
+    exit(EXIT_FAILURE);
+  for (int i = 0; i < workers_count; i++) {
+    if (pthread_create(&workers[i], NULL, worker, NULL) != 0) {
+      fprintf(stderr, "can't start worker: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* fds[0] - listening socket, fds[1] - served connections, rest - idle connections */
+  fds[0].fd = lsock;     fds[0].events = POLLIN;
+  fds[1].fd = wakeup[0]; fds[1].events = POLLIN;
+
+  while (!stop) {
+    if ((ret = poll(fds, nfds, -1)) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "poll: %s\n", strerror(errno));
+      break;
+    }
+    /* idle connections with pending requests -> workers */
+    for (int i = 2; i < nfds; i++) {
+      if (fds[i].revents == 0)
+        continue;
+      if (fds[i].revents & POLLIN) {
+        queue_push(fds[i].fd);
+      } else {
+        client_close(fds[i].fd); /* hangup or error */
+      }
+      fds[i--] = fds[--nfds];
+    }
+    /* served connections -> idle, always fit: at most MAX_CLIENTS connections */
+    if (fds[1].revents & POLLIN && read(wakeup[0], &fd, sizeof(fd)) == sizeof(fd)) {
+      fds[nfds].fd = fd; fds[nfds].events = POLLIN; fds[nfds].revents = 0;
+      nfds++;
+    }
+    /* new connections -> idle */
+    if (fds[0].revents & POLLIN && (fd = accept(lsock, NULL, NULL)) >= 0) {
+      /* don't let stalled client block worker forever */
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      /* queued and served connections left fds[], but still counted */
+      if (__atomic_load_n(&clients, __ATOMIC_ACQUIRE) < MAX_CLIENTS) {
+        __atomic_add_fetch(&clients, 1, __ATOMIC_RELEASE);
+        fds[nfds].fd = fd; fds[nfds].events = POLLIN; fds[nfds].revents = 0;
+        nfds++;
+      } else {
+        close(fd);
+      }
+    }
+  }
+
+  pthread_mutex_lock(&queue.mutex);
+  stop = 1;
+  pthread_cond_broadcast(&queue.cond);
+  pthread_mutex_unlock(&queue.mutex);
+  for (int i = 0; i < workers_count; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+
+  close(lsock);
+  unlink(sock_path);
+  for (int i = 0; i < databases_count; i++) {
+    simdb_close(databases[i]);
+    pthread_rwlock_destroy(&databases_locks[i]);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -10,31 +10,70 @@
 
 #include "common.h"
 #include "simdb.h"
+#include "proto.h"
 
 #include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #define CHAR_USED '@'
 #define CHAR_FREE '-'
 
+/* LSH index parameters, see simdb_lsh_setup() */
+#define LSH_TABLES 32
+#define LSH_BITS   14
+
 void usage(int exitcode) {
   fprintf(stderr,
 "Usage: simdb-tool <opts>\n"
 "  -b <path>   Path to database\n"
+"  -c <path>   Send request to simdb-server listening on this socket, instead of -b\n"
+"  -d <int>    Database number on server (with -c, default: 0)\n"
 "  -t <int>    Maximum difference pct (0 - 50, default: 10%%)\n"
+"  -s          Print search statistics to stderr (with -N / -S)\n"
+"  -a          Approximate search with LSH index, much faster on large\n"
+"              databases, but may miss some matches (with -N / -S / -P),\n"
+"              index must be built with -K first\n"
 );
   fprintf(stderr,
 "  -A <num>,<path>  Add sample from 'path' as record 'num'\n"
 "  -B <num>    Show bitmap for this sample\n"
 "  -C <a>,<b>  Show difference percent for this samples\n"
 "  -D <num>    Delete record <num>\n"
+"  -E <fmt>    Export used records to stdout, <fmt> is 'bin' or 'hex'\n"
 "  -F <a>,<b>  Show difference bitmap for this samples\n"
+"  -G <num>    Show near-duplicates group of this sample, groups table\n"
+"              must be built with -R first, with same -t / -a\n"
 "  -I          Create database (init)\n"
+"  -K          Build LSH index for approximate search (-a), kept current\n"
+"              by writes afterwards\n"
+"  -H          With -I: also store 32x32 bitmaps for two-stage search\n"
+"  -p          With -I: prefilter searches by perceptual hash, faster,\n"
+"              but may miss some matches\n"
+"  -L <fmt>[,<shift>|,append]\n"
+"              Import records from stdin, optionally adding <shift> to their\n"
+"              numbers or appending them to end of database\n"
 "  -N <num>    Compare this sample to other images in database\n"
+"  -P          Batch mode: read commands from stdin, one per line, see below\n"
+"  -R          Build near-duplicate groups table for -G, linking records\n"
+"              within -t (with -a: found in LSH mode), kept current by\n"
+"              writes afterwards\n"
 "  -S <path>   Search for images similar to this image\n"
 "  -U <num>    Show db usage map, <num> entries per column\n"
 "              Special case - 0, output will be single line\n"
+"  -V <path>   Vacuum: rewrite database without unused records, save\n"
+"              old to new record numbers mapping to <path>\n"
 "  -W <a>,<b>  Show usage map starting from <a>, but no more\n"
 "              than <b> entries (limit)\n"
+);
+  fprintf(stderr,
+"Batch mode commands (fields separated by spaces):\n"
+"  add <num> <path>     del <num>     search <num>     search-file <path>\n"
+"  bitmap <num>         diff <a> <b>\n"
+"Each command produces single line on stdout, fields separated by tabs:\n"
+"  ok <result...>  or  error <message>\n"
+"Results: add/del - record number; search - count, then <num>:<d_bitmap>:<d_ratio>\n"
+"  for each match; bitmap - side, then rows of 0/1; diff - difference percent\n"
 );
   exit(exitcode);
 }
@@ -69,19 +108,50 @@ print_search_results(simdb_search_t *search) {
   assert(search != NULL);
 
   for (int i = 0; i < search->found; i++) {
-    printf("%d -- %.1f (bitmap), %.1f (ratio)\n",
+    printf("%" PRId64 " -- %.1f (bitmap), %.1f (ratio)\n",
       search->matches[i].num,
       search->matches[i].d_bitmap * 100,
       search->matches[i].d_ratio  * 100);
   }
 }
 
-int search_similar_file(simdb_t *db, float maxdiff, char *path) {
-  int ret = 0;
+static void
+print_search_stats(simdb_search_stats_t *stats) {
+  assert(stats != NULL);
+
+  if (stats->cached) {
+    fprintf(stderr, "results taken from cache\n");
+    return;
+  }
+  fprintf(stderr, "records scanned   : %lu\n", stats->scanned);
+  fprintf(stderr, "unused skipped    : %lu\n", stats->unused);
+  fprintf(stderr, "rejected by phash : %lu\n", stats->r_phash);
+  fprintf(stderr, "rejected by ratio : %lu\n", stats->r_ratio);
+  fprintf(stderr, "rejected by color : %lu\n", stats->r_color);
+  fprintf(stderr, "bitmap compares   : %lu\n", stats->compares);
+  fprintf(stderr, "32x32 compares    : %lu\n", stats->refines);
+  fprintf(stderr, "rejected by 32x32 : %lu\n", stats->r_refine);
+  fprintf(stderr, "bytes read        : %lu\n", stats->bytes);
+  fprintf(stderr, "blocks read       : %lu\n", stats->blocks);
+  if (stats->candidates)
+    fprintf(stderr, "LSH candidates    : %lu\n", stats->candidates);
+  if (stats->filtered)
+    fprintf(stderr, "not eligible      : %lu\n", stats->filtered);
+  fprintf(stderr, "i/o time          : %.6fs wall, %.6fs cpu\n", stats->io_wall,  stats->io_cpu);
+  fprintf(stderr, "compare time      : %.6fs wall, %.6fs cpu\n", stats->cmp_wall, stats->cmp_cpu);
+}
+
+int search_similar_file(simdb_t *db, float maxdiff, int mode, char *path, bool show_stats) {
+  simdb_search_stats_t stats;
   simdb_search_t search;
+  int ret = 0;
 
   simdb_search_init(&search);
+  memset(&stats, 0x0, sizeof(stats));
   search.d_bitmap = maxdiff;
+  search.mode     = mode;
+  if (show_stats)
+    search.stats = &stats;
 
   if ((ret = simdb_search_file(db, &search, path)) < 0) {
     fprintf(stderr, "%s\n", simdb_error(ret));
@@ -89,6 +159,8 @@ int search_similar_file(simdb_t *db, float maxdiff, char *path) {
   }
 
   print_search_results(&search);
+  if (show_stats)
+    print_search_stats(&stats);
 
   if (search.found > 0)
     FREE(search.matches);
@@ -96,12 +168,17 @@ int search_similar_file(simdb_t *db, float maxdiff, char *path) {
   return 0;
 }
 
-int search_similar_byid(simdb_t *db, float maxdiff, int num) {
-  int ret = 0;
+int search_similar_byid(simdb_t *db, float maxdiff, int mode, simdb_num_t num, bool show_stats) {
+  simdb_search_stats_t stats;
   simdb_search_t search;
+  int ret = 0;
 
   simdb_search_init(&search);
+  memset(&stats, 0x0, sizeof(stats));
   search.d_bitmap = maxdiff;
+  search.mode     = mode;
+  if (show_stats)
+    search.stats = &stats;
 
   if ((ret = simdb_search_byid(db, &search, num)) < 0) {
     fprintf(stderr, "%s\n", simdb_error(ret));
@@ -109,6 +186,8 @@ int search_similar_byid(simdb_t *db, float maxdiff, int num) {
   }
 
   print_search_results(&search);
+  if (show_stats)
+    print_search_stats(&stats);
 
   if (search.found > 0)
     FREE(search.matches);
@@ -116,27 +195,54 @@ int search_similar_byid(simdb_t *db, float maxdiff, int num) {
   return 0;
 }
 
-int db_usage_map(simdb_t *db, int cols) {
-  char *map = NULL;
-  char *m   = NULL;
-  char row[cols + 1];
-  int records, pos;
-  int rest = 0;
+/** set up groups table, then show group of @a num, if set */
+int show_group(simdb_t *db, float maxdiff, int mode, simdb_num_t num) {
+  simdb_search_t link;
+  simdb_num_t *nums = NULL, count = 0;
+  int ret = 0;
 
-  if ((records = simdb_usage_map(db, &map)) <= 0) {
-    fprintf(stderr, "database usage: can't get database map -- %s\n", simdb_error(records));
-    FREE(map);
+  simdb_search_init(&link);
+  link.d_bitmap = maxdiff;
+  link.mode     = mode;
+
+  if ((ret = simdb_cluster_setup(db, &link)) < 0) {
+    fprintf(stderr, "clusters: %s%s\n", simdb_error(ret),
+            ret == SIMDB_ERR_NOINDEX ? ", build it with -R" : "");
     return 1;
   }
 
-  for (uint16_t i = 0; i < records; i++)
+  if (num == 0)
+    return 0;
+
+  if ((count = simdb_cluster_get(db, num, &nums)) < 0) {
+    fprintf(stderr, "%s\n", simdb_error(count));
+    return 1;
+  }
+
+  for (simdb_num_t i = 0; i < count; i++)
+    printf("%" PRId64 "\n", nums[i]);
+  FREE(nums);
+
+  return 0;
+}
+
+static void
+print_usage_map(char *map, simdb_num_t records, int cols) {
+  char *m = NULL;
+  char row[cols + 1];
+  simdb_num_t pos;
+  int rest = 0;
+
+  assert(map != NULL);
+
+  for (simdb_num_t i = 0; i < records; i++)
     map[i] = map[i] ? CHAR_USED : CHAR_FREE;
 
   if (cols == 0) {
     putchar(CHAR_FREE); /* zero */
-    puts(map);
-    FREE(map);
-    return 0;
+    fwrite(map, 1, records, stdout);
+    putchar('\n');
+    return;
   }
 
   m = map;
@@ -145,23 +251,44 @@ int db_usage_map(simdb_t *db, int cols) {
     memcpy(row, m, rest);
     row[rest] = '\0';
     pos = m - map + 1;
-    printf("%7d : %s\n", pos, row);
+    printf("%7" PRId64 " : %s\n", pos, row);
     m       += rest;
     records -= rest;
   }
+}
+
+int db_usage_map(simdb_t *db, int cols) {
+  char *map = NULL;
+  simdb_num_t records;
+
+  if ((records = simdb_usage_map(db, &map)) <= 0) {
+    fprintf(stderr, "database usage: can't get database map -- %s\n", simdb_error(records));
+    FREE(map);
+    return 1;
+  }
+
+  print_usage_map(map, records, cols);
 
   FREE(map);
   return 0;
 }
 
-int db_usage_slice(simdb_t *db, int offset, uint16_t limit) {
+int db_usage_slice(simdb_t *db, simdb_num_t offset, simdb_num_t limit) {
   char *map = NULL;
+  simdb_num_t count = 0;
 
-  if ((limit = simdb_usage_slice(db, &map, offset, limit)) <= 0) {
-    fprintf(stderr, "database usage: can't get database slice -- %s\n", simdb_error(limit));
+  if (limit > INT_MAX) {
+    fprintf(stderr, "database usage: slice too large\n");
+    return 1;
+  }
+  if ((count = simdb_usage_slice(db, &map, offset, limit)) < 0) {
+    fprintf(stderr, "database usage: can't get database slice -- %s\n", simdb_error(count));
+    return 1;
+  } else if (count == 0) {
+    fprintf(stderr, "database usage: no records in this range\n");
     return 1;
   }
-  for (uint16_t i = 0; i < limit; i++)
+  for (simdb_num_t i = 0; i < count; i++)
     map[i] = map[i] ? CHAR_USED : CHAR_FREE;
   puts(map);
   FREE(map);
@@ -169,7 +296,7 @@ int db_usage_slice(simdb_t *db, int offset, uint16_t limit) {
   return 0;
 }
 
-int rec_bitmap(simdb_t *db, int num) {
+int rec_bitmap(simdb_t *db, simdb_num_t num) {
   char *bitmap;
   size_t side;
   int ret;
@@ -190,75 +317,335 @@ int rec_bitmap(simdb_t *db, int num) {
   return 0;
 }
 
-int rec_diff(simdb_t *db, int a, int b, bool show_map) {
-  char *map1 = NULL, *map2 = NULL, *dmap = NULL;
-  size_t size = 0, diff = 0;
+int rec_diff(simdb_t *db, simdb_num_t a, simdb_num_t b, bool show_map) {
+  unsigned char map1[SIMDB_BITMAP_SIZE], map2[SIMDB_BITMAP_SIZE];
+  char dmap[SIMDB_BITMAP_BITS];
+  simdb_num_t nums[2] = { a, b };
   int ret;
 
   assert(db != NULL);
 
-  do {
-    if ((ret = simdb_record_bitmap(db, a, &map1, &size)) < 0) {
+  for (int i = 0; i < 2; i++) {
+    if ((ret = simdb_record_bitmap_raw(db, nums[i], i ? map2 : map1)) <= 0) {
       if (ret < 0) {
-        fprintf(stderr, "can't get bitmap for record #%d: %s\n", a, simdb_error(ret));
+        fprintf(stderr, "can't get bitmap for record #%" PRId64 ": %s\n", nums[i], simdb_error(ret));
       } else {
-        fprintf(stderr, "record diff: record #%d not exists\n", a);
+        fprintf(stderr, "record diff: record #%" PRId64 " not exists\n", nums[i]);
       }
-      ret = 1;
-      break;
+      return 1;
     }
+  }
 
-    if ((ret = simdb_record_bitmap(db, b, &map2, &size)) <= 0) {
-      if (ret < 0) {
-        fprintf(stderr, "can't get bitmap for record #%d: %s\n", b, simdb_error(ret));
-      } else {
-        fprintf(stderr, "record diff: record #%d not exists\n", b);
-      }
-      ret = 1;
-      break;
-    }
+  if (show_map) {
+    simdb_bitmap_xor(map1, map2, map1);
+    simdb_bitmap_unpack_into(map1, dmap);
+    bitmap_print(dmap, SIMDB_BITMAP_SIDE);
+  } else {
+    printf("%.2f%%\n", ((float) simdb_bitmap_distance(map1, map2) / SIMDB_BITMAP_BITS) * 100);
+  }
 
-    if ((dmap = calloc(size, sizeof(char))) == NULL) {
-      ret = 1;
-      break;
+  return 0;
+}
+
+static int
+parse_format(const char *fmt) {
+  if (strncmp(fmt, "bin", 3) == 0 && (fmt[3] == '\0' || fmt[3] == ','))
+    return SIMDB_EXPORT_BINARY;
+  if (strncmp(fmt, "hex", 3) == 0 && (fmt[3] == '\0' || fmt[3] == ','))
+    return SIMDB_EXPORT_HEX;
+  fprintf(stderr, "unknown stream format: %s\n", fmt);
+  usage(EXIT_FAILURE);
+  return -1;
+}
+
+/**
+ * @brief Execute single batch command, print result line
+ * @returns false if command can't be parsed
+ */
+static bool
+batch_command(simdb_t *db, float maxdiff, int mode, char *line) {
+  simdb_search_t search;
+  char *cmd = NULL, *arg = NULL, *save = NULL;
+  char *map1 = NULL, *map2 = NULL;
+  unsigned char raw1[SIMDB_BITMAP_SIZE], raw2[SIMDB_BITMAP_SIZE];
+  size_t side = 0;
+  simdb_num_t a = 0, b = 0, ret = 0;
+
+  if ((cmd = strtok_r(line, " \t", &save)) == NULL)
+    return true; /* empty line */
+  arg = strtok_r(NULL, "", &save); /* rest of line, may contain spaces */
+  if (arg != NULL)
+    arg += strspn(arg, " \t");
+
+  simdb_search_init(&search);
+  search.d_bitmap = maxdiff;
+  search.mode     = mode;
+
+  if (strcmp(cmd, "add") == 0) {
+    if (arg == NULL || (a = strtoll(arg, &arg, 10)) <= 0 || *arg != ' ')
+      return false;
+    arg += strspn(arg, " \t");
+    ret = simdb_record_add(db, a, arg, 0);
+  } else if (strcmp(cmd, "del") == 0) {
+    if (arg == NULL || (a = atoll(arg)) <= 0)
+      return false;
+    ret = simdb_record_del(db, a);
+  } else if (strcmp(cmd, "search") == 0 || strcmp(cmd, "search-file") == 0) {
+    if (arg == NULL)
+      return false;
+    if (cmd[6] == '\0') {
+      if ((a = atoll(arg)) <= 0)
+        return false;
+      ret = simdb_search_byid(db, &search, a);
+    } else {
+      ret = simdb_search_file(db, &search, arg);
     }
-    char *m1 = map1, *m2 = map2, *dm = dmap;
-    for (size_t i = 0; i < size; i++, m1++, m2++, dm++) {
-      *dm = *m1 ^ *m2;
-      diff += *dm ? 0 : 1;
+  } else if (strcmp(cmd, "bitmap") == 0) {
+    if (arg == NULL || (a = atoll(arg)) <= 0)
+      return false;
+    if ((ret = simdb_record_bitmap(db, a, &map1, &side)) == 0)
+      ret = SIMDB_ERR_NXRECORD;
+  } else if (strcmp(cmd, "diff") == 0) {
+    if (arg == NULL || sscanf(arg, "%" SCNd64 " %" SCNd64, &a, &b) != 2 || a <= 0 || b <= 0)
+      return false;
+    if ((ret = simdb_record_bitmap_raw(db, a, raw1)) == 0 ||
+        (ret > 0 && (ret = simdb_record_bitmap_raw(db, b, raw2)) == 0))
+      ret = SIMDB_ERR_NXRECORD;
+  } else {
+    return false;
+  }
+
+  if (ret < 0) {
+    printf("error\t%s\n", simdb_error(ret));
+  } else if (strcmp(cmd, "bitmap") == 0) {
+    printf("ok\t%zu", side);
+    for (size_t i = 0; i < side * side; i++) {
+      if (i % side == 0)
+        putchar('\t');
+      putchar(map1[i] ? '1' : '0');
     }
-    if (show_map) {
-      bitmap_print(dmap, size);
-    } else {
-      printf("%.2f%%\n", ((float) diff / size) * 100);
+    putchar('\n');
+  } else if (strcmp(cmd, "diff") == 0) {
+    printf("ok\t%.2f\n", ((float) simdb_bitmap_distance(raw1, raw2) / SIMDB_BITMAP_BITS) * 100);
+  } else if (cmd[0] == 's') {
+    printf("ok\t%d", search.found);
+    for (int i = 0; i < search.found; i++) {
+      printf("\t%" PRId64 ":%.4f:%.4f", search.matches[i].num,
+        search.matches[i].d_bitmap, search.matches[i].d_ratio);
     }
-    ret = 0;
-  } while (0);
+    putchar('\n');
+  } else {
+    printf("ok\t%" PRId64 "\n", ret);
+  }
 
+  simdb_search_free(&search);
   free(map1);
   free(map2);
-  free(dmap);
+
+  return true;
+}
+
+/**
+ * @brief Read commands from stdin and execute them against single database handle
+ * @returns 0 if all commands succeeded, 1 otherwise
+ */
+int batch_main(simdb_t *db, float maxdiff, int mode) {
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len = 0;
+  int ret = 0;
+
+  /* results should be visible to the other end of pipe immediately */
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  while ((len = getline(&line, &size, stdin)) >= 0) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (!batch_command(db, maxdiff, mode, line)) {
+      printf("error\t%s\n", simdb_error(SIMDB_ERR_USAGE));
+      ret = 1;
+    }
+  }
+
+  free(line);
 
   return ret;
 }
 
+/**
+ * @brief Connect to simdb-server
+ * @returns connected socket or -1 on error
+ */
+static int
+client_connect(const char *path) {
+  struct sockaddr_un addr;
+  int sock = -1;
+
+  assert(path != NULL);
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long\n");
+    return -1;
+  }
+
+  memset(&addr, 0x0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "connect: %s: %s\n", path, strerror(errno));
+    if (sock >= 0)
+      close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+/**
+ * @brief Send request to simdb-server and wait for response
+ * @param payload Path to sample or NULL
+ * @param data Response payload will be stored here, caller should free() it
+ * @returns status of operation from server, or SIMDB_ERR_SYSTEM on connection error
+ */
+static simdb_num_t
+client_request(int sock, simdb_proto_req_t *req, const char *payload, void **data) {
+  simdb_proto_resp_t resp;
+  void *buf = NULL;
+
+  assert(req  != NULL);
+  assert(data != NULL);
+
+  req->magic = SIMDB_PROTO_MAGIC;
+  req->len   = payload ? strlen(payload) : 0;
+  if (req->len > SIMDB_PROTO_MAXLEN)
+    return SIMDB_ERR_USAGE;
+
+  if (!simdb_proto_write(sock, req, sizeof(simdb_proto_req_t)) ||
+      (req->len > 0 && !simdb_proto_write(sock, payload, req->len)) ||
+      !simdb_proto_read(sock, &resp, sizeof(resp)) ||
+      resp.magic != SIMDB_PROTO_MAGIC)
+    return SIMDB_ERR_SYSTEM;
+
+  if (resp.len > 0) {
+    if ((buf = calloc(resp.len + 1, 1)) == NULL)
+      return SIMDB_ERR_OOM;
+    if (!simdb_proto_read(sock, buf, resp.len)) {
+      FREE(buf);
+      return SIMDB_ERR_SYSTEM;
+    }
+  }
+
+  *data = buf;
+
+  return resp.status;
+}
+
+/** @brief Perform single request (add, del, search or usage) via simdb-server */
+int client_main(const char *path, int dbnum, char mode, simdb_num_t num, const char *sample,
+                float maxdiff, int cols) {
+  simdb_proto_req_t req;
+  simdb_search_t search;
+  char real[PATH_MAX];
+  void *data = NULL;
+  simdb_num_t ret = 0;
+  int sock = -1;
+
+  /* server has other working directory */
+  if (sample != NULL) {
+    if (realpath(sample, real) == NULL) {
+      fprintf(stderr, "%s: %s\n", sample, strerror(errno));
+      return 1;
+    }
+    sample = real;
+  }
+
+  if ((sock = client_connect(path)) < 0)
+    return 1;
+
+  memset(&req, 0x0, sizeof(req));
+  simdb_search_init(&search);
+  req.db       = dbnum;
+  req.num      = num;
+  req.limit    = search.limit;
+  req.d_bitmap = maxdiff;
+  req.d_ratio  = search.d_ratio;
+  req.d_color  = search.d_color;
+
+  switch (mode) {
+    case 'A' : req.op = SIMDB_OP_ADD;         break;
+    case 'D' : req.op = SIMDB_OP_DEL;         break;
+    case 'N' : req.op = SIMDB_OP_SEARCH_ID;   break;
+    case 'S' : req.op = SIMDB_OP_SEARCH_FILE; break;
+    case 'U' : req.op = SIMDB_OP_USAGE;       break;
+  }
+
+  if ((ret = client_request(sock, &req, sample, &data)) < 0) {
+    fprintf(stderr, "%s\n", simdb_error(ret));
+    close(sock);
+    return 1;
+  }
+
+  switch (req.op) {
+    case SIMDB_OP_ADD :
+      fprintf(stderr, "added as record #%" PRId64 "\n", ret);
+      break;
+    case SIMDB_OP_SEARCH_ID :
+    case SIMDB_OP_SEARCH_FILE :
+      search.found   = ret;
+      search.matches = data;
+      print_search_results(&search);
+      break;
+    case SIMDB_OP_USAGE :
+      if (data != NULL)
+        print_usage_map(data, ret, cols);
+      break;
+  }
+
+  FREE(data);
+  close(sock);
+
+  return 0;
+}
+
 int main(int argc, char **argv) {
   simdb_t *db = NULL;
   enum { undef = 0, add, del, init, search_byid, search_file,
-    bitmap, usage_map, usage_slice, diff } mode = undef;
-  char *db_path = NULL, *sample = NULL, *c = NULL, opt = '\0';
-  int cols = 64, a = 0, b = 0, ret = 0, db_flags = 0;
-  bool show_map = false, need_write = false;
+    bitmap, usage_map, usage_slice, diff, batch, export, import, vacuum, group, build_index, build_groups } mode = undef;
+  char *db_path = NULL, *sock_path = NULL, *sample = NULL, *map_path = NULL, *c = NULL, opt = '\0';
+  char client_op = '\0';
+  simdb_num_t a = 0, b = 0, num = 0;
+  int cols = 64, ret = 0, db_flags = 0, dbnum = 0;
+  int format = 0, import_flags = 0, search_mode = SIMDB_SEARCH_EXACT;
+  bool show_map = false, show_stats = false, need_write = false, hires = false, phash = false;
   float maxdiff = 0.10;
 
   if (argc < 3)
     usage(EXIT_FAILURE);
 
-  while ((opt = getopt(argc, argv, "b:t:A:B:C:D:F:IN:S:U:W:")) != -1) {
+  while ((opt = getopt(argc, argv, "ab:c:d:pst:A:B:C:D:E:F:G:HIKL:N:PRS:U:V:W:")) != -1) {
     switch (opt) {
+      case 'a' :
+        search_mode = SIMDB_SEARCH_LSH;
+        break;
       case 'b' :
         db_path = optarg;
         break;
+      case 'c' :
+        sock_path = optarg;
+        break;
+      case 'd' :
+        dbnum = atoi(optarg);
+        if (dbnum < 0 || dbnum > 255)
+          usage(EXIT_FAILURE);
+        break;
+      case 'p' :
+        phash = true;
+        break;
+      case 's' :
+        show_stats = true;
+        break;
       case 't' :
         maxdiff = atoi(optarg);
         if (maxdiff > 50 || maxdiff < 0) {
@@ -284,9 +671,36 @@ int main(int argc, char **argv) {
         need_write = true;
         a = atoll(optarg);
         break;
+      case 'E' :
+        mode = export;
+        format = parse_format(optarg);
+        break;
+      case 'G' :
+        mode = group;
+        a = atoll(optarg);
+        break;
+      case 'H' :
+        hires = true;
+        break;
       case 'I' :
         mode = init;
         break;
+      case 'K' :
+        mode = build_index;
+        need_write = true;
+        break;
+      case 'L' :
+        mode = import;
+        need_write = true;
+        format = parse_format(optarg);
+        if ((c = strchr(optarg, ',')) == NULL)
+          break;
+        if (strcmp(c + 1, "append") == 0) {
+          import_flags |= SIMDB_ADD_APPEND;
+        } else {
+          a = atoll(c + 1);
+        }
+        break;
       case 'F' :
         show_map = true;
       case 'C' :
@@ -300,6 +714,14 @@ int main(int argc, char **argv) {
         mode = search_byid;
         a = atoll(optarg);
         break;
+      case 'P' :
+        mode = batch;
+        need_write = true;
+        break;
+      case 'R' :
+        mode = build_groups;
+        need_write = true;
+        break;
       case 'S' :
         mode = search_file;
         sample = optarg;
@@ -312,6 +734,11 @@ int main(int argc, char **argv) {
           cols = 100;
         }
         break;
+      case 'V' :
+        mode = vacuum;
+        need_write = true;
+        map_path = optarg;
+        break;
       case 'W' :
         mode = usage_slice;
         if ((c = strchr(optarg, ',')) == NULL)
@@ -325,13 +752,36 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (sock_path != NULL) {
+    switch (mode) {
+      case add         : client_op = 'A'; break;
+      case del         : client_op = 'D'; break;
+      case search_byid : client_op = 'N'; break;
+      case search_file : client_op = 'S'; break;
+      case usage_map   : client_op = 'U'; break;
+      default :
+        fprintf(stderr, "only -A, -D, -N, -S and -U supported with -c\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((mode == add || mode == search_byid) && a <= 0) {
+      fprintf(stderr, "can't parse number\n");
+      usage(EXIT_FAILURE);
+    }
+    return client_main(sock_path, dbnum, client_op, a, sample, maxdiff, cols);
+  }
+
   if (db_path == NULL) {
     fprintf(stderr, "database path not set\n");
     exit(EXIT_FAILURE);
   }
 
   if (mode == init) {
-    if (!simdb_create(db_path)) {
+    int caps = SIMDB_CAP_BITMAP | SIMDB_CAP_COLORS | SIMDB_CAP_RATIO;
+    if (hires)
+      caps |= SIMDB_CAP_BITMAP32;
+    if (phash)
+      caps |= SIMDB_CAP_PHASH;
+    if (!simdb_create_ex(db_path, caps)) {
       fprintf(stderr, "database init: %s\n", strerror(errno));
       exit(EXIT_FAILURE);
     }
@@ -340,25 +790,44 @@ int main(int argc, char **argv) {
   if (need_write)
     db_flags = SIMDB_FLAG_WRITE|SIMDB_FLAG_LOCK;
 
-  if ((db = simdb_open(db_path, db_flags, &ret)) == NULL) {
+  if (mode == batch && (db = simdb_open(db_path, db_flags, &ret)) == NULL &&
+      ret == SIMDB_ERR_SYSTEM && (errno == EACCES || errno == EROFS)) {
+    /* read-only file, batch may contain searches only */
+    db_flags = 0;
+  }
+
+  if (db == NULL && (db = simdb_open(db_path, db_flags, &ret)) == NULL) {
     fprintf(stderr, "database open: %s\n", simdb_error(ret));
     exit(EXIT_FAILURE);
   }
 
+  /* writers keep existing index files current */
+  if (db_flags & SIMDB_FLAG_WRITE && (ret = simdb_indexes_setup(db)) < 0) {
+    fprintf(stderr, "indexes: %s\n", simdb_error(ret));
+    exit(EXIT_FAILURE);
+  }
+
+  if ((search_mode == SIMDB_SEARCH_LSH || mode == build_index) &&
+      (ret = simdb_lsh_setup(db, LSH_TABLES, LSH_BITS)) < 0) {
+    fprintf(stderr, "LSH index: %s%s\n", simdb_error(ret),
+            ret == SIMDB_ERR_NOINDEX ? ", build it with -K" : "");
+    exit(EXIT_FAILURE);
+  }
+
   switch (mode) {
     case add :
       if (a == 0 || sample == NULL)
         usage(EXIT_FAILURE);
-      if ((ret = simdb_record_add(db, a, sample, 0)) < 0) {
-        fprintf(stderr, "%s\n", simdb_error(ret));
+      if ((num = simdb_record_add(db, a, sample, 0)) < 0) {
+        fprintf(stderr, "%s\n", simdb_error(num));
         exit(EXIT_FAILURE);
       } else {
-        fprintf(stderr, "added as record #%d", ret);
+        fprintf(stderr, "added as record #%" PRId64 "\n", num);
       }
       break;
     case del :
-      if ((ret = simdb_record_del(db, a)) < 0) {
-        fprintf(stderr, "%s\n", simdb_error(ret));
+      if ((num = simdb_record_del(db, a)) < 0) {
+        fprintf(stderr, "%s\n", simdb_error(num));
         exit(EXIT_FAILURE);
       }
       break;
@@ -370,10 +839,10 @@ int main(int argc, char **argv) {
         fprintf(stderr, "can't parse number\n");
         usage(EXIT_FAILURE);
       }
-      ret = search_similar_byid(db, maxdiff, a);
+      ret = search_similar_byid(db, maxdiff, search_mode, a, show_stats);
       break;
     case search_file :
-      ret = search_similar_file(db, maxdiff, sample);
+      ret = search_similar_file(db, maxdiff, search_mode, sample, show_stats);
       break;
     case bitmap :
       if (a <= 0) {
@@ -388,6 +857,47 @@ int main(int argc, char **argv) {
     case usage_slice :
       ret = db_usage_slice(db, a, b);
       break;
+    case batch :
+      ret = batch_main(db, maxdiff, search_mode);
+      break;
+    case export :
+      if ((num = simdb_export(db, STDOUT_FILENO, format, 1, 0)) < 0) {
+        fprintf(stderr, "export: %s\n", simdb_error(num));
+        exit(EXIT_FAILURE);
+      }
+      fprintf(stderr, "exported %" PRId64 " records\n", num);
+      ret = 0;
+      break;
+    case import :
+      if ((num = simdb_import(db, STDIN_FILENO, format, a, import_flags)) < 0) {
+        fprintf(stderr, "import: %s\n", simdb_error(num));
+        exit(EXIT_FAILURE);
+      }
+      fprintf(stderr, "imported %" PRId64 " records\n", num);
+      ret = 0;
+      break;
+    case group :
+      if (a <= 0) {
+        fprintf(stderr, "can't parse number\n");
+        usage(EXIT_FAILURE);
+      }
+      ret = show_group(db, maxdiff, search_mode, a);
+      break;
+    case build_groups :
+      ret = show_group(db, maxdiff, search_mode, 0);
+      break;
+    case build_index :
+      /* built and stored by setup above */
+      fprintf(stderr, "LSH index: %d tables of %d bits\n", LSH_TABLES, LSH_BITS);
+      break;
+    case vacuum :
+      if ((num = simdb_vacuum(db, map_path, 0)) < 0) {
+        fprintf(stderr, "vacuum: %s\n", simdb_error(num));
+        exit(EXIT_FAILURE);
+      }
+      fprintf(stderr, "vacuum: %" PRId64 " records left\n", num);
+      ret = 0;
+      break;
     case diff :
       if (a <= 0 || b <= 0) {
         fprintf(stderr, "both numbers must be set\n");
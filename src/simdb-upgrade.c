@@ -8,8 +8,26 @@
  * (at your option) any later version.
  */
 
+/**
+ * @file
+ * @brief Database format migration tool
+ *
+ * Source version detected by header, then chain of migration steps
+ * applied to each chunk of records. Chunks converted in parallel and
+ * written to temporary file next to destination. Progress of each chunk
+ * recorded in '.progress' file, so interrupted run resumes from where
+ * it stopped. After all chunks converted and verified, temporary file
+ * atomically renamed to destination (which may be the source itself).
+ */
+
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,92 +36,447 @@
 #include <unistd.h>
 
 #define SIMDB_REC_LEN 48
-#define BLK_SIZE 1000
+#define SIMDB_VERSION 2   /**< latest known version */
+#define ALIGN       4096  /**< i/o alignment, chunk size in bytes is multiple of this */
+#define CHUNK_MIN    256  /**< SIMDB_REC_LEN * CHUNK_MIN is multiple of ALIGN */
+#define CHUNK_DEF  65536  /**< default chunk size, in records */
+
+/** migration step from one version to next */
+typedef struct migration_t {
+  int from;
+  int to;
+  void (*header)(unsigned char *hdr);                   /**< convert header in place */
+  void (*records)(unsigned char *buf, size_t records);  /**< convert records in place */
+  bool (*check)(const unsigned char *src, const unsigned char *dst); /**< check converted record against source */
+} migration_t;
+
+/** header of progress file, followed by one byte per chunk */
+typedef struct progress_t {
+  char magic[8];
+  uint64_t size;      /**< source size */
+  int64_t mtime;      /**< source mtime, seconds */
+  int64_t mtime_ns;   /**< source mtime, nanoseconds */
+  uint32_t chunk;     /**< chunk size, in records */
+  uint32_t version;   /**< source version */
+} progress_t;
+
+/** state shared by workers */
+typedef struct job_t {
+  int in, out, progress;
+  unsigned long records;  /**< records in source, including header */
+  unsigned long chunk;    /**< records per chunk */
+  unsigned long chunks;   /**< chunks total */
+  unsigned long next;     /**< next chunk to process, atomic */
+  unsigned long done;     /**< chunks processed, atomic */
+  unsigned char *marks;   /**< per-chunk progress marks */
+  const migration_t *steps[SIMDB_VERSION];
+  int nsteps;
+  bool verify;            /**< check output against source instead of conversion */
+  int error;              /**< errno of first failure, atomic */
+  const char *failed;     /**< description of first failure */
+} job_t;
+
+static void
+v1_to_v2_header(unsigned char *hdr) {
+  memset(hdr, 0x0, SIMDB_REC_LEN);
+  snprintf((char *) hdr, SIMDB_REC_LEN, "IMDB v%02u, CAPS: %s;", 2, "M-R");
+}
+
+static void
+v1_to_v2_records(unsigned char *buf, size_t records) {
+  unsigned char src[SIMDB_REC_LEN];
+  unsigned char *dst = buf;
+
+  for (size_t i = 0; i < records; i++, dst += SIMDB_REC_LEN) {
+    memcpy(src, dst, SIMDB_REC_LEN);
+    memset(dst, 0x0, SIMDB_REC_LEN);
+    memcpy(dst +  0, src + 0, sizeof(char) *  1); // usage flag
+    memcpy(dst + 16, src + 2, sizeof(char) * 32); // image bitmap
+  }
+}
+
+static bool
+v1_to_v2_check(const unsigned char *src, const unsigned char *dst) {
+  for (int i = 1; i < 16; i++) {
+    if (dst[i] != 0x0)
+      return false; /* unused fields must be empty */
+  }
+
+  return dst[0] == src[0] && memcmp(dst + 16, src + 2, 32) == 0;
+}
+
+static const migration_t migrations[] = {
+  { 1, 2, v1_to_v2_header, v1_to_v2_records, v1_to_v2_check },
+  { 0, 0, NULL, NULL, NULL },
+};
 
 void usage(const char *message) {
   if (message)
     printf("error: %s\n", message);
-  printf("Usage: simdb_convert_1to2 <infile> <outfile>\n");
+  printf("Usage: simdb-upgrade [-j <threads>] [-c <records>] [-n] <infile> [<outfile>]\n");
+  printf("  -j <int>    Worker threads (default: 4)\n");
+  printf("  -c <int>    Records per chunk, rounded to multiple of %d (default: %d)\n", CHUNK_MIN, CHUNK_DEF);
+  printf("  -n          Don't verify converted database\n");
+  printf("If <outfile> omitted, database converted in place.\n");
   exit(EXIT_FAILURE);
 }
 
+/** @returns database version by header, or -1 if unknown */
+static int
+detect_version(const unsigned char *hdr) {
+  unsigned int version = 0;
+
+  if (memcmp(hdr, "DB of image fingerprints (ver 1)", 32) == 0)
+    return 1;
+  if (sscanf((const char *) hdr, "IMDB v%02u, CAPS: ", &version) == 1)
+    return version;
+
+  return -1;
+}
+
+static bool
+io_full(bool write, int fd, unsigned char *buf, size_t len, off_t offset) {
+  ssize_t bytes = 0;
+
+  while (len > 0) {
+    bytes = write ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+    if (bytes < 0 && errno == EINTR)
+      continue;
+    if (bytes <= 0) {
+      if (bytes == 0)
+        errno = EIO; /* unexpected end of file */
+      return false;
+    }
+    buf    += bytes;
+    len    -= bytes;
+    offset += bytes;
+  }
+
+  return true;
+}
+
+static void
+job_fail(job_t *job, const char *what) {
+  int expected = 0;
+
+  if (__atomic_compare_exchange_n(&job->error, &expected, errno ? errno : EIO, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    job->failed = what;
+}
+
+/** read chunk of source and apply migration steps, all or all but last */
+static bool
+convert_chunk(job_t *job, unsigned long chunk, unsigned char *buf, size_t count, int nsteps) {
+  off_t offset = (off_t) chunk * job->chunk * SIMDB_REC_LEN;
+  unsigned char *recs = buf;
+
+  if (!io_full(false, job->in, buf, count * SIMDB_REC_LEN, offset)) {
+    job_fail(job, "read source");
+    return false;
+  }
+
+  if (chunk == 0) {
+    for (int i = 0; i < nsteps; i++)
+      job->steps[i]->header(buf);
+    recs  += SIMDB_REC_LEN;
+    count -= 1;
+  }
+
+  for (int i = 0; i < nsteps; i++)
+    job->steps[i]->records(recs, count);
+
+  return true;
+}
+
+/**
+ * @brief Check converted chunk field by field against source
+ * @param buf   Source chunk, converted by all steps but last
+ * @param check Converted chunk
+ * @note Last step not applied again, so error in conversion is not repeated here
+ */
+static bool
+verify_chunk(job_t *job, unsigned long chunk, const unsigned char *buf, const unsigned char *check, size_t count) {
+  const migration_t *last = job->steps[job->nsteps - 1];
+  size_t i = 0;
+
+  if (chunk == 0) {
+    if (detect_version(check) != last->to)
+      return false;
+    i = 1;
+  }
+
+  for (; i < count; i++) {
+    if (!last->check(buf + i * SIMDB_REC_LEN, check + i * SIMDB_REC_LEN))
+      return false;
+  }
+
+  return true;
+}
+
+static void *
+worker(void *arg) {
+  job_t *job = arg;
+  unsigned char *buf = NULL, *check = NULL;
+  unsigned long chunk = 0;
+  size_t len = job->chunk * SIMDB_REC_LEN, count = 0;
+  off_t offset = 0;
+  unsigned char mark = 1;
+
+  if (posix_memalign((void **) &buf,   ALIGN, len) != 0 ||
+      posix_memalign((void **) &check, ALIGN, len) != 0) {
+    job_fail(job, "allocate buffers");
+    free(buf);
+    return NULL;
+  }
+
+  while (__atomic_load_n(&job->error, __ATOMIC_ACQUIRE) == 0) {
+    if ((chunk = __atomic_fetch_add(&job->next, 1, __ATOMIC_ACQ_REL)) >= job->chunks)
+      break;
+    if (!job->verify && job->marks[chunk])
+      continue; /* done in previous run */
+
+    offset = (off_t) chunk * len;
+    count  = job->records - chunk * job->chunk;
+    if (count > job->chunk)
+      count = job->chunk;
+
+    if (!convert_chunk(job, chunk, buf, count, job->verify ? job->nsteps - 1 : job->nsteps))
+      break;
+
+    if (job->verify) {
+      if (!io_full(false, job->out, check, count * SIMDB_REC_LEN, offset)) {
+        job_fail(job, "read converted database");
+        break;
+      }
+      if (!verify_chunk(job, chunk, buf, check, count)) {
+        errno = EINVAL;
+        job_fail(job, "verify converted database");
+        break;
+      }
+    } else {
+      if (!io_full(true, job->out, buf, count * SIMDB_REC_LEN, offset)) {
+        job_fail(job, "write converted database");
+        break;
+      }
+      /* mark chunk done only when its data is on disk */
+      if (fdatasync(job->out) < 0 ||
+          !io_full(true, job->progress, &mark, 1, sizeof(progress_t) + chunk)) {
+        job_fail(job, "save progress");
+        break;
+      }
+    }
+    __atomic_add_fetch(&job->done, 1, __ATOMIC_ACQ_REL);
+  }
+
+  free(buf);
+  free(check);
+
+  return NULL;
+}
+
+/** run all workers over all chunks */
+static bool
+run(job_t *job, int threads) {
+  pthread_t workers[threads];
+  int started = 0;
+
+  job->next = 0;
+  job->done = 0;
+
+  for (started = 0; started < threads; started++) {
+    if (pthread_create(&workers[started], NULL, worker, job) != 0)
+      break;
+  }
+  if (started == 0) {
+    job_fail(job, "start workers");
+    return false;
+  }
+  for (int i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+
+  return job->error == 0;
+}
+
+/** flush directory entry of renamed file to disk */
+static bool
+sync_dir(const char *path) {
+  char copy[PATH_MAX];
+  int fd = -1;
+  bool ok = false;
+
+  strncpy(copy, path, sizeof(copy) - 1);
+  copy[sizeof(copy) - 1] = '\0';
+  if ((fd = open(dirname(copy), O_RDONLY | O_DIRECTORY)) < 0)
+    return false;
+  ok = (fsync(fd) == 0);
+  close(fd);
+
+  return ok;
+}
+
+/**
+ * @brief Open progress file and load marks of done chunks
+ * @returns true if previous run with same parameters found
+ */
+static bool
+progress_open(job_t *job, const char *path, const progress_t *expected) {
+  progress_t found;
+  bool resume = false;
+
+  if ((job->progress = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+    usage(strerror(errno));
+
+  if (io_full(false, job->progress, (unsigned char *) &found, sizeof(found), 0) &&
+      memcmp(&found, expected, sizeof(found)) == 0 &&
+      io_full(false, job->progress, job->marks, job->chunks, sizeof(found)))
+    resume = true;
+
+  if (!resume) {
+    memset(job->marks, 0x0, job->chunks);
+    if (ftruncate(job->progress, 0) < 0 ||
+        !io_full(true, job->progress, (unsigned char *) expected, sizeof(progress_t), 0) ||
+        !io_full(true, job->progress, job->marks, job->chunks, sizeof(progress_t)) ||
+        fsync(job->progress) < 0)
+      usage(strerror(errno));
+  }
+
+  return resume;
+}
+
 int main(int argc, char **argv) {
-  int in, out;
-  long unsigned int simdb_rec_total, rec_first, rec_last, records;
-  unsigned char  in_buf[SIMDB_REC_LEN * BLK_SIZE];
-  unsigned char out_buf[SIMDB_REC_LEN * BLK_SIZE];
-  unsigned char  header[SIMDB_REC_LEN];
-  unsigned char *src, *dst;
+  job_t job;
+  progress_t progress;
   struct stat st;
-  ssize_t bytes;
+  unsigned char header[SIMDB_REC_LEN];
+  char tmp_path[PATH_MAX], progress_path[PATH_MAX];
+  const char *in_path = NULL, *out_path = NULL;
+  unsigned long chunk = CHUNK_DEF, resumed = 0;
+  int threads = 4, version = 0, opt = 0;
+  bool verify = true, resume = false;
 
-  memset(header, 0x0, SIMDB_REC_LEN);
-  snprintf((char *) header, SIMDB_REC_LEN, "IMDB v%02u, CAPS: %s;", 2, "M-R");
+  while ((opt = getopt(argc, argv, "j:c:n")) != -1) {
+    switch (opt) {
+      case 'j' :
+        if ((threads = atoi(optarg)) < 1 || threads > 256)
+          usage("threads count out of range (1 - 256)");
+        break;
+      case 'c' :
+        if ((chunk = strtoul(optarg, NULL, 10)) < CHUNK_MIN)
+          chunk = CHUNK_MIN;
+        chunk -= chunk % CHUNK_MIN;
+        break;
+      case 'n' :
+        verify = false;
+        break;
+      default :
+        usage(NULL);
+        break;
+    }
+  }
 
-  if (argc < 2)
+  if (optind >= argc)
     usage(NULL);
+  in_path  = argv[optind];
+  out_path = (optind + 1 < argc) ? argv[optind + 1] : in_path;
 
-  errno = 0;
-  if ((in  = open(argv[1], O_RDONLY)) < 0)
-    usage(strerror(errno));
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.upgrade", out_path) >= (int) sizeof(tmp_path) ||
+      snprintf(progress_path, sizeof(progress_path), "%s.progress", tmp_path) >= (int) sizeof(progress_path))
+    usage("path too long");
 
-  if ((out = open(argv[2], O_WRONLY | O_TRUNC | O_CREAT, 0644)) < 0)
+  memset(&job, 0x0, sizeof(job));
+  job.chunk = chunk;
+
+  errno = 0;
+  if ((job.in = open(in_path, O_RDONLY)) < 0)
     usage(strerror(errno));
 
-  if (fstat(in, &st) != 0)
+  if (fstat(job.in, &st) != 0)
     usage(strerror(errno));
 
   if ((st.st_size % SIMDB_REC_LEN) != 0)
     usage("database size expected to be multiples to 48");
 
-  if (lseek(in, 0, SEEK_SET) < 0)
-    usage(strerror(errno));
-
-  if (read(in, in_buf, SIMDB_REC_LEN) != SIMDB_REC_LEN)
+  if (!io_full(false, job.in, header, SIMDB_REC_LEN, 0))
     usage("can't read header of database");
 
-  if (memcmp(in_buf, "DB of image fingerprints (ver 1)", 32) != 0)
-    usage("wrong database header / version mismatch");
+  if ((version = detect_version(header)) < 0)
+    usage("wrong database header / unknown version");
+
+  if (version == SIMDB_VERSION) {
+    printf("Database already has latest version (%d)\n", version);
+    exit(EXIT_SUCCESS);
+  }
+
+  if (version > SIMDB_VERSION)
+    usage("database version is newer than this tool knows");
+
+  for (int v = version; v < SIMDB_VERSION; ) {
+    const migration_t *m = migrations;
+    while (m->header && m->from != v)
+      m++;
+    if (m->header == NULL)
+      usage("no migration path to latest version");
+    job.steps[job.nsteps++] = m;
+    v = m->to;
+  }
 
-  simdb_rec_total = (st.st_size / SIMDB_REC_LEN);
-  printf("Processing %lu records\n", simdb_rec_total - 1);
+  posix_fadvise(job.in, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-  if (lseek(in, SIMDB_REC_LEN, SEEK_SET) < 0)
+  job.records = st.st_size / SIMDB_REC_LEN;
+  job.chunks  = (job.records + job.chunk - 1) / job.chunk;
+  if ((job.marks = calloc(job.chunks, 1)) == NULL)
     usage(strerror(errno));
 
-  if (lseek(out, 0, SEEK_SET) < 0)
+  memset(&progress, 0x0, sizeof(progress));
+  memcpy(progress.magic, "SDBUPG1", 8);
+  progress.size     = st.st_size;
+  progress.mtime    = st.st_mtim.tv_sec;
+  progress.mtime_ns = st.st_mtim.tv_nsec;
+  progress.chunk    = job.chunk;
+  progress.version  = version;
+
+  resume = progress_open(&job, progress_path, &progress);
+  if ((job.out = open(tmp_path, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0644)) < 0)
+    usage(strerror(errno));
+  if (ftruncate(job.out, st.st_size) < 0)
     usage(strerror(errno));
-  if (write(out, header, SIMDB_REC_LEN) != SIMDB_REC_LEN)
+
+  for (unsigned long i = 0; resume && i < job.chunks; i++)
+    resumed += job.marks[i] ? 1 : 0;
+
+  printf("Upgrading v%d -> v%d, %lu records, %lu chunks, %d threads\n",
+    version, SIMDB_VERSION, job.records - 1, job.chunks, threads);
+  if (resume)
+    printf("Resuming: %lu of %lu chunks already converted\n", resumed, job.chunks);
+
+  if (!run(&job, threads)) {
+    printf("Can't %s: %s\n", job.failed, strerror(job.error));
+    printf("Run again to resume\n");
+    exit(EXIT_FAILURE);
+  }
+  printf("Converted %lu chunks\n", job.done);
+
+  if (fsync(job.out) < 0)
     usage(strerror(errno));
 
-  for (unsigned int block = 0; block <= (simdb_rec_total / BLK_SIZE); block++) {
-    rec_first = rec_last = (block * BLK_SIZE) + 1;
-    records   = ((rec_first + BLK_SIZE) > simdb_rec_total) ? simdb_rec_total - rec_first : BLK_SIZE;
-    rec_last  = rec_first + records;
-    printf("* block %u, %4lu records [%lu, %lu]\n",
-      block + 1, records, rec_first, rec_last - 1);
-    lseek(in,  rec_first * SIMDB_REC_LEN, SEEK_SET);
-    lseek(out, rec_first * SIMDB_REC_LEN, SEEK_SET);
-    bytes = read(in, in_buf, SIMDB_REC_LEN * records);
-    if (bytes != (ssize_t) records * SIMDB_REC_LEN) {
-      printf("Read size mismatch, expected %lu, got: %zi\n",
-        SIMDB_REC_LEN * records, bytes);
+  if (verify) {
+    job.verify = true;
+    if (!run(&job, threads)) {
+      printf("Can't %s: %s\n", job.failed, strerror(job.error));
+      unlink(progress_path); /* output is broken, don't resume from it */
       exit(EXIT_FAILURE);
     }
-    memset(out_buf, 0x0, records * SIMDB_REC_LEN);
-    for (unsigned int i = 0; i < records; i++) {
-      src =  &in_buf[i * SIMDB_REC_LEN];
-      dst = &out_buf[i * SIMDB_REC_LEN];
-      memcpy(dst +  0, src + 0, sizeof(char) *  1); // usage flag
-      memcpy(dst + 16, src + 2, sizeof(char) *  32); // image bitmap
-    }
-    bytes = write(out, out_buf, SIMDB_REC_LEN * records);
-    if (bytes != (ssize_t) records * SIMDB_REC_LEN) {
-      printf("Write size mismatch, expected %lu, got: %zi\n",
-        SIMDB_REC_LEN * records, bytes);
-      exit(EXIT_FAILURE); 
-    }
+    printf("Verified %lu chunks\n", job.done);
   }
 
+  if (rename(tmp_path, out_path) < 0 || !sync_dir(out_path))
+    usage(strerror(errno));
+  unlink(progress_path);
+
+  close(job.in);
+  close(job.out);
+  close(job.progress);
+  free(job.marks);
+
   exit(EXIT_SUCCESS);
 }
@@ -15,9 +15,22 @@
  * @brief Exportable simdb functions, defines & structs
  */
 
+#include <stdint.h>
+
 #define SIMDB_VERSION  2  /**< database format version */
 #define SIMDB_REC_LEN 48  /**< record length, in bytes */
 
+/**
+ * record number, 64-bit on all platforms
+ *
+ * File offsets of records computed in 64-bit arithmetic, so database
+ * may hold more than 2^31 records. Functions returning record number
+ * or records count return this type, negative values are error codes.
+ */
+typedef int64_t simdb_num_t;
+/** max record number */
+#define SIMDB_NUM_MAX INT64_MAX
+
 /**
  * @defgroup SIMDBFlags Database runtime flags
  *  @{ */
@@ -25,6 +38,12 @@
 #define SIMDB_FLAG_WRITE    1 << (0 + 0)  /**< database has write access */
 #define SIMDB_FLAG_LOCK     1 << (0 + 1)  /**< use locks for file with write access (only with @ref SIMDB_FLAG_WRITE) */
 #define SIMDB_FLAG_LOCKNB   1 << (0 + 2)  /**< same as above, but not wait for lock (only with @ref SIMDB_FLAG_WRITE) */
+#define SIMDB_FLAG_METRICS  1 << (0 + 3)  /**< collect operation metrics, see @ref simdb_metrics_get() */
+#define SIMDB_FLAG_THREADS  1 << (0 + 4)  /**< handle may be shared between threads, see notes below */
+#define SIMDB_FLAG_LOCKRANGE 1 << (0 + 5) /**< lock only ranges of records being read (shared) or written (exclusive),
+                                               instead of whole file lock, see notes below */
+#define SIMDB_FLAG_REFRESH  1 << (0 + 6)  /**< check for changes made by other processes before each search, see @ref simdb_refresh() */
+#define SIMDB_FLAG_RESIDENT 1 << (0 + 7)  /**< keep copy of all records in memory, searches don't touch file */
 /** @} */
 
 /**
@@ -33,7 +52,9 @@
 #define SIMDB_CAP_BITMAP    1 << (8 + 0)  /**< database can compare images by luma bitmaps */
 #define SIMDB_CAP_COLORS    1 << (8 + 1)  /**< database can compare images by color levels */
 #define SIMDB_CAP_RATIO     1 << (8 + 2)  /**< database can compare images by ratio */
-/* 3 used, 5 reserved */
+#define SIMDB_CAP_BITMAP32  1 << (8 + 3)  /**< database stores 32x32 luma bitmaps in sidecar file, see notes below */
+#define SIMDB_CAP_PHASH     1 << (8 + 4)  /**< database prefilters images by 64-bit perceptual hash, opt-in: may reject records matching by bitmap */
+/* 5 used, 3 reserved */
 /** @} */
 
 /**
@@ -41,6 +62,37 @@
  * @{ */
 #define SIMDB_ADD_NOREPLACE 1 << (0 + 0)  /**< don't replace existing record */
 #define SIMDB_ADD_NOEXTEND  1 << (0 + 1)  /**< don't extend database if @a num greater than existing records count */
+#define SIMDB_ADD_APPEND    1 << (0 + 2)  /**< simdb_import() only: ignore record numbers in stream, append records to end */
+/** @} */
+
+/**
+ * @defgroup SIMDBExportFormats Formats of export stream, see simdb_export()
+ *
+ * Binary stream starts with 8-byte header: "SDBX", format version (1 byte),
+ * record length (1 byte), record number width in bytes (1 byte, 8; zero
+ * in older streams means 4), zero byte. Header followed by entries:
+ * record number (uint64_t, or uint32_t in older streams), then raw record
+ * (@ref SIMDB_REC_LEN bytes).
+ * Integers in same byte order as in database file (host).
+ *
+ * Text stream consists of lines "<num>,<raw record in hex>".
+ * Lines starting with '#' are comments.
+ * @{ */
+#define SIMDB_EXPORT_BINARY 0  /**< compact binary stream */
+#define SIMDB_EXPORT_HEX    1  /**< text, one record per line */
+/** @} */
+
+/**
+ * @defgroup SIMDBVacuum Flags for simdb_vacuum() call
+ *
+ * Mapping file starts with 8-byte header: "SDBM", format version (1 byte),
+ * three zero bytes. Header followed by records count before vacuum (uint64_t),
+ * then runs of kept records, each as three uint64_t: number of first record
+ * before vacuum, number of first record after vacuum, records in run.
+ * Runs sorted by record number, records not covered by any run were unused.
+ * Integers in same byte order as in database file (host).
+ * @{ */
+#define SIMDB_VACUUM_REMAP  1 << (0 + 0)  /**< keep mapping in handle, see simdb_remap() */
 /** @} */
 
 /**
@@ -56,20 +108,121 @@
 #define SIMDB_ERR_USAGE       -7 /**< wrong arguments passed */
 #define SIMDB_ERR_SAMPLER     -8 /**< given file not an image, damaged or has unsupported format */
 #define SIMDB_ERR_LOCK        -9 /**< can't add lock on database file */
+#define SIMDB_ERR_NOINDEX    -10 /**< index file missing, out of date or built with other parameters */
+#define SIMDB_ERR_STALE      -11 /**< database file replaced by vacuum of other process, reopen database */
 /** @} */
 
-/** opaque database handler */
+/**
+ * opaque database handler
+ *
+ * Handle opened with @ref SIMDB_FLAG_LOCKRANGE takes no lock on whole file.
+ * Instead each read takes shared lock on records being read, each write takes
+ * exclusive lock on records being written, and appends additionally lock
+ * the header record while choosing number for new record, so processes
+ * may write disjoint records concurrently and readers never see partially
+ * written records. Locks are open file description locks (Linux >= 3.15),
+ * classic fcntl() locks used as fallback. Together with @ref SIMDB_FLAG_THREADS
+ * each thread locks through own open file description, so threads don't
+ * merge or drop locks of each other; this requires open file description locks,
+ * @ref simdb_open() fails with @ref SIMDB_ERR_USAGE without them. Such handle
+ * may also fail reads with @ref SIMDB_ERR_STALE, see @ref simdb_vacuum(). With @ref SIMDB_FLAG_LOCKNB
+ * operations fail with @ref SIMDB_ERR_LOCK instead of waiting for lock.
+ * All processes working with database should use this flag.
+ *
+ * Handle opened with @ref SIMDB_FLAG_THREADS may be used by many threads at once:
+ * searches, reads and writes run in parallel, appends (@ref simdb_record_add()
+ * with zero @a num) reserve unique record numbers atomically, and new records
+ * count becomes visible to other threads only after record data written.
+ * Search cache and metrics are guarded by internal mutex.
+ * Setup calls (@ref simdb_cache_setup(), @ref simdb_lsh_setup(), @ref simdb_memory_setup())
+ * and @ref simdb_close() must not run concurrently with other calls.
+ * Without this flag handle is not thread-safe.
+ */
 typedef struct _simdb_t simdb_t;
 
+/**
+ * @defgroup SIMDBBitmap Packed bitmaps
+ * Bitmap is monochrome square image, stored row by row, lower bit of each byte first,
+ * so each 2 bytes is row of 16x16 bitmap. Set bit - pixel brighter than average.
+ * @{
+ */
+/** Bits per bitmap side (currently - 16) */
+#define SIMDB_BITMAP_SIDE 16
+/** Total bits in bitmap (currently - 256) */
+#define SIMDB_BITMAP_BITS (SIMDB_BITMAP_SIDE * SIMDB_BITMAP_SIDE)
+/** Bitmap size in bytes (currently - 32) */
+#define SIMDB_BITMAP_SIZE (SIMDB_BITMAP_BITS / 8)
+
+/** Bits per side of high-resolution bitmap, see @ref SIMDB_CAP_BITMAP32 */
+#define SIMDB_BITMAP_HR_SIDE 32
+/** Total bits in high-resolution bitmap (1024) */
+#define SIMDB_BITMAP_HR_BITS (SIMDB_BITMAP_HR_SIDE * SIMDB_BITMAP_HR_SIDE)
+/** High-resolution bitmap size in bytes (128) */
+#define SIMDB_BITMAP_HR_SIZE (SIMDB_BITMAP_HR_BITS / 8)
+/** @} */
+
+/**
+ * @defgroup SIMDBTransforms Sample transforms
+ * Rotations are clockwise, all transforms are applied to sample bitmap
+ * @{
+ */
+#define SIMDB_TRANSFORM_NONE       0 /**< sample as is */
+#define SIMDB_TRANSFORM_ROT90      1 /**< rotated by 90 degrees */
+#define SIMDB_TRANSFORM_ROT180     2 /**< rotated by 180 degrees */
+#define SIMDB_TRANSFORM_ROT270     3 /**< rotated by 270 degrees */
+#define SIMDB_TRANSFORM_FLIP_H     4 /**< mirrored left to right */
+#define SIMDB_TRANSFORM_FLIP_V     5 /**< mirrored top to bottom */
+#define SIMDB_TRANSFORM_TRANSPOSE  6 /**< mirrored along main diagonal */
+#define SIMDB_TRANSFORM_TRANSVERSE 7 /**< mirrored along anti-diagonal */
+#define SIMDB_TRANSFORMS           8 /**< transforms count */
+#define SIMDB_TRANSFORMS_ALL    0xFF /**< mask of all transforms, see simdb_search_t.transforms */
+/** @} */
+
 /**
  * search matches
  */
 typedef struct simdb_match_t {
-  int num;         /**< record id */
+  simdb_num_t num; /**< record id */
   float d_ratio;   /**< difference of ratio */
+  float d_color;   /**< difference of color levels */
   float d_bitmap;  /**< difference of bitmap */
+  int transform;   /**< transform of sample matched this record, see @ref SIMDBTransforms */
 } simdb_match_t;
 
+/**
+ * per-query search statistics, see simdb_search_t.stats
+ * @note Times measured in seconds, cpu time is time of calling thread
+ */
+typedef struct simdb_search_stats_t {
+  unsigned long scanned;   /**< records scanned */
+  unsigned long unused;    /**< unused records skipped */
+  unsigned long r_phash;   /**< records rejected by perceptual hash test */
+  unsigned long r_ratio;   /**< records rejected by ratio test */
+  unsigned long r_color;   /**< records rejected by color levels test */
+  unsigned long compares;  /**< bitmap compares performed */
+  unsigned long refines;   /**< 32x32 bitmap compares performed, see @ref SIMDB_CAP_BITMAP32 */
+  unsigned long r_refine;  /**< records rejected by 32x32 bitmap compare */
+  unsigned long bytes;     /**< bytes read from database */
+  unsigned long blocks;    /**< blocks read from database */
+  unsigned long candidates; /**< candidates taken from LSH index, see @ref SIMDB_SEARCH_LSH */
+  unsigned long filtered;  /**< records skipped as not eligible, see simdb_search_t.allow */
+  bool cached;             /**< results taken from search cache */
+  double io_wall;   /**< i/o phase: wall time */
+  double io_cpu;    /**< i/o phase: cpu time */
+  double cmp_wall;  /**< compare phase: wall time */
+  double cmp_cpu;   /**< compare phase: cpu time */
+} simdb_search_stats_t;
+
+/**
+ * @defgroup SIMDBSearchModes Search modes
+ * @{
+ */
+#define SIMDB_SEARCH_EXACT 0 /**< scan all records */
+/** check only records sharing LSH bucket with sample, see @ref simdb_lsh_setup().
+ *  Much faster on large databases, but some matches may be missed */
+#define SIMDB_SEARCH_LSH   1
+/** @} */
+
 /**
  * search parameters
  * d_* fields should have value from 0.0 to 1.0 (0% - 100%)
@@ -77,20 +230,96 @@ typedef struct simdb_match_t {
 typedef struct simdb_search_t {
   float d_bitmap; /**< max difference of luma bitmaps, default - 7% */
   float d_ratio;  /**< max difference of ratios, default - 7% */
+  float d_color;  /**< max difference of color levels, default - 10%, used only with @ref SIMDB_CAP_COLORS,
+                       records with all levels zero (sampled without them) not compared */
+  float d_phash;  /**< max difference of perceptual hashes, default - 25% (16 of 64 bits), used only with @ref SIMDB_CAP_PHASH */
   int limit;      /**< max results */
+  int mode;       /**< search mode, see @ref SIMDBSearchModes */
+  int lsh_tables; /**< LSH mode: tables to look in, 0 - all, fewer tables - faster, lower recall */
+  int lsh_probes; /**< LSH mode: also probe buckets with keys differing from sample's in up to this many bits,
+                       0 - chosen from @a d_bitmap for 95% recall, <0 - sample's bucket only (fastest, lowest recall) */
+  bool cold;      /**< cold scan: read database bypassing page cache (O_DIRECT, or dropping pages after
+                       reading where not supported), for one-off scans which shouldn't evict hot data of
+                       other processes. Exact search without @ref SIMDB_FLAG_RESIDENT only */
+  int transforms; /**< also match rotated and mirrored copies of sample: mask, bit N - transform N (see @ref SIMDBTransforms),
+                       0 - sample as is only. All transforms compared in single pass, perceptual hash test skipped */
+  simdb_num_t first; /**< first record to check, 0 - from start of database */
+  simdb_num_t last;  /**< last record to check, 0 - up to end of database */
+  const unsigned char *allow; /**< optional bitset of eligible records, bit N (lower bit of byte N / 8 first) - record N,
+                                   NULL - all records of range. Only blocks with eligible records are read,
+                                   such searches are not cached */
+  simdb_num_t allow_bits; /**< size of @a allow, in bits, records beyond it are not eligible */
   int found;      /**< count of found results */
   simdb_match_t *matches; /**< search results */
+  simdb_search_stats_t *stats; /**< optional storage for search statistics, filled if set */
 } simdb_search_t;
 
+/**
+ * search cache counters, see @ref simdb_cache_setup()
+ */
+typedef struct simdb_cache_stats_t {
+  size_t size;       /**< memory used by cached results, in bytes */
+  size_t budget;     /**< memory limit for cached results, in bytes */
+  unsigned long entries;    /**< cached results count */
+  unsigned long hits;       /**< searches answered from cache */
+  unsigned long misses;     /**< searches not found in cache */
+  unsigned long evictions;  /**< results dropped to fit in memory limit */
+} simdb_cache_stats_t;
+
+/** buckets in latency histogram: 4 per power of two of nanoseconds, up to ~34 seconds */
+#define SIMDB_HIST_BUCKETS 140
+
+/**
+ * latency histogram with logarithmic buckets
+ * @note Bucket precision is 25% of measured value, see @ref simdb_histogram_percentile()
+ */
+typedef struct simdb_histogram_t {
+  unsigned long count;  /**< observations count */
+  double sum;           /**< sum of observed values, in seconds */
+  double max;           /**< max observed value, in seconds */
+  unsigned long buckets[SIMDB_HIST_BUCKETS]; /**< observations count per bucket */
+} simdb_histogram_t;
+
+/**
+ * cumulative operation metrics of database handle, see @ref SIMDB_FLAG_METRICS
+ */
+typedef struct simdb_metrics_t {
+  simdb_histogram_t search;  /**< latency of simdb_search_byid() and simdb_search_file() */
+  simdb_histogram_t add;     /**< latency of simdb_record_add() */
+  simdb_histogram_t del;     /**< latency of simdb_record_del() */
+  simdb_histogram_t sampler; /**< time spent in sampling images */
+  unsigned long read_calls;  /**< database reads */
+  unsigned long read_bytes;  /**< bytes read from database */
+  unsigned long write_calls; /**< database writes */
+  unsigned long write_bytes; /**< bytes written to database */
+} simdb_metrics_t;
+
 /**
  * @brief Creates empty database at given path
  * @param path Path to database
  * @returns true on success, and false on error
- * @note See errno value for details
- * @todo 2nd arg: caps
+ * @note See errno value for details.
+ *   Same as simdb_create_ex() with bitmap, color levels and ratio caps.
  */
 bool simdb_create(const char *path);
 
+/**
+ * @brief Creates empty database with given capabilities
+ * @param path Path to database
+ * @param caps Database capabilities, see @ref SIMDBCaps
+ * @returns true on success, and false on error
+ * @note See errno value for details.
+ *   With @ref SIMDB_CAP_BITMAP32 also creates sidecar file "<path>.hr",
+ *   which holds 32x32 luma bitmap for each record. Search in such database
+ *   is two-stage: 16x16 bitmaps compared first as cheap prefilter, and only
+ *   records passed it compared by 32x32 bitmaps against the same
+ *   @a d_bitmap threshold. Records without 32x32 bitmap (e.g. imported with
+ *   simdb_import()) are matched by 16x16 bitmaps only.
+ *   Missing sidecar recreated empty by simdb_open() for writing, read-only
+ *   open fails with @ref SIMDB_ERR_CORRUPTDB.
+ */
+bool simdb_create_ex(const char *path, int caps);
+
 /**
  * @brief Open database at given path
  * @param path Path to database
@@ -135,7 +364,7 @@ void simdb_search_free(simdb_search_t *search);
  * @retval  0 if nothing found
  * @retval <0 on error
  */
-int simdb_search_byid(simdb_t *db, simdb_search_t *search, int num);
+int simdb_search_byid(simdb_t *db, simdb_search_t *search, simdb_num_t num);
 
 /**
  * @brief Compare given file against other records in database
@@ -149,13 +378,228 @@ int simdb_search_byid(simdb_t *db, simdb_search_t *search, int num);
  */
 int simdb_search_file(simdb_t *db, simdb_search_t *search, const char *file);
 
+/**
+ * @brief Enable, resize or disable cache of search results
+ * @param db     Database handle
+ * @param budget Memory limit for cached results, in bytes. Zero disables cache.
+ * @retval  0 on success
+ * @retval <0 on error
+ * @note Cached results are keyed by sample and search parameters,
+ *   and dropped on any write to database with this handle.
+ *   Resizing cache drops all stored results.
+ */
+int simdb_cache_setup(simdb_t *db, size_t budget);
+
+/**
+ * @defgroup SIMDBMemory In-memory records placement, see @ref simdb_memory_setup()
+ * @{
+ */
+#define SIMDB_MEMORY_HUGEPAGES  1 << 0 /**< use huge pages: reserved ones if configured, transparent otherwise */
+#define SIMDB_MEMORY_INTERLEAVE 1 << 1 /**< spread pages evenly over all NUMA nodes */
+/** @} */
+
+/**
+ * @brief Change placement of in-memory records, see @ref SIMDB_FLAG_RESIDENT
+ * @param db      Database handle, opened with @ref SIMDB_FLAG_RESIDENT
+ * @param options Wanted options, see @ref SIMDBMemory, 0 - plain heap memory
+ * @returns Options actually applied (may be fewer than wanted) or <0 on error
+ * @note Records moved to new memory at once, and all later extensions of it
+ *   use same options. Options unsupported by system silently dropped:
+ *   without reserved huge pages transparent ones requested with madvise(),
+ *   interleaving applied only on systems with more than one NUMA node.
+ *   With interleaving each scanning thread reads local and remote memory
+ *   in equal shares, so no single node's memory bandwidth becomes bottleneck.
+ */
+int simdb_memory_setup(simdb_t *db, int options);
+
+/**
+ * @brief Enable or disable LSH index for approximate search
+ * @param db     Database handle
+ * @param tables Number of hash tables (1-64), zero disables index
+ * @param bits   Bitmap bits sampled by each table (1-15)
+ * @retval  0 on success
+ * @retval <0 on error
+ * @note Index keys stored in file next to database (suffix ".lsh") and reused
+ *   on next setup with same parameters, if database not changed since.
+ *   Otherwise writable handle rebuilds index from records and stores it,
+ *   read-only handle fails with @ref SIMDB_ERR_NOINDEX, as with file built
+ *   with other parameters. Index file kept current by writes with this
+ *   handle and by @ref simdb_refresh(), writable handles attach existing
+ *   index with @ref simdb_indexes_setup().
+ *   Good start is 32 tables of 14 bits: with default probes finds 95% of
+ *   records within 25% bitmap difference, checking about 3% of records.
+ *   More tables - higher recall and memory usage, more bits - smaller buckets,
+ *   faster search and lower recall.
+ *   Candidates verified same way as in exact search, so LSH mode never
+ *   returns records exact search wouldn't.
+ */
+int simdb_lsh_setup(simdb_t *db, int tables, int bits);
+
+/**
+ * @brief Set up indexes found next to database, with their stored parameters
+ * @param db Database handle
+ * @retval  0 on success, also if there is no index files
+ * @retval <0 on error
+ * @note Indexes already set up are kept. Writers should call this after open,
+ *   so their writes keep index files current for other processes.
+ */
+int simdb_indexes_setup(simdb_t *db);
+
+/**
+ * @brief Enable or disable table of near-duplicate groups
+ * @param db   Database handle
+ * @param link Search parameters linking records: thresholds, transforms and mode,
+ *   NULL disables table
+ * @retval  0 on success
+ * @retval <0 on error
+ * @retval <0 on error, @ref SIMDB_ERR_NOINDEX if table file built with other
+ *   parameters, or missing or out of date for read-only handle
+ * @note Records linked if one found by search for other, group is all records
+ *   connected by chains of links. Table stored in file next to database
+ *   (suffix ".clu") and reused on next setup with same thresholds, transforms
+ *   and mode, if database not changed since. Otherwise writable handle rebuilds
+ *   table with search for each record among records before it, so large
+ *   databases need @ref SIMDB_SEARCH_LSH mode here (index must be set up first).
+ *   Table file of other parameters never replaced, remove it to change them.
+ *   Table kept current by @ref simdb_record_add(), @ref simdb_record_del() and
+ *   @ref simdb_vacuum() with this handle, writers attach existing table with
+ *   @ref simdb_indexes_setup(). After changes by others, found by
+ *   @ref simdb_refresh(), lookups fail with @ref SIMDB_ERR_NOINDEX until setup
+ *   called again. Failed update after record written also invalidates table,
+ *   write itself still reported as successful.
+ *   Deleted record leaves its group, but group is not split, even if
+ *   record was only link between its parts.
+ */
+int simdb_cluster_setup(simdb_t *db, const simdb_search_t *link);
+
+/**
+ * @brief Get near-duplicate group of record, see @ref simdb_cluster_setup()
+ * @param db   Database handle
+ * @param num  Record number
+ * @param nums Pointer to storage for group members (allocated), sorted ascending, including @a num
+ * @retval >0 as group size
+ * @retval  0 if record unused
+ * @retval <0 on error, @ref SIMDB_ERR_USAGE if table not set up,
+ *   @ref SIMDB_ERR_NOINDEX if table out of date
+ * @note Takes time proportional to group size, database is not read
+ */
+simdb_num_t simdb_cluster_get(simdb_t *db, simdb_num_t num, simdb_num_t **nums);
+
+/**
+ * @brief Get search cache counters
+ * @param db    Database handle
+ * @param stats Pointer to storage for counters
+ * @retval true  on success
+ * @retval false if cache not enabled
+ */
+bool simdb_cache_stats(simdb_t *db, simdb_cache_stats_t *stats);
+
+/**
+ * @brief Get cumulative metrics of database handle
+ * @param db      Database handle
+ * @param metrics Pointer to storage for metrics
+ * @retval true  on success
+ * @retval false if database opened without @ref SIMDB_FLAG_METRICS
+ */
+bool simdb_metrics_get(simdb_t *db, simdb_metrics_t *metrics);
+
+/**
+ * @brief Reset all metrics of database handle to zero
+ * @param db Database handle
+ */
+void simdb_metrics_reset(simdb_t *db);
+
+/**
+ * @brief Estimate percentile of observed values
+ * @param hist Histogram
+ * @param q    Quantile, from 0.0 to 1.0, e.g. 0.99 for 99th percentile
+ * @returns Upper bound of bucket containing requested percentile, in seconds,
+ *   or 0.0 if histogram is empty
+ */
+double simdb_histogram_percentile(const simdb_histogram_t *hist, double q);
+
+/**
+ * @brief Pick up changes made to database by other processes
+ * @param db Database handle
+ * @retval  1 if database changed since open or last refresh
+ * @retval  0 if nothing changed
+ * @retval <0 on error, @ref SIMDB_ERR_STALE if database file replaced
+ *   by @ref simdb_vacuum() of other process
+ * @note Change detected by file size and modification time, state after
+ *   own writes remembered, so they are not taken as change. On change
+ *   records count updated and stored search results dropped.
+ *   With @ref SIMDB_FLAG_RESIDENT whole file compared with in-memory records,
+ *   only changed and appended records are stored.
+ *   See also @ref SIMDB_FLAG_REFRESH to do this check automatically.
+ */
+int simdb_refresh(simdb_t *db);
+
+/**
+ * @brief Write used records to stream
+ * @param db     Database handle
+ * @param fd     Writable file descriptor
+ * @param format Stream format, see @ref SIMDBExportFormats
+ * @param start  First record number to export
+ * @param limit  Max records to scan, zero means "up to end of database"
+ * @retval >=0 as records exported
+ * @retval  <0 on error
+ * @note Unused records skipped, so stream may be not contiguous.
+ */
+simdb_num_t simdb_export(simdb_t *db, int fd, int format, simdb_num_t start, simdb_num_t limit);
+
+/**
+ * @brief Read records from stream and write them to database
+ * @param db     Database handle
+ * @param fd     Readable file descriptor, read until end of stream
+ * @param format Stream format, see @ref SIMDBExportFormats
+ * @param shift  Value added to record numbers from stream, ignored with @ref SIMDB_ADD_APPEND
+ * @param flags  Modifier flags, see @ref SIMDBAddModifiers
+ * @retval >=0 as records imported
+ * @retval  <0 on error, records imported before error stay in database
+ * @note Records with consecutive numbers are written in one call.
+ *   Records skipped due to @a flags are not counted.
+ */
+simdb_num_t simdb_import(simdb_t *db, int fd, int format, simdb_num_t shift, int flags);
+
+/**
+ * @brief Rewrite database without unused records
+ * @param db    Database handle, opened with @ref SIMDB_FLAG_WRITE
+ * @param map   Path to mapping file for old record numbers, see @ref SIMDBVacuum, or NULL
+ * @param flags Modifier flags, see @ref SIMDBVacuum
+ * @retval >=0 as records count after vacuum
+ * @retval  <0 on error: database left unchanged, or, if error came after
+ *   sidecar file replaced, vacuum finished by next open for writing
+ * @note Used records keep their order and get numbers from 1 and up.
+ *   New files written next to database with next vacuum generation in
+ *   headers, then sidecar file renamed over old one and database last.
+ *   Open checks generations of both match, and open for writing with
+ *   lock finishes rename if vacuum was interrupted between them; open
+ *   without write access fails with @ref SIMDB_ERR_CORRUPTDB until then.
+ *   Whole file locked during copy and swap, also with @ref SIMDB_FLAG_LOCKRANGE,
+ *   so writes of other processes wait. Their handles then see
+ *   @ref SIMDB_ERR_STALE from @ref simdb_refresh() and range-locked writes,
+ *   and must reopen database; open waiting for lock opens new file.
+ *   Must not be called concurrently with other calls on same handle.
+ */
+simdb_num_t simdb_vacuum(simdb_t *db, const char *map, int flags);
+
+/**
+ * @brief Get number of record after last vacuum by its number before
+ * @param db  Database handle, see @ref SIMDB_VACUUM_REMAP
+ * @param num Record number before vacuum
+ * @retval >0 as record number after vacuum
+ * @retval  0 if record was unused and dropped
+ * @retval <0 on error: no mapping kept in handle, or no such record before vacuum
+ */
+simdb_num_t simdb_remap(simdb_t *db, simdb_num_t num);
+
 /**
  * @brief Checks is record with given number is used
  * @param db  Database handle
  * @param num Record number
  * @returns true if used, false if no record exists or not used
  */
-bool simdb_record_used(simdb_t *db, int num);
+bool simdb_record_used(simdb_t *db, simdb_num_t num);
 
 /**
  * @brief Create an record from image file
@@ -169,7 +613,7 @@ bool simdb_record_used(simdb_t *db, int num);
  * @retval >0 if record added successfully
  * @note setting @a num to zero means "append to end"
  */
-int simdb_record_add(simdb_t *db, int num, const char *path, int flags);
+simdb_num_t simdb_record_add(simdb_t *db, simdb_num_t num, const char *path, int flags);
 
 /**
  * @brief Delete a record from database by num
@@ -179,7 +623,7 @@ int simdb_record_add(simdb_t *db, int num, const char *path, int flags);
  * @retval  0 if record not exists
  * @retval >0 as on success
  */
-int simdb_record_del(simdb_t *db, int num);
+simdb_num_t simdb_record_del(simdb_t *db, simdb_num_t num);
 
 /**
  * @brief Get record bitmap
@@ -192,12 +636,62 @@ int simdb_record_del(simdb_t *db, int num);
  * @retval >0 on success (this is size of allocated bitmap in bytes)
  * @note Don't forget to free() bitmap on success
  */
-int simdb_record_bitmap(simdb_t *db, int num, char **map, size_t *side);
+int simdb_record_bitmap(simdb_t *db, simdb_num_t num, char **map, size_t *side);
+
+/**
+ * @brief Get packed record bitmap, without unpacking
+ * @param db  Database handle
+ * @param num Number of record
+ * @param map Storage for bitmap, @ref SIMDB_BITMAP_SIZE bytes
+ * @retval <0 on error
+ * @retval  0 if record not exists or unused
+ * @retval  1 on success
+ */
+int simdb_record_bitmap_raw(simdb_t *db, simdb_num_t num, unsigned char *map);
+
+/**
+ * @brief Count set bits of packed bitmap
+ * @param map Bitmap, see @ref SIMDBBitmap
+ * @returns Set bits count (0-256)
+ */
+int simdb_bitmap_popcount(const unsigned char *map);
+
+/**
+ * @brief Count differing bits of two packed bitmaps
+ * @param a First bitmap
+ * @param b Second bitmap
+ * @returns Differing bits count (0-256)
+ */
+int simdb_bitmap_distance(const unsigned char *a, const unsigned char *b);
+
+/**
+ * @brief Get bitmap of differing bits
+ * @param a   First bitmap
+ * @param b   Second bitmap
+ * @param out Storage for result, @ref SIMDB_BITMAP_SIZE bytes, may be same as @a a or @a b
+ */
+void simdb_bitmap_xor(const unsigned char *a, const unsigned char *b, unsigned char *out);
+
+/**
+ * @brief Count differing bits of two packed bitmaps, row by row
+ * @param a    First bitmap
+ * @param b    Second bitmap
+ * @param rows Storage for counts, @ref SIMDB_BITMAP_SIDE items (0-16 each)
+ * @returns Differing bits count, same as @ref simdb_bitmap_distance()
+ */
+int simdb_bitmap_row_diff(const unsigned char *a, const unsigned char *b, int *rows);
+
+/**
+ * @brief Unpack bitmap to caller-provided buffer, one byte (0 or 1) per bit
+ * @param map Bitmap
+ * @param buf Storage for unpacked bitmap, @ref SIMDB_BITMAP_BITS bytes
+ */
+void simdb_bitmap_unpack_into(const unsigned char *map, char *buf);
 
 /**
  * @brief Get database capacity
  */
-int simdb_records_count(simdb_t * const db);
+simdb_num_t simdb_records_count(simdb_t * const db);
 
 /**
   * @brief Fills buffer 'map' according to records existense in database
@@ -205,7 +699,7 @@ int simdb_records_count(simdb_t * const db);
   * @param map Pointer to storage for generated usage map (allocated)
   * @returns records processed (and also buffer size)
 */
-int simdb_usage_map(simdb_t * const db, char ** const map);
+simdb_num_t simdb_usage_map(simdb_t * const db, char ** const map);
 
 /**
  * @brief   Fills buffer 'map' according to records existense in given range
@@ -215,6 +709,6 @@ int simdb_usage_map(simdb_t * const db, char ** const map);
  * @param   limit   Slice size
  * @returns Records processed (and also buffer size)
 */
-int simdb_usage_slice(simdb_t * const db, char ** const map, int offset, int limit);
+int simdb_usage_slice(simdb_t * const db, char ** const map, simdb_num_t offset, int limit);
 
 #endif /* HAS_SIMDB_H */
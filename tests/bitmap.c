@@ -37,5 +37,72 @@ main() {
   ret = simdb_bitmap_compare(a, b);
   assert(ret == 256);
 
+  /* transforms */
+  unsigned char t[SIMDB_BITMAP_SIZE], u[SIMDB_BITMAP_SIZE];
+  unsigned char all[SIMDB_TRANSFORMS][SIMDB_BITMAP_SIZE];
+  int best = -1;
+
+  memset (a, 0x00, sizeof(a));
+  a[0] = 0x02; /* x = 1, y = 0 */
+  simdb_bitmap_transform(a, t, SIMDB_BITMAP_SIDE, SIMDB_TRANSFORM_ROT90);
+  assert(t[0] == 0x0 && t[SIMDB_BITMAP_SIZE - 1] == 0x0);
+  assert(t[2 * 1 + 1] == 0x80); /* x = 15, y = 1 */
+  simdb_bitmap_transform(a, t, SIMDB_BITMAP_SIDE, SIMDB_TRANSFORM_FLIP_H);
+  assert(t[1] == 0x40);         /* x = 14, y = 0 */
+  simdb_bitmap_transform(a, t, SIMDB_BITMAP_SIDE, SIMDB_TRANSFORM_TRANSPOSE);
+  assert(t[2] == 0x01);         /* x = 0, y = 1 */
+
+  for (size_t i = 0; i < sizeof(a); i++)
+    a[i] = (i * 37 + 11) & 0xFF;
+  simdb_bitmap_transform(a, t, SIMDB_BITMAP_SIDE, SIMDB_TRANSFORM_ROT90);
+  simdb_bitmap_transform(t, u, SIMDB_BITMAP_SIDE, SIMDB_TRANSFORM_ROT270);
+  assert(memcmp(a, u, sizeof(a)) == 0);
+  simdb_bitmap_transform(a, t, SIMDB_BITMAP_SIDE, SIMDB_TRANSFORM_FLIP_V);
+  simdb_bitmap_transform(t, u, SIMDB_BITMAP_SIDE, SIMDB_TRANSFORM_FLIP_V);
+  assert(memcmp(a, u, sizeof(a)) == 0);
+
+  for (int i = 0; i < SIMDB_TRANSFORMS; i++)
+    simdb_bitmap_transform(a, all[i], SIMDB_BITMAP_SIDE, i);
+  ret = simdb_bitmap_compare_multi(all[SIMDB_TRANSFORM_TRANSVERSE], all[0], SIMDB_TRANSFORMS_ALL, &best);
+  assert(ret == 0);
+  assert(best == SIMDB_TRANSFORM_TRANSVERSE);
+  ret = simdb_bitmap_compare_multi(all[SIMDB_TRANSFORM_ROT180], all[0], 0x1, &best);
+  assert(ret == simdb_bitmap_compare(all[SIMDB_TRANSFORM_ROT180], a));
+  assert(best == SIMDB_TRANSFORM_NONE);
+
+  /* packed operations */
+  int rows[SIMDB_BITMAP_SIDE];
+  char bytes[SIMDB_BITMAP_BITS], *alloc = NULL;
+
+  memset (a, 0x00, sizeof(a));
+  memset (b, 0x00, sizeof(b));
+  a[0] = 0x81;  /* row 0: x = 0, x = 7 */
+  a[3] = 0x80;  /* row 1: x = 15 */
+  b[0] = 0x01;
+  b[31] = 0xFF; /* row 15: x = 8..15 */
+  assert(simdb_bitmap_popcount(a) == 3);
+  assert(simdb_bitmap_popcount(b) == 9);
+  assert(simdb_bitmap_distance(a, b) == 10);
+
+  ret = simdb_bitmap_row_diff(a, b, rows);
+  assert(ret == 10);
+  assert(rows[0] == 1 && rows[1] == 1 && rows[15] == 8);
+  assert(rows[2] == 0 && rows[14] == 0);
+
+  simdb_bitmap_xor(a, b, t);
+  assert(t[0] == 0x80 && t[3] == 0x80 && t[31] == 0xFF);
+  assert(simdb_bitmap_popcount(t) == 10);
+
+  simdb_bitmap_unpack_into(a, bytes);
+  for (int i = 0; i < SIMDB_BITMAP_BITS; i++)
+    assert(bytes[i] == ((i == 0 || i == 7 || i == 31) ? 1 : 0));
+
+  for (size_t i = 0; i < sizeof(a); i++)
+    a[i] = (i * 37 + 11) & 0xFF;
+  assert(simdb_bitmap_unpack(a, &alloc) == SIMDB_BITMAP_BITS);
+  for (int i = 0; i < SIMDB_BITMAP_BITS; i++)
+    assert(alloc[i] == ((a[i / 8] >> (i % 8)) & 0x1));
+  free(alloc);
+
   return 0;
 }
@@ -0,0 +1,184 @@
+#include "../src/common.h"
+#include "../src/record.h"
+#include "../src/io.h"
+#include "../src/simdb.h"
+
+#define RECORDS 6
+
+/* check group of record 'num' is exactly 'count' members from 'want' */
+static void
+check_group(simdb_t *db, simdb_num_t num, const simdb_num_t *want, int count) {
+  simdb_num_t *nums = NULL;
+  simdb_num_t ret = 0;
+
+  ret = simdb_cluster_get(db, num, &nums);
+  assert(ret == count);
+  for (int i = 0; i < count; i++)
+    assert(nums[i] == want[i]);
+  FREE(nums);
+}
+
+int main() {
+  simdb_t *db;
+  simdb_search_t link;
+  simdb_urec_t rec[RECORDS];
+  simdb_num_t *nums = NULL, a = 0, b = 0;
+  char *path = "test-cluster.db";
+  char *clu_path = "test-cluster.db.clu";
+  int mode = SIMDB_FLAG_WRITE, ret = 0;
+
+  unlink(path);
+  unlink(clu_path);
+
+  ret = simdb_create(path);
+  assert(ret == true);
+
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+
+  /* chain 1 - 3 - 5, 10 bits between neighbours, 20 bits between 1 and 5;
+   * pair 2 - 4; 6 alone */
+  memset(rec, 0x0, sizeof(rec));
+  srand(42);
+  for (int i = 0; i < RECORDS; i++) {
+    rec[i].used = 0xFF;
+    for (size_t j = 0; j < sizeof(rec[i].bitmap); j++)
+      rec[i].bitmap[j] = rand() & 0xFF;
+  }
+  memcpy(rec[2].bitmap, rec[0].bitmap, sizeof(rec[0].bitmap));
+  rec[2].bitmap[0] ^= 0xFF;
+  rec[2].bitmap[1] ^= 0x03;
+  memcpy(rec[4].bitmap, rec[2].bitmap, sizeof(rec[2].bitmap));
+  rec[4].bitmap[8] ^= 0xFF;
+  rec[4].bitmap[9] ^= 0x03;
+  memcpy(rec[3].bitmap, rec[1].bitmap, sizeof(rec[1].bitmap));
+  rec[3].bitmap[20] ^= 0x01;
+  ret = simdb_write(db, 1, RECORDS, rec);
+  assert(ret == RECORDS);
+
+  /* not set up */
+  assert(simdb_cluster_get(db, 1, &nums) == SIMDB_ERR_USAGE);
+
+  simdb_search_init(&link);
+  link.d_ratio = 0.0;
+  link.d_color = 0.0;
+
+  /* LSH mode without index */
+  link.mode = SIMDB_SEARCH_LSH;
+  assert(simdb_cluster_setup(db, &link) == SIMDB_ERR_USAGE);
+  link.mode = SIMDB_SEARCH_EXACT;
+
+  ret = simdb_cluster_setup(db, &link);
+  assert(ret == SIMDB_SUCCESS);
+  assert(access(clu_path, F_OK) == 0);
+
+  check_group(db, 5, (simdb_num_t []) { 1, 3, 5 }, 3);
+  check_group(db, 2, (simdb_num_t []) { 2, 4 }, 2);
+  check_group(db, 6, (simdb_num_t []) { 6 }, 1);
+  assert(simdb_cluster_get(db, 7, &nums) == 0);
+
+  /* deleted record leaves group, group not split */
+  ret = simdb_record_del(db, 3);
+  assert(ret == 3);
+  check_group(db, 1, (simdb_num_t []) { 1, 5 }, 2);
+  assert(simdb_cluster_get(db, 3, &nums) == 0);
+
+  /* added record joins group of its copy */
+  srand(7);
+  a = simdb_record_add(db, 0, ".", 0);
+  assert(a == RECORDS + 1);
+  check_group(db, a, (simdb_num_t []) { a }, 1);
+  srand(7);
+  b = simdb_record_add(db, 0, ".", 0);
+  assert(b == RECORDS + 2);
+  check_group(db, a, (simdb_num_t []) { a, b }, 2);
+
+  /* replaced record moves to new group */
+  srand(99);
+  ret = simdb_record_add(db, a, ".", 0);
+  assert(ret == a);
+  check_group(db, b, (simdb_num_t []) { b }, 1);
+  check_group(db, a, (simdb_num_t []) { a }, 1);
+
+  simdb_close(db);
+
+  /* table reused by other handle: 1 and 5 still linked */
+  db = simdb_open(path, 0, &ret);
+  assert(db != NULL);
+  ret = simdb_cluster_setup(db, &link);
+  assert(ret == SIMDB_SUCCESS);
+  check_group(db, 5, (simdb_num_t []) { 1, 5 }, 2);
+  check_group(db, 4, (simdb_num_t []) { 2, 4 }, 2);
+
+  /* other parameters: never rebuilt, table of other writer kept */
+  link.d_bitmap = 0.05;
+  ret = simdb_cluster_setup(db, &link);
+  assert(ret == SIMDB_ERR_NOINDEX);
+  assert(simdb_cluster_get(db, 5, &nums) == SIMDB_ERR_USAGE);
+  link.d_bitmap = 0.07;
+
+  /* disabled */
+  ret = simdb_cluster_setup(db, NULL);
+  assert(ret == SIMDB_SUCCESS);
+  assert(simdb_cluster_get(db, 1, &nums) == SIMDB_ERR_USAGE);
+
+  simdb_close(db);
+
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+  link.d_bitmap = 0.05;
+  assert(simdb_cluster_setup(db, &link) == SIMDB_ERR_NOINDEX);
+  link.d_bitmap = 0.07;
+
+  /* writer attaches stored table, and keeps it current */
+  assert(simdb_indexes_setup(db) == SIMDB_SUCCESS);
+  check_group(db, 5, (simdb_num_t []) { 1, 5 }, 2);
+  srand(7);
+  b = simdb_record_add(db, 0, ".", 0);
+  assert(b == RECORDS + 3);
+  check_group(db, b, (simdb_num_t []) { RECORDS + 2, b }, 2);
+
+  /* changed by other process: lookups fail until set up again */
+  simdb_t *other = simdb_open(path, mode, &ret);
+  assert(other != NULL);
+  ret = simdb_write(other, 2, 1, &rec[1]);
+  assert(ret == 1);
+  simdb_close(other);
+  assert(simdb_refresh(db) == 1);
+  assert(simdb_cluster_get(db, 5, &nums) == SIMDB_ERR_NOINDEX);
+
+  /* read-only handle doesn't rebuild out of date table */
+  other = simdb_open(path, 0, &ret);
+  assert(other != NULL);
+  assert(simdb_cluster_setup(other, &link) == SIMDB_ERR_NOINDEX);
+
+  /* rebuilt by writer: 1 and 5 linked only through deleted 3 before */
+  ret = simdb_cluster_setup(db, &link);
+  assert(ret == SIMDB_SUCCESS);
+  assert(simdb_cluster_setup(other, &link) == SIMDB_SUCCESS);
+  check_group(other, 5, (simdb_num_t []) { 5 }, 1);
+  check_group(other, 2, (simdb_num_t []) { 2, 4 }, 2);
+  simdb_close(other);
+
+  /* vacuum renumbers groups: 3 unused, so 4 -> 3, 5 -> 4 and so on */
+  ret = simdb_vacuum(db, NULL, 0);
+  assert(ret == RECORDS + 2);
+  check_group(db, 4, (simdb_num_t []) { 4 }, 1);
+  check_group(db, 2, (simdb_num_t []) { 2, 3 }, 2);
+  check_group(db, RECORDS + 2, (simdb_num_t []) { RECORDS + 1, RECORDS + 2 }, 2);
+  assert(simdb_cluster_get(db, RECORDS + 3, &nums) == 0);
+  simdb_close(db);
+
+  /* and stays synced for others */
+  db = simdb_open(path, 0, &ret);
+  assert(db != NULL);
+  assert(simdb_cluster_setup(db, &link) == SIMDB_SUCCESS);
+  check_group(db, 6, (simdb_num_t []) { 6 }, 1);
+  check_group(db, RECORDS + 1, (simdb_num_t []) { RECORDS + 1, RECORDS + 2 }, 2);
+  simdb_close(db);
+
+  unlink(path);
+  unlink(clu_path);
+
+  return 0;
+}
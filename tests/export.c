@@ -0,0 +1,125 @@
+#include "../src/common.h"
+#include "../src/record.h"
+#include "../src/io.h"
+#include "../src/simdb.h"
+
+/* export used records of 'from' and import them to 'to' */
+static int
+roundtrip(simdb_t *from, simdb_t *to, int format, int shift, int flags) {
+  char *stream = "test-export.stream";
+  int fd = -1, ret = 0;
+
+  fd = open(stream, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0);
+
+  ret = simdb_export(from, fd, format, 1, 0);
+  assert(ret >= 0);
+
+  lseek(fd, 0, SEEK_SET);
+  ret = simdb_import(to, fd, format, shift, flags);
+
+  close(fd);
+  unlink(stream);
+
+  return ret;
+}
+
+int main() {
+  simdb_t *src, *dst;
+  simdb_urec_t rec[4], *data = NULL;
+  char *path_src = "test-export-src.db";
+  char *path_dst = "test-export-dst.db";
+  int mode = SIMDB_FLAG_WRITE, ret = 0;
+
+  unlink(path_src);
+  unlink(path_dst);
+  assert(simdb_create(path_src) == true);
+  assert(simdb_create(path_dst) == true);
+
+  src = simdb_open(path_src, mode, &ret);
+  assert(src != NULL);
+  dst = simdb_open(path_dst, mode, &ret);
+  assert(dst != NULL);
+
+  for (int i = 0; i < 4; i++) {
+    memset(&rec[i], 0xA0 + i, SIMDB_REC_LEN);
+    rec[i].used = 1;
+  }
+  rec[2].used = 0; /* gap in stream */
+  ret = simdb_write(src, 1, 4, rec);
+  assert(ret == 4);
+
+  /* bad arguments */
+  ret = simdb_export(src, 1, 5, 1, 0);
+  assert(ret == SIMDB_ERR_USAGE);
+  ret = simdb_export(src, 1, SIMDB_EXPORT_BINARY, 0, 0);
+  assert(ret == SIMDB_ERR_USAGE);
+
+  /* ids preserved, unused record skipped */
+  ret = roundtrip(src, dst, SIMDB_EXPORT_BINARY, 0, 0);
+  assert(ret == 3);
+  assert(simdb_records_count(dst) == 4);
+  ret = simdb_read(dst, 1, 4, &data);
+  assert(ret == 4);
+  assert(memcmp(&data[0], &rec[0], SIMDB_REC_LEN) == 0);
+  assert(memcmp(&data[1], &rec[1], SIMDB_REC_LEN) == 0);
+  assert(data[2].used == 0);
+  assert(memcmp(&data[3], &rec[3], SIMDB_REC_LEN) == 0);
+  free(data);
+
+  /* ids shifted */
+  ret = roundtrip(src, dst, SIMDB_EXPORT_HEX, 10, 0);
+  assert(ret == 3);
+  assert(simdb_records_count(dst) == 14);
+  ret = simdb_read(dst, 11, 4, &data);
+  assert(ret == 4);
+  assert(memcmp(&data[0], &rec[0], SIMDB_REC_LEN) == 0);
+  assert(data[2].used == 0);
+  assert(memcmp(&data[3], &rec[3], SIMDB_REC_LEN) == 0);
+  free(data);
+
+  /* ids remapped to end of database */
+  ret = roundtrip(src, dst, SIMDB_EXPORT_HEX, 0, SIMDB_ADD_APPEND);
+  assert(ret == 3);
+  assert(simdb_records_count(dst) == 17);
+  ret = simdb_read(dst, 15, 3, &data);
+  assert(ret == 3);
+  assert(memcmp(&data[0], &rec[0], SIMDB_REC_LEN) == 0);
+  assert(memcmp(&data[1], &rec[1], SIMDB_REC_LEN) == 0);
+  assert(memcmp(&data[2], &rec[3], SIMDB_REC_LEN) == 0);
+  free(data);
+
+  /* existing records kept */
+  ret = simdb_record_del(dst, 2);
+  assert(ret == 2);
+  ret = roundtrip(src, dst, SIMDB_EXPORT_BINARY, 0, SIMDB_ADD_NOREPLACE);
+  assert(ret == 1); /* only deleted one */
+  assert(simdb_record_used(dst, 2) == true);
+
+  /* database not extended */
+  ret = roundtrip(src, dst, SIMDB_EXPORT_BINARY, 15, SIMDB_ADD_NOEXTEND);
+  assert(ret == 2); /* 16, 17 written, 19 dropped */
+  assert(simdb_records_count(dst) == 17);
+
+  /* record numbers out of range */
+  ret = roundtrip(src, dst, SIMDB_EXPORT_BINARY, -1, 0);
+  assert(ret == SIMDB_ERR_USAGE);
+
+  simdb_close(src);
+  simdb_close(dst);
+
+  /* read-only database */
+  dst = simdb_open(path_dst, 0, &ret);
+  assert(dst != NULL);
+  src = simdb_open(path_src, 0, &ret);
+  assert(src != NULL);
+  ret = roundtrip(src, dst, SIMDB_EXPORT_BINARY, 0, 0);
+  assert(ret == SIMDB_ERR_READONLY);
+  simdb_close(src);
+  simdb_close(dst);
+
+  unlink(path_src);
+  unlink(path_dst);
+
+  return 0;
+}
@@ -81,6 +81,47 @@ int main() {
   ret = simdb_read(db, 3, 4, &data);
   assert(ret == 0);
 
+  /* packed bitmap */
+  unsigned char map[SIMDB_BITMAP_SIZE];
+  ret = simdb_record_bitmap_raw(db, 2, map);
+  assert(ret == 1);
+  assert(memcmp(map, rec[1].bitmap, SIMDB_BITMAP_SIZE) == 0);
+  ret = simdb_record_bitmap_raw(db, 3, map);
+  assert(ret == 0);
+  ret = simdb_record_bitmap_raw(db, 0, map);
+  assert(ret == SIMDB_ERR_USAGE);
+
+  /* changes made with other handle */
+  simdb_t *other = simdb_open(path, 0, &ret);
+  assert(other != NULL);
+  ret = simdb_refresh(other);
+  assert(ret == 0);
+
+  ret = simdb_write(db, 3, 2, rec);
+  assert(ret == 2);
+  ret = simdb_records_count(other);
+  assert(ret == 2); /* not seen yet */
+  ret = simdb_refresh(other);
+  assert(ret == 1);
+  ret = simdb_records_count(other);
+  assert(ret == 4);
+  ret = simdb_refresh(other);
+  assert(ret == 0);
+  simdb_close(other);
+
+  /* record numbers beyond 32 bits, file is sparse */
+  simdb_num_t big = ((simdb_num_t) 1 << 32) + 3;
+  ret = simdb_write(db, big, 1, &rec[1]);
+  assert(ret == 1);
+  assert(simdb_records_count(db) == big);
+  assert(simdb_record_used(db, big));
+  assert(!simdb_record_used(db, big - 1));
+  ret = simdb_record_bitmap_raw(db, big, map);
+  assert(ret == 1);
+  assert(memcmp(map, rec[1].bitmap, SIMDB_BITMAP_SIZE) == 0);
+  assert(simdb_record_del(db, big) == big);
+  assert(!simdb_record_used(db, big));
+
   simdb_close(db);
 
   unlink(path);
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE 1 /* usleep */
+
+#include "../src/common.h"
+#include "../src/record.h"
+#include "../src/io.h"
+#include "../src/lock.h"
+#include "../src/simdb.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define WRITERS 4
+#define APPENDS 100
+
+/* one handle shared by threads: writer rewrites whole range, readers read part of it */
+#define SHARED_RECORDS 262144
+#define SHARED_WRITES  20
+#define SHARED_READERS 4
+#define PART_START     65537
+#define PART_RECORDS   131072
+
+static simdb_t *shared = NULL;
+static bool shared_done = false;
+
+static void *
+shared_writer(void *arg) {
+  simdb_urec_t *recs = calloc(SHARED_RECORDS, sizeof(simdb_urec_t));
+
+  (void) arg;
+  assert(recs != NULL);
+  for (int i = 0; i < SHARED_WRITES; i++) {
+    memset(recs, 1 + i % 0xFE, sizeof(simdb_urec_t) * SHARED_RECORDS);
+    assert(simdb_write(shared, 1, SHARED_RECORDS, recs) == SHARED_RECORDS);
+  }
+  __atomic_store_n(&shared_done, true, __ATOMIC_RELEASE);
+  free(recs);
+
+  return NULL;
+}
+
+static void *
+shared_reader(void *arg) {
+  simdb_urec_t *data = NULL;
+
+  (void) arg;
+  while (!__atomic_load_n(&shared_done, __ATOMIC_ACQUIRE)) {
+    assert(simdb_read(shared, PART_START, PART_RECORDS, &data) == PART_RECORDS);
+    FREE(data);
+    usleep(1000); /* let writer in, locks are not fair */
+  }
+
+  return NULL;
+}
+
+/* other process: part read under own shared lock is never half-written,
+ * until parent closes pipe; then no locks left on file */
+static int
+shared_checker(const char *path, int pipe) {
+  struct pollfd pfd = { .fd = pipe, .events = POLLIN };
+  size_t len = (size_t) SIMDB_REC_LEN * PART_RECORDS;
+  off_t offset = (off_t) SIMDB_REC_LEN * PART_START;
+  unsigned char *buf = malloc(len);
+  struct flock fl;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || buf == NULL)
+    return 1;
+
+  while (poll(&pfd, 1, 0) == 0) {
+    if (simdb_lock_range(fd, F_RDLCK, offset, len, true) < 0)
+      return 1;
+    if (pread(fd, buf, len, offset) != (ssize_t) len)
+      return 1;
+    for (size_t i = 1; i < len; i++) {
+      if (buf[i] != buf[0])
+        return 2;
+    }
+    simdb_lock_range(fd, F_UNLCK, offset, len, true);
+  }
+
+  memset(&fl, 0x0, sizeof(fl));
+  fl.l_type   = F_RDLCK;
+  fl.l_whence = SEEK_SET;
+  if (fcntl(fd, F_GETLK, &fl) < 0 || fl.l_type != F_UNLCK)
+    return 3;
+
+  close(fd);
+  free(buf);
+  return 0;
+}
+
+int main() {
+  simdb_t *db;
+  simdb_urec_t rec;
+  char *path = "test-lock.db";
+  char *map = NULL;
+  int mode = 0, ret = 0, fd = -1, status = 0;
+
+  unlink(path);
+  ret = simdb_create(path);
+  assert(ret == true);
+
+  /* concurrent appends from many processes */
+  mode = SIMDB_FLAG_WRITE | SIMDB_FLAG_LOCKRANGE;
+  for (int i = 0; i < WRITERS; i++) {
+    if (fork() != 0)
+      continue;
+    db = simdb_open(path, mode, &ret);
+    if (db == NULL)
+      _exit(1);
+    for (int j = 0; j < APPENDS; j++) {
+      if (simdb_record_add(db, 0, ".", 0) <= 0)
+        _exit(1);
+    }
+    simdb_close(db);
+    _exit(0);
+  }
+  for (int i = 0; i < WRITERS; i++) {
+    assert(wait(&status) > 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+
+  db = simdb_open(path, mode | SIMDB_FLAG_LOCKNB, &ret);
+  assert(db != NULL);
+  ret = simdb_usage_map(db, &map);
+  assert(ret == WRITERS * APPENDS);
+  for (int i = 0; i < ret; i++)
+    assert(map[i] == 0x1);
+  free(map);
+
+  /* other open file description holds lock on record #10 */
+  fd = open(path, O_RDWR);
+  assert(fd >= 0);
+  ret = simdb_lock_range(fd, F_WRLCK, 10 * SIMDB_REC_LEN, SIMDB_REC_LEN, false);
+  assert(ret == SIMDB_SUCCESS);
+
+  memset(&rec, 0xAA, sizeof(rec));
+  ret = simdb_write(db, 10, 1, &rec);
+  assert(ret == SIMDB_ERR_LOCK);
+  ret = simdb_write(db, 11, 1, &rec);
+  assert(ret == 1); /* disjoint range */
+  assert(simdb_record_used(db, 10) == false); /* even read is blocked */
+
+  ret = simdb_lock_range(fd, F_UNLCK, 10 * SIMDB_REC_LEN, SIMDB_REC_LEN, true);
+  assert(ret == SIMDB_SUCCESS);
+  ret = simdb_write(db, 10, 1, &rec);
+  assert(ret == 1);
+  close(fd);
+
+  simdb_close(db);
+
+  /* threads of one handle don't share lock owner: read lock of one thread
+   * neither downgrades nor drops write lock of other, as seen by other process */
+  int pipes[2];
+  pthread_t writer, readers[SHARED_READERS];
+  simdb_urec_t *recs = NULL;
+  pid_t pid = 0;
+
+  shared = simdb_open(path, SIMDB_FLAG_WRITE | SIMDB_FLAG_LOCKRANGE | SIMDB_FLAG_THREADS, &ret);
+  assert(shared != NULL);
+  recs = calloc(SHARED_RECORDS, sizeof(simdb_urec_t));
+  assert(recs != NULL);
+  memset(recs, 0xFF, sizeof(simdb_urec_t) * SHARED_RECORDS);
+  assert(simdb_write(shared, 1, SHARED_RECORDS, recs) == SHARED_RECORDS);
+  free(recs);
+  assert(pipe(pipes) == 0);
+  if ((pid = fork()) == 0) {
+    close(pipes[1]);
+    _exit(shared_checker(path, pipes[0]));
+  }
+  close(pipes[0]);
+
+  assert(pthread_create(&writer, NULL, shared_writer, NULL) == 0);
+  for (int i = 0; i < SHARED_READERS; i++)
+    assert(pthread_create(&readers[i], NULL, shared_reader, NULL) == 0);
+  pthread_join(writer, NULL);
+  for (int i = 0; i < SHARED_READERS; i++)
+    pthread_join(readers[i], NULL);
+  close(pipes[1]);
+
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status));
+  assert(WEXITSTATUS(status) == 0);
+  simdb_close(shared);
+
+  unlink(path);
+
+  return 0;
+}
@@ -0,0 +1,231 @@
+#include "../src/common.h"
+#include "../src/record.h"
+#include "../src/io.h"
+#include "../src/simdb.h"
+
+#define RECORDS 2000
+#define PAIRS   200
+
+/* flip exactly 'count' distinct bits of bitmap */
+static void
+perturb(unsigned char *bitmap, int count) {
+  int bits[SIMDB_BITMAP_BITS], j = 0, tmp = 0;
+
+  for (int i = 0; i < SIMDB_BITMAP_BITS; i++)
+    bits[i] = i;
+  for (int i = 0; i < count; i++) {
+    j = i + rand() % (SIMDB_BITMAP_BITS - i);
+    tmp = bits[i], bits[i] = bits[j], bits[j] = tmp;
+    bitmap[bits[i] / 8] ^= 1 << (bits[i] % 8);
+  }
+}
+
+/* share of records 1..PAIRS finding their copy PAIRS+1.. in LSH mode, in percent */
+static int
+recall(simdb_t *db, float d_bitmap) {
+  simdb_search_t search;
+  int found = 0, ret = 0;
+
+  simdb_search_init(&search);
+  search.d_bitmap = d_bitmap;
+  search.d_ratio  = 0.0;
+  search.d_color  = 0.0;
+  search.mode     = SIMDB_SEARCH_LSH;
+  for (int i = 1; i <= PAIRS; i++) {
+    ret = simdb_search_byid(db, &search, i);
+    assert(ret >= 0);
+    for (int m = 0; m < ret; m++)
+      found += (search.matches[m].num == i + PAIRS);
+  }
+  simdb_search_free(&search);
+
+  return found * 100 / PAIRS;
+}
+
+int main() {
+  simdb_t *db;
+  simdb_search_t search;
+  simdb_search_stats_t st;
+  simdb_urec_t *rec = NULL;
+  char *path = "test-lsh.db";
+  char *lsh_path = "test-lsh.db.lsh";
+  int mode = SIMDB_FLAG_WRITE, ret = 0;
+  unsigned long candidates = 0;
+
+  unlink(path);
+  unlink(lsh_path);
+
+  ret = simdb_create(path);
+  assert(ret == true);
+
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+
+  /* random bitmaps, far from each other */
+  rec = calloc(RECORDS, sizeof(simdb_urec_t));
+  assert(rec != NULL);
+  srand(42);
+  for (int i = 0; i < RECORDS; i++) {
+    rec[i].used = 0xFF;
+    for (size_t j = 0; j < sizeof(rec[i].bitmap); j++)
+      rec[i].bitmap[j] = rand() & 0xFF;
+  }
+  /* near-duplicate of record 1, 3 bits differ */
+  memcpy(rec[99].bitmap, rec[0].bitmap, sizeof(rec[0].bitmap));
+  rec[99].bitmap[3]  ^= 0x01;
+  rec[99].bitmap[17] ^= 0x10;
+  rec[99].bitmap[30] ^= 0x80;
+
+  ret = simdb_write(db, 1, RECORDS, rec);
+  assert(ret == RECORDS);
+
+  simdb_search_init(&search);
+  search.d_ratio = 0.0;
+  search.d_color = 0.0;
+  search.stats   = &st;
+
+  /* no index yet */
+  search.mode = SIMDB_SEARCH_LSH;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == SIMDB_ERR_USAGE);
+
+  /* bad parameters */
+  assert(simdb_lsh_setup(db, 65, 12) == SIMDB_ERR_USAGE);
+  assert(simdb_lsh_setup(db, 16, 16) == SIMDB_ERR_USAGE);
+
+  ret = simdb_lsh_setup(db, 32, 14);
+  assert(ret == SIMDB_SUCCESS);
+  assert(access(lsh_path, F_OK) == 0);
+
+  /* same match as exact search, but only few records checked */
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 100);
+  assert(st.candidates > 0);
+  assert(st.scanned < RECORDS / 10);
+
+  search.mode = SIMDB_SEARCH_EXACT;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 100);
+  assert(st.scanned == RECORDS);
+
+  /* probes widen search */
+  search.mode = SIMDB_SEARCH_LSH;
+  search.lsh_probes = 2;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  search.lsh_probes = 0;
+
+  /* range applied to candidates before reading */
+  search.first = 101;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 0);
+  assert(st.filtered > 0);
+  search.first = 0;
+
+  /* new record indexed on write */
+  memcpy(&rec[RECORDS - 1], &rec[99], sizeof(simdb_urec_t));
+  ret = simdb_write(db, RECORDS + 1, 1, &rec[RECORDS - 1]);
+  assert(ret == 1);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 2);
+  assert(search.matches[0].num == 100);
+  assert(search.matches[1].num == RECORDS + 1);
+
+  /* deleted record leaves buckets */
+  candidates = st.candidates;
+  ret = simdb_record_del(db, 100);
+  assert(ret == 100);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == RECORDS + 1);
+  assert(st.candidates < candidates);
+
+  simdb_close(db);
+
+  /* index file reused by other handle */
+  db = simdb_open(path, 0, &ret);
+  assert(db != NULL);
+  ret = simdb_lsh_setup(db, 32, 14);
+  assert(ret == SIMDB_SUCCESS);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == RECORDS + 1);
+
+  /* index disabled */
+  ret = simdb_lsh_setup(db, 0, 0);
+  assert(ret == SIMDB_SUCCESS);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == SIMDB_ERR_USAGE);
+
+  /* read-only handle never rebuilds: other parameters or no file */
+  assert(simdb_lsh_setup(db, 16, 12) == SIMDB_ERR_NOINDEX);
+  unlink(lsh_path);
+  assert(simdb_lsh_setup(db, 32, 14) == SIMDB_ERR_NOINDEX);
+
+  simdb_search_free(&search);
+  simdb_close(db);
+
+  /* writer attaches existing index and keeps it current for readers */
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+  assert(simdb_indexes_setup(db) == SIMDB_SUCCESS);
+  assert(simdb_lsh_setup(db, 32, 14) == SIMDB_SUCCESS);
+  simdb_close(db);
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+  assert(simdb_indexes_setup(db) == SIMDB_SUCCESS);
+  ret = simdb_write(db, RECORDS + 2, 1, &rec[RECORDS - 1]);
+  assert(ret == 1);
+  simdb_close(db);
+  db = simdb_open(path, 0, &ret);
+  assert(db != NULL);
+  assert(simdb_lsh_setup(db, 32, 14) == SIMDB_SUCCESS);
+  simdb_search_init(&search);
+  search.d_ratio = 0.0;
+  search.d_color = 0.0;
+  search.mode    = SIMDB_SEARCH_LSH;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 2);
+  assert(search.matches[1].num == RECORDS + 2);
+  simdb_search_free(&search);
+  simdb_close(db);
+
+  unlink(path);
+  unlink(lsh_path);
+
+  /* recall: copies with 20% and 30% of bits flipped found at these thresholds */
+  ret = simdb_create(path);
+  assert(ret == true);
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+  srand(7);
+  for (int i = 0; i < PAIRS; i++) {
+    for (size_t j = 0; j < sizeof(rec[i].bitmap); j++)
+      rec[i].bitmap[j] = rand() & 0xFF;
+    rec[PAIRS + i] = rec[i];
+    perturb(rec[PAIRS + i].bitmap, SIMDB_BITMAP_BITS * 20 / 100);
+  }
+  ret = simdb_write(db, 1, PAIRS * 2, rec);
+  assert(ret == PAIRS * 2);
+  ret = simdb_lsh_setup(db, 32, 14);
+  assert(ret == SIMDB_SUCCESS);
+  assert(recall(db, 0.20) >= 95);
+
+  for (int i = 0; i < PAIRS; i++) {
+    rec[PAIRS + i] = rec[i];
+    perturb(rec[PAIRS + i].bitmap, SIMDB_BITMAP_BITS * 30 / 100);
+  }
+  ret = simdb_write(db, PAIRS + 1, PAIRS, &rec[PAIRS]);
+  assert(ret == PAIRS);
+  assert(recall(db, 0.30) >= 95);
+
+  simdb_close(db);
+  free(rec);
+
+  unlink(path);
+  unlink(lsh_path);
+
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include "../src/common.h"
+#include "../src/record.h"
+#include "../src/io.h"
+#include "../src/metrics.h"
+#include "../src/simdb.h"
+
+int main() {
+  simdb_t *db;
+  simdb_metrics_t metrics;
+  simdb_histogram_t hist;
+  simdb_search_t search;
+  simdb_urec_t rec[2];
+  char *path = "test-metrics.db";
+  uint64_t values[] = { 0, 1, 3, 4, 5, 7, 8, 1000, 1023, 1024, 123456789, 1ULL << 40 };
+  int mode = 0, ret = 0, bucket = 0;
+
+  /* buckets */
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    bucket = simdb_histogram_bucket(values[i]);
+    assert(bucket >= 0 && bucket < SIMDB_HIST_BUCKETS);
+    if (bucket == SIMDB_HIST_BUCKETS - 1)
+      continue; /* overflow */
+    assert(simdb_histogram_bound(bucket) >= values[i]);
+    if (bucket > 0)
+      assert(simdb_histogram_bound(bucket - 1) < values[i]);
+  }
+  for (int i = 1; i < SIMDB_HIST_BUCKETS; i++)
+    assert(simdb_histogram_bound(i) > simdb_histogram_bound(i - 1));
+
+  /* percentiles */
+  memset(&hist, 0x0, sizeof(hist));
+  assert(simdb_histogram_percentile(&hist, 0.5) == 0.0);
+  hist.count = 100;
+  hist.max   = 1.0;
+  hist.buckets[simdb_histogram_bucket(1000)]    = 90;
+  hist.buckets[simdb_histogram_bucket(1000000)] = 10;
+  assert(simdb_histogram_percentile(&hist, 0.50) < 1.5e-6);
+  assert(simdb_histogram_percentile(&hist, 0.90) < 1.5e-6);
+  assert(simdb_histogram_percentile(&hist, 0.99) > 0.9e-3);
+  assert(simdb_histogram_percentile(&hist, 0.99) < 1.5e-3);
+
+  /* database metrics */
+  unlink(path);
+  ret = simdb_create(path);
+  assert(ret == true);
+
+  db = simdb_open(path, SIMDB_FLAG_WRITE, &ret);
+  assert(db != NULL);
+  assert(simdb_metrics_get(db, &metrics) == false);
+  simdb_close(db);
+
+  mode = SIMDB_FLAG_WRITE | SIMDB_FLAG_METRICS;
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+
+  memset(rec, 0xAA, sizeof(rec));
+  ret = simdb_write(db, 1, 2, rec);
+  assert(ret == 2);
+
+  simdb_search_init(&search);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  simdb_search_free(&search);
+
+  ret = simdb_record_del(db, 2);
+  assert(ret == 2);
+
+  assert(simdb_metrics_get(db, &metrics) == true);
+  assert(metrics.search.count == 1);
+  assert(metrics.del.count    == 1);
+  assert(metrics.add.count    == 0);
+  assert(metrics.write_calls  == 2);
+  assert(metrics.write_bytes  == 3 * SIMDB_REC_LEN);
+  assert(metrics.read_calls   >= 3);
+
+  simdb_metrics_reset(db);
+  assert(simdb_metrics_get(db, &metrics) == true);
+  assert(metrics.search.count == 0);
+  assert(metrics.write_calls  == 0);
+
+  simdb_close(db);
+  unlink(path);
+
+  return 0;
+}
@@ -0,0 +1,4 @@
+/* same sampler without size hint, for comparison with reduced decode */
+#define MAGICK_HINT_SIDE 0
+#define simdb_record_create simdb_record_create_full
+#include "../src/samplers/magick.c"
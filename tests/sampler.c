@@ -0,0 +1,51 @@
+#include "../src/common.h"
+#include "../src/bitmap.h"
+#include "../src/phash.h"
+#include "../src/record.h"
+#include "../src/simdb.h"
+
+#include <wand/magick_wand.h>
+
+#define WIDTH  2400
+#define HEIGHT 1800
+
+/* sampler without size hint, see sampler-full.c */
+simdb_urec_t * simdb_record_create_full(const char * const path, simdb_hrec_t *hires);
+
+/* same JPEG decoded at reduced size and in full gives nearly same record */
+int main() {
+  MagickWand *wand = NULL;
+  simdb_urec_t *reduced = NULL, *full = NULL;
+  simdb_hrec_t reduced_hr, full_hr;
+  char *path = "test-sampler.jpg";
+
+  InitializeMagick("/");
+  wand = NewMagickWand();
+  assert(MagickSetSize(wand, WIDTH, HEIGHT) == MagickPass);
+  assert(MagickReadImage(wand, "plasma:fractal") == MagickPass);
+  assert(MagickSetCompressionQuality(wand, 95) == MagickPass);
+  assert(MagickWriteImage(wand, path) == MagickPass);
+  DestroyMagickWand(wand);
+
+  reduced = simdb_record_create(path, &reduced_hr);
+  full = simdb_record_create_full(path, &full_hr);
+  assert(reduced != NULL && full != NULL);
+
+  /* real size, not size of reduced image */
+  assert(reduced->image_w == WIDTH && reduced->image_h == HEIGHT);
+  assert(full->image_w == WIDTH && full->image_h == HEIGHT);
+
+  /* well below default search thresholds (7% of bits, 16 bits of phash, 10% of color) */
+  assert(simdb_bitmap_compare(reduced->bitmap, full->bitmap) <= SIMDB_BITMAP_BITS * 3 / 100);
+  assert(simdb_bitmap_compare_hr(reduced_hr.bitmap, full_hr.bitmap) <= SIMDB_BITMAP_HR_BITS * 4 / 100);
+  assert(simdb_phash_compare(reduced->phash, full->phash) <= 6);
+  assert(abs(reduced->clevel_r - full->clevel_r) <= 3);
+  assert(abs(reduced->clevel_g - full->clevel_g) <= 3);
+  assert(abs(reduced->clevel_b - full->clevel_b) <= 3);
+
+  free(reduced);
+  free(full);
+  unlink(path);
+
+  return 0;
+}
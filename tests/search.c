@@ -0,0 +1,446 @@
+#include "../src/common.h"
+#include "../src/bitmap.h"
+#include "../src/record.h"
+#include "../src/io.h"
+#include "../src/phash.h"
+#include "../src/resident.h"
+#include "../src/simdb.h"
+
+int main() {
+  simdb_t *db;
+  simdb_search_t search;
+  simdb_urec_t rec[4];
+  char *path = "test-search.db";
+  int mode = 0, ret = 0;
+
+  unlink(path);
+
+  ret = simdb_create_ex(path, SIMDB_CAP_BITMAP | SIMDB_CAP_COLORS | SIMDB_CAP_RATIO | SIMDB_CAP_PHASH);
+  assert(ret == true);
+
+  mode = SIMDB_FLAG_WRITE | SIMDB_FLAG_LOCKNB;
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+
+  memset(rec, 0x0, sizeof(rec));
+  for (int i = 0; i < 4; i++) {
+    rec[i].used = 0xFF;
+    rec[i].image_w = 400;
+    rec[i].image_h = 300;
+    rec[i].clevel_r = 0x80;
+    rec[i].clevel_g = 0x40;
+    rec[i].clevel_b = 0x20;
+    memset(rec[i].bitmap, 0xA5, sizeof(rec[i].bitmap));
+  }
+  rec[1].bitmap[0] = 0xA4;  /* 1 bit differs */
+  rec[2].clevel_g  = 0xC0;  /* same bitmap, but other colors */
+  rec[3].used      = 0x0;   /* deleted */
+
+  ret = simdb_write(db, 1, 4, rec);
+  assert(ret == 4);
+
+  simdb_search_init(&search);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 2);
+  assert(search.matches[0].d_color == 0.0);
+  assert(search.matches[0].d_bitmap > 0.0);
+
+  /* disable color test */
+  search.d_color = 0.0;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 2);
+  assert(search.matches[0].num == 2);
+  assert(search.matches[1].num == 3);
+  assert(search.matches[1].d_bitmap == 0.0);
+
+  /* bitmap threshold is inclusive */
+  search.d_bitmap = 1 / (float) SIMDB_BITMAP_BITS;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 2);
+  search.d_bitmap = 0.0;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 3);
+  search.d_bitmap = 0.07;
+
+  /* results limit, without ratio test */
+  search.limit   = 1;
+  search.d_ratio = 0.0;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 2);
+  search.limit   = 0;
+  search.d_ratio = 0.07;
+
+  /* id range and allow-list */
+  simdb_search_stats_t fst;
+  unsigned char allow[1] = { 1 << 3 };
+  search.first = 3;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 3);
+  search.first = 1;
+  search.last  = 2;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 2);
+  search.first = 3;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == SIMDB_ERR_USAGE);
+  search.first = 0;
+  search.last  = 0;
+  search.allow = allow;
+  search.allow_bits = 8;
+  search.stats = &fst;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 3);
+  assert(fst.scanned  == 2); /* records 1 and 2 not read */
+  assert(fst.filtered == 1);
+  search.allow_bits = 3;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 0);
+  assert(fst.scanned == 0);
+  search.allow = NULL;
+  search.allow_bits = 0;
+  search.stats = NULL;
+
+  /* search statistics */
+  simdb_search_stats_t st;
+  search.d_color = 0.10;
+  search.stats = &st;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(st.scanned  == 4);
+  assert(st.unused   == 1);
+  assert(st.r_color  == 1);
+  assert(st.compares == 1);
+  assert(st.blocks   == 1);
+  assert(st.bytes    == 4 * SIMDB_REC_LEN);
+  assert(st.cached   == false);
+  search.stats = NULL;
+
+  /* same results bypassing page cache */
+  search.cold = true;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  search.cold = false;
+
+  /* same results with in-memory records */
+  simdb_t *res = simdb_open(path, SIMDB_FLAG_RESIDENT, &ret);
+  assert(res != NULL);
+  search.d_color = 0.0;
+  ret = simdb_search_byid(res, &search, 1);
+  assert(ret == 2);
+  assert(search.matches[0].num == 2);
+  assert(search.matches[1].num == 3);
+  rec[3].clevel_r = 0x0;
+  ret = simdb_write(db, 5, 1, &rec[3]); /* unused */
+  assert(ret == 1);
+  ret = simdb_refresh(res);
+  assert(ret == 1);
+  ret = simdb_records_count(res);
+  assert(ret == 5);
+
+  /* records moved to other memory, options may be unsupported here */
+  ret = simdb_memory_setup(res, SIMDB_MEMORY_HUGEPAGES | SIMDB_MEMORY_INTERLEAVE);
+  assert(ret >= 0);
+  ret = simdb_search_byid(res, &search, 1);
+  assert(ret == 2);
+  assert(search.matches[1].num == 3);
+  ret = simdb_memory_setup(res, 0);
+  assert(ret == 0);
+  ret = simdb_search_byid(res, &search, 1);
+  assert(ret == 2);
+  ret = simdb_memory_setup(db, 0);
+  assert(ret == SIMDB_ERR_USAGE); /* no in-memory records */
+
+  /* records survive moves to memory of each kind, including growth after move;
+   * few huge pages worth, so rounding to page size matters */
+  simdb_resident_t *mem = simdb_resident_new();
+  simdb_urec_t *many = NULL, *got = NULL;
+  const int count = 3 * 65536, half = count / 2;
+  assert(mem != NULL);
+  many = calloc(count, sizeof(simdb_urec_t));
+  assert(many != NULL);
+  for (int i = 0; i < count; i++) {
+    many[i].used = 0xFF;
+    memcpy(many[i].bitmap, &i, sizeof(i));
+  }
+  assert(simdb_resident_store(mem, 1, half, many) == 0);
+  ret = simdb_resident_setup(mem, SIMDB_MEMORY_HUGEPAGES | SIMDB_MEMORY_INTERLEAVE);
+  assert(ret >= 0);
+  assert(simdb_resident_store(mem, half + 1, count - half, many + half) == 0);
+  simdb_resident_rdlock(mem);
+  assert(simdb_resident_fetch(mem, 1, count, &got) == count);
+  assert(memcmp(got, many, count * sizeof(simdb_urec_t)) == 0);
+  simdb_resident_unlock(mem);
+  assert(simdb_resident_setup(mem, 0) == 0);
+  simdb_resident_rdlock(mem);
+  assert(simdb_resident_fetch(mem, 1, count, &got) == count);
+  assert(memcmp(got, many, count * sizeof(simdb_urec_t)) == 0);
+  simdb_resident_unlock(mem);
+  simdb_resident_free(mem);
+  free(many);
+
+  /* own writes are not changes */
+  assert(simdb_refresh(db) == 0);
+
+  /* appended and changed in place at once */
+  simdb_urec_t empty;
+  memset(&empty, 0x0, sizeof(empty));
+  ret = simdb_write(db, 3, 1, &empty);
+  assert(ret == 1);
+  ret = simdb_write(db, 6, 1, &rec[3]);
+  assert(ret == 1);
+  assert(simdb_refresh(db) == 0);
+  ret = simdb_refresh(res);
+  assert(ret == 1);
+  ret = simdb_search_byid(res, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 2);
+  simdb_close(res);
+
+  search.d_color = 1.5;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == SIMDB_ERR_USAGE);
+
+  /* perceptual hash */
+  unsigned char luma[SIMDB_PHASH_SIDE * SIMDB_PHASH_SIDE];
+  uint64_t h1, h2;
+  for (int i = 0; i < SIMDB_PHASH_SIDE * SIMDB_PHASH_SIDE; i++) {
+    int x = i % SIMDB_PHASH_SIDE, y = i / SIMDB_PHASH_SIDE;
+    luma[i] = ((x * x + 3 * x * y + 2 * y * y) % 256) / 4 + x * 4; /* 2D texture, plain gradient has too few AC coefficients */
+  }
+  h1 = simdb_phash(luma);
+  assert(h1 != 0);
+  assert(simdb_phash(luma) == h1);
+  luma[0] ^= 0x10; /* small change */
+  h2 = simdb_phash(luma);
+  assert(simdb_phash_compare(h1, h2) <= 4);
+  for (int i = 0; i < SIMDB_PHASH_SIDE * SIMDB_PHASH_SIDE; i++)
+    luma[i] = 0xFF - luma[i]; /* inverted */
+  h2 = simdb_phash(luma);
+  assert(simdb_phash_compare(h1, h2) > 16);
+
+  search.d_color = 0.0;
+  rec[0].phash = 0x0123456789ABCDEFULL;
+  rec[1].phash = rec[0].phash ^ 0xFFFF; /* 16 bits differ - on the edge */
+  rec[2].phash = ~rec[0].phash;         /* all bits differ */
+  ret = simdb_write(db, 1, 3, rec);
+  assert(ret == 3);
+  search.stats = &st;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 2);
+  assert(st.r_phash  == 1);
+  assert(st.compares == 1);
+  search.d_phash = 0.0; /* disabled */
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 2);
+  search.stats = NULL;
+  for (int i = 0; i < 3; i++)
+    rec[i].phash = 0; /* not set */
+  ret = simdb_write(db, 1, 3, rec);
+  assert(ret == 3);
+
+  /* search results cache */
+  simdb_cache_stats_t stats;
+  assert(simdb_cache_stats(db, &stats) == false);
+  ret = simdb_cache_setup(db, 64 * 1024);
+  assert(ret == SIMDB_SUCCESS);
+
+  simdb_search_init(&search);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 2);
+  assert(simdb_cache_stats(db, &stats) == true);
+  assert(stats.misses  == 1);
+  assert(stats.hits    == 1);
+  assert(stats.entries == 1);
+
+  /* other parameters - other key */
+  search.d_color = 0.0;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 2);
+  assert(simdb_cache_stats(db, &stats) == true);
+  assert(stats.misses  == 2);
+  assert(stats.entries == 2);
+
+  /* any write invalidates cache */
+  rec[3].used = 0xFF;
+  ret = simdb_write(db, 4, 1, &rec[3]);
+  assert(ret == 1);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 3);
+  assert(simdb_cache_stats(db, &stats) == true);
+  assert(stats.misses  == 3);
+  assert(stats.entries == 1);
+
+  /* budget too small for any entry */
+  ret = simdb_cache_setup(db, 16);
+  assert(ret == SIMDB_SUCCESS);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 3);
+  assert(simdb_cache_stats(db, &stats) == true);
+  assert(stats.entries == 0);
+  assert(stats.size    == 0);
+
+  simdb_search_free(&search);
+  simdb_close(db);
+
+  unlink(path);
+
+  /* two-stage search with 32x32 bitmaps */
+  simdb_hrec_t hires[4];
+  char hr_path[PATH_MAX];
+  snprintf(hr_path, sizeof(hr_path), "%s.hr", path);
+
+  ret = simdb_create_ex(path, SIMDB_CAP_BITMAP | SIMDB_CAP_RATIO | SIMDB_CAP_BITMAP32);
+  assert(ret == true);
+  assert(access(hr_path, R_OK) == 0);
+
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+
+  memset(hires, 0x0, sizeof(hires));
+  for (int i = 0; i < 4; i++) {
+    rec[i].used = 0xFF;
+    hires[i].used = 0xFF;
+    memset(hires[i].bitmap, 0x5A, sizeof(hires[i].bitmap));
+  }
+  memset(hires[2].bitmap, 0xFF, 32); /* same 16x16 bitmap, but 32x32 differs a lot */
+  hires[3].used = 0x0;               /* no 32x32 bitmap, 16x16 used */
+
+  ret = simdb_write_hires(db, 1, 4, hires);
+  assert(ret == 4);
+  ret = simdb_write(db, 1, 4, rec);
+  assert(ret == 4);
+
+  search.stats = &st;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 2);
+  assert(search.matches[0].num == 2);
+  assert(search.matches[0].d_bitmap == 0.0); /* 32x32 difference */
+  assert(search.matches[1].num == 4);
+  assert(st.compares == 3);
+  assert(st.refines  == 2);
+  assert(st.r_refine == 1);
+
+  /* stale 32x32 bitmaps dropped */
+  simdb_hrec_t check;
+  ret = simdb_read_hires(db, 2, &check);
+  assert(ret == 1);
+  ret = simdb_write_hires(db, 2, 1, NULL);
+  assert(ret == 1);
+  ret = simdb_read_hires(db, 2, &check);
+  assert(ret == 0);
+  ret = simdb_read_hires(db, 9, &check);
+  assert(ret == 0); /* beyond end of file */
+
+  simdb_search_free(&search);
+  simdb_close(db);
+
+  /* lost sidecar file: read-only open fails, open for write recreates it empty */
+  unlink(hr_path);
+  db = simdb_open(path, 0, &ret);
+  assert(db == NULL);
+  assert(ret == SIMDB_ERR_CORRUPTDB);
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+  assert(access(hr_path, R_OK) == 0);
+  ret = simdb_read_hires(db, 2, &check);
+  assert(ret == 0);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 3); /* 16x16 bitmaps only */
+  simdb_search_free(&search);
+  simdb_close(db);
+
+  unlink(path);
+
+  /* rotated and mirrored copies */
+  ret = simdb_create(path);
+  assert(ret == true);
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+
+  memset(rec, 0x0, sizeof(rec));
+  for (int i = 0; i < (int) sizeof(rec[0].bitmap); i++)
+    rec[0].bitmap[i] = (i * 37 + 11) & 0xFF; /* no symmetry */
+  rec[0].used    = 0xFF;
+  rec[0].image_w = 400;
+  rec[0].image_h = 300;
+  memcpy(&rec[1], &rec[0], sizeof(simdb_urec_t));
+  memcpy(&rec[2], &rec[0], sizeof(simdb_urec_t));
+  simdb_bitmap_transform(rec[0].bitmap, rec[1].bitmap, SIMDB_BITMAP_SIDE, SIMDB_TRANSFORM_FLIP_H);
+  simdb_bitmap_transform(rec[0].bitmap, rec[2].bitmap, SIMDB_BITMAP_SIDE, SIMDB_TRANSFORM_ROT90);
+  rec[2].image_w = 300; /* rotated image */
+  rec[2].image_h = 400;
+  ret = simdb_write(db, 1, 3, rec);
+  assert(ret == 3);
+
+  simdb_search_init(&search);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 0);
+
+  search.transforms = SIMDB_TRANSFORMS_ALL;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 2);
+  assert(search.matches[0].num == 2);
+  assert(search.matches[0].transform == SIMDB_TRANSFORM_FLIP_H);
+  assert(search.matches[0].d_bitmap == 0.0);
+  assert(search.matches[1].num == 3);
+  assert(search.matches[1].transform == SIMDB_TRANSFORM_ROT90);
+  assert(search.matches[1].d_ratio == 0.0);
+
+  search.transforms = 1 << SIMDB_TRANSFORM_FLIP_H;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 2);
+
+  search.transforms = 0x100;
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == SIMDB_ERR_USAGE);
+
+  simdb_search_free(&search);
+  simdb_close(db);
+
+  unlink(path);
+
+  /* records without color levels (all zero, e.g. imported from database without 'C')
+   * are not compared as black ones, neither as targets nor as samples */
+  ret = simdb_create(path);
+  assert(ret == true);
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+
+  memset(rec, 0x0, sizeof(rec));
+  for (int i = 0; i < 3; i++) {
+    rec[i].used = 0xFF;
+    memset(rec[i].bitmap, 0xA5, sizeof(rec[i].bitmap));
+  }
+  rec[0].clevel_r = rec[0].clevel_g = rec[0].clevel_b = 0xC0;
+  rec[2].clevel_r = rec[2].clevel_g = rec[2].clevel_b = 0x01; /* nearly black, but set */
+  ret = simdb_write(db, 1, 3, rec);
+  assert(ret == 3);
+
+  simdb_search_init(&search);
+  ret = simdb_search_byid(db, &search, 1);
+  assert(ret == 1);
+  assert(search.matches[0].num == 2);
+  assert(search.matches[0].d_color == 0.0);
+  ret = simdb_search_byid(db, &search, 2);
+  assert(ret == 2);
+  assert(search.matches[0].num == 1);
+  assert(search.matches[1].num == 3);
+
+  simdb_search_free(&search);
+  simdb_close(db);
+
+  unlink(path);
+
+  return 0;
+}
@@ -0,0 +1,98 @@
+#include "../src/common.h"
+#include "../src/record.h"
+#include "../src/io.h"
+#include "../src/simdb.h"
+
+#include <pthread.h>
+
+#define THREADS 8
+#define APPENDS 200
+
+static simdb_t *db = NULL;
+
+static void *
+writer(void *arg) {
+  int *nums = arg;
+
+  for (int i = 0; i < APPENDS; i++)
+    nums[i] = simdb_record_add(db, 0, ".", 0);
+
+  return NULL;
+}
+
+static void *
+reader(void *arg) {
+  simdb_search_t search;
+  simdb_num_t records = 0;
+  int *errors = arg;
+
+  simdb_search_init(&search);
+  for (int i = 0; i < APPENDS / 10; i++) {
+    if ((records = simdb_records_count(db)) < 1)
+      continue;
+    /* published records are always written */
+    if (!simdb_record_used(db, records))
+      (*errors)++;
+    if (simdb_search_byid(db, &search, 1) < 0)
+      (*errors)++;
+  }
+  simdb_search_free(&search);
+
+  return NULL;
+}
+
+/* concurrent appends and searches on handle opened with given mode */
+static void
+run(int mode) {
+  pthread_t writers[THREADS], readers[THREADS];
+  static int nums[THREADS][APPENDS];
+  int errors[THREADS];
+  char *path = "test-threads.db";
+  char *map = NULL;
+  int ret = 0;
+
+  unlink(path);
+  ret = simdb_create(path);
+  assert(ret == true);
+
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+  ret = simdb_cache_setup(db, 64 * 1024);
+  assert(ret == SIMDB_SUCCESS);
+
+  memset(errors, 0x0, sizeof(errors));
+  for (int i = 0; i < THREADS; i++) {
+    assert(pthread_create(&writers[i], NULL, writer, nums[i]) == 0);
+    assert(pthread_create(&readers[i], NULL, reader, &errors[i]) == 0);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(writers[i], NULL);
+    pthread_join(readers[i], NULL);
+    assert(errors[i] == 0);
+  }
+
+  /* each append got own slot, no holes */
+  ret = simdb_records_count(db);
+  assert(ret == THREADS * APPENDS);
+  for (int i = 0; i < THREADS; i++) {
+    for (int j = 0; j < APPENDS; j++)
+      assert(nums[i][j] > 0 && nums[i][j] <= THREADS * APPENDS);
+  }
+  ret = simdb_usage_map(db, &map);
+  assert(ret == THREADS * APPENDS);
+  for (int i = 0; i < ret; i++)
+    assert(map[i] == 0x1);
+  free(map);
+
+  simdb_close(db);
+  unlink(path);
+}
+
+int main() {
+  int mode = SIMDB_FLAG_WRITE | SIMDB_FLAG_THREADS | SIMDB_FLAG_METRICS;
+
+  run(mode);
+  run(mode | SIMDB_FLAG_RESIDENT);
+
+  return 0;
+}
@@ -0,0 +1,166 @@
+#include "../src/common.h"
+#include "../src/record.h"
+#include "../src/io.h"
+#include "../src/simdb.h"
+
+#define RECORDS 10
+
+int main() {
+  simdb_t *db, *other, *ranged;
+  simdb_urec_t rec[RECORDS], *data = NULL;
+  simdb_hrec_t hires[RECORDS], check;
+  unsigned char hdr[8];
+  uint64_t map[1 + 3 * 3];
+  char *path = "test-vacuum.db";
+  char *hr_path = "test-vacuum.db.hr";
+  char *map_path = "test-vacuum.map";
+  char *tmp_path = "test-vacuum.db.vacuum";
+  uint64_t gen = 0;
+  char buf[SIMDB_REC_LEN * 8];
+  ssize_t len = 0;
+  int mode = SIMDB_FLAG_WRITE | SIMDB_FLAG_RESIDENT, ret = 0, fd = -1;
+  struct stat st;
+
+  unlink(path);
+  unlink(hr_path);
+  unlink(map_path);
+  unlink(tmp_path);
+
+  ret = simdb_create_ex(path, SIMDB_CAP_BITMAP | SIMDB_CAP_RATIO | SIMDB_CAP_BITMAP32);
+  assert(ret == true);
+
+  db = simdb_open(path, mode, &ret);
+  assert(db != NULL);
+
+  /* used: 2, 3, 6, 9, 10 */
+  memset(rec, 0x0, sizeof(rec));
+  memset(hires, 0x0, sizeof(hires));
+  for (int i = 0; i < RECORDS; i++) {
+    memset(rec[i].bitmap, 0x10 + i, sizeof(rec[i].bitmap));
+    memset(hires[i].bitmap, 0x20 + i, sizeof(hires[i].bitmap));
+    hires[i].used = 0xFF;
+  }
+  rec[1].used = rec[2].used = rec[5].used = rec[8].used = rec[9].used = 0xFF;
+  ret = simdb_write(db, 1, RECORDS, rec);
+  assert(ret == RECORDS);
+  ret = simdb_write_hires(db, 1, RECORDS, hires);
+  assert(ret == RECORDS);
+
+  /* no mapping yet */
+  assert(simdb_remap(db, 1) == SIMDB_ERR_USAGE);
+  assert(simdb_vacuum(db, NULL, 0x80) == SIMDB_ERR_USAGE);
+
+  /* handles of other processes, opened before vacuum */
+  other = simdb_open(path, 0, &ret);
+  assert(other != NULL);
+  ranged = simdb_open(path, SIMDB_FLAG_WRITE | SIMDB_FLAG_LOCK | SIMDB_FLAG_LOCKRANGE, &ret);
+  assert(ranged != NULL);
+
+  ret = simdb_vacuum(db, map_path, SIMDB_VACUUM_REMAP);
+  assert(ret == 5);
+
+  /* they see file replaced, and don't write to old one */
+  assert(simdb_refresh(other) == SIMDB_ERR_STALE);
+  assert(simdb_write(ranged, 1, 1, rec) == SIMDB_ERR_STALE);
+  simdb_close(other);
+  simdb_close(ranged);
+  assert(simdb_records_count(db) == 5);
+  assert(stat(path, &st) == 0 && st.st_size == SIMDB_REC_LEN * 6);
+  assert(access("test-vacuum.db.vacuum", F_OK) < 0);
+
+  /* order kept, records and sidecar moved together */
+  ret = simdb_read(db, 1, RECORDS, &data);
+  assert(ret == 5);
+  assert(data[0].bitmap[0] == 0x11 && data[1].bitmap[0] == 0x12);
+  assert(data[2].bitmap[0] == 0x15 && data[4].bitmap[0] == 0x19);
+  for (int i = 0; i < 5; i++)
+    assert(data[i].used);
+  FREE(data);
+  ret = simdb_read_hires(db, 3, &check);
+  assert(ret == 1 && check.bitmap[0] == 0x25);
+
+  /* old numbers resolve */
+  assert(simdb_remap(db, 1) == 0);
+  assert(simdb_remap(db, 2) == 1);
+  assert(simdb_remap(db, 3) == 2);
+  assert(simdb_remap(db, 5) == 0);
+  assert(simdb_remap(db, 6) == 3);
+  assert(simdb_remap(db, 10) == 5);
+  assert(simdb_remap(db, 11) == SIMDB_ERR_NXRECORD);
+  assert(simdb_remap(db, 0) == SIMDB_ERR_NXRECORD);
+
+  /* search sees new numbers, in-memory copy reloaded */
+  simdb_search_t search;
+  simdb_search_init(&search);
+  search.d_ratio = 0.0;
+  ret = simdb_search_byid(db, &search, 3);
+  assert(ret == 0);
+  rec[0] = rec[5];
+  ret = simdb_write(db, 4, 1, &rec[0]);
+  assert(ret == 1);
+  ret = simdb_write_hires(db, 4, 1, &hires[5]);
+  assert(ret == 1);
+  ret = simdb_search_byid(db, &search, 3);
+  assert(ret == 1 && search.matches[0].num == 4);
+  simdb_search_free(&search);
+
+  /* mapping file: header, records count before, runs 2-3, 6, 9-10 */
+  fd = open(map_path, O_RDONLY);
+  assert(fd >= 0);
+  assert(read(fd, hdr, sizeof(hdr)) == sizeof(hdr));
+  assert(memcmp(hdr, "SDBM", 4) == 0 && hdr[4] == 1);
+  assert(read(fd, map, sizeof(map)) == sizeof(map));
+  assert(read(fd, hdr, 1) == 0);
+  close(fd);
+  assert(map[0] == RECORDS);
+  assert(map[1] == 2 && map[2] == 1 && map[3] == 2);
+  assert(map[4] == 6 && map[5] == 3 && map[6] == 1);
+  assert(map[7] == 9 && map[8] == 4 && map[9] == 2);
+
+  /* already dense, mapping dropped without flag */
+  ret = simdb_vacuum(db, NULL, 0);
+  assert(ret == 5);
+  assert(simdb_remap(db, 2) == SIMDB_ERR_USAGE);
+
+  simdb_close(db);
+
+  /* new file valid for other handles */
+  db = simdb_open(path, 0, &ret);
+  assert(db != NULL);
+  assert(simdb_records_count(db) == 5);
+  assert(simdb_vacuum(db, NULL, 0) == SIMDB_ERR_READONLY);
+  simdb_close(db);
+
+  /* interrupted between renames: new sidecar in place, new database not yet */
+  fd = open(path, O_RDWR);
+  assert(fd >= 0);
+  len = read(fd, buf, sizeof(buf));
+  assert(len == SIMDB_REC_LEN * 6);
+  memcpy(&gen, buf + SIMDB_REC_LEN - sizeof(gen), sizeof(gen));
+  assert(gen == 2);
+  gen--;
+  assert(pwrite(fd, &gen, sizeof(gen), SIMDB_REC_LEN - sizeof(gen)) == sizeof(gen));
+  close(fd);
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0);
+  assert(write(fd, buf, len) == len);
+  close(fd);
+
+  /* generations differ: not readable, finished by writer */
+  db = simdb_open(path, 0, &ret);
+  assert(db == NULL && ret == SIMDB_ERR_CORRUPTDB);
+  db = simdb_open(path, SIMDB_FLAG_WRITE | SIMDB_FLAG_LOCK, &ret);
+  assert(db != NULL);
+  assert(access(tmp_path, F_OK) < 0);
+  assert(simdb_records_count(db) == 5);
+  simdb_close(db);
+  db = simdb_open(path, 0, &ret);
+  assert(db != NULL);
+  simdb_close(db);
+
+  unlink(path);
+  unlink(hr_path);
+  unlink(map_path);
+
+  return 0;
+}